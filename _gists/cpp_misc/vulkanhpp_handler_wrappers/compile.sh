@@ -1,4 +1,10 @@
 #!/bin/bash
 
 clang++ -std=gnu++20 -g -o main main.cpp
+# the benchmarks are release builds - see bench.cpp
+clang++ -std=gnu++20 -O2 -DNDEBUG -o bench bench.cpp
+clang++ -std=gnu++20 -O2 -DNDEBUG -o pool_bench pool_bench.cpp
+# what a move compiles to
+objdump -d --no-show-raw-insn --disassemble=move_construct_handle bench |
+  grep -A4 '<move_construct_handle>:'
 echo "done"
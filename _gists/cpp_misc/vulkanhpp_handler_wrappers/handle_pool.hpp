@@ -0,0 +1,228 @@
+#pragma once
+
+#include "unique_handle.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// HandlePool<T, Deleter> - registry of resources T (VkBuffers, VkImages, ...)
+// handed out as 32-bit generational handles, with destruction deferred until
+// the GPU is done with the frames that may still use the resource:
+//
+//   HandlePool<VkBuffer, BufferBatchDeleter> buffers{};
+//   auto h = buffers.create(create_buffer());
+//   VkBuffer b = buffers.get(h); // record frame n using b
+//   buffers.destroy(h);          // h is dead now, the VkBuffer is not
+//   uint64_t n = buffers.end_frame(); // submit frame n with a fence
+//   ...
+//   buffers.collect(n);          // fence n signaled - VkBuffer destroyed
+//
+// A handle is a slot index (low index_bits) and the slot's generation (high
+// bits). destroy() bumps the slot's generation, so every copy of the handle
+// goes stale at once - get() of a stale handle returns T{} instead of a
+// destroyed (or reused) resource - and queues the slot in the retirement
+// queue of the frame being recorded. collect(frame) hands the resources of
+// every queue up to that frame to the deleter in ONE batch and only then are
+// their slots reused. Generations are 12 bits, so a handle kept across 4095
+// reuses of its slot could look valid again - do not keep dead handles
+// around forever.
+//
+// Storage is a structure of arrays: resources, generations and the free list
+// are separate vectors, so the validity check of get() only touches the 2
+// bytes of generation of a slot and create/destroy never allocate once the
+// pool and its queues have grown to their steady state size.
+//
+// Deleter is called with a std::span<const T> of the resources to destroy and
+// must not throw. Not thread safe - like a VkCommandPool, one pool belongs to
+// the thread that records the frames.
+
+template <typename T, typename Deleter> class HandlePool {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "T must be a plain handle (pointer or integer)");
+  static_assert(std::is_nothrow_invocable_v<Deleter &, std::span<const T>>,
+                "Deleter must take a std::span<const T> and be noexcept");
+
+public:
+  static constexpr std::uint32_t index_bits = 20;
+  static constexpr std::uint32_t generation_bits = 32 - index_bits;
+  static constexpr std::uint32_t max_slots = 1u << index_bits;
+
+  struct Handle {
+    std::uint32_t value{0}; // 0 is the null handle (generations start at 1)
+
+    constexpr std::uint32_t index() const noexcept {
+      return value & (max_slots - 1);
+    }
+    constexpr std::uint32_t generation() const noexcept {
+      return value >> index_bits;
+    }
+    constexpr explicit operator bool() const noexcept { return value != 0; }
+    // the key of UniqueHandle's debug names
+    constexpr explicit operator std::uintptr_t() const noexcept {
+      return value;
+    }
+    friend constexpr bool operator==(Handle, Handle) noexcept = default;
+  };
+
+  // deleter of Unique - retires the handle into the pool it came from
+  struct Retirer {
+    HandlePool *pool{nullptr};
+    void operator()(Handle h) const noexcept { pool->destroy(h); }
+  };
+
+  // handle retired when it goes out of scope (VkHandleWrapper's
+  // destructor-calls-clear() - without destroying anything inline)
+  using Unique = UniqueHandle<Handle, Retirer>;
+
+private:
+  // the slots retired while recording one frame
+  struct RetireQueue {
+    std::uint64_t frame;
+    std::vector<std::uint32_t> indices;
+  };
+
+  // slots - structure of arrays
+  std::vector<T> m_resources{};
+  std::vector<std::uint16_t> m_generations{};
+  std::vector<std::uint32_t> m_free{}; // free slots, last freed on top
+
+  std::deque<RetireQueue> m_retiring{};              // oldest frame first
+  std::vector<std::vector<std::uint32_t>> m_spare{}; // emptied queue vectors
+  std::vector<T> m_batch{};                          // handed to the deleter
+
+  std::uint64_t m_frame{0}; // the frame being recorded
+  std::size_t m_live{0};
+  std::size_t m_pending{0};
+  Deleter m_deleter{};
+
+  static constexpr std::uint16_t next_generation(std::uint16_t g) noexcept {
+    g = (g + 1) & ((1u << generation_bits) - 1);
+    return g != 0 ? g : 1;
+  }
+
+  // gives the resources of the queues of frames <= frame to the deleter
+  std::size_t flush(std::uint64_t frame) noexcept {
+    m_batch.clear();
+    while (!m_retiring.empty() && m_retiring.front().frame <= frame) {
+      auto &indices = m_retiring.front().indices;
+      for (std::uint32_t i : indices) {
+        m_batch.push_back(std::exchange(m_resources[i], T{}));
+        m_free.push_back(i);
+      }
+      indices.clear();
+      m_spare.push_back(std::move(indices));
+      m_retiring.pop_front();
+    }
+    if (!m_batch.empty())
+      m_deleter(std::span<const T>{m_batch});
+    m_pending -= m_batch.size();
+    return m_batch.size();
+  }
+
+public:
+  HandlePool() = default;
+  explicit HandlePool(Deleter deleter) : m_deleter{std::move(deleter)} {}
+
+  // the pool is pointed at by the Retirers of its Unique handles
+  HandlePool(const HandlePool &) = delete;
+  HandlePool &operator=(const HandlePool &) = delete;
+
+  // like vkDeviceWaitIdle before vkDestroyDevice: whatever was retired and
+  // whatever is still alive is destroyed (Unique handles must be gone by now)
+  ~HandlePool() {
+    flush(std::numeric_limits<std::uint64_t>::max());
+    m_batch.clear();
+    for (std::size_t i = 0; i < m_resources.size(); ++i)
+      if (m_resources[i] != T{})
+        m_batch.push_back(m_resources[i]);
+    if (!m_batch.empty())
+      m_deleter(std::span<const T>{m_batch});
+  }
+
+  // registers resource (not T{}) - throws std::length_error if all
+  // max_slots slots are taken
+  Handle create(T resource) {
+    std::uint32_t i;
+    if (!m_free.empty()) {
+      i = m_free.back();
+      m_free.pop_back();
+    } else {
+      if (m_resources.size() == max_slots)
+        throw std::length_error("HandlePool: out of slots");
+      i = static_cast<std::uint32_t>(m_resources.size());
+      m_resources.push_back(T{});
+      m_generations.push_back(1);
+      // flush() frees every slot at once at worst - it must not allocate
+      m_free.reserve(m_resources.capacity());
+      m_batch.reserve(m_resources.capacity());
+    }
+    m_resources[i] = resource;
+    ++m_live;
+    return Handle{static_cast<std::uint32_t>(m_generations[i]) << index_bits |
+                  i};
+  }
+
+  Unique create_unique(T resource) {
+    return Unique{create(resource), Retirer{this}};
+  }
+
+  bool valid(Handle h) const noexcept {
+    std::uint32_t i = h.index();
+    return h && i < m_generations.size() &&
+           m_generations[i] == h.generation();
+  }
+
+  // the resource of h or T{} if h is stale (destroyed) or null
+  T get(Handle h) const noexcept {
+    return valid(h) ? m_resources[h.index()] : T{};
+  }
+
+  // retires h: it is stale right away, its resource is destroyed by the
+  // collect() of the frame being recorded. Returns false (and does nothing)
+  // if h is stale or null, so destroying twice is harmless. Growing a queue
+  // can allocate - out of memory terminates, like in any destructor
+  bool destroy(Handle h) noexcept {
+    if (!valid(h))
+      return false;
+    std::uint32_t i = h.index();
+    m_generations[i] = next_generation(m_generations[i]);
+    if (m_retiring.empty() || m_retiring.back().frame != m_frame) {
+      std::vector<std::uint32_t> indices{};
+      if (!m_spare.empty()) {
+        indices = std::move(m_spare.back());
+        m_spare.pop_back();
+      }
+      m_retiring.push_back(RetireQueue{m_frame, std::move(indices)});
+    }
+    m_retiring.back().indices.push_back(i);
+    --m_live;
+    ++m_pending;
+    return true;
+  }
+
+  // ends the frame being recorded - returns its number, which the caller
+  // passes to collect() once the frame's fence has signaled
+  std::uint64_t end_frame() noexcept { return m_frame++; }
+
+  // destroys (in one batch) the resources retired while recording frames up
+  // to and including frame, i.e., once the GPU is done with them. Returns
+  // how many were destroyed
+  std::size_t collect(std::uint64_t frame) noexcept { return flush(frame); }
+
+  // destroys every retired resource - the GPU must be idle
+  std::size_t collect_all() noexcept {
+    return flush(std::numeric_limits<std::uint64_t>::max());
+  }
+
+  std::size_t live() const noexcept { return m_live; }
+  std::size_t pending() const noexcept { return m_pending; }
+  std::size_t capacity() const noexcept { return m_resources.size(); }
+  std::uint64_t frame() const noexcept { return m_frame; }
+};
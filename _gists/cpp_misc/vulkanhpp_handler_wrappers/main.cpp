@@ -1,83 +1,102 @@
+#include "unique_handle.hpp"
+
 #include <iostream>
 #include <string>
 #include <string_view>
+#include <type_traits>
+
+// a stand-in for a Vulkan handle - VkBuffer is a pointer to an opaque struct
+// (VK_DEFINE_NON_DISPATCHABLE_HANDLE on 64-bit platforms)
+struct VkBuffer_T {
+  int id;
+};
+using VkBuffer = VkBuffer_T *;
+
+// ... and for vkCreateBuffer/vkDestroyBuffer
+VkBuffer create_buffer(int id) {
+  std::cout << "  create_buffer(" << id << ")\n";
+  return new VkBuffer_T{id};
+}
+
+void destroy_buffer(VkBuffer buffer) noexcept {
+  std::cout << "  destroy_buffer(" << buffer->id << ")\n";
+  delete buffer;
+}
 
-class VkHandleWrapper {
-private:
-  int m_some_shit{0};
-  std::string m_name{};
-
-public:
-  // default constructor (deleted)
-  VkHandleWrapper() = delete;
-
-  // move constructor
-  VkHandleWrapper(VkHandleWrapper &&other)
-      : m_name{other.m_name}, m_some_shit{other.m_some_shit} {}
-
-  // custom contructor
-  VkHandleWrapper(std::string_view name, int val = 0)
-      : m_name{name}, m_some_shit{val} {
-    std::cout << __PRETTY_FUNCTION__ << " for: " << m_name << "\n";
-  }
-
-  // another custom constructor (nullptr constructor)
-  VkHandleWrapper(std::nullptr_t) : m_name{"nullptr"} {
-    std::cout << __PRETTY_FUNCTION__ << " for: " << m_name << "\n";
-  }
-
-  // copy constructor
-  VkHandleWrapper(const VkHandleWrapper &) = delete;
-  VkHandleWrapper &operator=(const VkHandleWrapper &) = delete;
-
-  // move assignment
-  VkHandleWrapper &operator=(VkHandleWrapper &&rls) {
-    std::cout << __PRETTY_FUNCTION__ << " for: " << m_name << "\n";
-    return *this;
-  }
-
-  ~VkHandleWrapper() {
-    std::cout << __PRETTY_FUNCTION__ << " for: " << m_name << "\n";
-    clear(); // cleanup of resources
-  }
-
-  // this is just to simulate resources cleanup
-  void clear() {}
-
-  std::string get_name() { return m_name; }
+// stateless deleter - costs no space in the handle
+struct BufferDeleter {
+  void operator()(VkBuffer buffer) const noexcept { destroy_buffer(buffer); }
 };
 
+// what VulkanHpp's vk::UniqueBuffer is
+using VkHandleWrapper = UniqueHandle<VkBuffer, BufferDeleter>;
+
+// stateful deleter - like vk::ObjectDestroy, which holds the VkDevice the
+// handle has to be destroyed with
+struct VkDevice_T;
+struct DeviceBufferDeleter {
+  VkDevice_T *device{nullptr};
+  void operator()(VkBuffer buffer) const noexcept { destroy_buffer(buffer); }
+};
+
+// the handle is exactly what it wraps - no name, no flag, no deleter
+static_assert(sizeof(VkHandleWrapper) == sizeof(VkBuffer));
+// ... unless the deleter carries state, which then is all it adds
+static_assert(sizeof(UniqueHandle<VkBuffer, DeviceBufferDeleter>) ==
+              sizeof(VkBuffer) + sizeof(VkDevice_T *));
+// move-only, and moves cannot throw (so std::vector moves them on growth
+// instead of trying to copy them)
+static_assert(!std::is_copy_constructible_v<VkHandleWrapper>);
+static_assert(!std::is_copy_assignable_v<VkHandleWrapper>);
+static_assert(std::is_nothrow_move_constructible_v<VkHandleWrapper>);
+static_assert(std::is_nothrow_move_assignable_v<VkHandleWrapper>);
+static_assert(std::is_nothrow_destructible_v<VkHandleWrapper>);
+static_assert(std::is_nothrow_default_constructible_v<VkHandleWrapper>);
+
 // pass by value - to figure out what happens when a user-defined object is
 // passed by value
 void test_func(VkHandleWrapper some_a) {
-  std::cout << "scope exit of: " << __PRETTY_FUNCTION__ << "\n";
+  std::cout << "scope exit of: " << __PRETTY_FUNCTION__ << " for: "
+            << some_a.debug_name() << "\n";
 }
 
 int main() {
   // although you see the '=' assigment character there is actually no
   // invokation of an assigment operator here. All that is invoked is the right
-  // constructor - in this case, the default constructor.
+  // constructor - in this case, the one taking ownership of a handle.
   //
   // this is another (albeit silly) reason to use the {} initialization syntax
   // to avoid confusion (especially for beginner C++ users)
-  std::cout
-      << "constructed a via default constructor (auto a = VkHandleWrapper())"
-      << "\n";
-  auto a = VkHandleWrapper("a");
-
-  std::cout << "constructed a via default constructor (VkHandleWrapper a2{})"
+  std::cout << "constructed a (auto a = VkHandleWrapper(create_buffer(1)))"
             << "\n";
-  VkHandleWrapper a2{"a2"}; // this should invoke same constructor as above
+  auto a = VkHandleWrapper(create_buffer(1));
+  a.set_debug_name("a");
+
+  std::cout << "constructed a2 (VkHandleWrapper a2{create_buffer(2)})" << "\n";
+  VkHandleWrapper a2{create_buffer(2)}; // same constructor as above
+  a2.set_debug_name("a2");
 
   // VulkanHpp makes a lot of use of this
   std::cout << "assigned a nullptr (a = nullptr)" << "\n";
-  a = nullptr; // this should call the destructor and cleanup the underlying
-               // resources
+  a = nullptr; // destroys buffer 1 right here - not at scope exit
+
+  std::cout << "moved a2 into a (a = std::move(a2))" << "\n";
+  a = std::move(a2); // nothing to destroy (a is null) - a2 is left null and
+                     // the debug name follows the handle
+  std::cout << "  a is " << a.debug_name() << ", a2 is "
+            << (a2 ? "not null" : "null") << "\n";
 
-  // this should invoke the copy constructor and errors  at compile time
+  // this errors at compile time - the copy constructor is deleted:
   // auto a_copy = VkHandleWrapper(a);
+  // and so does passing a by value without giving it up:
+  // test_func(a);
+
+  std::cout << "passed a by value (test_func(std::move(a)))" << "\n";
+  test_func(std::move(a)); // buffer 2 dies with some_a, at test_func's exit
 
-  test_func(a);
+  std::cout << "move-assigned over a live handle" << "\n";
+  VkHandleWrapper b{create_buffer(3)};
+  b = VkHandleWrapper{create_buffer(4)}; // buffer 3 is destroyed first
 
   std::cout << "going out of scope (program exit)" << "\n";
 }
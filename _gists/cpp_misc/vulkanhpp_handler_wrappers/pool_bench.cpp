@@ -0,0 +1,226 @@
+// pool_bench.cpp - checks and benchmarks HandlePool (handle_pool.hpp) with a
+// mock deleter, on the CPU only: a fake renderer creates and destroys
+// resources every frame with FRAMES_IN_FLIGHT frames on the "GPU" and
+// collects each frame once its (simulated) fence signals.
+//
+// The mock deleter checks that no resource is destroyed before the frames
+// that could still use it are done, and that every resource is destroyed
+// exactly once. The baseline is what the renderer did so far: a UniqueHandle
+// per resource, destroyed inline by its destructor (and thus while the GPU
+// may still be using it).
+//
+// build it as a release build:
+//
+//   clang++ -std=gnu++20 -O2 -DNDEBUG -o pool_bench pool_bench.cpp
+
+#include "handle_pool.hpp"
+#include "unique_handle.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <span>
+#include <vector>
+
+constexpr std::uint64_t frames_in_flight = 2;
+
+// a mock resource: its id (never 0)
+using MockBuffer = std::uint64_t;
+
+// what the mock deleter sees
+struct MockDevice {
+  std::uint64_t completed_frame{0}; // the last frame whose fence signaled
+  std::vector<std::uint64_t> retired_in; // frame each resource was retired in
+  std::vector<std::uint8_t> destroyed;   // per resource
+  std::uint64_t nbr_destroyed{0};
+  std::uint64_t batches{0};
+  std::uint64_t errors{0};
+
+  void destroy(MockBuffer b) noexcept {
+    if (destroyed[b] || retired_in[b] > completed_frame)
+      ++errors; // destroyed twice or while the GPU may still use it
+    destroyed[b] = 1;
+    ++nbr_destroyed;
+  }
+};
+
+static MockDevice device{};
+
+struct MockBatchDeleter {
+  void operator()(std::span<const MockBuffer> buffers) noexcept {
+    ++device.batches;
+    for (MockBuffer b : buffers)
+      device.destroy(b);
+  }
+};
+
+// the baseline: one resource destroyed at a time, inline
+struct MockDeleter {
+  void operator()(MockBuffer b) const noexcept {
+    ++device.nbr_destroyed;
+    asm volatile("" : : "r"(b) : "memory");
+  }
+};
+
+using Pool = HandlePool<MockBuffer, MockBatchDeleter>;
+
+static_assert(sizeof(Pool::Handle) == 4);
+// a Unique handle is its 4-byte handle and the pool it retires into
+static_assert(sizeof(Pool::Unique) == 2 * sizeof(Pool *));
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+static void check(bool ok, const char *what) {
+  if (!ok) {
+    std::fprintf(stderr, "FAILED: %s\n", what);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+// the rules of the handles, one by one
+static void check_semantics() {
+  device = MockDevice{};
+  device.retired_in.assign(16, 0);
+  device.destroyed.assign(16, 0);
+  {
+    Pool pool{};
+    pool.end_frame(); // frame 0 - so that there is an older frame to collect
+    auto a = pool.create(1);
+    check(pool.get(a) == 1 && pool.valid(a), "get of a live handle");
+    check(!pool.valid(Pool::Handle{}), "the null handle is never valid");
+
+    device.retired_in[1] = pool.frame();
+    check(pool.destroy(a), "destroy");
+    check(!pool.valid(a) && pool.get(a) == 0, "a destroyed handle is stale");
+    check(!pool.destroy(a), "destroying twice does nothing");
+    check(device.nbr_destroyed == 0, "destruction is deferred");
+
+    // the slot is not reused before the resource is destroyed
+    auto b = pool.create(2);
+    check(b.index() != a.index(), "a retiring slot is not reused");
+
+    std::uint64_t f = pool.end_frame();
+    pool.collect(f - 1); // nothing of frame f yet
+    check(device.nbr_destroyed == 0, "collect of an older frame");
+    device.completed_frame = f;
+    check(pool.collect(f) == 1 && device.nbr_destroyed == 1,
+          "collect of the retiring frame");
+
+    // now it is - with a new generation
+    auto c = pool.create(3);
+    check(c.index() == a.index() && c != a, "a reused slot");
+    check(!pool.valid(a) && pool.get(c) == 3, "the old handle stays stale");
+
+    // a Unique handle retires itself
+    {
+      auto u = pool.create_unique(4);
+      device.retired_in[4] = pool.frame();
+      check(pool.get(u.get()) == 4, "get of a Unique handle");
+    }
+    check(pool.live() == 2 && pool.pending() == 1,
+          "Unique retires on scope exit");
+    device.completed_frame = pool.end_frame();
+    pool.collect_all();
+    check(device.destroyed[4], "collect_all");
+  } // the pool destroys b and c
+  check(device.destroyed[2] && device.destroyed[3],
+        "the pool destroys the rest");
+  check(device.errors == 0, "no early or double destruction");
+}
+
+int main() {
+  check_semantics();
+
+  constexpr std::uint64_t frames = 2000;
+  constexpr std::size_t per_frame = 2000; // created and destroyed per frame
+  constexpr std::size_t live = 50000;     // resources alive at any time
+  constexpr std::uint64_t total = live + frames * per_frame;
+
+  // pool: destroy the oldest per_frame resources and create as many each
+  // frame, collect the frame whose fence "signaled"
+  device = MockDevice{};
+  device.retired_in.assign(total + 1, 0);
+  device.destroyed.assign(total + 1, 0);
+  std::vector<Pool::Handle> handles(live);
+  double pool_s, lookup_ns;
+  std::uint64_t pool_batches;
+  {
+    Pool pool{};
+    MockBuffer next = 1;
+    for (auto &h : handles)
+      h = pool.create(next++);
+
+    auto start = std::chrono::steady_clock::now();
+    std::size_t oldest = 0;
+    for (std::uint64_t f = 0; f < frames; ++f) {
+      for (std::size_t i = 0; i < per_frame; ++i) {
+        auto &h = handles[oldest];
+        device.retired_in[pool.get(h)] = pool.frame();
+        pool.destroy(h);
+        h = pool.create(next++);
+        oldest = (oldest + 1) % live;
+      }
+      std::uint64_t submitted = pool.end_frame();
+      if (submitted >= frames_in_flight) { // the fence of an older frame
+        device.completed_frame = submitted - frames_in_flight;
+        pool.collect(device.completed_frame);
+      }
+    }
+    pool_s = seconds_since(start);
+    pool_batches = device.batches;
+
+    // lookups of live handles in random order
+    std::uint64_t sum = 0, x = 88172645463325252ull;
+    constexpr std::size_t lookups = 10000000;
+    start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < lookups; ++i) {
+      x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+      sum += pool.get(handles[x % live]);
+    }
+    lookup_ns = seconds_since(start) * 1e9 / lookups;
+    check(sum != 0, "lookups");
+
+    device.completed_frame = pool.end_frame();
+    pool.collect_all();
+  }
+  check(device.errors == 0, "no early or double destruction");
+  check(device.nbr_destroyed == total, "every resource destroyed once");
+
+  // baseline: UniqueHandle, destroyed inline
+  device.nbr_destroyed = 0;
+  double inline_s;
+  {
+    std::vector<UniqueHandle<MockBuffer, MockDeleter>> buffers(live);
+    MockBuffer next = 1;
+    for (auto &b : buffers)
+      b.reset(next++);
+    auto start = std::chrono::steady_clock::now();
+    std::size_t oldest = 0;
+    for (std::uint64_t f = 0; f < frames; ++f) {
+      for (std::size_t i = 0; i < per_frame; ++i) {
+        buffers[oldest] = UniqueHandle<MockBuffer, MockDeleter>{next++};
+        oldest = (oldest + 1) % live;
+      }
+    }
+    inline_s = seconds_since(start);
+  }
+  check(device.nbr_destroyed == total, "baseline destroyed everything");
+
+  double ops = 2.0 * frames * per_frame; // a create and a destroy each
+  std::printf("%llu frames, %zu creates + %zu destroys per frame, %zu live, "
+              "%llu frames in flight\n",
+              static_cast<unsigned long long>(frames), per_frame, per_frame,
+              live, static_cast<unsigned long long>(frames_in_flight));
+  std::printf("  pool, deferred:       %6.1f M create/destroy per s (%llu "
+              "batches, %.0f resources per batch)\n",
+              ops / pool_s / 1e6, static_cast<unsigned long long>(pool_batches),
+              static_cast<double>(frames * per_frame) / pool_batches);
+  std::printf("  UniqueHandle, inline: %6.1f M create/destroy per s\n",
+              ops / inline_s / 1e6);
+  std::printf("  pool lookup of a random live handle: %.2f ns\n", lookup_ns);
+  std::printf("no resource destroyed early or twice\n");
+}
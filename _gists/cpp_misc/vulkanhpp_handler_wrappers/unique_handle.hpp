@@ -0,0 +1,195 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+// UniqueHandle<T, Deleter> - move-only owner of a C API handle T (a Vulkan
+// VkBuffer, a file descriptor, ...), i.e., what vk::UniqueHandle and
+// std::unique_ptr are to their resources:
+//
+//   struct BufferDeleter {
+//     void operator()(VkBuffer b) const noexcept { destroy_buffer(b); }
+//   };
+//   UniqueHandle<VkBuffer, BufferDeleter> buf{create_buffer()};
+//   buf = nullptr; // destroys the buffer right away
+//
+// T{} is the null handle (VK_NULL_HANDLE is a null pointer or 0) and is never
+// passed to the deleter. The deleter is called with the handle and must not
+// throw.
+//
+// Zero overhead: with a stateless deleter (no data members) a UniqueHandle is
+// exactly sizeof(T) - the deleter takes no space ([[no_unique_address]]) - and
+// moving one is copying T and writing T{} into the source, which the compiler
+// keeps in registers (see bench.cpp). A stateful deleter (e.g., one that holds
+// the VkDevice the handle belongs to) adds its own size and nothing else.
+//
+// Debug names (e.g., for vkSetDebugUtilsObjectNameEXT or log lines) are NOT
+// stored in the handle: debug builds keep them in a side table keyed by the
+// handle's value (so they follow the handle through moves) and release builds
+// (NDEBUG) compile set_debug_name() to nothing.
+
+namespace detail {
+
+// the key of handle h in the debug name table - handles are pointers
+// (dispatchable and, on 64-bit, non-dispatchable Vulkan handles) or integers
+template <typename T> constexpr std::uintptr_t handle_key(T h) noexcept {
+  if constexpr (std::is_pointer_v<T>)
+    return reinterpret_cast<std::uintptr_t>(h);
+  else
+    return static_cast<std::uintptr_t>(h);
+}
+
+#ifndef NDEBUG
+// the debug names of the live handles of one handle type
+class DebugNames {
+private:
+  std::mutex m_mutex{};
+  std::unordered_map<std::uintptr_t, std::string> m_names{};
+
+public:
+  void set(std::uintptr_t key, std::string_view name) {
+    std::lock_guard lock{m_mutex};
+    m_names.insert_or_assign(key, std::string{name});
+  }
+
+  // returns a copy - the entry can be erased by another thread right after
+  std::string get(std::uintptr_t key) {
+    std::lock_guard lock{m_mutex};
+    auto it = m_names.find(key);
+    return it != m_names.end() ? it->second : std::string{};
+  }
+
+  void erase(std::uintptr_t key) {
+    std::lock_guard lock{m_mutex};
+    m_names.erase(key);
+  }
+};
+#endif
+
+} // namespace detail
+
+template <typename T, typename Deleter> class UniqueHandle {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "T must be a plain handle (pointer or integer)");
+  static_assert(std::is_nothrow_invocable_v<const Deleter &, T>,
+                "Deleter must be callable with a T and be noexcept");
+  static_assert(std::is_nothrow_move_constructible_v<Deleter> &&
+                    std::is_nothrow_move_assignable_v<Deleter>,
+                "Deleter moves must not throw");
+
+private:
+  T m_handle{};
+  [[no_unique_address]] Deleter m_deleter{};
+
+#ifndef NDEBUG
+  static detail::DebugNames &debug_names() {
+    static detail::DebugNames names{}; // one table per handle type
+    return names;
+  }
+#endif
+
+  void destroy() noexcept {
+    if (m_handle == T{})
+      return;
+#ifndef NDEBUG
+    debug_names().erase(detail::handle_key(m_handle));
+#endif
+    m_deleter(m_handle);
+  }
+
+public:
+  using handle_type = T;
+  using deleter_type = Deleter;
+
+  // null handle
+  constexpr UniqueHandle() noexcept = default;
+  constexpr UniqueHandle(std::nullptr_t) noexcept {}
+
+  // takes ownership of handle
+  constexpr explicit UniqueHandle(T handle, Deleter deleter = Deleter{}) noexcept
+      : m_handle{handle}, m_deleter{std::move(deleter)} {}
+
+  UniqueHandle(const UniqueHandle &) = delete;
+  UniqueHandle &operator=(const UniqueHandle &) = delete;
+
+  // other is left null
+  constexpr UniqueHandle(UniqueHandle &&other) noexcept
+      : m_handle{std::exchange(other.m_handle, T{})},
+        m_deleter{std::move(other.m_deleter)} {}
+
+  // destroys the handle held so far and steals other's (other is left null)
+  UniqueHandle &operator=(UniqueHandle &&other) noexcept {
+    if (this != &other) {
+      reset(std::exchange(other.m_handle, T{})); // keeps its debug name
+      m_deleter = std::move(other.m_deleter);
+    }
+    return *this;
+  }
+
+  // destroys the handle held so far (VulkanHpp's `handle = nullptr`)
+  UniqueHandle &operator=(std::nullptr_t) noexcept {
+    reset();
+    return *this;
+  }
+
+  ~UniqueHandle() { destroy(); }
+
+  constexpr T get() const noexcept { return m_handle; }
+  constexpr T operator*() const noexcept { return m_handle; }
+  constexpr explicit operator bool() const noexcept { return m_handle != T{}; }
+
+  Deleter &get_deleter() noexcept { return m_deleter; }
+  const Deleter &get_deleter() const noexcept { return m_deleter; }
+
+  // gives up ownership without destroying the handle (its debug name is
+  // dropped - the new owner names it again if it wants to)
+  [[nodiscard]] T release() noexcept {
+#ifndef NDEBUG
+    if (m_handle != T{})
+      debug_names().erase(detail::handle_key(m_handle));
+#endif
+    return std::exchange(m_handle, T{});
+  }
+
+  // destroys the handle held so far and takes ownership of handle
+  void reset(T handle = T{}) noexcept {
+    if (handle == m_handle) // resetting to the handle we own must not kill it
+      return;
+    destroy();
+    m_handle = handle;
+  }
+
+  void swap(UniqueHandle &other) noexcept {
+    using std::swap;
+    swap(m_handle, other.m_handle);
+    swap(m_deleter, other.m_deleter);
+  }
+
+  // names the handle in debug builds (does nothing for a null handle)
+  void set_debug_name([[maybe_unused]] std::string_view name) {
+#ifndef NDEBUG
+    if (m_handle != T{})
+      debug_names().set(detail::handle_key(m_handle), name);
+#endif
+  }
+
+  // the handle's debug name - always empty in release builds
+  std::string debug_name() const {
+#ifndef NDEBUG
+    if (m_handle != T{})
+      return debug_names().get(detail::handle_key(m_handle));
+#endif
+    return {};
+  }
+};
+
+template <typename T, typename Deleter>
+void swap(UniqueHandle<T, Deleter> &a, UniqueHandle<T, Deleter> &b) noexcept {
+  a.swap(b);
+}
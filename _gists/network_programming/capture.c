@@ -0,0 +1,287 @@
+/*
+ * capture.c -- capture of the inbound traffic of a chat server (see
+ * capture.h).
+ *
+ * Records are encoded into a buffer under a lock (workers share the capture)
+ * and written out in one write per loop iteration (capture_flush) or whenever
+ * the buffer is full - the event loop never waits for the disk, only for the
+ * page cache. A flush swaps the buffer for a second one under the lock and
+ * writes the full one after releasing it, so workers keep appending
+ * meanwhile (a second lock keeps the writes in order). Connection ids are
+ * assigned by the capture: fds are reused by new connections, so the capture
+ * maps each fd to the id of the connection that currently owns it.
+ */
+
+#define _GNU_SOURCE /* reallocarray */
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAPTURE_BUF_SIZE (256 * 1024) /* records written out at once */
+#define RECORD_HEADER_MAX (1 + 10 + 5 + 5) /* type and three varints */
+
+struct capture {
+  pthread_mutex_t lock;
+  pthread_mutex_t write_lock; /* held by the flush writing spare */
+  int fd;
+  int failed;       /* a write failed - nothing is captured anymore */
+  uint64_t last_us; /* time of the previous record */
+  uint32_t *ids;    /* connection id of each fd, 0 if none */
+  uint32_t nbr_ids; /* number of elements in ids */
+  uint32_t next_id;
+  char *buf;    /* records appended since the last flush */
+  size_t len;
+  size_t size;  /* of buf - grown for records larger than it */
+  char *spare;  /* the other buffer (owned by the holder of write_lock) */
+  size_t spare_size;
+
+  /* statistics */
+  uint64_t records;
+  uint64_t payload_bytes;
+  uint64_t file_bytes;
+};
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t put_varint(char *p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (char)v;
+  return n;
+}
+
+/* Returns the number of bytes written - short of len on error. */
+static size_t write_all(int fd, const char *p, size_t len) {
+  size_t done = 0;
+  while (done != len) {
+    ssize_t n = write(fd, p + done, len - done);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("capture: write");
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+/* Appends a record - the connection's id must be known. Called with the lock
+ * held, which is released while a full buffer is flushed. */
+static void append(struct capture *cap, enum capture_type type, uint32_t id,
+                   const char *data, size_t len) {
+  while (cap->len != 0 && cap->len + RECORD_HEADER_MAX + len > cap->size) {
+    pthread_mutex_unlock(&cap->lock);
+    capture_flush(cap);
+    pthread_mutex_lock(&cap->lock);
+  }
+  if (RECORD_HEADER_MAX + len > cap->size) { /* larger than the buffer */
+    char *buf = (char *)realloc(cap->buf, RECORD_HEADER_MAX + len);
+    if (buf == NULL) {
+      perror("realloc");
+      cap->failed = 1; /* the capture would miss a record */
+      return;
+    }
+    cap->buf = buf;
+    cap->size = RECORD_HEADER_MAX + len;
+  }
+
+  char header[RECORD_HEADER_MAX];
+  uint64_t now = now_us();
+  size_t n = 0;
+
+  header[n++] = (char)type;
+  n += put_varint(header + n, now - cap->last_us);
+  n += put_varint(header + n, id);
+  if (type == CAPTURE_DATA)
+    n += put_varint(header + n, len);
+  cap->last_us = now;
+
+  memcpy(cap->buf + cap->len, header, n);
+  if (len != 0)
+    memcpy(cap->buf + cap->len + n, data, len);
+  cap->len += n + len;
+  ++cap->records;
+  cap->payload_bytes += len;
+}
+
+struct capture *capture_open(const char *path) {
+  struct capture *cap = (struct capture *)calloc(1, sizeof(struct capture));
+  if (cap == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  cap->buf = (char *)malloc(CAPTURE_BUF_SIZE);
+  cap->spare = (char *)malloc(CAPTURE_BUF_SIZE);
+  if (cap->buf == NULL || cap->spare == NULL) {
+    perror("malloc");
+    free(cap->buf);
+    free(cap->spare);
+    free(cap);
+    return NULL;
+  }
+  cap->size = cap->spare_size = CAPTURE_BUF_SIZE;
+  cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (cap->fd == -1) {
+    perror("capture: open");
+    free(cap->buf);
+    free(cap->spare);
+    free(cap);
+    return NULL;
+  }
+  pthread_mutex_init(&cap->lock, NULL);
+  pthread_mutex_init(&cap->write_lock, NULL);
+  cap->next_id = 1;
+  cap->last_us = now_us();
+  memcpy(cap->buf, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1);
+  cap->len = sizeof(CAPTURE_MAGIC) - 1;
+  return cap;
+}
+
+void capture_connect(struct capture *cap, int fd) {
+  pthread_mutex_lock(&cap->lock);
+  if ((uint32_t)fd >= cap->nbr_ids) { /* grow the fd -> id map */
+    uint32_t nbr = cap->nbr_ids == 0 ? 1024 : cap->nbr_ids;
+    while (nbr <= (uint32_t)fd)
+      nbr *= 2;
+    uint32_t *ids = (uint32_t *)reallocarray(cap->ids, nbr, sizeof(uint32_t));
+    if (ids == NULL) {
+      perror("reallocarray");
+      pthread_mutex_unlock(&cap->lock);
+      return;
+    }
+    memset(ids + cap->nbr_ids, 0, (nbr - cap->nbr_ids) * sizeof(uint32_t));
+    cap->ids = ids;
+    cap->nbr_ids = nbr;
+  }
+  cap->ids[fd] = cap->next_id++;
+  append(cap, CAPTURE_CONNECT, cap->ids[fd], NULL, 0);
+  pthread_mutex_unlock(&cap->lock);
+}
+
+void capture_data(struct capture *cap, int fd, const char *buf, size_t len) {
+  pthread_mutex_lock(&cap->lock);
+  if ((uint32_t)fd < cap->nbr_ids && cap->ids[fd] != 0)
+    append(cap, CAPTURE_DATA, cap->ids[fd], buf, len);
+  pthread_mutex_unlock(&cap->lock);
+}
+
+void capture_disconnect(struct capture *cap, int fd) {
+  pthread_mutex_lock(&cap->lock);
+  if ((uint32_t)fd < cap->nbr_ids && cap->ids[fd] != 0) {
+    append(cap, CAPTURE_DISCONNECT, cap->ids[fd], NULL, 0);
+    cap->ids[fd] = 0;
+  }
+  pthread_mutex_unlock(&cap->lock);
+}
+
+void capture_flush(struct capture *cap) {
+  /* flushes are serialized so that the buffers reach the file in the order
+   * they were swapped */
+  pthread_mutex_lock(&cap->write_lock);
+  pthread_mutex_lock(&cap->lock);
+  if (cap->len == 0) {
+    pthread_mutex_unlock(&cap->lock);
+    pthread_mutex_unlock(&cap->write_lock);
+    return;
+  }
+  char *full = cap->buf;
+  size_t len = cap->failed ? 0 : cap->len, size = cap->size;
+  cap->buf = cap->spare;
+  cap->size = cap->spare_size;
+  cap->len = 0;
+  cap->spare = full;
+  cap->spare_size = size;
+  pthread_mutex_unlock(&cap->lock);
+
+  size_t written = write_all(cap->fd, full, len);
+
+  pthread_mutex_lock(&cap->lock);
+  cap->file_bytes += written;
+  if (written != len)
+    cap->failed = 1;
+  pthread_mutex_unlock(&cap->lock);
+  pthread_mutex_unlock(&cap->write_lock);
+}
+
+void capture_print_stats(struct capture *cap, const char *prefix) {
+  pthread_mutex_lock(&cap->lock);
+  printf("%scapture:         %u connections, %lu records, %lu bytes of "
+         "payload (%lu bytes written)%s\n",
+         prefix, cap->next_id - 1, cap->records, cap->payload_bytes,
+         cap->file_bytes, cap->failed ? " - FAILED" : "");
+  pthread_mutex_unlock(&cap->lock);
+}
+
+void capture_close(struct capture *cap) {
+  capture_flush(cap);
+  close(cap->fd);
+  pthread_mutex_destroy(&cap->lock);
+  pthread_mutex_destroy(&cap->write_lock);
+  free(cap->ids);
+  free(cap->buf);
+  free(cap->spare);
+  free(cap);
+}
+
+/* Reads a varint - 0 if it is truncated (or too long). */
+static int get_varint(struct capture_reader *r, uint64_t *v) {
+  *v = 0;
+  for (unsigned shift = 0; r->p != r->end && shift < 64; shift += 7) {
+    unsigned char b = *r->p++;
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (b < 0x80)
+      return 1;
+  }
+  return 0;
+}
+
+int capture_reader_init(struct capture_reader *r, const void *buf,
+                        size_t len) {
+  const size_t magic_len = sizeof(CAPTURE_MAGIC) - 1;
+  if (len < magic_len || memcmp(buf, CAPTURE_MAGIC, magic_len) != 0)
+    return -1;
+  r->p = (const unsigned char *)buf + magic_len;
+  r->end = (const unsigned char *)buf + len;
+  r->time_us = 0;
+  return 0;
+}
+
+int capture_next(struct capture_reader *r, struct capture_record *rec) {
+  uint64_t delta, conn, len = 0;
+
+  if (r->p == r->end)
+    return 0;
+  rec->type = (enum capture_type)*r->p++;
+  if (rec->type < CAPTURE_CONNECT || rec->type > CAPTURE_DISCONNECT)
+    return -1;
+  if (!get_varint(r, &delta) || !get_varint(r, &conn) ||
+      (rec->type == CAPTURE_DATA && !get_varint(r, &len)) ||
+      len > (uint64_t)(r->end - r->p)) {
+    r->p = r->end; /* cut short */
+    return 0;
+  }
+  if (conn == 0 || conn > UINT32_MAX || len > UINT32_MAX)
+    return -1;
+
+  r->time_us += delta;
+  rec->time_us = r->time_us;
+  rec->conn = (uint32_t)conn;
+  rec->data = (const char *)r->p;
+  rec->len = (uint32_t)len;
+  r->p += len;
+  return 1;
+}
@@ -0,0 +1,81 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A capture of the inbound traffic of a chat server: when clients connect,
+ * what they send (as received - one record per recv) and when they hang up,
+ * with the time of each event relative to the start of the capture. Replayed
+ * by chatreplay.c.
+ *
+ * A capture file is the magic "CHATCAP1" followed by records:
+ *
+ *   type   1 byte   CAPTURE_CONNECT, CAPTURE_DATA or CAPTURE_DISCONNECT
+ *   delta  varint   microseconds since the previous record
+ *   conn   varint   connection id (1, 2, ... in the order of the connects)
+ *   len    varint   CAPTURE_DATA only - followed by len bytes of payload
+ *
+ * where a varint is an unsigned LEB128 (7 bits per byte, least significant
+ * group first). A capture cut short (e.g., the server was killed) ends with
+ * the last complete record. */
+
+#define CAPTURE_MAGIC "CHATCAP1"
+
+enum capture_type {
+  CAPTURE_CONNECT = 1,
+  CAPTURE_DATA = 2,
+  CAPTURE_DISCONNECT = 3
+};
+
+struct capture;
+
+/* creates (or truncates) the capture file at path. Returns NULL on failure */
+struct capture *capture_open(const char *path);
+
+/* records that a client connected on socket fd. Thread safe, like every
+ * function below - all workers of a server share a capture */
+void capture_connect(struct capture *cap, int fd);
+
+/* records len bytes received from the client on socket fd (ignored if its
+ * connect was not recorded) */
+void capture_data(struct capture *cap, int fd, const char *buf, size_t len);
+
+/* records that the client on socket fd hung up - call it before closing fd */
+void capture_disconnect(struct capture *cap, int fd);
+
+/* writes out the buffered records (once per loop iteration). The file always
+ * ends with a complete record */
+void capture_flush(struct capture *cap);
+
+/* prints statistics (connections, records, bytes) to stdout with every line
+ * prefixed by prefix */
+void capture_print_stats(struct capture *cap, const char *prefix);
+
+/* flushes and releases the capture */
+void capture_close(struct capture *cap);
+
+/* A record read back from a capture. data points into the capture's buffer. */
+struct capture_record {
+  enum capture_type type;
+  uint32_t conn;
+  uint64_t time_us; /* since the start of the capture */
+  const char *data;
+  uint32_t len;
+};
+
+/* Iterates over the records of a capture held in memory (e.g., mapped). */
+struct capture_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+  uint64_t time_us;
+};
+
+/* starts reading the capture of len bytes at buf. -1 if it is not one */
+int capture_reader_init(struct capture_reader *r, const void *buf, size_t len);
+
+/* reads the next record into rec. Returns 1 on success, 0 at the end of the
+ * capture and -1 if the record is corrupt */
+int capture_next(struct capture_reader *r, struct capture_record *rec);
+
+#endif
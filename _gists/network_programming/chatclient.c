@@ -0,0 +1,512 @@
+/*
+ * chatclient.c -- event loop driven pool of chat client connections (see
+ * chatclient.h).
+ *
+ * Each connection has a read buffer that frames are delivered from in place
+ * (only a trailing partial frame is moved to its front) and an output buffer
+ * that chat_pool_send appends to. Connections with queued bytes are put on a
+ * dirty list which is flushed - one send per connection - before and after
+ * waiting for events, so messages queued in a burst (e.g., from the frame
+ * callback) leave in a single write. A connection whose socket buffer is full
+ * waits for EPOLLOUT instead, and one that falls WBUF_MAX bytes behind makes
+ * chat_pool_send fail so that the caller can back off.
+ *
+ * A connection that fails is re-dialed after a backoff that doubles with
+ * every failure (BACKOFF_MIN_MS to BACKOFF_MAX_MS) and is reset once it is up
+ * again. Half of each delay is random so that the connections of a pool (and
+ * of many clients) that lost their server at once do not all come back at
+ * once. A single timerfd is armed for the earliest re-dial.
+ */
+
+#define _GNU_SOURCE /* SOCK_NONBLOCK */
+#include "chatclient.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RBUF_SIZE 65536       /* longer frames are delivered in pieces */
+#define WBUF_INIT_CAP 4096    /* initial capacity of an output buffer */
+#define WBUF_MAX (4 << 20)    /* unsent bytes beyond which sends fail */
+#define FLUSH_BYTES 65536     /* queued bytes that are sent right away */
+#define BACKOFF_MIN_MS 50
+#define BACKOFF_MAX_MS 10000
+#define MAX_EVENTS 256
+#define TIMER_ID UINT32_MAX /* epoll user data of the re-dial timer */
+
+enum conn_state { CONN_DOWN, CONN_CONNECTING, CONN_UP };
+
+struct conn {
+  int fd; /* -1 while down */
+  enum conn_state state;
+  int pollout;         /* EPOLLOUT is requested */
+  int dirty;           /* on the dirty list */
+  uint32_t backoff_ms; /* delay of the next re-dial (before jitter) */
+  uint64_t retry_at;   /* when to re-dial (monotonic ms) while down */
+  char *rbuf;          /* partial frame (RBUF_SIZE bytes) */
+  uint32_t rlen;
+  char *wbuf; /* unsent bytes (wbuf + woff to wbuf + wlen) */
+  uint32_t woff;
+  uint32_t wlen;
+  uint32_t wcap;
+};
+
+struct chat_pool {
+  int epfd;
+  int timer_fd;
+  uint64_t timer_at; /* when timer_fd fires, 0 if disarmed */
+  struct addrinfo *addrs;
+  struct addrinfo *next_addr; /* dialed next - rotates on failure */
+  struct conn *conns;
+  uint32_t nbr_conns;
+  uint32_t up;
+  uint32_t next;   /* round-robin position of chat_pool_send_any */
+  uint32_t *dirty; /* connections with queued bytes */
+  uint32_t nbr_dirty;
+  uint64_t rng; /* xorshift64 state of the jitter */
+  chat_frame_fn on_frame;
+  chat_state_fn on_state;
+  void *arg;
+  struct chat_pool_stats stats;
+  struct epoll_event events[MAX_EVENTS];
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t next_random(struct chat_pool *pool) {
+  pool->rng ^= pool->rng << 13;
+  pool->rng ^= pool->rng >> 7;
+  pool->rng ^= pool->rng << 17;
+  return pool->rng;
+}
+
+static void set_interest(struct chat_pool *pool, uint32_t i) {
+  struct conn *c = &pool->conns[i];
+  struct epoll_event ev;
+
+  ev.events = c->state == CONN_CONNECTING ? EPOLLOUT
+                                          : EPOLLIN | (c->pollout ? EPOLLOUT : 0);
+  ev.data.u32 = i;
+  if (epoll_ctl(pool->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+    perror("epoll_ctl");
+}
+
+/* Arms the timer for the earliest re-dial (if any). */
+static void arm_timer(struct chat_pool *pool) {
+  uint64_t at = UINT64_MAX;
+
+  for (uint32_t i = 0; i < pool->nbr_conns; ++i) {
+    struct conn *c = &pool->conns[i];
+    if (c->state == CONN_DOWN && c->retry_at < at)
+      at = c->retry_at;
+  }
+  if (at == UINT64_MAX || at == pool->timer_at)
+    return;
+
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = at / 1000;
+  its.it_value.tv_nsec = (long)(at % 1000) * 1000000 + 1; /* never 0 */
+  if (timerfd_settime(pool->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+    perror("timerfd_settime");
+    return;
+  }
+  pool->timer_at = at;
+}
+
+/* Closes connection i (if open) and schedules its re-dial. */
+static void conn_down(struct chat_pool *pool, uint32_t i, const char *why) {
+  struct conn *c = &pool->conns[i];
+  int was_up = c->state == CONN_UP;
+
+  if (was_up)
+    fprintf(stderr, "chatclient: connection %u down (%s)\n", i, why);
+  if (c->fd != -1) {
+    close(c->fd); /* which also removes it from the epoll instance */
+    c->fd = -1;
+  }
+  c->state = CONN_DOWN;
+  c->pollout = 0;
+  c->rlen = 0;
+  c->woff = c->wlen = 0; /* whatever was not sent is lost */
+  ++pool->stats.failures;
+
+  /* half of the delay is random */
+  uint32_t half = c->backoff_ms / 2;
+  c->retry_at = now_ms() + half + next_random(pool) % (half + 1);
+  c->backoff_ms = c->backoff_ms * 2 > BACKOFF_MAX_MS ? BACKOFF_MAX_MS
+                                                     : c->backoff_ms * 2;
+  if (pool->next_addr != NULL && (pool->next_addr = pool->next_addr->ai_next) ==
+                                     NULL) /* try the next address next */
+    pool->next_addr = pool->addrs;
+
+  if (was_up) {
+    --pool->up;
+    if (pool->on_state != NULL)
+      pool->on_state(pool->arg, i, 0);
+  }
+  arm_timer(pool);
+}
+
+static void conn_up(struct chat_pool *pool, uint32_t i) {
+  struct conn *c = &pool->conns[i];
+  int y = 1;
+
+  /* messages are batched here already - Nagle would only add delay */
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &y, sizeof(y));
+  c->state = CONN_UP;
+  c->backoff_ms = BACKOFF_MIN_MS;
+  set_interest(pool, i);
+  ++pool->up;
+  ++pool->stats.connects;
+  if (pool->on_state != NULL)
+    pool->on_state(pool->arg, i, 1);
+}
+
+/* Starts a non-blocking connect of connection i. */
+static void dial(struct chat_pool *pool, uint32_t i) {
+  struct conn *c = &pool->conns[i];
+  struct addrinfo *a = pool->next_addr;
+
+  c->fd = socket(a->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (c->fd == -1) {
+    perror("socket");
+    conn_down(pool, i, "socket");
+    return;
+  }
+  if (connect(c->fd, a->ai_addr, a->ai_addrlen) == -1 &&
+      errno != EINPROGRESS) {
+    conn_down(pool, i, strerror(errno));
+    return;
+  }
+
+  struct epoll_event ev = {.events = EPOLLOUT, .data.u32 = i};
+  if (epoll_ctl(pool->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+    perror("epoll_ctl");
+    conn_down(pool, i, "epoll_ctl");
+    return;
+  }
+  c->state = CONN_CONNECTING; /* up once writable (see handle_event) */
+}
+
+/* Re-dials the connections whose backoff has expired. */
+static void redial(struct chat_pool *pool) {
+  uint64_t expirations, now = now_ms();
+
+  if (read(pool->timer_fd, &expirations, sizeof(expirations)) == -1 &&
+      errno != EAGAIN)
+    perror("read");
+  pool->timer_at = 0;
+  for (uint32_t i = 0; i < pool->nbr_conns; ++i) {
+    struct conn *c = &pool->conns[i];
+    if (c->state == CONN_DOWN && c->retry_at <= now)
+      dial(pool, i);
+  }
+  arm_timer(pool);
+}
+
+/* Sends as much of the queued output of connection i as possible. */
+static void flush_conn(struct chat_pool *pool, uint32_t i) {
+  struct conn *c = &pool->conns[i];
+  int full = 0;
+
+  while (c->woff != c->wlen) {
+    ssize_t n =
+        send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        full = 1; /* retry when EPOLLOUT fires */
+        break;
+      }
+      conn_down(pool, i, strerror(errno));
+      return;
+    }
+    c->woff += n;
+    ++pool->stats.writes;
+    pool->stats.bytes_out += n;
+  }
+  if (c->woff == c->wlen)
+    c->woff = c->wlen = 0;
+
+  if (c->pollout != full) {
+    c->pollout = full;
+    set_interest(pool, i);
+  }
+}
+
+static void flush_dirty(struct chat_pool *pool) {
+  for (uint32_t d = 0; d < pool->nbr_dirty; ++d) {
+    uint32_t i = pool->dirty[d];
+    struct conn *c = &pool->conns[i];
+    c->dirty = 0;
+    if (c->state == CONN_UP && !c->pollout)
+      flush_conn(pool, i);
+  }
+  pool->nbr_dirty = 0;
+}
+
+/* Receives what is available on connection i and delivers every complete
+ * frame. The servers terminate frames with "\n" (followed by a "\0"). Returns
+ * the number of frames delivered. */
+static int handle_read(struct chat_pool *pool, uint32_t i) {
+  struct conn *c = &pool->conns[i];
+  int frames = 0;
+
+  ssize_t n = recv(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen, 0);
+  if (n <= 0) {
+    if (n == 0)
+      conn_down(pool, i, "closed by the server");
+    else if (errno != EAGAIN && errno != EWOULDBLOCK)
+      conn_down(pool, i, strerror(errno));
+    return 0;
+  }
+  pool->stats.bytes_in += n;
+
+  char *p = c->rbuf, *end = c->rbuf + c->rlen + n;
+  for (;;) {
+    while (p != end && *p == '\0') /* the servers' frame terminators */
+      ++p;
+    char *nl = (char *)memchr(p, '\n', end - p);
+    if (nl == NULL)
+      break;
+    pool->on_frame(pool->arg, i, p, (uint32_t)(nl - p));
+    ++frames;
+    p = nl + 1;
+    if (c->state != CONN_UP) /* the callback cannot close it - but be safe */
+      return frames;
+  }
+
+  c->rlen = (uint32_t)(end - p);
+  if (c->rlen == RBUF_SIZE) { /* no terminator in sight - deliver a piece */
+    pool->on_frame(pool->arg, i, c->rbuf, c->rlen);
+    ++frames;
+    c->rlen = 0;
+  } else if (p != c->rbuf) {
+    memmove(c->rbuf, p, c->rlen);
+  }
+  pool->stats.frames_in += frames;
+  return frames;
+}
+
+static int handle_event(struct chat_pool *pool, const struct epoll_event *ev) {
+  uint32_t i = ev->data.u32;
+  struct conn *c;
+  int frames = 0;
+
+  if (i == TIMER_ID) {
+    redial(pool);
+    return 0;
+  }
+
+  c = &pool->conns[i];
+  if (c->state == CONN_CONNECTING) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+      err = errno;
+    if (err != 0)
+      conn_down(pool, i, strerror(err));
+    else
+      conn_up(pool, i);
+    return 0;
+  }
+
+  if (c->state == CONN_UP && (ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    frames = handle_read(pool, i);
+  if (c->state == CONN_UP && (ev->events & EPOLLOUT))
+    flush_conn(pool, i);
+  return frames;
+}
+
+struct chat_pool *chat_pool_new(const char *host, const char *port,
+                                uint32_t nbr_conns, chat_frame_fn on_frame,
+                                chat_state_fn on_state, void *arg) {
+  struct chat_pool *pool =
+      (struct chat_pool *)calloc(1, sizeof(struct chat_pool));
+  if (pool == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  pool->epfd = pool->timer_fd = -1;
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int rv = getaddrinfo(host, port, &hints, &pool->addrs);
+  if (rv != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    pool->addrs = NULL;
+    goto fail;
+  }
+  pool->next_addr = pool->addrs;
+
+  pool->conns = (struct conn *)calloc(nbr_conns, sizeof(struct conn));
+  pool->dirty = (uint32_t *)calloc(nbr_conns, sizeof(uint32_t));
+  if (pool->conns == NULL || pool->dirty == NULL) {
+    perror("calloc");
+    goto fail;
+  }
+  pool->nbr_conns = nbr_conns;
+  for (uint32_t i = 0; i < nbr_conns; ++i) {
+    struct conn *c = &pool->conns[i];
+    c->fd = -1;
+    c->backoff_ms = BACKOFF_MIN_MS;
+    c->rbuf = (char *)malloc(RBUF_SIZE);
+    c->wbuf = (char *)malloc(WBUF_INIT_CAP);
+    c->wcap = WBUF_INIT_CAP;
+    if (c->rbuf == NULL || c->wbuf == NULL) {
+      perror("malloc");
+      goto fail;
+    }
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  pool->rng = ((uint64_t)ts.tv_nsec << 32 ^ (uint64_t)getpid()) | 1;
+  pool->on_frame = on_frame;
+  pool->on_state = on_state;
+  pool->arg = arg;
+
+  pool->epfd = epoll_create1(EPOLL_CLOEXEC);
+  pool->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct epoll_event ev = {.events = EPOLLIN, .data.u32 = TIMER_ID};
+  if (pool->epfd == -1 || pool->timer_fd == -1 ||
+      epoll_ctl(pool->epfd, EPOLL_CTL_ADD, pool->timer_fd, &ev) == -1) {
+    perror("epoll/timerfd");
+    goto fail;
+  }
+
+  for (uint32_t i = 0; i < nbr_conns; ++i)
+    dial(pool, i);
+  return pool;
+
+fail:
+  chat_pool_free(pool);
+  return NULL;
+}
+
+int chat_pool_fd(const struct chat_pool *pool) { return pool->epfd; }
+
+int chat_pool_send(struct chat_pool *pool, uint32_t conn, const char *msg,
+                   uint32_t len) {
+  struct conn *c = &pool->conns[conn];
+  uint32_t need = len + (len == 0 || msg[len - 1] != '\n');
+
+  if (c->state != CONN_UP) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  if (c->wlen - c->woff + need > WBUF_MAX) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  if (c->woff != 0 && c->wlen + need > c->wcap) { /* compact first */
+    memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+    c->wlen -= c->woff;
+    c->woff = 0;
+  }
+  if (c->wlen + need > c->wcap) { /* still no space left - grow */
+    uint32_t cap = c->wcap;
+    while (cap < c->wlen + need)
+      cap *= 2;
+    char *wbuf = (char *)realloc(c->wbuf, cap);
+    if (wbuf == NULL) {
+      perror("realloc");
+      errno = ENOBUFS;
+      return -1;
+    }
+    c->wbuf = wbuf;
+    c->wcap = cap;
+  }
+
+  memcpy(c->wbuf + c->wlen, msg, len);
+  c->wlen += len;
+  if (need != len)
+    c->wbuf[c->wlen++] = '\n';
+  ++pool->stats.msgs_out;
+
+  if (c->pollout) /* the socket buffer is full - EPOLLOUT flushes it */
+    return 0;
+  if (c->wlen - c->woff >= FLUSH_BYTES) {
+    flush_conn(pool, conn);
+  } else if (!c->dirty) {
+    c->dirty = 1;
+    pool->dirty[pool->nbr_dirty++] = conn;
+  }
+  return 0;
+}
+
+int64_t chat_pool_send_any(struct chat_pool *pool, const char *msg,
+                           uint32_t len) {
+  for (uint32_t n = 0; n < pool->nbr_conns; ++n) {
+    uint32_t i = pool->next;
+    pool->next = (pool->next + 1) % pool->nbr_conns;
+    if (chat_pool_send(pool, i, msg, len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+uint32_t chat_pool_unsent(const struct chat_pool *pool, uint32_t conn) {
+  const struct conn *c = &pool->conns[conn];
+  return c->wlen - c->woff;
+}
+
+uint32_t chat_pool_up(const struct chat_pool *pool) { return pool->up; }
+
+int chat_pool_poll(struct chat_pool *pool, int timeout_ms) {
+  int frames = 0;
+
+  flush_dirty(pool);
+  int n = epoll_wait(pool->epfd, pool->events, MAX_EVENTS, timeout_ms);
+  if (n == -1) {
+    if (errno == EINTR)
+      return 0;
+    perror("epoll_wait");
+    return -1;
+  }
+  for (int i = 0; i < n; ++i)
+    frames += handle_event(pool, &pool->events[i]);
+  flush_dirty(pool); /* what the callbacks queued */
+  return frames;
+}
+
+const struct chat_pool_stats *chat_pool_stats(const struct chat_pool *pool) {
+  return &pool->stats;
+}
+
+void chat_pool_free(struct chat_pool *pool) {
+  if (pool->conns != NULL) {
+    for (uint32_t i = 0; i < pool->nbr_conns; ++i) {
+      struct conn *c = &pool->conns[i];
+      if (c->fd != -1)
+        close(c->fd);
+      free(c->rbuf);
+      free(c->wbuf);
+    }
+  }
+  if (pool->addrs != NULL)
+    freeaddrinfo(pool->addrs);
+  if (pool->timer_fd != -1)
+    close(pool->timer_fd);
+  if (pool->epfd != -1)
+    close(pool->epfd);
+  free(pool->conns);
+  free(pool->dirty);
+  free(pool);
+}
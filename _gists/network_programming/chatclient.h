@@ -0,0 +1,80 @@
+#ifndef CHATCLIENT_H
+#define CHATCLIENT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A pool of non-blocking client connections to a chat server, driven by an
+ * event loop of its own (chat_pool_poll) - or by the caller's: the pool's
+ * epoll instance (chat_pool_fd) can be added to another one. Connections that
+ * fail or are closed by the server are re-dialed after a jittered exponential
+ * backoff. Outgoing messages are queued per connection and sent in one write
+ * per connection and loop iteration. Incoming frames (lines) are handed to a
+ * callback straight from the connection's read buffer - no allocation per
+ * message on either path. Not thread safe. */
+struct chat_pool;
+
+/* called for every frame received on connection conn - a line without its
+ * terminator. frame is only valid during the call */
+typedef void (*chat_frame_fn)(void *arg, uint32_t conn, const char *frame,
+                              uint32_t len);
+
+/* called when connection conn comes up (up is 1) or goes down (0) */
+typedef void (*chat_state_fn)(void *arg, uint32_t conn, int up);
+
+struct chat_pool_stats {
+  uint64_t msgs_out;   /* messages queued by chat_pool_send */
+  uint64_t bytes_out;  /* bytes written to the sockets */
+  uint64_t writes;     /* send calls that wrote something */
+  uint64_t frames_in;  /* frames delivered to the callback */
+  uint64_t bytes_in;
+  uint64_t connects;   /* connections that came up */
+  uint64_t failures;   /* dials that failed and connections that went down */
+};
+
+/* creates a pool of nbr_conns connections to host:port and starts dialing
+ * them. on_state may be NULL. Returns NULL on failure */
+struct chat_pool *chat_pool_new(const char *host, const char *port,
+                                uint32_t nbr_conns, chat_frame_fn on_frame,
+                                chat_state_fn on_state, void *arg);
+
+/* returns the pool's epoll instance - readable whenever chat_pool_poll has
+ * something to do */
+int chat_pool_fd(const struct chat_pool *pool);
+
+/* queues msg (a line - the '\n' is appended if it is missing) on connection
+ * conn. 0 on success and -1 if conn is down (errno ENOTCONN) or has too much
+ * unsent data already (ENOBUFS) */
+int chat_pool_send(struct chat_pool *pool, uint32_t conn, const char *msg,
+                   uint32_t len);
+
+/* same as chat_pool_send on the next connection that is up (round-robin).
+ * Returns the connection or -1 if none could take the message */
+int64_t chat_pool_send_any(struct chat_pool *pool, const char *msg,
+                           uint32_t len);
+
+/* returns the number of bytes queued on conn but not sent yet */
+uint32_t chat_pool_unsent(const struct chat_pool *pool, uint32_t conn);
+
+/* returns the number of connections that are up */
+uint32_t chat_pool_up(const struct chat_pool *pool);
+
+/* sends what was queued, waits up to timeout_ms (-1 forever) for events,
+ * handles them (frames, connects, reconnects) and sends again. Returns the
+ * number of frames delivered or -1 on error */
+int chat_pool_poll(struct chat_pool *pool, int timeout_ms);
+
+/* returns the pool's counters */
+const struct chat_pool_stats *chat_pool_stats(const struct chat_pool *pool);
+
+/* closes every connection and releases the pool */
+void chat_pool_free(struct chat_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
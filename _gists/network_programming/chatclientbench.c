@@ -0,0 +1,186 @@
+/*
+ * chatclientbench.c -- measures how many messages a single client process
+ * gets through a chat server with the pool of chatclient.c: CONNS connections
+ * join the room and send messages round-robin as fast as the server takes
+ * them, and every connection counts what the server broadcasts back.
+ *
+ * Usage: ./chatclientbench [-c CONNS] [-d SECONDS] [-s SIZE] [-w WINDOW]
+ *                          HOST PORT
+ *
+ *   -c  number of connections (default 4)
+ *   -d  duration of the run in seconds (default 5)
+ *   -s  size of a message in bytes, '\n' included (default 32)
+ *   -w  max number of messages in flight (default 4096). The server broadcasts
+ *       each message to the CONNS - 1 other connections; a message is in
+ *       flight until the last of them came back. The window keeps the run
+ *       closed-loop - without it the client would only measure how fast it
+ *       fills the socket buffers.
+ *
+ * Messages are sent in bursts of up to BURST per loop iteration, so the pool
+ * writes each connection's share of a burst with one send - the report shows
+ * the messages per write it got. Reconnects (e.g., restart the server during
+ * a run) are reported as they happen.
+ *
+ * Example:
+ *
+ *   ./multichatserver_epoll 9034 > /dev/null &
+ *   ./chatclientbench -c 8 -d 10 localhost 9034
+ *
+ * compile with:
+ *
+ *   cc -O2 -o chatclientbench chatclientbench.c chatclient.c
+ */
+
+#include "chatclient.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BURST 256 /* messages queued between two polls */
+
+static uint64_t received = 0; /* chat lines broadcast back to us */
+static int running = 0;        /* the room is full - report reconnects */
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void on_frame(void *arg, uint32_t conn, const char *frame,
+                     uint32_t len) {
+  (void)arg;
+  (void)conn;
+  /* chat lines only - not presence and other notices */
+  if (len >= 5 && memcmp(frame, "user ", 5) == 0)
+    ++received;
+}
+
+static void on_state(void *arg, uint32_t conn, int up) {
+  (void)arg;
+  if (running && up) /* chatclient.c reports it going down */
+    fprintf(stderr, "connection %u up again\n", conn);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [-c CONNS] [-d SECONDS] [-s SIZE] [-w WINDOW] HOST "
+          "PORT\n",
+          argv0);
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t nbr_conns = 4, size = 32;
+  uint64_t window = 4096;
+  double seconds = 5;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:d:s:w:")) != -1) {
+    switch (opt) {
+    case 'c':
+      nbr_conns = (uint32_t)atoi(optarg);
+      break;
+    case 'd':
+      seconds = atof(optarg);
+      break;
+    case 's':
+      size = (uint32_t)atoi(optarg);
+      break;
+    case 'w':
+      window = (uint64_t)atoll(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 2 || nbr_conns < 2 || size < 2 || window == 0) {
+    usage(argv[0]);
+    if (nbr_conns < 2)
+      fprintf(stderr, "at least 2 connections are needed\n");
+    return 1;
+  }
+
+  char *msg = (char *)malloc(size);
+  if (msg == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  memset(msg, 'x', size - 1);
+  msg[size - 1] = '\n';
+
+  struct chat_pool *pool = chat_pool_new(argv[optind], argv[optind + 1],
+                                         nbr_conns, on_frame, on_state, NULL);
+  if (pool == NULL)
+    return 1;
+
+  /* wait for the room to fill up */
+  uint64_t deadline = now_ns() + 5000000000ull;
+  while (chat_pool_up(pool) < nbr_conns && now_ns() < deadline)
+    if (chat_pool_poll(pool, 100) == -1)
+      return 1;
+  if (chat_pool_up(pool) < nbr_conns) {
+    fprintf(stderr, "only %u of %u connections came up\n", chat_pool_up(pool),
+            nbr_conns);
+    return 1;
+  }
+  while (chat_pool_poll(pool, 200) > 0) /* drain join notices */
+    ;
+
+  running = 1;
+  struct chat_pool_stats base = *chat_pool_stats(pool);
+  uint64_t fanout = nbr_conns - 1;
+  uint64_t sent = 0, stalls = 0, start = now_ns(), last_received = start;
+  uint64_t end = start + (uint64_t)(seconds * 1e9);
+
+  for (uint64_t now = start; now < end; now = now_ns()) {
+    /* received is only approximate once connections came and went */
+    uint64_t done = received / fanout;
+    uint64_t in_flight = sent > done ? sent - done : 0;
+    for (int n = 0; n < BURST && in_flight < window; ++n, ++in_flight) {
+      if (chat_pool_send_any(pool, msg, size) == -1) {
+        ++stalls; /* every connection is down or backed up */
+        break;
+      }
+      ++sent;
+    }
+
+    uint64_t before = received;
+    if (chat_pool_poll(pool, in_flight < window ? 0 : 10) == -1)
+      return 1;
+    if (received != before)
+      last_received = now_ns();
+  }
+
+  /* collect what is still in flight */
+  deadline = now_ns() + 2000000000ull;
+  while (received < sent * fanout && now_ns() < deadline) {
+    uint64_t before = received;
+    if (chat_pool_poll(pool, 100) == -1)
+      return 1;
+    if (received != before)
+      last_received = now_ns();
+  }
+
+  const struct chat_pool_stats *st = chat_pool_stats(pool);
+  uint64_t msgs = st->msgs_out - base.msgs_out;
+  uint64_t writes = st->writes - base.writes;
+  double sent_secs = seconds, recv_secs = (last_received - start) / 1e9;
+
+  printf("connections:     %u (%lu reconnects)\n", nbr_conns,
+         st->connects - base.connects);
+  printf("sent:            %lu messages (%.0f msgs/s, %.1f MB/s)\n", msgs,
+         msgs / sent_secs, (st->bytes_out - base.bytes_out) / sent_secs / 1e6);
+  printf("received:        %lu lines (%.0f lines/s) of %lu expected\n",
+         received, recv_secs > 0 ? received / recv_secs : 0.0, sent * fanout);
+  printf("writes:          %lu (%.1f messages per write)\n", writes,
+         writes ? (double)msgs / writes : 0.0);
+  printf("stalled:         %lu iterations (no connection took a message)\n",
+         stalls);
+
+  chat_pool_free(pool);
+  free(msg);
+  return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * chatloadgen.c -- load generator for the chat servers. Opens a number of
+ * client connections, sends timestamped messages at a fixed aggregate rate
+ * (round-robin over the clients) and measures the fan-out latency, i.e., the
+ * time between a message being sent and each other client receiving it.
+ *
+ * Usage: ./chatloadgen [-n CLIENTS] [-r MSGS_PER_SEC] [-d SECONDS] [-s SIZE]
+ *                      HOST PORT [PORT...]
+ *
+ *   -n  number of client connections (default 16)
+ *   -r  aggregate number of messages sent per second (default 1000)
+ *   -d  duration of the run in seconds (default 10)
+ *   -s  size of each message in bytes (default 64, max 200)
+ *
+ * Example - comparing the default blocking mode against busy-poll mode:
+ *
+ *   ./multichatserver_epoll 9034 > /dev/null &
+ *   ./chatloadgen -n 32 -r 20000 localhost 9034
+ *   ./multichatserver_epoll -B 50 -C 2 9034 > /dev/null &
+ *   taskset -c 4 ./chatloadgen -n 32 -r 20000 localhost 9034
+ *
+ * With several ports, clients are spread round-robin over them - e.g., over
+ * the nodes of a cluster (see -N of multichatserver_epoll):
+ *
+ *   ./chatloadgen -n 48 -r 5000 localhost 9001 9002 9003
+ *
+ * All processes must run on the same host (timestamps come from the
+ * monotonic clock).
+ *
+ * compile with:
+ *
+ *   cc -O2 -o chatloadgen chatloadgen.c sockethelpers.c
+ */
+
+#include "sockethelpers.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 1024
+#define MAX_SAMPLES (16 * 1024 * 1024) /* latency samples kept (4 B each) */
+#define LINE_MAX_LEN 512               /* longest line we expect back */
+#define TIMER_ID UINT32_MAX            /* epoll user data of the send timer */
+
+/* A client connection and the partial line it has received so far. */
+struct conn {
+  int fd;
+  uint32_t len;
+  char line[LINE_MAX_LEN];
+};
+
+static uint32_t *samples; /* fan-out latencies in nanoseconds */
+static uint64_t nbr_samples = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Connects a client to host:port and returns its (non-blocking) socket. */
+static int connect_to(const char *host, const char *port) {
+  struct addrinfo hints, *servinfo, *p;
+  int fd = -1, rv;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    exit(EXIT_FAILURE);
+  }
+
+  for (p = servinfo; p != NULL; p = p->ai_next) {
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+  }
+  freeaddrinfo(servinfo);
+
+  if (p == NULL) {
+    fprintf(stderr, "failed to connect to %s:%s\n", host, port);
+    exit(EXIT_FAILURE);
+  }
+
+  int y = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &y, sizeof(y));
+  return fd;
+}
+
+/* Extracts the send timestamp of a received line (if it has one) and records
+ * the resulting latency. */
+static void handle_line(const char *line, uint64_t now) {
+  const char *ts = strstr(line, ": ts ");
+  if (ts == NULL)
+    return; /* e.g., presence frames */
+  uint64_t sent = strtoull(ts + 5, NULL, 10);
+  if (nbr_samples < MAX_SAMPLES && now >= sent) {
+    uint64_t lat = now - sent;
+    samples[nbr_samples++] = lat > UINT32_MAX ? UINT32_MAX : (uint32_t)lat;
+  }
+}
+
+/* Receives whatever is available on c and handles every complete line. The
+ * servers terminate every message with "\n\0". */
+static void handle_conn(struct conn *c) {
+  char buf[65536];
+  ssize_t n;
+
+  while ((n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    uint64_t now = now_ns();
+    for (ssize_t i = 0; i < n; ++i) {
+      char ch = buf[i];
+      if (ch == '\0')
+        continue;
+      if (ch == '\n' || c->len == LINE_MAX_LEN - 1) {
+        c->line[c->len] = '\0';
+        handle_line(c->line, now);
+        c->len = 0;
+      } else {
+        c->line[c->len++] = ch;
+      }
+    }
+  }
+  if (n == 0) {
+    fprintf(stderr, "server closed a connection\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_us(double p) {
+  uint64_t i = (uint64_t)(p * (nbr_samples - 1));
+  return samples[i] / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t nbr_clients = 16, rate = 1000, duration = 10, size = 64;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:r:d:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      nbr_clients = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      rate = strtoul(optarg, NULL, 10);
+      break;
+    case 'd':
+      duration = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      size = strtoul(optarg, NULL, 10);
+      if (size > 200)
+        size = 200;
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if (optind > argc - 2 || nbr_clients < 2) {
+  usage:
+    fprintf(stderr,
+            "Usage: %s [-n CLIENTS] [-r MSGS_PER_SEC] [-d SECONDS] "
+            "[-s SIZE] HOST PORT [PORT...]\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  samples = (uint32_t *)malloc(MAX_SAMPLES * sizeof(uint32_t));
+  struct conn *conns = (struct conn *)calloc(nbr_clients, sizeof(struct conn));
+  struct epoll_event *events =
+      (struct epoll_event *)calloc(MAX_EVENTS, sizeof(struct epoll_event));
+  int epfd = epoll_create1(0);
+  if (samples == NULL || conns == NULL || events == NULL || epfd == -1) {
+    perror("malloc/epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+
+  for (uint32_t i = 0; i < nbr_clients; ++i) {
+    int nbr_ports = argc - optind - 1;
+    conns[i].fd = connect_to(argv[optind], argv[optind + 1 + i % nbr_ports]);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+  }
+
+  /* sends are paced by a 1ms periodic timer */
+  int tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+  struct itimerspec its = {.it_interval = {0, 1000000}, .it_value = {0, 1000000}};
+  struct epoll_event tev = {.events = EPOLLIN, .data.u32 = TIMER_ID};
+  if (tfd == -1 || timerfd_settime(tfd, 0, &its, NULL) == -1 ||
+      epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &tev) == -1) {
+    perror("timerfd");
+    exit(EXIT_FAILURE);
+  }
+
+  /* let the presence notifications of our own joins settle */
+  usleep(300000);
+  for (uint32_t i = 0; i < nbr_clients; ++i)
+    handle_conn(&conns[i]);
+  nbr_samples = 0;
+
+  char msg[256];
+  uint64_t start = now_ns(), stop = start + (uint64_t)duration * 1000000000ull;
+  uint64_t end = stop + 500000000ull; /* grace period for in-flight msgs */
+  uint64_t sent = 0;
+  uint32_t next = 0;
+
+  for (;;) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+    if (n == -1 && errno != EINTR) {
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+
+    uint64_t now = now_ns();
+    if (now >= end)
+      break;
+
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.u32 != TIMER_ID) {
+        handle_conn(&conns[events[i].data.u32]);
+        continue;
+      }
+
+      uint64_t expirations;
+      if (read(tfd, &expirations, sizeof(expirations)) <= 0 || now >= stop)
+        continue;
+
+      /* catch up with the target rate */
+      uint64_t target = (now - start) * rate / 1000000000ull;
+      for (; sent < target; ++sent) {
+        int len = snprintf(msg, sizeof(msg), "ts %lu ", now_ns());
+        memset(msg + len, 'x', size > (uint32_t)len + 1 ? size - len - 1 : 0);
+        len = size > (uint32_t)len + 1 ? (int)size : len + 1;
+        msg[len - 1] = '\n';
+        if (send(conns[next].fd, msg, len, MSG_NOSIGNAL) == -1 &&
+            errno != EAGAIN)
+          perror("send");
+        next = (next + 1) % nbr_clients;
+      }
+    }
+  }
+
+  uint64_t expected = sent * (nbr_clients - 1);
+  printf("clients %u  sent %lu msgs (%.0f msgs/s)  received %lu of %lu "
+         "(%.2f%%)\n",
+         nbr_clients, sent, sent / (double)duration, nbr_samples, expected,
+         expected != 0 ? 100.0 * nbr_samples / expected : 0.0);
+
+  if (nbr_samples == 0)
+    exit(EXIT_FAILURE);
+
+  qsort(samples, nbr_samples, sizeof(uint32_t), cmp_u32);
+  printf("fan-out latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  "
+         "max %.1f\n",
+         percentile_us(0.5), percentile_us(0.9), percentile_us(0.99),
+         percentile_us(0.999), samples[nbr_samples - 1] / 1000.0);
+
+  exit(EXIT_SUCCESS);
+}
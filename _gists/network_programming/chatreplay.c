@@ -0,0 +1,535 @@
+/*
+ * chatreplay.c -- replays a traffic capture (see -X of multichatserver_epoll.c
+ * and capture.h) against a chat server: every captured connection is opened,
+ * fed with the bytes it sent - in the chunks and at the times they were
+ * received by the capturing server - and closed again. Unlike chatloadgen.c's
+ * uniform messages at a fixed rate, this reproduces the burstiness, message
+ * size mix and connection churn of real traffic.
+ *
+ * Usage: ./chatreplay [-x SPEED] [-w SECONDS] [-r] FILE HOST PORT
+ *
+ *   -x  replay speed: 1 (the default) replays at the captured pace, N N times
+ *       faster (e.g., 10 or 0.5) and 0 as fast as the server takes it
+ *   -w  keep reading for SECONDS seconds after the last record (default 1)
+ *   -r  send the payloads as captured - no latency is measured then
+ *
+ * To measure the fan-out latency, the first STAMP_LEN bytes of every line that
+ * is long enough are overwritten with the time it is sent ("~" and 12 hex
+ * digits) - the rest of the line and the line lengths are kept. Every
+ * replayed connection reads what the server broadcasts, and every stamped
+ * line it gets back is a latency sample. Throughput is reported as lines
+ * (and bytes) sent per second and lines received per second (i.e., after the
+ * fan-out, until the last one came back). At max speed, connections are only
+ * closed on exit - the whole capture is sent within milliseconds, and
+ * short-lived connections would hang up before the server broadcasts a thing
+ * to them otherwise. If the server does not keep up with the replay,
+ * connections with too much unsent data stall the replay (rather than piling
+ * up data) - the "behind schedule" figure shows by how much.
+ *
+ * Example - capture real traffic and replay it 10x against another backend:
+ *
+ *   ./multichatserver_epoll -X chat.cap 9034
+ *   ./multichatserver 9035 64 > /dev/null &
+ *   ./chatreplay -x 10 chat.cap localhost 9035
+ *
+ * All processes must run on the same host (timestamps come from the
+ * monotonic clock).
+ *
+ * compile with:
+ *
+ *   cc -O2 -pthread -o chatreplay chatreplay.c capture.c
+ */
+
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 1024
+#define MAX_SAMPLES (16 * 1024 * 1024) /* latency samples kept (4 B each) */
+#define LINE_MAX_LEN 512               /* longest line we expect back */
+#define OUT_MAX (1 << 20)   /* unsent bytes per connection that stall replay */
+#define BATCH 64            /* records replayed between two epoll_waits */
+#define STAMP_LEN 13        /* "~" and 12 hex digits */
+#define STAMP_MASK ((1ull << 48) - 1)
+#define TIMER_ID UINT32_MAX /* epoll user data of the replay timer */
+
+enum conn_state { CONN_UNUSED, CONN_OPEN, CONN_CLOSING, CONN_CLOSED };
+
+/* A replayed connection: its unsent output and the partial line it has
+ * received so far. */
+struct conn {
+  int fd;
+  enum conn_state state;
+  int at_line_start; /* the next byte it sends starts a line */
+  int pollout;       /* EPOLLOUT is requested */
+  uint32_t len;
+  char line[LINE_MAX_LEN];
+  char *out;
+  uint32_t out_off;
+  uint32_t out_len;
+  uint32_t out_cap;
+};
+
+static uint32_t *samples; /* fan-out latencies in nanoseconds */
+static uint64_t nbr_samples = 0;
+static uint64_t lines_received = 0;
+static uint64_t last_received = 0; /* time the last line was received */
+static int epfd;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Connects to host:port and returns the (non-blocking) socket or -1. */
+static int connect_to(const char *host, const char *port) {
+  struct addrinfo hints, *servinfo, *p;
+  int fd = -1, rv;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return -1;
+  }
+
+  for (p = servinfo; p != NULL; p = p->ai_next) {
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+  }
+  freeaddrinfo(servinfo);
+
+  if (p == NULL) {
+    fprintf(stderr, "failed to connect to %s:%s\n", host, port);
+    return -1;
+  }
+
+  int y = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &y, sizeof(y));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+static void set_pollout(struct conn *c, uint32_t id, int on) {
+  if (c->pollout == on)
+    return;
+  struct epoll_event ev = {.events = EPOLLIN | (on ? EPOLLOUT : 0),
+                           .data.u32 = id};
+  epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+  c->pollout = on;
+}
+
+static void close_conn(struct conn *c) {
+  close(c->fd); /* which also removes it from the epoll instance */
+  free(c->out);
+  c->out = NULL;
+  c->state = CONN_CLOSED;
+}
+
+/* Sends as much of the unsent output of c as possible. Returns -1 if the
+ * connection failed. */
+static int flush_conn(struct conn *c, uint32_t id) {
+  while (c->out_off != c->out_len) {
+    ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                     MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      perror("send");
+      return -1;
+    }
+    c->out_off += n;
+  }
+  if (c->out_off == c->out_len)
+    c->out_off = c->out_len = 0;
+  set_pollout(c, id, c->out_len != 0);
+  return 0;
+}
+
+/* Sends len bytes of buf on c - whatever does not fit into the socket buffer
+ * right now is kept for later. Returns -1 if the connection failed. */
+static int send_conn(struct conn *c, uint32_t id, const char *buf,
+                     uint32_t len) {
+  if (c->out_len == 0) {
+    ssize_t n = send(c->fd, buf, len, MSG_NOSIGNAL);
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("send");
+      return -1;
+    }
+    n = n == -1 ? 0 : n;
+    buf += n;
+    len -= n;
+    if (len == 0)
+      return 0;
+  }
+
+  if (c->out_len + len > c->out_cap) {
+    uint32_t cap = c->out_cap == 0 ? 4096 : c->out_cap;
+    while (cap < c->out_len + len)
+      cap *= 2;
+    char *out = (char *)realloc(c->out, cap);
+    if (out == NULL) {
+      perror("realloc");
+      return -1;
+    }
+    c->out = out;
+    c->out_cap = cap;
+  }
+  memcpy(c->out + c->out_len, buf, len);
+  c->out_len += len;
+  set_pollout(c, id, 1);
+  return 0;
+}
+
+/* Overwrites the start of every line of buf (sent by c) that is at least
+ * STAMP_LEN bytes long - within buf - with the stamp of now. Returns the
+ * number of lines (i.e., newlines) in buf. */
+static uint64_t stamp_lines(struct conn *c, char *buf, uint32_t len,
+                            uint64_t now) {
+  static const char hex[] = "0123456789abcdef";
+  char *p = buf, *end = buf + len;
+  uint64_t lines = 0;
+
+  while (p != end) {
+    char *nl = (char *)memchr(p, '\n', end - p);
+    if (c->at_line_start && (nl != NULL ? nl : end) - p >= STAMP_LEN) {
+      uint64_t t = now & STAMP_MASK;
+      p[0] = '~';
+      for (int i = STAMP_LEN - 1; i >= 1; --i, t >>= 4)
+        p[i] = hex[t & 0xf];
+    }
+    if (nl == NULL) {
+      c->at_line_start = 0;
+      break;
+    }
+    c->at_line_start = 1;
+    ++lines;
+    p = nl + 1;
+  }
+  return lines;
+}
+
+static uint64_t count_lines(const char *p, uint32_t len) {
+  const char *end = p + len;
+  uint64_t lines = 0;
+  for (; (p = (const char *)memchr(p, '\n', end - p)) != NULL; ++p)
+    ++lines;
+  return lines;
+}
+
+/* Extracts the stamp of a received line (if it has one) and records the
+ * resulting latency. */
+static void handle_line(const char *line, uint64_t now) {
+  ++lines_received;
+  const char *s = strstr(line, ": ~");
+  if (s == NULL)
+    return; /* e.g., presence frames or lines too short to be stamped */
+  s += 2;
+
+  uint64_t sent = 0;
+  for (int i = 1; i < STAMP_LEN; ++i) {
+    char ch = s[i];
+    if (ch >= '0' && ch <= '9')
+      sent = sent << 4 | (ch - '0');
+    else if (ch >= 'a' && ch <= 'f')
+      sent = sent << 4 | (ch - 'a' + 10);
+    else
+      return;
+  }
+  uint64_t lat = (now - sent) & STAMP_MASK;
+  if (nbr_samples < MAX_SAMPLES)
+    samples[nbr_samples++] = lat > UINT32_MAX ? UINT32_MAX : (uint32_t)lat;
+}
+
+/* Receives whatever is available on c and handles every complete line. The
+ * servers terminate every message with "\n" (and a "\0" after it). */
+static void handle_conn(struct conn *c) {
+  char buf[65536];
+  ssize_t n;
+
+  while ((n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    uint64_t now = now_ns();
+    for (ssize_t i = 0; i < n; ++i) {
+      char ch = buf[i];
+      if (ch == '\0')
+        continue;
+      if (ch == '\n' || c->len == LINE_MAX_LEN - 1) {
+        c->line[c->len] = '\0';
+        handle_line(c->line, now);
+        last_received = now;
+        c->len = 0;
+      } else {
+        c->line[c->len++] = ch;
+      }
+    }
+  }
+  if (n == 0) { /* the server hung up on us - stop replaying this one */
+    fprintf(stderr, "server closed a connection\n");
+    close_conn(c);
+  }
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_us(double p) {
+  uint64_t i = (uint64_t)(p * (nbr_samples - 1));
+  return samples[i] / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+  double speed = 1.0, linger_s = 1.0;
+  int raw = 0, opt;
+
+  while ((opt = getopt(argc, argv, "x:w:r")) != -1) {
+    switch (opt) {
+    case 'x':
+      speed = strtod(optarg, NULL);
+      break;
+    case 'w':
+      linger_s = strtod(optarg, NULL);
+      break;
+    case 'r':
+      raw = 1;
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if (optind != argc - 3 || speed < 0) {
+  usage:
+    fprintf(stderr, "Usage: %s [-x SPEED] [-w SECONDS] [-r] FILE HOST PORT\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *host = argv[optind + 1], *port = argv[optind + 2];
+
+  /* the capture is mapped - records point into it */
+  int cfd = open(argv[optind], O_RDONLY);
+  struct stat st;
+  if (cfd == -1 || fstat(cfd, &st) == -1) {
+    perror(argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+  struct capture_reader rd;
+  if (map == MAP_FAILED || capture_reader_init(&rd, map, st.st_size) == -1) {
+    fprintf(stderr, "%s is not a capture\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  /* first pass - size the connection table and summarize the capture */
+  struct capture_record rec;
+  uint32_t max_conn = 0;
+  uint64_t nbr_records = 0, nbr_data = 0, payload = 0, span_us = 0;
+  uint32_t max_len = 1; /* of a chunk */
+  int r;
+  while ((r = capture_next(&rd, &rec)) == 1) {
+    ++nbr_records;
+    if (rec.conn > max_conn)
+      max_conn = rec.conn;
+    if (rec.type == CAPTURE_DATA) {
+      ++nbr_data;
+      payload += rec.len;
+      if (rec.len > max_len)
+        max_len = rec.len;
+    }
+    span_us = rec.time_us;
+  }
+  if (r == -1)
+    fprintf(stderr, "corrupt record - replaying the %lu records before it\n",
+            nbr_records);
+  printf("capture: %u connections, %lu chunks (%lu bytes) over %.3f s\n",
+         max_conn, nbr_data, payload, span_us / 1e6);
+
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  samples = (uint32_t *)malloc(MAX_SAMPLES * sizeof(uint32_t));
+  struct conn *conns = (struct conn *)calloc(max_conn + 1, sizeof(struct conn));
+  struct epoll_event *events =
+      (struct epoll_event *)calloc(MAX_EVENTS, sizeof(struct epoll_event));
+  char *scratch = (char *)malloc(max_len); /* a stamped chunk */
+  epfd = epoll_create1(0);
+  if (samples == NULL || conns == NULL || events == NULL || scratch == NULL ||
+      epfd == -1) {
+    perror("malloc/epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+
+  /* records are due at an absolute time - the timer is armed for the next */
+  int tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+  struct epoll_event tev = {.events = EPOLLIN, .data.u32 = TIMER_ID};
+  if (tfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &tev) == -1) {
+    perror("timerfd");
+    exit(EXIT_FAILURE);
+  }
+
+  capture_reader_init(&rd, map, st.st_size);
+  int have = capture_next(&rd, &rec) == 1;
+  uint64_t start = now_ns(), done = 0, max_lag = 0, lag_sum = 0;
+  uint64_t lines_sent = 0, bytes_sent = 0, skipped = 0, failed = 0;
+
+  for (;;) {
+    uint64_t now = now_ns();
+
+    /* replay what is due (as long as no connection is stalled) */
+    for (int batch = 0; have && batch < BATCH; ++batch) {
+      uint64_t due = speed == 0 ? now : start + rec.time_us * 1000 / speed;
+      if (due > now)
+        break;
+      struct conn *c = &conns[rec.conn];
+      if (rec.type == CAPTURE_DATA && c->state == CONN_OPEN &&
+          c->out_len >= OUT_MAX)
+        break; /* stalled until the server takes more */
+
+      uint64_t lag = now - due;
+      lag_sum += lag;
+      if (lag > max_lag)
+        max_lag = lag;
+
+      if (rec.type == CAPTURE_CONNECT) {
+        if ((c->fd = connect_to(host, port)) == -1) {
+          ++failed;
+          c->state = CONN_CLOSED;
+        } else {
+          struct epoll_event ev = {.events = EPOLLIN, .data.u32 = rec.conn};
+          epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+          c->state = CONN_OPEN;
+          c->at_line_start = 1;
+        }
+      } else if (c->state != CONN_OPEN) { /* failed (or hung up on) */
+        skipped += rec.type == CAPTURE_DATA;
+      } else if (rec.type == CAPTURE_DATA) {
+        const char *buf = rec.data;
+        if (raw) {
+          lines_sent += count_lines(buf, rec.len);
+        } else { /* the capture is read-only - stamps go into a copy */
+          memcpy(scratch, rec.data, rec.len);
+          lines_sent += stamp_lines(c, scratch, rec.len, now);
+          buf = scratch;
+        }
+        bytes_sent += rec.len;
+        if (send_conn(c, rec.conn, buf, rec.len) == -1) {
+          ++failed;
+          close_conn(c);
+        }
+      } else if (speed == 0) { /* closed on exit (see above) */
+      } else if (c->out_len != 0) { /* disconnect once everything is sent */
+        c->state = CONN_CLOSING;
+      } else {
+        close_conn(c);
+      }
+      have = capture_next(&rd, &rec) == 1;
+    }
+
+    if (!have && done == 0)
+      done = now;
+    if (done != 0 && now >= done + (uint64_t)(linger_s * 1e9))
+      break;
+
+    /* wake up for the next record (unless it is due already) */
+    int timeout = -1;
+    if (!have) {
+      timeout = 100;
+    } else {
+      uint64_t due = speed == 0 ? now : start + rec.time_us * 1000 / speed;
+      if (due <= now) {
+        timeout = 0;
+      } else {
+        struct itimerspec its = {
+            .it_value = {(time_t)(due / 1000000000ull),
+                         (long)(due % 1000000000ull)}};
+        timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+      }
+    }
+
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    if (n == -1 && errno != EINTR) {
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; ++i) {
+      uint32_t id = events[i].data.u32;
+      if (id == TIMER_ID) {
+        uint64_t expirations;
+        read(tfd, &expirations, sizeof(expirations));
+        continue;
+      }
+      struct conn *c = &conns[id];
+      if (c->state == CONN_CLOSED)
+        continue;
+      if (events[i].events & EPOLLIN)
+        handle_conn(c);
+      if (c->state != CONN_CLOSED && (events[i].events & EPOLLOUT)) {
+        if (flush_conn(c, id) == -1) {
+          ++failed;
+          close_conn(c);
+        } else if (c->state == CONN_CLOSING && c->out_len == 0) {
+          close_conn(c);
+        }
+      }
+    }
+  }
+
+  double took = (done - start) / 1e9;
+  uint64_t rx_end = last_received > done ? last_received : done;
+  double rx_took = (rx_end - start) / 1e9;
+  if (speed == 0)
+    printf("replayed as fast as possible in %.3f s", took);
+  else
+    printf("replayed at %gx in %.3f s", speed, took);
+  printf(" (%.1fx the captured pace) - behind schedule: avg %.3f ms, max "
+         "%.3f ms\n",
+         took > 0 ? span_us / 1e6 / took : 0.0,
+         nbr_records != 0 ? lag_sum / 1e6 / nbr_records : 0.0, max_lag / 1e6);
+  printf("sent %lu lines (%.0f lines/s, %.2f MiB/s)  received %lu lines "
+         "(%.0f lines/s)\n",
+         lines_sent, took > 0 ? lines_sent / took : 0.0,
+         took > 0 ? bytes_sent / took / (1 << 20) : 0.0, lines_received,
+         rx_took > 0 ? lines_received / rx_took : 0.0);
+  if (failed != 0 || skipped != 0)
+    printf("%lu connections failed, %lu records skipped\n", failed, skipped);
+
+  if (raw)
+    exit(EXIT_SUCCESS);
+  if (nbr_samples == 0) {
+    fprintf(stderr, "no stamped line came back\n");
+    exit(EXIT_FAILURE);
+  }
+
+  qsort(samples, nbr_samples, sizeof(uint32_t), cmp_u32);
+  printf("fan-out latency (us, %lu samples): p50 %.1f  p90 %.1f  p99 %.1f  "
+         "p999 %.1f  max %.1f\n",
+         nbr_samples, percentile_us(0.5), percentile_us(0.9),
+         percentile_us(0.99), percentile_us(0.999),
+         samples[nbr_samples - 1] / 1000.0);
+
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,560 @@
+/*
+ * coro.hpp -- C++20 coroutines over non-blocking sockets: the event loops of
+ * this directory without the hand-written state machines.
+ *
+ *   coro::Task<> echo(coro::Executor &ex, int fd) {
+ *     char buf[4096];
+ *     ssize_t n;
+ *     while ((n = co_await ex.recv(fd, buf, sizeof(buf))) > 0)
+ *       if (co_await ex.send_all(fd, buf, n) == -1)
+ *         break;
+ *     ex.close(fd);
+ *   }
+ *
+ *   coro::Executor ex;
+ *   ex.spawn(echo(ex, fd));
+ *   ex.run();
+ *
+ * Executor is a single-threaded epoll loop. Every socket is registered once,
+ * edge-triggered for both directions, and every operation first tries its
+ * system call right away - a coroutine is only suspended (and parked on its
+ * fd) on EAGAIN and is resumed as soon as the retried call succeeds. Operations
+ * return what the system call does (-1 with errno set on failure).
+ *
+ * Rules: at most one coroutine reads and one writes a given fd at a time,
+ * sockets are closed with Executor::close() (it forgets the fd's state before
+ * the number gets reused) and an Executor and its coroutines stay on the
+ * thread that created them.
+ *
+ * Allocation: a suspended operation lives in the awaiting coroutine's frame
+ * and coroutine frames come from a per-thread pool of power of two size
+ * classes (FramePool) - once a pool has warmed up, spawning a coroutine and
+ * co_awaiting anything allocates nothing.
+ *
+ * io_uring would save the syscall retry after a readiness event but needs
+ * liburing (or a lot of ring plumbing) - epoll keeps this header-only.
+ */
+
+#ifndef CORO_HPP
+#define CORO_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace coro {
+
+// per-thread free lists of coroutine frames, one per power of two size class
+// from 64 bytes to 16 KiB (larger frames come from the heap every time)
+class FramePool {
+private:
+  static constexpr unsigned min_shift = 6;
+  static constexpr unsigned nbr_classes = 9; // 64 B ... 16 KiB
+
+  struct FreeFrame {
+    FreeFrame *next;
+  };
+
+  FreeFrame *m_free[nbr_classes]{};
+  std::uint64_t m_heap_allocs{0}; // frames that had to come from the heap
+  std::uint64_t m_reused{0};      // frames that came from a free list
+
+  static unsigned size_class(std::size_t size) noexcept {
+    if (size <= (std::size_t{1} << min_shift))
+      return 0;
+    return std::bit_width(size - 1) - min_shift;
+  }
+
+public:
+  FramePool() = default;
+  FramePool(const FramePool &) = delete;
+  FramePool &operator=(const FramePool &) = delete;
+
+  ~FramePool() {
+    for (auto *&head : m_free)
+      while (head != nullptr)
+        ::operator delete(std::exchange(head, head->next));
+  }
+
+  static FramePool &local() {
+    thread_local FramePool pool{};
+    return pool;
+  }
+
+  void *allocate(std::size_t size) {
+    unsigned c = size_class(size);
+    if (c >= nbr_classes) {
+      ++m_heap_allocs;
+      return ::operator new(size);
+    }
+    if (FreeFrame *f = m_free[c]) {
+      m_free[c] = f->next;
+      ++m_reused;
+      return f;
+    }
+    ++m_heap_allocs;
+    return ::operator new(std::size_t{1} << (c + min_shift));
+  }
+
+  void deallocate(void *p, std::size_t size) noexcept {
+    unsigned c = size_class(size);
+    if (c >= nbr_classes) {
+      ::operator delete(p);
+      return;
+    }
+    auto *f = static_cast<FreeFrame *>(p);
+    f->next = m_free[c];
+    m_free[c] = f;
+  }
+
+  std::uint64_t heap_allocs() const noexcept { return m_heap_allocs; }
+  std::uint64_t reused() const noexcept { return m_reused; }
+};
+
+template <typename T = void> class Task;
+
+namespace detail {
+
+struct PromiseBase {
+  std::coroutine_handle<> continuation{}; // who co_awaits us
+  bool detached{false};                   // spawned - nobody awaits us
+
+  static void *operator new(std::size_t size) {
+    return FramePool::local().allocate(size);
+  }
+  static void operator delete(void *p, std::size_t size) noexcept {
+    FramePool::local().deallocate(p, size);
+  }
+
+  // lazy - the coroutine starts when it is co_awaited or spawned
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  // resumes the awaiting coroutine (without growing the stack) or, if
+  // detached, frees the frame
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      PromiseBase &p = h.promise();
+      if (p.detached) {
+        h.destroy();
+        return std::noop_coroutine();
+      }
+      return p.continuation ? p.continuation : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  // like the C code around it, nothing here throws on purpose
+  void unhandled_exception() noexcept { std::terminate(); }
+};
+
+template <typename T> struct Promise : PromiseBase {
+  T value{};
+  Task<T> get_return_object() noexcept;
+  void return_value(T v) noexcept { value = std::move(v); }
+};
+
+template <> struct Promise<void> : PromiseBase {
+  Task<void> get_return_object() noexcept;
+  void return_void() noexcept {}
+};
+
+} // namespace detail
+
+// a coroutine returning T - co_await it to run it and get its result, or hand
+// a Task<> to Executor::spawn() to run it on its own
+template <typename T> class Task {
+public:
+  using promise_type = detail::Promise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+private:
+  handle_type m_handle{};
+
+public:
+  Task() = default;
+  explicit Task(handle_type h) noexcept : m_handle{h} {}
+  Task(Task &&other) noexcept : m_handle{std::exchange(other.m_handle, {})} {}
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (m_handle)
+        m_handle.destroy();
+      m_handle = std::exchange(other.m_handle, {});
+    }
+    return *this;
+  }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() {
+    if (m_handle)
+      m_handle.destroy();
+  }
+
+  // gives up the frame - it frees itself when the coroutine finishes
+  handle_type detach() noexcept {
+    m_handle.promise().detached = true;
+    return std::exchange(m_handle, {});
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+    m_handle.promise().continuation = awaiting;
+    return m_handle; // symmetric transfer - start running the task
+  }
+  T await_resume() noexcept {
+    if constexpr (!std::is_void_v<T>)
+      return std::move(m_handle.promise().value);
+  }
+};
+
+template <typename T>
+Task<T> detail::Promise<T>::get_return_object() noexcept {
+  return Task<T>{std::coroutine_handle<Promise<T>>::from_promise(*this)};
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() noexcept {
+  return Task<void>{std::coroutine_handle<Promise<void>>::from_promise(*this)};
+}
+
+class Executor;
+
+// an auto-reset event with (at most) one waiter: set() wakes the coroutine
+// co_awaiting it (on the next turn of the loop), or the next one to do so
+class Event {
+private:
+  Executor &m_ex;
+  std::coroutine_handle<> m_waiter{};
+  bool m_set{false};
+
+public:
+  explicit Event(Executor &ex) noexcept : m_ex{ex} {}
+  Event(const Event &) = delete;
+  Event &operator=(const Event &) = delete;
+
+  inline void set() noexcept;
+
+  bool await_ready() const noexcept { return m_set; }
+  void await_suspend(std::coroutine_handle<> h) noexcept { m_waiter = h; }
+  void await_resume() noexcept { m_set = false; }
+};
+
+class Executor {
+public:
+  // an operation waiting for its fd - perform() retries the system call and
+  // returns false if it would still block
+  struct Op {
+    std::coroutine_handle<> handle{};
+    bool (*perform)(Op *) = nullptr;
+  };
+
+private:
+  static constexpr int max_events = 256;
+
+  struct FdState {
+    Op *reader{nullptr};
+    Op *writer{nullptr};
+    bool registered{false};
+  };
+
+  struct Timer {
+    std::uint64_t deadline_us;
+    std::coroutine_handle<> handle;
+    // min-heap on the deadline (std::push_heap builds max-heaps)
+    bool operator<(const Timer &other) const noexcept {
+      return deadline_us > other.deadline_us;
+    }
+  };
+
+  int m_epfd{-1};
+  std::vector<FdState> m_fds{};                   // indexed by fd
+  std::vector<std::coroutine_handle<>> m_ready{}; // to resume this turn
+  std::vector<std::coroutine_handle<>> m_running{};
+  std::vector<Timer> m_timers{};
+  bool m_stop{false};
+  std::uint64_t m_suspends{0}; // operations that had to wait for their fd
+
+  FdState &state(int fd) {
+    if (static_cast<std::size_t>(fd) >= m_fds.size())
+      m_fds.resize(fd + 1024);
+    return m_fds[fd];
+  }
+
+  // parks op on fd (reader or writer side), registering fd on first use
+  void park(int fd, Op *op, bool write) {
+    FdState &st = state(fd);
+    if (!st.registered) {
+      epoll_event ev{};
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.fd = fd;
+      if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        std::terminate(); // the coroutine would never be resumed
+      }
+      st.registered = true;
+    }
+    (write ? st.writer : st.reader) = op;
+    ++m_suspends;
+  }
+
+  // retries the operation parked on one side of fd
+  void complete(int fd, bool write) {
+    Op *&slot = write ? m_fds[fd].writer : m_fds[fd].reader;
+    Op *op = slot;
+    if (op == nullptr || !op->perform(op))
+      return;
+    slot = nullptr;
+    op->handle.resume();
+  }
+
+  static std::uint64_t now_us() noexcept {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  void resume_ready() {
+    while (!m_ready.empty()) {
+      m_running.swap(m_ready);
+      for (auto h : m_running)
+        h.resume();
+      m_running.clear();
+    }
+  }
+
+  // epoll_wait timeout in ms: until the next timer (rounded up) or forever
+  int timeout_ms() const noexcept {
+    if (m_timers.empty())
+      return -1;
+    std::uint64_t now = now_us(), deadline = m_timers.front().deadline_us;
+    return deadline <= now ? 0 : static_cast<int>((deadline - now + 999) / 1000);
+  }
+
+  void fire_timers() {
+    std::uint64_t now = now_us();
+    while (!m_timers.empty() && m_timers.front().deadline_us <= now) {
+      std::pop_heap(m_timers.begin(), m_timers.end());
+      m_ready.push_back(m_timers.back().handle);
+      m_timers.pop_back();
+    }
+  }
+
+  // -- awaitables (the operation state lives in the awaiting frame)
+
+  template <typename Derived, bool Write> struct FdOp : Op {
+    Executor &ex;
+    int fd;
+    ssize_t result{0};
+    int error{0};
+
+    FdOp(Executor &e, int f) noexcept : ex{e}, fd{f} {
+      perform = [](Op *op) { return static_cast<Derived *>(op)->attempt(); };
+    }
+    // stores the result of a system call - false if it would block
+    bool done(ssize_t rv) noexcept {
+      if (rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return false;
+      result = rv;
+      error = rv == -1 ? errno : 0;
+      return true;
+    }
+    bool await_ready() noexcept { return static_cast<Derived *>(this)->attempt(); }
+    void await_suspend(std::coroutine_handle<> h) {
+      handle = h;
+      ex.park(fd, this, Write);
+    }
+    ssize_t await_resume() const noexcept {
+      if (result == -1)
+        errno = error;
+      return result;
+    }
+  };
+
+  struct AcceptOp : FdOp<AcceptOp, false> {
+    using FdOp::FdOp;
+    bool attempt() noexcept {
+      return done(::accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC));
+    }
+  };
+
+  struct RecvOp : FdOp<RecvOp, false> {
+    void *buf;
+    std::size_t len;
+    RecvOp(Executor &e, int f, void *b, std::size_t l) noexcept
+        : FdOp{e, f}, buf{b}, len{l} {}
+    bool attempt() noexcept { return done(::recv(fd, buf, len, 0)); }
+  };
+
+  struct SendOp : FdOp<SendOp, true> {
+    const char *buf;
+    std::size_t len;
+    bool all; // until every byte is sent
+    std::size_t sent{0};
+    SendOp(Executor &e, int f, const void *b, std::size_t l, bool a) noexcept
+        : FdOp{e, f}, buf{static_cast<const char *>(b)}, len{l}, all{a} {}
+    bool attempt() noexcept {
+      do {
+        ssize_t n = ::send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n == -1)
+          return sent != 0 && !all ? done(sent) : done(-1);
+        sent += n;
+      } while (all && sent < len);
+      return done(sent);
+    }
+  };
+
+  struct ConnectOp : FdOp<ConnectOp, true> {
+    const sockaddr *addr;
+    socklen_t addr_len;
+    bool started{false};
+    ConnectOp(Executor &e, int f, const sockaddr *a, socklen_t l) noexcept
+        : FdOp{e, f}, addr{a}, addr_len{l} {}
+    bool attempt() noexcept {
+      if (!started) {
+        started = true;
+        if (::connect(fd, addr, addr_len) == 0)
+          return done(0);
+        if (errno != EINPROGRESS)
+          return done(-1);
+        errno = EAGAIN; // wait until writable
+        return false;
+      }
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        return done(-1);
+      if (err == 0)
+        return done(0);
+      errno = err;
+      return done(-1);
+    }
+  };
+
+  struct SleepOp {
+    Executor &ex;
+    std::uint64_t deadline_us;
+    bool await_ready() const noexcept { return deadline_us <= now_us(); }
+    void await_suspend(std::coroutine_handle<> h) {
+      ex.m_timers.push_back(Timer{deadline_us, h});
+      std::push_heap(ex.m_timers.begin(), ex.m_timers.end());
+    }
+    void await_resume() const noexcept {}
+  };
+
+  struct YieldOp {
+    Executor &ex;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) { ex.m_ready.push_back(h); }
+    void await_resume() const noexcept {}
+  };
+
+public:
+  Executor() {
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd == -1) {
+      perror("epoll_create1");
+      std::terminate();
+    }
+    m_ready.reserve(1024);
+    m_running.reserve(1024);
+    m_timers.reserve(64);
+  }
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+  ~Executor() { ::close(m_epfd); }
+
+  // runs task on its own - its frame is freed when it finishes
+  void spawn(Task<> task) { m_ready.push_back(task.detach()); }
+
+  // resumes h on this turn of the loop
+  void schedule(std::coroutine_handle<> h) { m_ready.push_back(h); }
+
+  // runs the loop until stop() is called or *stop_flag (e.g., set by a
+  // signal handler) becomes non-zero
+  void run(const volatile std::sig_atomic_t *stop_flag = nullptr) {
+    epoll_event events[max_events];
+    m_stop = false;
+    for (;;) {
+      resume_ready();
+      if (m_stop || (stop_flag != nullptr && *stop_flag))
+        return;
+      int n = epoll_wait(m_epfd, events, max_events, timeout_ms());
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        perror("epoll_wait");
+        return;
+      }
+      for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        std::uint32_t ev = events[i].events;
+        if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+          complete(fd, false);
+        if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+          complete(fd, true); // (the reader may have closed fd - then
+                              // there is nobody parked)
+      }
+      fire_timers();
+    }
+  }
+
+  void stop() noexcept { m_stop = true; }
+
+  // forgets fd and closes it - nothing may be parked on it
+  int close(int fd) {
+    if (static_cast<std::size_t>(fd) < m_fds.size())
+      m_fds[fd] = FdState{};
+    return ::close(fd);
+  }
+
+  // returns a new non-blocking socket
+  AcceptOp accept(int listen_fd) noexcept { return AcceptOp{*this, listen_fd}; }
+  RecvOp recv(int fd, void *buf, std::size_t len) noexcept {
+    return RecvOp{*this, fd, buf, len};
+  }
+  // returns as soon as some bytes are sent
+  SendOp send(int fd, const void *buf, std::size_t len) noexcept {
+    return SendOp{*this, fd, buf, len, false};
+  }
+  // returns once every byte is sent (or an error occurred)
+  SendOp send_all(int fd, const void *buf, std::size_t len) noexcept {
+    return SendOp{*this, fd, buf, len, true};
+  }
+  // fd must be a non-blocking socket
+  ConnectOp connect(int fd, const sockaddr *addr, socklen_t len) noexcept {
+    return ConnectOp{*this, fd, addr, len};
+  }
+  SleepOp sleep_for(std::chrono::microseconds d) noexcept {
+    return SleepOp{*this, now_us() + static_cast<std::uint64_t>(d.count())};
+  }
+  // lets the other ready coroutines run first
+  YieldOp yield() noexcept { return YieldOp{*this}; }
+
+  std::uint64_t suspends() const noexcept { return m_suspends; }
+};
+
+inline void Event::set() noexcept {
+  m_set = true;
+  if (m_waiter)
+    m_ex.schedule(std::exchange(m_waiter, {}));
+}
+
+} // namespace coro
+
+#endif
@@ -0,0 +1,567 @@
+/*
+ * federation.c -- persistent, batched links between chat server nodes (see
+ * federation.h).
+ *
+ * Everything sent over a link is a batch: a batch_header followed by count
+ * records, each a 16-bit length and the message itself. All messages of a
+ * batch come from the same origin node and have consecutive sequence numbers
+ * starting at first_seq - so a message costs 2 bytes of framing. The first
+ * batch sent over a new link is empty and tells the peer who we are.
+ *
+ * Sequence numbers start at the (microsecond) wall clock time the node
+ * started so that they keep increasing across restarts of a node. Every node
+ * remembers, per origin, the highest sequence number seen and which of the
+ * DEDUP_WINDOW preceding ones were seen.
+ */
+
+#define _GNU_SOURCE /* accept4 */
+#include "federation.h"
+#include "sockethelpers.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LISTEN_IDX FEDERATION_IDX_FIRST
+#define TIMER_IDX (FEDERATION_IDX_FIRST + 1)
+#define LINK_IDX(i) (FEDERATION_IDX_FIRST + 2 + (i))
+
+#define BATCH_MAX_BYTES 65536     /* max size of the records of a batch */
+#define LINK_WBUF_MAX (16 << 20)  /* a peer this far behind is disconnected */
+#define RECONNECT_MS 500          /* how often dead links are re-dialed */
+#define DEDUP_WINDOW 4096         /* sequence numbers remembered per origin */
+#define MAX_ORIGINS 256
+#define NO_BATCH UINT32_MAX
+
+struct batch_header {
+  uint32_t bytes; /* size of the records that follow */
+  uint16_t origin;
+  uint16_t count;
+  uint64_t first_seq;
+};
+
+struct link {
+  int fd;          /* -1 while the link is down */
+  int outbound;    /* dialed by us (and re-dialed when down) */
+  int connecting;  /* non-blocking connect in progress */
+  int pollout;     /* EPOLLOUT is requested */
+  char host[256];  /* outbound links only */
+  char port[16];
+  uint16_t peer;   /* node id of the peer - 0 until its first batch */
+  char *rbuf;      /* partial inbound batch */
+  uint32_t rlen;
+  char *wbuf;      /* unsent bytes (wbuf + woff to wbuf + wlen) */
+  uint32_t woff;
+  uint32_t wlen;
+  uint32_t wcap;
+  uint32_t batch;  /* offset of the header of the open batch in wbuf */
+  uint64_t batches_out, msgs_out, batches_in, msgs_in, dups;
+};
+
+struct origin {
+  uint16_t node;
+  uint64_t max_seq;
+  uint64_t seen[DEDUP_WINDOW / 64]; /* bit seq % DEDUP_WINDOW */
+};
+
+struct federation {
+  uint16_t node;
+  int epfd;
+  const char *port;
+  int listen_fd;
+  int timer_fd;
+  uint64_t next_seq;
+  uint64_t too_long; /* messages not forwarded (see FEDERATION_MSG_MAX) */
+  int dirty; /* some link has an open batch */
+  federation_deliver_fn deliver;
+  void *arg;
+  struct link links[FEDERATION_MAX_LINKS];
+  uint32_t nbr_links;
+  struct origin origins[MAX_ORIGINS];
+  uint32_t nbr_origins;
+};
+
+/* Returns 1 if seq of node has already been seen (or is too old to tell) and
+ * records it otherwise. */
+static int seen(struct federation *fed, uint16_t node, uint64_t seq) {
+  struct origin *o = NULL;
+
+  for (uint32_t i = 0; i < fed->nbr_origins; ++i) {
+    if (fed->origins[i].node == node) {
+      o = &fed->origins[i];
+      break;
+    }
+  }
+  if (o == NULL) {
+    if (fed->nbr_origins == MAX_ORIGINS)
+      return 1;
+    o = &fed->origins[fed->nbr_origins++];
+    memset(o, 0, sizeof(*o));
+    o->node = node;
+    o->max_seq = seq - 1;
+  }
+
+  if (seq > o->max_seq) { /* slide the window */
+    if (seq - o->max_seq >= DEDUP_WINDOW) {
+      memset(o->seen, 0, sizeof(o->seen));
+    } else {
+      for (uint64_t s = o->max_seq + 1; s < seq; ++s)
+        o->seen[(s % DEDUP_WINDOW) / 64] &= ~(1ull << (s % 64));
+    }
+    o->max_seq = seq;
+  } else if (o->max_seq - seq >= DEDUP_WINDOW) {
+    return 1;
+  } else if (o->seen[(seq % DEDUP_WINDOW) / 64] & (1ull << (seq % 64))) {
+    return 1;
+  }
+  o->seen[(seq % DEDUP_WINDOW) / 64] |= 1ull << (seq % 64);
+  return 0;
+}
+
+static void set_interest(struct federation *fed, uint32_t i) {
+  struct link *l = &fed->links[i];
+  struct epoll_event ev;
+
+  ev.events = l->connecting ? EPOLLOUT : EPOLLIN | (l->pollout ? EPOLLOUT : 0);
+  ev.data.u64 = LINK_IDX(i);
+  if (epoll_ctl(fed->epfd, EPOLL_CTL_MOD, l->fd, &ev) == -1)
+    perror("epoll_ctl");
+}
+
+/* Closes a link. Outbound links are re-dialed by the reconnect timer and the
+ * slots of inbound ones are reused. */
+static void link_down(struct federation *fed, uint32_t i, const char *why) {
+  struct link *l = &fed->links[i];
+
+  if (!l->connecting) /* failed dials are simply retried */
+    fprintf(stderr, "federation: link to node %u down (%s)\n", l->peer, why);
+  epoll_ctl(fed->epfd, EPOLL_CTL_DEL, l->fd, NULL);
+  close(l->fd);
+  l->fd = -1;
+  l->connecting = l->pollout = 0;
+  l->peer = 0;
+  l->rlen = 0;
+  l->woff = l->wlen = 0;
+  l->batch = NO_BATCH;
+}
+
+/* Makes room for len more bytes in the output buffer of link l. 0 on success
+ * and -1 if the peer is too far behind. */
+static int reserve(struct link *l, uint32_t len) {
+  if (l->woff != 0 && l->wlen + len > l->wcap) { /* compact first */
+    memmove(l->wbuf, l->wbuf + l->woff, l->wlen - l->woff);
+    l->wlen -= l->woff;
+    if (l->batch != NO_BATCH)
+      l->batch -= l->woff;
+    l->woff = 0;
+  }
+  if (l->wlen + len <= l->wcap)
+    return 0;
+
+  uint32_t cap = l->wcap == 0 ? 65536 : l->wcap;
+  while (cap < l->wlen + len)
+    cap *= 2;
+  if (cap > LINK_WBUF_MAX)
+    return -1;
+  char *wbuf = (char *)realloc(l->wbuf, cap);
+  if (wbuf == NULL) {
+    perror("realloc");
+    return -1;
+  }
+  l->wbuf = wbuf;
+  l->wcap = cap;
+  return 0;
+}
+
+/* Starts a new batch in the output buffer of link l. 0 on success and -1 if
+ * the peer is too far behind. */
+static int open_batch(struct federation *fed, struct link *l, uint64_t seq) {
+  struct batch_header h = {0, fed->node, 0, seq};
+  if (reserve(l, sizeof(h)) == -1)
+    return -1;
+  l->batch = l->wlen;
+  memcpy(l->wbuf + l->wlen, &h, sizeof(h));
+  l->wlen += sizeof(h);
+  ++l->batches_out;
+  fed->dirty = 1;
+  return 0;
+}
+
+/* Marks link i as up and introduces ourselves. */
+static void link_up(struct federation *fed, uint32_t i) {
+  struct link *l = &fed->links[i];
+  int y = 1;
+
+  setsockopt(l->fd, IPPROTO_TCP, TCP_NODELAY, &y, sizeof(y));
+  l->connecting = 0;
+  set_interest(fed, i);
+  if (open_batch(fed, l, fed->next_seq) == -1) /* empty - a hello */
+    link_down(fed, i, "out of memory");
+}
+
+/* Adds fd as link i to the epoll instance. 0 on success and -1 on error. */
+static int link_add(struct federation *fed, uint32_t i, int fd,
+                    int connecting) {
+  struct link *l = &fed->links[i];
+  struct epoll_event ev;
+
+  l->fd = fd;
+  l->connecting = connecting;
+  l->batch = NO_BATCH;
+  if (l->rbuf == NULL &&
+      (l->rbuf = (char *)malloc(sizeof(struct batch_header) +
+                                BATCH_MAX_BYTES)) == NULL) {
+    perror("malloc");
+    return -1;
+  }
+
+  ev.events = connecting ? EPOLLOUT : EPOLLIN;
+  ev.data.u64 = LINK_IDX(i);
+  if (epoll_ctl(fed->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  if (!connecting)
+    link_up(fed, i);
+  return 0;
+}
+
+/* Starts a non-blocking connect of outbound link i. */
+static void dial(struct federation *fed, uint32_t i) {
+  struct link *l = &fed->links[i];
+  struct addrinfo hints, *res;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(l->host, l->port, &hints, &res) != 0)
+    return;
+
+  int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  0);
+  if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) == -1 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd != -1 && link_add(fed, i, fd, 1) == -1) {
+    close(fd);
+    l->fd = -1;
+  }
+}
+
+/* (Re-)creates the listening socket and re-dials the outbound links that are
+ * down. */
+static void reconnect(struct federation *fed) {
+  if (fed->port != NULL && fed->listen_fd == -1) {
+    /* this may fail for a while after a hot restart (the predecessor still
+     * holds the port) */
+    int fd = create_listening_socket(fed->port, 64);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = LISTEN_IDX};
+    if (fd != -1 && epoll_ctl(fed->epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+      fed->listen_fd = fd;
+    else if (fd != -1)
+      close(fd);
+  }
+
+  for (uint32_t i = 0; i < fed->nbr_links; ++i) {
+    if (fed->links[i].outbound && fed->links[i].fd == -1)
+      dial(fed, i);
+  }
+}
+
+struct federation *federation_new(uint16_t node, int epfd, const char *port,
+                                  federation_deliver_fn deliver, void *arg) {
+  struct federation *fed =
+      (struct federation *)calloc(1, sizeof(struct federation));
+  if (fed == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  fed->next_seq = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  fed->node = node;
+  fed->epfd = epfd;
+  fed->port = port;
+  fed->listen_fd = -1;
+  fed->deliver = deliver;
+  fed->arg = arg;
+
+  fed->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct itimerspec its = {
+      .it_interval = {RECONNECT_MS / 1000, (RECONNECT_MS % 1000) * 1000000},
+      .it_value = {RECONNECT_MS / 1000, (RECONNECT_MS % 1000) * 1000000}};
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = TIMER_IDX};
+  if (fed->timer_fd == -1 ||
+      timerfd_settime(fed->timer_fd, 0, &its, NULL) == -1 ||
+      epoll_ctl(epfd, EPOLL_CTL_ADD, fed->timer_fd, &ev) == -1) {
+    perror("timerfd");
+    free(fed);
+    return NULL;
+  }
+
+  reconnect(fed);
+  if (port != NULL && fed->listen_fd == -1)
+    fprintf(stderr, "federation: cannot listen on port %s yet - retrying\n",
+            port);
+  return fed;
+}
+
+int federation_add_peer(struct federation *fed, const char *host_port) {
+  const char *colon = strrchr(host_port, ':');
+  if (colon == NULL || fed->nbr_links == FEDERATION_MAX_LINKS) {
+    fprintf(stderr, "federation: bad peer %s\n", host_port);
+    return -1;
+  }
+
+  struct link *l = &fed->links[fed->nbr_links];
+  memset(l, 0, sizeof(*l));
+  l->fd = -1;
+  l->outbound = 1;
+  l->batch = NO_BATCH;
+  snprintf(l->host, sizeof(l->host), "%.*s", (int)(colon - host_port),
+           host_port);
+  snprintf(l->port, sizeof(l->port), "%s", colon + 1);
+  dial(fed, fed->nbr_links++);
+  return 0;
+}
+
+/* Accepts a link from another node. */
+static void accept_link(struct federation *fed) {
+  int fd = accept4(fed->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd == -1) {
+    if (errno != EAGAIN)
+      perror("accept4");
+    return;
+  }
+
+  uint32_t i = 0; /* reuse the slot of a dead inbound link */
+  while (i < fed->nbr_links &&
+         (fed->links[i].outbound || fed->links[i].fd != -1))
+    ++i;
+  if (i == FEDERATION_MAX_LINKS) {
+    fprintf(stderr, "federation: too many links\n");
+    close(fd);
+    return;
+  }
+  if (i == fed->nbr_links) {
+    memset(&fed->links[i], 0, sizeof(struct link));
+    ++fed->nbr_links;
+  }
+  if (link_add(fed, i, fd, 0) == -1) {
+    close(fd);
+    fed->links[i].fd = -1;
+  }
+}
+
+/* Sends the pending bytes of link i (until the socket buffer is full). */
+static void flush_link(struct federation *fed, uint32_t i) {
+  struct link *l = &fed->links[i];
+  int full = 0;
+
+  l->batch = NO_BATCH; /* the open batch (if any) is complete */
+  while (l->woff != l->wlen) {
+    ssize_t n = send(l->fd, l->wbuf + l->woff, l->wlen - l->woff,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        full = 1;
+      else
+        link_down(fed, i, strerror(errno));
+      break;
+    }
+    l->woff += n;
+  }
+  if (l->fd == -1)
+    return;
+  if (l->woff == l->wlen)
+    l->woff = l->wlen = 0;
+  if (l->pollout != full) {
+    l->pollout = full;
+    set_interest(fed, i);
+  }
+}
+
+/* Handles the complete batches received over link i. Returns -1 if the link
+ * was closed. */
+static int handle_batches(struct federation *fed, uint32_t i) {
+  struct link *l = &fed->links[i];
+  uint32_t off = 0;
+
+  for (;;) {
+    struct batch_header h;
+    if (l->rlen - off < sizeof(h))
+      break;
+    memcpy(&h, l->rbuf + off, sizeof(h));
+    if (h.bytes > BATCH_MAX_BYTES || h.origin == 0) {
+      link_down(fed, i, "protocol error");
+      return -1;
+    }
+    if (l->rlen - off < sizeof(h) + h.bytes)
+      break;
+
+    if (h.origin == fed->node) {
+      link_down(fed, i, "connected to itself");
+      return -1;
+    }
+    if (l->peer == 0)
+      l->peer = h.origin;
+    ++l->batches_in;
+
+    const char *p = l->rbuf + off + sizeof(h), *end = p + h.bytes;
+    for (uint16_t k = 0; k < h.count && p + 2 <= end; ++k) {
+      uint16_t len;
+      memcpy(&len, p, 2);
+      p += 2;
+      if (p + len > end)
+        break;
+      if (seen(fed, h.origin, h.first_seq + k)) {
+        ++l->dups;
+      } else {
+        ++l->msgs_in;
+        fed->deliver(fed->arg, p, len);
+      }
+      p += len;
+    }
+    off += sizeof(h) + h.bytes;
+  }
+
+  if (off != 0) {
+    memmove(l->rbuf, l->rbuf + off, l->rlen - off);
+    l->rlen -= off;
+  }
+  return 0;
+}
+
+void federation_handle(struct federation *fed, uint64_t idx, uint32_t events) {
+  uint64_t expirations;
+
+  if (idx == LISTEN_IDX) {
+    accept_link(fed);
+    return;
+  }
+  if (idx == TIMER_IDX) {
+    if (read(fed->timer_fd, &expirations, sizeof(expirations)) > 0)
+      reconnect(fed);
+    return;
+  }
+
+  uint32_t i = (uint32_t)(idx - LINK_IDX(0));
+  struct link *l = &fed->links[i];
+  if (l->fd == -1)
+    return; /* closed earlier in this batch of events */
+
+  if (l->connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0)
+      link_down(fed, i, strerror(err));
+    else
+      link_up(fed, i);
+    return;
+  }
+
+  if (events & EPOLLOUT)
+    flush_link(fed, i);
+  if (l->fd == -1 || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    return;
+
+  uint32_t cap = sizeof(struct batch_header) + BATCH_MAX_BYTES;
+  ssize_t n = recv(l->fd, l->rbuf + l->rlen, cap - l->rlen, 0);
+  if (n <= 0) {
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      link_down(fed, i, n == 0 ? "closed by peer" : strerror(errno));
+    return;
+  }
+  l->rlen += n;
+  handle_batches(fed, i);
+}
+
+int federation_forward(struct federation *fed, const char *msg, uint32_t len) {
+  uint16_t len16 = (uint16_t)len;
+
+  /* checked before a sequence number is taken - peers must not wait for
+   * one that is never sent */
+  if (2 + (uint64_t)len > BATCH_MAX_BYTES) {
+    ++fed->too_long;
+    fprintf(stderr, "federation: a message of %u bytes is too long to be "
+                    "forwarded\n",
+            len);
+    return -1;
+  }
+  uint64_t seq = fed->next_seq++;
+
+  for (uint32_t i = 0; i < fed->nbr_links; ++i) {
+    struct link *l = &fed->links[i];
+    struct batch_header h;
+    if (l->fd == -1 || l->connecting)
+      continue;
+
+    if (l->batch != NO_BATCH) {
+      memcpy(&h, l->wbuf + l->batch, sizeof(h));
+      if (h.count == UINT16_MAX || h.bytes + 2 + len > BATCH_MAX_BYTES ||
+          h.first_seq + h.count != seq)
+        l->batch = NO_BATCH;
+    }
+    if ((l->batch == NO_BATCH && open_batch(fed, l, seq) == -1) ||
+        reserve(l, 2 + len) == -1) {
+      link_down(fed, i, "peer too slow");
+      continue;
+    }
+
+    memcpy(l->wbuf + l->wlen, &len16, 2);
+    memcpy(l->wbuf + l->wlen + 2, msg, len);
+    l->wlen += 2 + len;
+    memcpy(&h, l->wbuf + l->batch, sizeof(h));
+    h.bytes += 2 + len;
+    ++h.count;
+    memcpy(l->wbuf + l->batch, &h, sizeof(h));
+    ++l->msgs_out;
+  }
+  return 0;
+}
+
+void federation_flush(struct federation *fed) {
+  if (!fed->dirty)
+    return;
+  fed->dirty = 0;
+  for (uint32_t i = 0; i < fed->nbr_links; ++i) {
+    struct link *l = &fed->links[i];
+    l->batch = NO_BATCH;
+    if (l->fd != -1 && !l->connecting && !l->pollout && l->wlen != l->woff)
+      flush_link(fed, i);
+  }
+}
+
+void federation_print_stats(struct federation *fed, const char *prefix) {
+  for (uint32_t i = 0; i < fed->nbr_links; ++i) {
+    struct link *l = &fed->links[i];
+    char where[300] = "inbound";
+    if (l->fd == -1 && !l->outbound)
+      continue;
+    if (l->outbound)
+      snprintf(where, sizeof(where), "to %s:%s", l->host, l->port);
+    printf("%slink %u (%s, node %u) %s: out %lu msgs in %lu batches, in %lu "
+           "msgs in %lu batches, %lu duplicates\n",
+           prefix, i, where, l->peer,
+           l->fd == -1 ? "down" : l->connecting ? "connecting" : "up",
+           l->msgs_out, l->batches_out, l->msgs_in, l->batches_in, l->dups);
+  }
+  if (fed->too_long != 0)
+    printf("%sfederation:      %lu messages too long to be forwarded\n",
+           prefix, fed->too_long);
+}
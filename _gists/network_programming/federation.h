@@ -0,0 +1,53 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <stdint.h>
+
+/* Links a chat server (node) to its peers so that they all share one room.
+ * Every node keeps a persistent TCP link to every other node (a full mesh -
+ * each pair only needs to be configured on one side) and forwards the
+ * messages that originate from it to all of them. Messages are batched per
+ * link (one batch per event loop iteration) and tagged with their origin node
+ * and a sequence number so that duplicates (e.g., from a pair of nodes that
+ * dial each other) are dropped. Nodes never forward messages of other nodes -
+ * each node fans out to its own clients only. */
+struct federation;
+
+/* the federation's sockets and timer are registered with epoll instance epfd
+ * with user data in [FEDERATION_IDX_FIRST, FEDERATION_IDX_LAST] */
+#define FEDERATION_MAX_LINKS 64
+#define FEDERATION_IDX_FIRST (UINT64_MAX - 1024)
+#define FEDERATION_IDX_LAST (FEDERATION_IDX_FIRST + 1 + FEDERATION_MAX_LINKS)
+
+/* called for every message received from another node */
+typedef void (*federation_deliver_fn)(void *arg, const char *msg,
+                                      uint32_t len);
+
+/* creates the federation state of node (a non-zero id unique in the cluster)
+ * that accepts links from other nodes on port (NULL to only dial out).
+ * Returns NULL on failure */
+struct federation *federation_new(uint16_t node, int epfd, const char *port,
+                                  federation_deliver_fn deliver, void *arg);
+
+/* adds a peer (HOST:PORT) to keep a link to. 0 on success and -1 on failure */
+int federation_add_peer(struct federation *fed, const char *host_port);
+
+/* handles an event of epoll user data idx (see FEDERATION_IDX_FIRST) */
+void federation_handle(struct federation *fed, uint64_t idx, uint32_t events);
+
+/* max length of a forwarded message (it must fit a batch with its length) */
+#define FEDERATION_MSG_MAX 65534
+
+/* queues a message for all other nodes. Returns -1 (and counts it) if the
+ * message is longer than FEDERATION_MSG_MAX */
+int federation_forward(struct federation *fed, const char *msg, uint32_t len);
+
+/* sends the batches queued since the last call - call once per event loop
+ * iteration */
+void federation_flush(struct federation *fed);
+
+/* prints the state and counters of every link to stdout with every line
+ * prefixed by prefix */
+void federation_print_stats(struct federation *fed, const char *prefix);
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ * filebench.c -- load generator of the GET command of simplestreamserver.c:
+ * CONNS connections (one thread each) fetch file NAME GETS times each, one
+ * GET after the other, and the throughput and per GET latency are reported.
+ * Run it against the server's sendfile, splice and readwrite modes (-m) and
+ * compare the server's CPU time per MiB printed when it is stopped.
+ *
+ * Usage: ./filebench [-c CONNS] [-n GETS] [-r RANGE] [-x] HOST PORT NAME
+ *
+ *   -c  number of concurrent connections (default 4)
+ *   -n  GETs per connection (default 20)
+ *   -r  byte range to ask for (e.g., 0-1023, 4096- or -512 - see
+ *       simplestreamserver.c). The whole file by default
+ *   -x  copy the received data into a buffer (by default it is discarded in
+ *       the kernel with MSG_TRUNC so that the client costs as little CPU as
+ *       possible)
+ *
+ * compile with:
+ *
+ *   cc -O2 -pthread -o filebench filebench.c
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CONNS 256
+#define HEADER_MAX_LEN 128
+#define RECV_BUF_SIZE (1 << 18)
+
+/* what the connection threads share */
+struct bench {
+  const char *host, *port, *name, *range;
+  int gets;
+  int copy;
+};
+
+/* one connection */
+struct conn {
+  struct bench *b;
+  pthread_t thread;
+  uint32_t *latencies_us; /* one per GET */
+  uint64_t bytes;
+  int failed;
+};
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int connect_to(const char *host, const char *port) {
+  struct addrinfo hints, *res, *p;
+  int fd = -1, rv;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return -1;
+  }
+  for (p = res; p != NULL; p = p->ai_next) {
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd == -1)
+    perror("connect");
+  return fd;
+}
+
+/* Reads the response header line into line (of HEADER_MAX_LEN bytes) one
+ * byte at a time so that none of the body is read. 0 on success and -1 on
+ * failure. */
+static int read_header(int fd, char *line) {
+  for (size_t len = 0; len < HEADER_MAX_LEN - 1; ++len) {
+    ssize_t n = recv(fd, line + len, 1, 0);
+    if (n <= 0) {
+      if (n == -1)
+        perror("recv");
+      return -1;
+    }
+    if (line[len] == '\n') {
+      line[len] = '\0';
+      return 0;
+    }
+  }
+  fprintf(stderr, "response header too long\n");
+  return -1;
+}
+
+static void *run_conn(void *arg) {
+  struct conn *c = (struct conn *)arg;
+  struct bench *b = c->b;
+  char cmd[512], line[HEADER_MAX_LEN];
+  char *buf = (char *)malloc(RECV_BUF_SIZE);
+  unsigned long first, length, size;
+
+  int fd = connect_to(b->host, b->port);
+  if (fd == -1 || buf == NULL) {
+    c->failed = 1;
+    goto out;
+  }
+  int cmd_len = snprintf(cmd, sizeof(cmd), "GET %s%s%s\n", b->name,
+                         b->range != NULL ? " " : "",
+                         b->range != NULL ? b->range : "");
+
+  for (int i = 0; i < b->gets; ++i) {
+    uint64_t start = now_us();
+    if (send(fd, cmd, cmd_len, MSG_NOSIGNAL) != cmd_len) {
+      perror("send");
+      c->failed = 1;
+      break;
+    }
+    if (read_header(fd, line) == -1) {
+      c->failed = 1;
+      break;
+    }
+    if (sscanf(line, "OK %lu %lu %lu", &first, &length, &size) != 3) {
+      fprintf(stderr, "GET %s: %s\n", b->name, line);
+      c->failed = 1;
+      break;
+    }
+    uint64_t left = length;
+    while (left > 0) {
+      size_t want = left < RECV_BUF_SIZE ? left : RECV_BUF_SIZE;
+      ssize_t n = recv(fd, buf, want, b->copy ? 0 : MSG_TRUNC);
+      if (n <= 0) {
+        if (n == -1)
+          perror("recv");
+        else
+          fprintf(stderr, "server closed the connection mid-transfer\n");
+        c->failed = 1;
+        goto out;
+      }
+      left -= n;
+    }
+    c->latencies_us[i] = now_us() - start;
+    c->bytes += length;
+  }
+
+out:
+  if (fd != -1)
+    close(fd);
+  free(buf);
+  return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+  struct bench b = {0};
+  struct conn conns[MAX_CONNS];
+  int nbr_conns = 4, opt;
+
+  b.gets = 20;
+  while ((opt = getopt(argc, argv, "c:n:r:x")) != -1) {
+    switch (opt) {
+    case 'c':
+      nbr_conns = (int)strtol(optarg, NULL, 10);
+      break;
+    case 'n':
+      b.gets = (int)strtol(optarg, NULL, 10);
+      break;
+    case 'r':
+      b.range = optarg;
+      break;
+    case 'x':
+      b.copy = 1;
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if (argc - optind != 3 || nbr_conns < 1 || nbr_conns > MAX_CONNS ||
+      b.gets < 1) {
+  usage:
+    fprintf(stderr,
+            "Usage: %s [-c CONNS] [-n GETS] [-r RANGE] [-x] HOST PORT NAME\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  b.host = argv[optind];
+  b.port = argv[optind + 1];
+  b.name = argv[optind + 2];
+
+  size_t total_gets = (size_t)nbr_conns * b.gets;
+  uint32_t *latencies = (uint32_t *)calloc(total_gets, sizeof(uint32_t));
+  if (latencies == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t start = now_us();
+  for (int i = 0; i < nbr_conns; ++i) {
+    memset(&conns[i], 0, sizeof(conns[i]));
+    conns[i].b = &b;
+    conns[i].latencies_us = latencies + (size_t)i * b.gets;
+    if (pthread_create(&conns[i].thread, NULL, run_conn, &conns[i]) != 0) {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  uint64_t bytes = 0;
+  int failed = 0;
+  for (int i = 0; i < nbr_conns; ++i) {
+    pthread_join(conns[i].thread, NULL);
+    bytes += conns[i].bytes;
+    failed |= conns[i].failed;
+  }
+  double wall_s = (now_us() - start) / 1e6;
+  if (failed) {
+    fprintf(stderr, "some GETs failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  qsort(latencies, total_gets, sizeof(uint32_t), cmp_u32);
+  printf("%zu GETs over %d connections: %.1f MiB in %.3f s - %.1f MiB/s\n"
+         "GET latency (ms): p50 %.3f  p99 %.3f  max %.3f\n",
+         total_gets, nbr_conns, bytes / 1048576.0, wall_s,
+         bytes / 1048576.0 / wall_s, latencies[total_gets / 2] / 1000.0,
+         latencies[total_gets * 99 / 100] / 1000.0,
+         latencies[total_gets - 1] / 1000.0);
+  free(latencies);
+  exit(EXIT_SUCCESS);
+}
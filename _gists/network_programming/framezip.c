@@ -0,0 +1,200 @@
+/*
+ * framezip.c -- compression of outbound chat frames (see framezip.h).
+ *
+ * A single raw deflate stream is reset for every frame (and primed with the
+ * dictionary for deflate-dict). Resetting clears the hash table, and priming
+ * hashes the whole dictionary, so both are paid per frame - a small memLevel
+ * keeps the former cheap and a short dictionary the latter. Chat frames are
+ * short, so neither the larger hash nor the larger block buffer of the
+ * default memLevel would buy any ratio.
+ */
+
+#include "framezip.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#define MEM_LEVEL 4  /* 2^11 hash entries and up to 2^10 symbols per block */
+#define LEN_MAX 5    /* max length of the varint before a deflate-dict frame */
+
+/* Built-in dictionary: what chat frames are made of, most common last (the
+ * closer to the frame, the shorter a reference to it). */
+static const char default_dict[] =
+    "presence: joined  left  more; "
+    "https://www. .com/ thank you! good morning night "
+    "what do you think about it? how are you doing? I don't know "
+    "yes no maybe sure okay haha lol :) :D "
+    "that this with have just like what when where there would could "
+    "the and for you not are but can was all get "
+    "?\n\0user 1!\n\0user 2.\n\0user 3\n\0user ";
+
+static const char *const codec_names[FZ_NBR_CODECS] = {"none", "deflate",
+                                                       "deflate-dict"};
+
+/* Per-codec counters. */
+struct codec_stats {
+  uint64_t frames;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t ns; /* time spent compressing */
+};
+
+struct fz_encoder {
+  z_stream z;
+  const char *dict;
+  size_t dict_len;
+  uint32_t dict_id; /* Adler-32 of dict */
+  struct codec_stats stats[FZ_NBR_CODECS];
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t put_varint(char *p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (char)v;
+  return n;
+}
+
+struct fz_encoder *fz_encoder_new(const char *dict, size_t dict_len) {
+  if (dict == NULL) {
+    dict = default_dict;
+    dict_len = sizeof(default_dict) - 1;
+  }
+  if (dict_len == 0 || dict_len > FZ_DICT_MAX) {
+    fprintf(stderr, "framezip: the dictionary must be 1 to %d bytes\n",
+            FZ_DICT_MAX);
+    return NULL;
+  }
+
+  struct fz_encoder *e =
+      (struct fz_encoder *)calloc(1, sizeof(struct fz_encoder));
+  if (e == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  /* raw deflate (negative window bits) - no zlib header or checksum */
+  if (deflateInit2(&e->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, MEM_LEVEL,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    fprintf(stderr, "framezip: deflateInit2 failed\n");
+    free(e);
+    return NULL;
+  }
+  e->dict = dict;
+  e->dict_len = dict_len;
+  e->dict_id = (uint32_t)adler32(adler32(0, Z_NULL, 0), (const Bytef *)dict,
+                                 (uInt)dict_len);
+  return e;
+}
+
+int64_t fz_encode(struct fz_encoder *e, enum fz_codec codec, const char *frame,
+                  size_t len, char *out) {
+  z_stream *z = &e->z;
+  uint64_t start = now_ns();
+  size_t skip = codec == FZ_DEFLATE_DICT ? LEN_MAX : 0; /* room for len */
+  int rv;
+
+  if (deflateReset(z) != Z_OK)
+    return -1;
+  if (codec == FZ_DEFLATE_DICT &&
+      deflateSetDictionary(z, (const Bytef *)e->dict, (uInt)e->dict_len) !=
+          Z_OK)
+    return -1;
+
+  z->next_in = (Bytef *)frame;
+  z->avail_in = (uInt)len;
+  z->next_out = (Bytef *)out + skip;
+  z->avail_out = (uInt)(FZ_BOUND(len) - skip);
+  if (codec == FZ_DEFLATE_DICT) { /* a complete stream per frame */
+    rv = deflate(z, Z_FINISH);
+    if (rv != Z_STREAM_END)
+      return -1;
+  } else { /* a byte aligned piece of the client's stream */
+    rv = deflate(z, Z_SYNC_FLUSH);
+    if (rv != Z_OK || z->avail_in != 0 || z->avail_out == 0)
+      return -1;
+  }
+
+  size_t n = (char *)z->next_out - (out + skip);
+  if (codec == FZ_DEFLATE_DICT) {
+    char header[LEN_MAX];
+    size_t h = put_varint(header, n);
+    memmove(out + h, out + skip, n);
+    memcpy(out, header, h);
+    n += h;
+  }
+
+  struct codec_stats *st = &e->stats[codec];
+  ++st->frames;
+  st->bytes_in += len;
+  st->bytes_out += n;
+  st->ns += now_ns() - start;
+  return (int64_t)n;
+}
+
+int fz_negotiate(const struct fz_encoder *e, const char *line, size_t len) {
+  static const char offer[] = "/compress ";
+  const size_t offer_len = sizeof(offer) - 1;
+
+  if (len < offer_len || memcmp(line, offer, offer_len) != 0)
+    return -1;
+  if (e == NULL)
+    return FZ_NONE;
+
+  const char *p = line + offer_len, *end = line + len;
+  while (end != p && (end[-1] == '\n' || end[-1] == '\r'))
+    --end;
+  while (p != end) { /* the first codec we know wins */
+    const char *word = p;
+    while (p != end && *p != ' ')
+      ++p;
+    for (int codec = FZ_DEFLATE; codec < FZ_NBR_CODECS; ++codec)
+      if ((size_t)(p - word) == strlen(codec_names[codec]) &&
+          memcmp(word, codec_names[codec], p - word) == 0)
+        return codec;
+    while (p != end && *p == ' ')
+      ++p;
+  }
+  return FZ_NONE;
+}
+
+int fz_format_answer(const struct fz_encoder *e, enum fz_codec codec,
+                     char *buf, size_t cap) {
+  int n;
+  if (codec == FZ_DEFLATE_DICT)
+    n = snprintf(buf, cap, "compress %s %08x\n", codec_names[codec],
+                 e->dict_id);
+  else
+    n = snprintf(buf, cap, "compress %s\n", codec_names[codec]);
+  return n + 1; /* the frame's '\0' */
+}
+
+const char *fz_codec_name(enum fz_codec codec) { return codec_names[codec]; }
+
+void fz_print_stats(const struct fz_encoder *e, const char *prefix) {
+  for (int codec = FZ_DEFLATE; codec < FZ_NBR_CODECS; ++codec) {
+    const struct codec_stats *st = &e->stats[codec];
+    char label[32];
+    snprintf(label, sizeof(label), "%s:", codec_names[codec]);
+    printf("%s%-17s%lu frames, %lu -> %lu bytes (ratio %.2f), %.2f us per "
+           "frame\n",
+           prefix, label, st->frames, st->bytes_in,
+           st->bytes_out,
+           st->bytes_out ? (double)st->bytes_in / st->bytes_out : 0.0,
+           st->frames ? st->ns / 1e3 / st->frames : 0.0);
+  }
+}
+
+void fz_encoder_free(struct fz_encoder *e) {
+  deflateEnd(&e->z);
+  free(e);
+}
@@ -0,0 +1,78 @@
+#ifndef FRAMEZIP_H
+#define FRAMEZIP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compression of the frames a chat server sends (see -z of
+ * multichatserver_epoll.c). A raw TCP client may offer codecs with its first
+ * line:
+ *
+ *   /compress deflate-dict deflate
+ *
+ * (in order of preference). The server answers with an uncompressed frame
+ * naming the codec it picked - "compress deflate-dict 1a2b3c4d" (the
+ * dictionary id), "compress deflate" or "compress none" - and every frame it
+ * sends after that is compressed:
+ *
+ *   deflate       a raw deflate stream (RFC 1951) - every frame is compressed
+ *                 on its own and ends with a sync flush, so the client feeds
+ *                 everything it receives to a single inflater and reads the
+ *                 usual "...\n\0" frames out of it
+ *   deflate-dict  len (a varint, see capture.h) followed by len bytes of raw
+ *                 deflate that inflate (with inflateReset and then the shared
+ *                 dictionary set) to one frame
+ *
+ * The dictionary is a plain string of content typical for the room (the most
+ * common at its end) - its id is the Adler-32 of it, as in zlib. Since no
+ * frame refers to an earlier one, a frame is compressed once per codec and
+ * the result is sent to every client that picked the codec. This trades some
+ * ratio (frames are short) for compression cost that does not grow with the
+ * number of recipients - the shared dictionary wins most of that ratio back.
+ * Plain deflate does not shrink short chat lines (a fresh block costs about 6
+ * bytes) and only pays off for longer frames. (zstd with a trained dictionary
+ * would fit the same scheme.) */
+
+enum fz_codec { FZ_NONE, FZ_DEFLATE, FZ_DEFLATE_DICT, FZ_NBR_CODECS };
+
+#define FZ_DICT_MAX 32768 /* a deflate window */
+
+/* max length of the compressed form of a frame of len bytes */
+#define FZ_BOUND(len) ((len) + ((len) >> 10) + 64)
+
+/* Compresses frames - one per event loop thread. */
+struct fz_encoder;
+
+/* creates an encoder. dict (of dict_len bytes, at most FZ_DICT_MAX) is the
+ * shared dictionary - NULL for the built-in one. dict must outlive the
+ * encoder. Returns NULL on failure */
+struct fz_encoder *fz_encoder_new(const char *dict, size_t dict_len);
+
+/* compresses frame (of len bytes) with codec (not FZ_NONE) into out (of at
+ * least FZ_BOUND(len) bytes). Returns the length of the result or -1 on
+ * error */
+int64_t fz_encode(struct fz_encoder *e, enum fz_codec codec, const char *frame,
+                  size_t len, char *out);
+
+/* picks the codec for the client line (of len bytes) if it is an offer (e.g.,
+ * "/compress deflate-dict deflate\n") - FZ_NONE if no codec offered is
+ * supported or e is NULL (compression disabled). Returns -1 if line is not an
+ * offer */
+int fz_negotiate(const struct fz_encoder *e, const char *line, size_t len);
+
+/* writes the answer to an offer (a "compress ...\n\0" frame) for codec to buf
+ * (of cap bytes, 64 is plenty). Returns its length (terminator included) */
+int fz_format_answer(const struct fz_encoder *e, enum fz_codec codec,
+                     char *buf, size_t cap);
+
+/* returns the name of codec */
+const char *fz_codec_name(enum fz_codec codec);
+
+/* prints the counters of each codec (frames, bytes in and out, ratio and time
+ * per frame) to stdout with every line prefixed by prefix */
+void fz_print_stats(const struct fz_encoder *e, const char *prefix);
+
+/* releases the encoder */
+void fz_encoder_free(struct fz_encoder *e);
+
+#endif
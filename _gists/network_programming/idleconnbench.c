@@ -0,0 +1,176 @@
+/*
+ * idleconnbench.c -- opens a (large) number of idle connections to a locally
+ * running chat server and reports how many bytes of userspace memory the
+ * server spends per idle connection. Memory is sampled from the server's
+ * /proc/PID/status (VmRSS) before and after the connections are established.
+ *
+ * Usage: ./idleconnbench SERVER_PID PORT NBR_CONNS
+ *
+ * A single source address can only open ~28k connections to the same
+ * destination (ephemeral port range) - connections are therefore spread over
+ * the source addresses 127.0.0.1, 127.0.0.2, ... (all of 127.0.0.0/8 is
+ * routed to the loopback interface on Linux). For 1M connections you will also
+ * need to raise the fd limits of both processes, e.g.:
+ *
+ *   sysctl -w fs.nr_open=2100000 fs.file-max=2100000
+ *   sysctl -w net.ipv4.ip_local_port_range="1024 65535"
+ *   ulimit -n 2000000
+ *   ./multichatserver_epoll -d 9034 > /dev/null &
+ *   ./idleconnbench $! 9034 1000000
+ *
+ * compile with:
+ *
+ *   cc -O2 -o idleconnbench idleconnbench.c
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONNS_PER_SRC_ADDR 25000 /* stay below the ephemeral port range */
+#define MAX_EVENTS 1024
+
+/* Returns the VmRSS (in bytes) of the provided process. -1 on error. */
+static long read_rss(long pid) {
+  char path[64], line[256];
+  long kb = -1;
+
+  snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+      break;
+  }
+  fclose(f);
+  return kb == -1 ? -1 : kb * 1024;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reads (and discards) whatever the server sent so that the server's output
+ * buffers for our connections drain - we only want to measure idle ones. */
+static void drain(int epfd, struct epoll_event *events, int timeout_ms) {
+  static char buf[65536];
+  int n;
+  while ((n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms)) > 0) {
+    for (int i = 0; i < n; ++i) {
+      while (recv(events[i].data.fd, buf, sizeof(buf), 0) > 0)
+        ;
+    }
+    timeout_ms = 0;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s SERVER_PID PORT NBR_CONNS\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  long pid = strtol(argv[1], NULL, 10);
+  int port = (int)strtol(argv[2], NULL, 10);
+  long nbr_conns = strtol(argv[3], NULL, 10);
+
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if ((long)rl.rlim_cur < nbr_conns + 16)
+      fprintf(stderr, "warning: RLIMIT_NOFILE (%ld) is too low for %ld "
+                      "connections\n",
+              (long)rl.rlim_cur, nbr_conns);
+  }
+
+  int epfd = epoll_create1(0);
+  struct epoll_event *events =
+      (struct epoll_event *)calloc(MAX_EVENTS, sizeof(struct epoll_event));
+  if (epfd == -1 || events == NULL) {
+    perror("epoll_create1/calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  long rss_before = read_rss(pid);
+  if (rss_before == -1)
+    exit(EXIT_FAILURE);
+
+  struct sockaddr_in dst;
+  memset(&dst, 0, sizeof(dst));
+  dst.sin_family = AF_INET;
+  dst.sin_port = htons(port);
+  dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  double t0 = now_sec();
+  long opened = 0;
+  for (; opened < nbr_conns; ++opened) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+      perror("socket");
+      break;
+    }
+
+    /* 127.0.0.1, 127.0.0.2, ... - let the kernel pick the port at connect
+     * time rather than at bind time (otherwise bind exhausts ports early) */
+    struct sockaddr_in src;
+    int y = 1;
+    memset(&src, 0, sizeof(src));
+    src.sin_family = AF_INET;
+    src.sin_addr.s_addr =
+        htonl(INADDR_LOOPBACK + (uint32_t)(opened / CONNS_PER_SRC_ADDR));
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &y, sizeof(y));
+    if (bind(fd, (struct sockaddr *)&src, sizeof(src)) == -1) {
+      perror("bind");
+      close(fd);
+      break;
+    }
+
+    if (connect(fd, (struct sockaddr *)&dst, sizeof(dst)) == -1 &&
+        errno != EINPROGRESS) {
+      perror("connect");
+      close(fd);
+      break;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+
+    if (opened % 1000 == 999) /* do not let the server's backlog overflow */
+      drain(epfd, events, 0);
+    if (opened % 100000 == 99999)
+      printf("opened %ld connections (%.1fs)\n", opened + 1, now_sec() - t0);
+  }
+
+  /* wait until the server has accepted everything and is idle again, i.e.,
+   * until its RSS stops changing */
+  long rss_after = read_rss(pid), prev = -1;
+  while (rss_after != prev) {
+    prev = rss_after;
+    drain(epfd, events, 500);
+    rss_after = read_rss(pid);
+  }
+
+  printf("connections:          %ld\n", opened);
+  printf("server RSS before:    %ld bytes\n", rss_before);
+  printf("server RSS after:     %ld bytes\n", rss_after);
+  if (opened > 0)
+    printf("bytes per idle conn:  %.1f\n",
+           (double)(rss_after - rss_before) / opened);
+
+  exit(EXIT_SUCCESS);
+}
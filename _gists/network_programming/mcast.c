@@ -0,0 +1,150 @@
+/*
+ * mcast.c -- multicast socket setup and wire format shared by the multicast
+ * modes of udptalker.c (publisher) and udplistener.c (subscriber).
+ *
+ * To try it on a single host, multicast has to be enabled on the loopback
+ * interface (it is not by default) and the group routed to it:
+ *
+ *   sudo ip link set lo multicast on
+ *   sudo ip route add 239.0.0.0/8 dev lo
+ *
+ * and then pass -i lo to both sides.
+ */
+
+#include "mcast.h"
+#include <endian.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MCAST_RCVBUF (4 << 20) /* receive buffer size of subscribers */
+
+void mcast_header_swap(struct mcast_header *h) {
+  /* hton and ntoh are the same operation */
+  h->magic = htobe32(h->magic);
+  h->session = htobe32(h->session);
+  h->type = htobe16(h->type);
+  h->len = htobe16(h->len);
+  h->count = htobe32(h->count);
+  h->seq = htobe64(h->seq);
+}
+
+/* Sets the publisher options of socket fd (see mcast_socket). 0 on success and
+ * -1 on failure. */
+static int set_publisher_options(int fd, int family, unsigned ifindex, int ttl,
+                                 int loop) {
+  if (family == AF_INET) {
+    unsigned char t = ttl, l = loop;
+    struct ip_mreqn mreq = {.imr_ifindex = (int)ifindex};
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &t, sizeof(t)) == -1 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &l, sizeof(l)) == -1 ||
+        (ifindex != 0 && setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq,
+                                    sizeof(mreq)) == -1)) {
+      perror("setsockopt (IP_MULTICAST_*)");
+      return -1;
+    }
+  } else {
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl,
+                   sizeof(ttl)) == -1 ||
+        setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop,
+                   sizeof(loop)) == -1 ||
+        (ifindex != 0 && setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+                                    &ifindex, sizeof(ifindex)) == -1)) {
+      perror("setsockopt (IPV6_MULTICAST_*)");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Joins the group at addr on interface ifindex (0 lets the kernel pick one).
+ * 0 on success and -1 on failure. */
+static int join_group(int fd, const struct sockaddr *addr, unsigned ifindex) {
+  if (addr->sa_family == AF_INET) {
+    struct ip_mreqn mreq = {.imr_ifindex = (int)ifindex};
+    mreq.imr_multiaddr = ((const struct sockaddr_in *)addr)->sin_addr;
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) ==
+        -1) {
+      perror("setsockopt (IP_ADD_MEMBERSHIP)");
+      return -1;
+    }
+  } else {
+    struct ipv6_mreq mreq = {.ipv6mr_interface = ifindex};
+    mreq.ipv6mr_multiaddr = ((const struct sockaddr_in6 *)addr)->sin6_addr;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) ==
+        -1) {
+      perror("setsockopt (IPV6_JOIN_GROUP)");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int mcast_socket(const char *group, const char *port, const char *iface,
+                 int subscribe, int ttl, int loop,
+                 struct sockaddr_storage *group_addr, socklen_t *group_len) {
+  struct addrinfo hints, *res;
+  unsigned ifindex = 0;
+  int fd, rv, y = 1;
+
+  if (iface != NULL && (ifindex = if_nametoindex(iface)) == 0) {
+    perror(iface);
+    return -1;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC; /* the group's address decides */
+  hints.ai_socktype = SOCK_DGRAM;
+  rv = getaddrinfo(group, port, &hints, &res);
+  if (rv != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return -1;
+  }
+  memcpy(group_addr, res->ai_addr, res->ai_addrlen);
+  *group_len = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  int family = group_addr->ss_family;
+  fd = socket(family, SOCK_DGRAM, 0);
+  if (fd == -1) {
+    perror("socket");
+    return -1;
+  }
+
+  if (!subscribe) {
+    if (set_publisher_options(fd, family, ifindex, ttl, loop) == -1) {
+      close(fd);
+      return -1;
+    }
+    return fd; /* the first sendto binds it to an ephemeral port */
+  }
+
+  /* room for bursts (capped by net.core.rmem_max) - what overflows has to be
+   * repaired */
+  int rcvbuf = MCAST_RCVBUF;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1)
+    perror("setsockopt (SO_RCVBUF)");
+
+  /* bind to the group's port on any address - every subscriber on this host
+   * gets its own copy of each datagram */
+  struct sockaddr_storage local;
+  memcpy(&local, group_addr, *group_len);
+  if (family == AF_INET)
+    ((struct sockaddr_in *)&local)->sin_addr.s_addr = htonl(INADDR_ANY);
+  else
+    ((struct sockaddr_in6 *)&local)->sin6_addr = in6addr_any;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y)) == -1 ||
+      bind(fd, (struct sockaddr *)&local, *group_len) == -1) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+  if (join_group(fd, (struct sockaddr *)group_addr, ifindex) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
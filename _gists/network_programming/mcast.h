@@ -0,0 +1,52 @@
+#ifndef MCAST_H
+#define MCAST_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Multicast chat fan-out (udptalker -m / udplistener -m). The publisher sends
+ * every message once to a multicast group with a sequence number. Subscribers
+ * detect gaps (from the sequence numbers and from the publisher's periodic
+ * heartbeats, which carry the last sequence number) and ask the publisher for
+ * the missing messages with a NACK - a unicast datagram to the source address
+ * of the multicast traffic. The publisher re-sends them unicast from its
+ * history, or answers GONE if they are not in it anymore. */
+
+#define MCAST_MAGIC 0x4d434154 /* "MCAT" */
+#define MCAST_MAX_PAYLOAD 1400 /* stays below the usual 1500 bytes MTU */
+#define MCAST_MAX_NACK 256     /* max number of messages per NACK */
+
+enum mcast_type {
+  MCAST_DATA,      /* a message: seq */
+  MCAST_HEARTBEAT, /* nothing new: seq is the last message sent */
+  MCAST_END,       /* the publisher is done: seq is its last message */
+  MCAST_NACK,      /* please re-send count messages from seq */
+  MCAST_GONE,      /* count messages from seq are not available anymore */
+};
+
+/* header of every datagram (in network byte order on the wire) */
+struct mcast_header {
+  uint32_t magic;
+  uint32_t session; /* random per publisher run - a restart resets seq */
+  uint16_t type;
+  uint16_t len;   /* DATA: payload length */
+  uint32_t count; /* NACK, GONE */
+  uint64_t seq;
+};
+
+/* converts a header between host and network byte order */
+void mcast_header_swap(struct mcast_header *h);
+
+/* Creates a UDP socket for multicast group (IPv4 or IPv6) and port on network
+ * interface iface (NULL for the default one) and stores the group's address
+ * in group. A publisher socket (subscribe == 0) gets the multicast TTL (hop
+ * limit), loopback (whether subscribers on the same host receive what it
+ * sends) and outgoing interface set and is bound to an ephemeral port, which
+ * NACKs are sent to. A subscriber socket is bound to port (several
+ * subscribers can share it) and joins the group. Returns the socket or -1 on
+ * failure. */
+int mcast_socket(const char *group, const char *port, const char *iface,
+                 int subscribe, int ttl, int loop,
+                 struct sockaddr_storage *group_addr, socklen_t *group_len);
+
+#endif
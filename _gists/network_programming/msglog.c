@@ -0,0 +1,773 @@
+/*
+ * msglog.c -- append-only, segmented message log (see msglog.h).
+ *
+ * A log directory holds pairs of segment files named after the offset of
+ * their first message:
+ *
+ *   00000000000000000000.log  records (see struct record)
+ *   00000000000000000000.idx  sparse index - one struct index_entry every
+ *                             INDEX_INTERVAL bytes of records
+ *   00000000000000081234.log  ...
+ *
+ * The active segment is preallocated and memory mapped: appending a message is
+ * a memcpy into the page cache (no syscall). Making appended messages durable
+ * is left to a sync thread which msyncs whatever has been appended up to the
+ * last msglog_commit - so the event loop calls msglog_commit once per loop
+ * iteration and all messages of the iteration share a single flush (group
+ * commit). Once full, a segment is handed to the sync thread which flushes
+ * it, trims it to its used size and unmaps it. The index is not flushed
+ * before that - after a crash, the index of the last segment is rebuilt while
+ * scanning it for its end (each record carries a checksum so that torn writes
+ * are detected).
+ *
+ * Rolling over to a new segment stays off the disk as well: the sync thread
+ * keeps the next segment preallocated and mapped under a temporary name
+ * (spare.log and spare.idx) and renames it once the event loop has started
+ * appending to it - before flushing any of it. It also deletes the segments
+ * beyond the retention limit.
+ */
+
+#define _GNU_SOURCE /* reallocarray */
+#include "msglog.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INDEX_INTERVAL 4096 /* bytes of records per index entry */
+#define RECORD_ALIGN 8
+#define SPARE_NAME "spare" /* of the segment prepared by the sync thread */
+
+/* A record as stored in a segment, followed by the message (padded to
+ * RECORD_ALIGN). A zero len marks the end of the records. */
+struct record {
+  uint32_t len;
+  uint32_t checksum; /* of everything below and of the message */
+  uint64_t offset;
+  uint64_t timestamp_ns; /* CLOCK_REALTIME at append */
+};
+
+/* Position of the record of message base + rel_offset in a segment. */
+struct index_entry {
+  uint32_t rel_offset;
+  uint32_t pos;
+};
+
+struct segment {
+  uint64_t base;             /* offset of its first message */
+  int log_fd;
+  int idx_fd;
+  char *map;                 /* segment_bytes long */
+  struct index_entry *index; /* max_entries long */
+  uint32_t nbr_entries;
+  uint64_t pos;          /* append position */
+  uint64_t last_indexed; /* position of the last index entry */
+  uint64_t end_offset;   /* offset following its last message once retired */
+  uint64_t synced;       /* durable up to this position (sync thread only) */
+  int new_file;          /* its directory entry may not be durable yet */
+  struct segment *next;  /* next retired segment */
+};
+
+struct msglog {
+  char dir[PATH_MAX - 32]; /* room for the segment file names */
+  int dir_fd;
+  uint64_t segment_bytes;
+  uint32_t keep_segments;
+  uint32_t max_entries;
+
+  /* event loop side */
+  struct segment *active;
+  uint64_t next_offset;
+  uint64_t committed;  /* next_offset at the last msglog_commit */
+  uint64_t *bases;     /* base offsets of the retained segments */
+  uint32_t nbr_segments;
+  uint32_t bases_capacity;
+
+  /* shared with the sync thread (under lock) */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct segment *retired; /* full segments to flush, trim and unmap */
+  struct segment **retired_tail;
+  struct segment *spare;   /* the next segment, prepared ahead of a roll */
+  struct segment *to_name; /* a spare in use, to be renamed after its base */
+  uint64_t retain_from;    /* segment files below this base are deleted */
+  struct segment *commit_seg; /* flush commit_seg up to commit_pos... */
+  uint64_t commit_pos;
+  uint64_t commit_offset; /* ...which makes this many messages durable */
+  uint64_t taken_offset;  /* commit_offset last taken by the sync thread */
+  int stop;
+
+  atomic_uint_fast64_t durable;
+  int efd;
+
+  /* statistics (written by the sync thread) */
+  atomic_uint_fast64_t group_commits;
+  atomic_uint_fast64_t committed_msgs;
+  atomic_uint_fast64_t sync_ns;
+  atomic_uint_fast64_t max_sync_ns;
+};
+
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* FNV-1a - good enough to detect torn writes. */
+static uint32_t checksum(uint32_t h, const void *data, uint64_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  for (uint64_t i = 0; i < len; ++i)
+    h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+static uint32_t record_checksum(const struct record *rec) {
+  uint32_t h = checksum(2166136261u, &rec->offset, 16);
+  return checksum(h, rec + 1, rec->len);
+}
+
+static uint64_t record_size(uint32_t len) {
+  return (sizeof(struct record) + len + RECORD_ALIGN - 1) &
+         ~(uint64_t)(RECORD_ALIGN - 1);
+}
+
+static void segment_path(const struct msglog *log, uint64_t base,
+                         const char *ext, char *path) {
+  snprintf(path, PATH_MAX, "%s/%020lu.%s", log->dir, base, ext);
+}
+
+/* Opens (creating it if needed) a segment file, makes sure it is size bytes
+ * long and maps it. Returns the mapping or NULL on error. */
+static void *map_file(const char *path, uint64_t size, int *fd) {
+  struct stat st;
+
+  *fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (*fd == -1) {
+    perror("open");
+    return NULL;
+  }
+
+  /* allocate the blocks upfront so that writing through the mapping never
+   * fails with SIGBUS on a full disk and never waits for block allocation */
+  int err = 0;
+  if (fstat(*fd, &st) == 0 && (uint64_t)st.st_size < size)
+    err = posix_fallocate(*fd, 0, size);
+  if (err != 0) {
+    fprintf(stderr, "posix_fallocate: %s\n", strerror(err));
+    close(*fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    close(*fd);
+    return NULL;
+  }
+  return map;
+}
+
+/* Maps the files of a segment. 0 on success, -1 on error. */
+static int segment_map(struct msglog *log, struct segment *seg,
+                       const char *log_path, const char *idx_path) {
+  seg->map = (char *)map_file(log_path, log->segment_bytes, &seg->log_fd);
+  if (seg->map == NULL)
+    return -1;
+  seg->index = (struct index_entry *)map_file(
+      idx_path, (uint64_t)log->max_entries * sizeof(struct index_entry),
+      &seg->idx_fd);
+  if (seg->index == NULL) {
+    munmap(seg->map, log->segment_bytes);
+    close(seg->log_fd);
+    return -1;
+  }
+  return 0;
+}
+
+/* Opens the segment starting at offset base. Existing records are scanned (to
+ * find the append position) and re-indexed. Returns NULL on error. */
+static struct segment *segment_open(struct msglog *log, uint64_t base) {
+  char log_path[PATH_MAX], idx_path[PATH_MAX];
+  struct segment *seg = (struct segment *)calloc(1, sizeof(struct segment));
+  if (seg == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  seg->base = base;
+
+  segment_path(log, base, "log", log_path);
+  segment_path(log, base, "idx", idx_path);
+  seg->new_file = access(log_path, F_OK) == -1;
+  if (segment_map(log, seg, log_path, idx_path) == -1) {
+    free(seg);
+    return NULL;
+  }
+
+  /* find the end of the valid records */
+  uint64_t offset = base;
+  while (seg->pos + sizeof(struct record) <= log->segment_bytes) {
+    struct record *rec = (struct record *)(seg->map + seg->pos);
+    if (rec->len == 0 || rec->offset != offset ||
+        seg->pos + record_size(rec->len) > log->segment_bytes ||
+        rec->checksum != record_checksum(rec))
+      break;
+    if (seg->nbr_entries == 0 ||
+        seg->pos - seg->last_indexed >= INDEX_INTERVAL) {
+      seg->index[seg->nbr_entries++] =
+          (struct index_entry){(uint32_t)(offset - base), (uint32_t)seg->pos};
+      seg->last_indexed = seg->pos;
+    }
+    seg->pos += record_size(rec->len);
+    ++offset;
+  }
+  if (seg->pos + sizeof(uint32_t) <= log->segment_bytes)
+    *(uint32_t *)(seg->map + seg->pos) = 0; /* drop a torn record, if any */
+  seg->synced = seg->pos;
+  seg->end_offset = offset;
+  return seg;
+}
+
+/* Creates an empty segment under the spare name - its base is set once the
+ * event loop rolls over to it. Returns NULL on error. */
+static struct segment *spare_create(struct msglog *log) {
+  char log_path[PATH_MAX], idx_path[PATH_MAX];
+  struct segment *seg = (struct segment *)calloc(1, sizeof(struct segment));
+  if (seg == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  snprintf(log_path, sizeof(log_path), "%s/" SPARE_NAME ".log", log->dir);
+  snprintf(idx_path, sizeof(idx_path), "%s/" SPARE_NAME ".idx", log->dir);
+  unlink(log_path); /* a leftover may hold stale records */
+  unlink(idx_path);
+  if (segment_map(log, seg, log_path, idx_path) == -1) {
+    free(seg);
+    return NULL;
+  }
+  seg->new_file = 1;
+  return seg;
+}
+
+/* Gives a spare in use the file names of its base. */
+static void spare_name(struct msglog *log, struct segment *seg) {
+  char from[PATH_MAX], to[PATH_MAX];
+
+  snprintf(from, sizeof(from), "%s/" SPARE_NAME ".log", log->dir);
+  segment_path(log, seg->base, "log", to);
+  if (rename(from, to) == -1)
+    perror("rename");
+  snprintf(from, sizeof(from), "%s/" SPARE_NAME ".idx", log->dir);
+  segment_path(log, seg->base, "idx", to);
+  if (rename(from, to) == -1)
+    perror("rename");
+}
+
+/* Releases a spare that was never used and deletes its files. */
+static void spare_free(struct msglog *log, struct segment *seg) {
+  char path[PATH_MAX];
+
+  munmap(seg->map, log->segment_bytes);
+  munmap(seg->index, (uint64_t)log->max_entries * sizeof(struct index_entry));
+  close(seg->log_fd);
+  close(seg->idx_fd);
+  free(seg);
+  snprintf(path, sizeof(path), "%s/" SPARE_NAME ".log", log->dir);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/" SPARE_NAME ".idx", log->dir);
+  unlink(path);
+}
+
+/* Deletes the files of the segments with a base below below. */
+static void remove_segments(struct msglog *log, uint64_t below) {
+  DIR *d = opendir(log->dir);
+  struct dirent *e;
+  if (d == NULL) {
+    perror("opendir");
+    return;
+  }
+  while ((e = readdir(d)) != NULL) {
+    uint64_t base;
+    char ext[8];
+    if (strlen(e->d_name) == 24 &&
+        sscanf(e->d_name, "%20lu.%3s", &base, ext) == 2 && base < below &&
+        (strcmp(ext, "log") == 0 || strcmp(ext, "idx") == 0) &&
+        unlinkat(log->dir_fd, e->d_name, 0) == -1)
+      perror("unlink");
+  }
+  closedir(d);
+}
+
+/* Flushes the part of seg appended since the last flush. */
+static void segment_sync(struct msglog *log, struct segment *seg,
+                         uint64_t pos) {
+  if (seg->new_file) {
+    if (fsync(log->dir_fd) == -1)
+      perror("fsync (log directory)");
+    seg->new_file = 0;
+  }
+  if (pos <= seg->synced)
+    return;
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  uint64_t start = seg->synced & ~(page - 1);
+  if (msync(seg->map + start, pos - start, MS_SYNC) == -1)
+    perror("msync");
+  seg->synced = pos;
+}
+
+/* Flushes a segment that will not be appended to anymore, trims its files to
+ * their used size and releases it. */
+static void segment_close(struct msglog *log, struct segment *seg) {
+  uint64_t index_bytes = seg->nbr_entries * sizeof(struct index_entry);
+
+  segment_sync(log, seg, seg->pos);
+  munmap(seg->map, log->segment_bytes);
+  munmap(seg->index, (uint64_t)log->max_entries * sizeof(struct index_entry));
+  if (ftruncate(seg->log_fd, seg->pos) == -1 ||
+      ftruncate(seg->idx_fd, index_bytes) == -1)
+    perror("ftruncate");
+  if (fdatasync(seg->log_fd) == -1 || fdatasync(seg->idx_fd) == -1)
+    perror("fdatasync");
+  close(seg->log_fd);
+  close(seg->idx_fd);
+  free(seg);
+}
+
+/* Whether the sync thread has anything to do. */
+static int sync_pending(const struct msglog *log, uint64_t removed_below) {
+  return log->retired != NULL || log->commit_offset != log->taken_offset ||
+         log->to_name != NULL || log->retain_from != removed_below;
+}
+
+static void *sync_loop(void *arg) {
+  struct msglog *log = (struct msglog *)arg;
+  uint64_t removed_below = 0;
+  int need_spare = 1;
+
+  for (;;) {
+    if (need_spare) { /* off the lock - preallocating takes a while */
+      struct segment *spare = spare_create(log);
+      need_spare = 0;
+      pthread_mutex_lock(&log->lock);
+      if (spare != NULL && log->spare == NULL && !log->stop) {
+        log->spare = spare;
+        spare = NULL;
+      }
+      pthread_mutex_unlock(&log->lock);
+      if (spare != NULL)
+        spare_free(log, spare);
+    }
+
+    pthread_mutex_lock(&log->lock);
+    while (!log->stop && !sync_pending(log, removed_below))
+      pthread_cond_wait(&log->cond, &log->lock);
+    if (log->stop && !sync_pending(log, removed_below)) {
+      pthread_mutex_unlock(&log->lock);
+      return NULL;
+    }
+
+    /* take everything that has been committed so far - it is all flushed
+     * together */
+    struct segment *retired = log->retired;
+    struct segment *seg = log->commit_seg;
+    uint64_t pos = log->commit_pos;
+    uint64_t target = log->commit_offset;
+    uint64_t prev = log->taken_offset;
+    struct segment *to_name = log->to_name;
+    uint64_t retain_from = log->retain_from;
+    log->retired = NULL;
+    log->retired_tail = &log->retired;
+    log->taken_offset = target;
+    log->to_name = NULL;
+    pthread_mutex_unlock(&log->lock);
+
+    /* a roll used up the spare (or found none) - prepare the next one */
+    need_spare = retired != NULL;
+    if (to_name != NULL) /* before anything in it is flushed */
+      spare_name(log, to_name);
+
+    uint64_t t0 = clock_ns(CLOCK_MONOTONIC);
+    while (retired != NULL) {
+      struct segment *next = retired->next;
+      if (retired->end_offset > target)
+        target = retired->end_offset;
+      segment_close(log, retired);
+      retired = next;
+    }
+    if (seg != NULL)
+      segment_sync(log, seg, pos);
+    uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - t0;
+
+    if (target > atomic_load(&log->durable)) {
+      atomic_fetch_add(&log->group_commits, 1);
+      atomic_fetch_add(&log->committed_msgs, target - prev);
+      atomic_fetch_add(&log->sync_ns, elapsed);
+      if (elapsed > atomic_load(&log->max_sync_ns))
+        atomic_store(&log->max_sync_ns, elapsed);
+      atomic_store(&log->durable, target);
+      uint64_t one = 1;
+      if (write(log->efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("write (eventfd)");
+    }
+
+    if (retain_from != removed_below) {
+      remove_segments(log, retain_from);
+      removed_below = retain_from;
+    }
+  }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Adds base to the retained segments. 0 on success, -1 on error. */
+static int push_base(struct msglog *log, uint64_t base) {
+  if (log->nbr_segments == log->bases_capacity) {
+    uint32_t capacity = log->bases_capacity == 0 ? 16 : log->bases_capacity * 2;
+    uint64_t *bases =
+        (uint64_t *)reallocarray(log->bases, capacity, sizeof(uint64_t));
+    if (bases == NULL) {
+      perror("reallocarray");
+      return -1;
+    }
+    log->bases = bases;
+    log->bases_capacity = capacity;
+  }
+  log->bases[log->nbr_segments++] = base;
+  return 0;
+}
+
+/* Lists the segments already in the log directory. 0 on success, -1 on
+ * error. */
+static int list_segments(struct msglog *log) {
+  DIR *d = opendir(log->dir);
+  struct dirent *e;
+  if (d == NULL) {
+    perror("opendir");
+    return -1;
+  }
+  while ((e = readdir(d)) != NULL) {
+    uint64_t base;
+    char ext[8];
+    if (strlen(e->d_name) == 24 &&
+        sscanf(e->d_name, "%20lu.%3s", &base, ext) == 2 &&
+        strcmp(ext, "log") == 0 && push_base(log, base) == -1) {
+      closedir(d);
+      return -1;
+    }
+  }
+  closedir(d);
+  qsort(log->bases, log->nbr_segments, sizeof(uint64_t), cmp_u64);
+  return 0;
+}
+
+/* Forgets the oldest segments beyond the retention limit - the sync thread
+ * deletes their files (see retain_from). */
+static void apply_retention(struct msglog *log) {
+  uint32_t drop = 0;
+
+  while (log->nbr_segments - drop > log->keep_segments)
+    ++drop;
+  if (drop != 0) {
+    log->nbr_segments -= drop;
+    memmove(log->bases, log->bases + drop,
+            log->nbr_segments * sizeof(uint64_t));
+  }
+}
+
+struct msglog *msglog_open(const char *dir, uint64_t segment_bytes,
+                           uint32_t keep_segments) {
+  struct msglog *log = (struct msglog *)calloc(1, sizeof(struct msglog));
+  if (log == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  snprintf(log->dir, sizeof(log->dir), "%s", dir);
+  log->segment_bytes = segment_bytes < 65536 ? 65536 : segment_bytes;
+  if (log->segment_bytes > UINT32_MAX) /* index entries hold 32-bit positions */
+    log->segment_bytes = UINT32_MAX;
+  log->keep_segments = keep_segments == 0 ? 1 : keep_segments;
+  log->max_entries = (uint32_t)(log->segment_bytes / INDEX_INTERVAL) + 1;
+  log->retired_tail = &log->retired;
+  log->dir_fd = log->efd = -1;
+
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+    perror("mkdir");
+    goto fail;
+  }
+  log->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (log->dir_fd == -1) {
+    perror("open");
+    goto fail;
+  }
+  log->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (log->efd == -1) {
+    perror("eventfd");
+    goto fail;
+  }
+
+  /* append to the last segment - or start from scratch */
+  if (list_segments(log) == -1 ||
+      (log->nbr_segments == 0 && push_base(log, 0) == -1))
+    goto fail;
+  log->active = segment_open(log, log->bases[log->nbr_segments - 1]);
+  if (log->active == NULL)
+    goto fail;
+  log->next_offset = log->active->end_offset;
+  log->committed = log->next_offset;
+  log->commit_offset = log->taken_offset = log->next_offset;
+  atomic_init(&log->durable, log->next_offset);
+  apply_retention(log);
+  log->retain_from = log->bases[0];
+
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->cond, NULL);
+  if (pthread_create(&log->thread, NULL, sync_loop, log) != 0) {
+    perror("pthread_create");
+    segment_close(log, log->active);
+    goto fail;
+  }
+  return log;
+
+fail:
+  if (log->dir_fd != -1)
+    close(log->dir_fd);
+  if (log->efd != -1)
+    close(log->efd);
+  free(log->bases);
+  free(log);
+  return NULL;
+}
+
+/* Starts a new segment - the spare prepared by the sync thread, if any - and
+ * hands the active one over to the sync thread. 0 on success, -1 on error. */
+static int roll(struct msglog *log) {
+  struct segment *old = log->active;
+
+  pthread_mutex_lock(&log->lock);
+  struct segment *seg = log->spare;
+  log->spare = NULL;
+  pthread_mutex_unlock(&log->lock);
+  int spare = seg != NULL;
+  if (spare)
+    seg->base = seg->end_offset = log->next_offset;
+  else /* the sync thread is behind - open it here */
+    seg = segment_open(log, log->next_offset);
+  if (seg == NULL || push_base(log, seg->base) == -1) {
+    if (seg != NULL)
+      segment_close(log, seg);
+    return -1;
+  }
+  old->end_offset = log->next_offset;
+  log->active = seg;
+  apply_retention(log);
+
+  pthread_mutex_lock(&log->lock);
+  if (spare)
+    log->to_name = seg;
+  log->retain_from = log->bases[0];
+  old->next = NULL;
+  *log->retired_tail = old;
+  log->retired_tail = &old->next;
+  if (log->commit_seg == old) /* it is flushed entirely anyway */
+    log->commit_seg = NULL;
+  pthread_cond_signal(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+  return 0;
+}
+
+int64_t msglog_append(struct msglog *log, const void *data, uint32_t len) {
+  uint64_t size = record_size(len);
+  if (size + sizeof(uint32_t) > log->segment_bytes) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  struct segment *seg = log->active;
+  if (seg->pos + size + sizeof(uint32_t) > log->segment_bytes) {
+    if (roll(log) == -1)
+      return -1;
+    seg = log->active;
+  }
+
+  if (seg->nbr_entries == 0 || seg->pos - seg->last_indexed >= INDEX_INTERVAL) {
+    seg->index[seg->nbr_entries++] = (struct index_entry){
+        (uint32_t)(log->next_offset - seg->base), (uint32_t)seg->pos};
+    seg->last_indexed = seg->pos;
+  }
+
+  struct record *rec = (struct record *)(seg->map + seg->pos);
+  rec->len = len;
+  rec->offset = log->next_offset;
+  rec->timestamp_ns = clock_ns(CLOCK_REALTIME);
+  memcpy(rec + 1, data, len);
+  rec->checksum = record_checksum(rec);
+  seg->pos += size;
+  *(uint32_t *)(seg->map + seg->pos) = 0; /* end marker */
+
+  return (int64_t)log->next_offset++;
+}
+
+void msglog_commit(struct msglog *log) {
+  if (log->committed == log->next_offset)
+    return;
+  pthread_mutex_lock(&log->lock);
+  log->commit_seg = log->active;
+  log->commit_pos = log->active->pos;
+  log->commit_offset = log->next_offset;
+  pthread_cond_signal(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+  log->committed = log->next_offset;
+}
+
+uint64_t msglog_durable(struct msglog *log) {
+  return atomic_load(&log->durable);
+}
+
+uint64_t msglog_next_offset(const struct msglog *log) {
+  return log->next_offset;
+}
+
+int msglog_event_fd(const struct msglog *log) { return log->efd; }
+
+/* Returns the number of leading valid entries of index with a relative offset
+ * up to rel - i.e., 1 + the position of the entry to start scanning from. A
+ * segment that was never trimmed has zeroed entries past the valid ones. */
+static uint32_t index_search(const struct index_entry *index, uint32_t n,
+                             uint64_t rel) {
+  uint32_t lo = 1, hi = n; /* entry 0 is always valid */
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (index[mid].rel_offset != 0 && index[mid].rel_offset <= rel)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int64_t msglog_read(struct msglog *log, uint64_t offset, void *buf,
+                    uint32_t cap) {
+  if (offset >= log->next_offset || log->bases[0] > offset)
+    return -1;
+
+  uint32_t lo = 0, hi = log->nbr_segments - 1;
+  while (lo < hi) { /* last segment with a base up to offset */
+    uint32_t mid = hi - (hi - lo) / 2;
+    if (log->bases[mid] <= offset)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  /* older segments are mapped for the duration of the lookup */
+  const char *map;
+  const struct index_entry *index;
+  uint64_t map_bytes, index_bytes;
+  int log_fd = -1, idx_fd = -1;
+  if (lo == log->nbr_segments - 1) {
+    map = log->active->map;
+    map_bytes = log->active->pos;
+    index = log->active->index;
+    index_bytes = log->active->nbr_entries * sizeof(struct index_entry);
+  } else {
+    char path[PATH_MAX];
+    struct stat st1, st2;
+    segment_path(log, log->bases[lo], "log", path);
+    log_fd = open(path, O_RDONLY | O_CLOEXEC);
+    segment_path(log, log->bases[lo], "idx", path);
+    idx_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (log_fd == -1 || idx_fd == -1 || fstat(log_fd, &st1) == -1 ||
+        fstat(idx_fd, &st2) == -1 || st1.st_size == 0 || st2.st_size == 0) {
+      if (log_fd != -1)
+        close(log_fd);
+      if (idx_fd != -1)
+        close(idx_fd);
+      return -1;
+    }
+    map_bytes = st1.st_size;
+    index_bytes = st2.st_size;
+    map = (const char *)mmap(NULL, map_bytes, PROT_READ, MAP_SHARED, log_fd, 0);
+    index = (const struct index_entry *)mmap(NULL, index_bytes, PROT_READ,
+                                             MAP_SHARED, idx_fd, 0);
+    close(log_fd);
+    close(idx_fd);
+    if (map == MAP_FAILED || index == MAP_FAILED) {
+      if (map != MAP_FAILED)
+        munmap((void *)map, map_bytes);
+      if (index != MAP_FAILED)
+        munmap((void *)index, index_bytes);
+      return -1;
+    }
+  }
+
+  /* jump to the closest indexed record and scan from there */
+  int64_t found = -1;
+  uint32_t i = index_search(index, index_bytes / sizeof(struct index_entry),
+                            offset - log->bases[lo]);
+  uint64_t pos = index[i - 1].pos;
+  while (pos + sizeof(struct record) <= map_bytes) {
+    const struct record *rec = (const struct record *)(map + pos);
+    if (rec->len == 0 || rec->offset > offset)
+      break;
+    if (rec->offset == offset) {
+      memcpy(buf, rec + 1, rec->len < cap ? rec->len : cap);
+      found = rec->len;
+      break;
+    }
+    pos += record_size(rec->len);
+  }
+
+  if (lo != log->nbr_segments - 1) {
+    munmap((void *)map, map_bytes);
+    munmap((void *)index, index_bytes);
+  }
+  return found;
+}
+
+void msglog_print_stats(struct msglog *log, const char *prefix) {
+  uint64_t commits = atomic_load(&log->group_commits);
+  printf("%slog offsets:     %lu - %lu (durable up to %lu)\n"
+         "%slog segments:    %u\n"
+         "%sgroup commits:   %lu (%.1f msgs each, sync avg %.1f us, max "
+         "%.1f us)\n",
+         prefix, log->bases[0], log->next_offset, msglog_durable(log), prefix,
+         log->nbr_segments, prefix, commits,
+         commits != 0 ? (double)atomic_load(&log->committed_msgs) / commits
+                      : 0.0,
+         commits != 0 ? atomic_load(&log->sync_ns) / 1e3 / commits : 0.0,
+         atomic_load(&log->max_sync_ns) / 1e3);
+}
+
+void msglog_close(struct msglog *log) {
+  msglog_commit(log);
+  pthread_mutex_lock(&log->lock);
+  log->stop = 1;
+  pthread_cond_signal(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+  pthread_join(log->thread, NULL);
+
+  segment_close(log, log->active);
+  if (log->spare != NULL)
+    spare_free(log, log->spare);
+  close(log->dir_fd);
+  close(log->efd);
+  pthread_mutex_destroy(&log->lock);
+  pthread_cond_destroy(&log->cond);
+  free(log->bases);
+  free(log);
+}
@@ -0,0 +1,49 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stdint.h>
+
+/* An append-only, segmented message log. Messages are copied into a memory
+ * mapped segment file and identified by their offset (0, 1, 2, ...). A
+ * background thread makes them durable (msync) in batches - one batch per
+ * msglog_commit call (group commit). Segments are rolled once full and only
+ * the most recent ones are retained. */
+struct msglog;
+
+/* opens (or recovers) the log stored in directory dir (created if needed)
+ * with segment files of segment_bytes bytes of which at most keep_segments
+ * are retained. Returns NULL on failure */
+struct msglog *msglog_open(const char *dir, uint64_t segment_bytes,
+                           uint32_t keep_segments);
+
+/* appends a message of len bytes. Returns its offset or -1 on failure. The
+ * message is not durable until a msglog_commit that follows has completed */
+int64_t msglog_append(struct msglog *log, const void *data, uint32_t len);
+
+/* asks the background thread to make everything appended so far durable.
+ * Never blocks on I/O */
+void msglog_commit(struct msglog *log);
+
+/* returns the offset of the first message that is not yet durable */
+uint64_t msglog_durable(struct msglog *log);
+
+/* returns the offset the next appended message will get */
+uint64_t msglog_next_offset(const struct msglog *log);
+
+/* returns an eventfd that becomes readable whenever msglog_durable advances
+ * (read it to re-arm it) */
+int msglog_event_fd(const struct msglog *log);
+
+/* copies the message at offset into buf (truncated to cap bytes). Returns the
+ * message length or -1 if offset is not in the log (anymore) */
+int64_t msglog_read(struct msglog *log, uint64_t offset, void *buf,
+                    uint32_t cap);
+
+/* prints statistics (segments, group commits, sync latency) to stdout with
+ * every line prefixed by prefix */
+void msglog_print_stats(struct msglog *log, const char *prefix);
+
+/* makes everything durable and releases the log */
+void msglog_close(struct msglog *log);
+
+#endif
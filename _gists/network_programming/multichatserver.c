@@ -27,7 +27,8 @@ void broadcast_msg(const struct pollfd *pfds, int fd_count, const char *buf,
     int dest_fd = pfds[i].fd;
     if (dest_fd != listener_fd &&
         dest_fd != except_fd /* without this an inifinte loop occurs */) {
-      if (send(dest_fd, buf, buf_len, 0) == -1) {
+      /* a client that just hung up must not kill the server (SIGPIPE) */
+      if (send(dest_fd, buf, buf_len, MSG_NOSIGNAL) == -1) {
         perror("send");
       }
     }
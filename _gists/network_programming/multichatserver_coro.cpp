@@ -0,0 +1,306 @@
+/*
+ * multichatserver_coro.cpp -- the chat room of multichatserver_epoll.c (in
+ * its default configuration minus the presence batching) written with the
+ * C++20 coroutines of coro.hpp: every client is a coroutine that reads lines
+ * and broadcasts them, plus a writer coroutine that sends what was broadcast
+ * to it - the control flow reads top to bottom instead of being spread over
+ * epoll callbacks and per-client state flags.
+ *
+ * Usage: ./multichatserver_coro [-s SECONDS] PORT
+ *
+ *   -s  print a stats line every SECONDS seconds: clients, frames broadcast,
+ *       coroutine frames allocated vs. reused and every heap allocation the
+ *       process made during the interval (0 once it has warmed up)
+ *
+ * Like multichatserver_epoll.c, lines are cut at MAX_CLIENT_MSG_LENGTH bytes,
+ * sanitized (textscan.c) and broadcast as "user FD: TEXT\n\0" to all other
+ * clients, joins and leaves as "user FD joined the chat room\n\0" (right away
+ * - there is no presence tick). Broadcasts to a client are coalesced: its
+ * writer sends everything broadcast since its last send at once. A client
+ * that falls WBUF_MAX_CAP bytes behind loses messages.
+ *
+ * Benchmark against the C version with chatloadgen.c:
+ *
+ *   ./multichatserver_coro 9034 > /dev/null &
+ *   ./chatloadgen -n 32 -r 20000 localhost 9034
+ *   ./multichatserver_epoll -t 0 9035 > /dev/null &
+ *   ./chatloadgen -n 32 -r 20000 localhost 9035
+ *
+ * compile with:
+ *
+ *   cc -O2 -c sockethelpers.c textscan.c
+ *   c++ -std=c++20 -O2 -o multichatserver_coro multichatserver_coro.cpp \
+ *       sockethelpers.o textscan.o
+ */
+
+#include "coro.hpp"
+#include "sockethelpers.h"
+#include "textscan.h"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_CLIENT_MSG_LENGTH 256 /* a frame longer than this is cut */
+#define RX_BUF_SIZE 4096          /* receive buffer (in the client's frame) */
+#define WBUF_INIT_CAP 4096        /* initial capacity of an output buffer */
+#define WBUF_MAX_CAP (1 << 20)    /* slow consumers lose messages beyond this */
+
+// every heap allocation of the process (see -s)
+static std::atomic<std::uint64_t> heap_allocs{0};
+
+void *operator new(std::size_t size) {
+  heap_allocs.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size != 0 ? size : 1))
+    return p;
+  throw std::bad_alloc{};
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+static volatile std::sig_atomic_t stop = 0;
+
+static void handle_signal(int) { stop = 1; }
+
+struct Client {
+  int fd;
+  std::size_t index; // in Room::clients
+  // broadcast to the client but not handed to its writer yet - the writer
+  // swaps it with its own (drained) buffer so that neither is reallocated
+  // while a send is in flight
+  std::vector<char> pending{};
+  coro::Event wake;        // set when pending gets data or on hang up
+  coro::Event writer_done; // set when the writer has returned
+  bool closing{false};
+
+  Client(coro::Executor &ex, int f) : fd{f}, index{0}, wake{ex}, writer_done{ex} {
+    pending.reserve(WBUF_INIT_CAP);
+  }
+};
+
+struct Room {
+  std::vector<Client *> clients{};
+  std::uint64_t frames{0};  // broadcast
+  std::uint64_t dropped{0}; // frames lost by too slow clients
+
+  void join(Client *c) {
+    c->index = clients.size();
+    clients.push_back(c);
+  }
+
+  void leave(Client *c) {
+    clients[c->index] = clients.back();
+    clients[c->index]->index = c->index;
+    clients.pop_back();
+  }
+
+  // queues msg (of len bytes) to every client but except
+  void broadcast(const char *msg, std::size_t len, const Client *except) {
+    for (Client *c : clients) {
+      if (c == except || c->closing)
+        continue;
+      if (c->pending.size() + len > WBUF_MAX_CAP) {
+        ++dropped;
+        continue;
+      }
+      c->pending.insert(c->pending.end(), msg, msg + len);
+      c->wake.set();
+    }
+    ++frames;
+  }
+};
+
+// sends whatever is broadcast to c until c hangs up
+static coro::Task<> writer(coro::Executor &ex, Client &c) {
+  std::vector<char> sending{};
+  sending.reserve(WBUF_INIT_CAP);
+
+  while (!c.closing) {
+    co_await c.wake;
+    if (c.pending.empty())
+      continue;
+    sending.swap(c.pending);
+    if (co_await ex.send_all(c.fd, sending.data(), sending.size()) == -1) {
+      if (errno != EPIPE && errno != ECONNRESET)
+        perror("send");
+      shutdown(c.fd, SHUT_RD); // wakes the reader up (recv returns 0)
+      break;
+    }
+    sending.clear();
+  }
+  c.writer_done.set();
+}
+
+// broadcasts a frame (a line, not null-terminated) received from c - see
+// broadcast_frame of multichatserver_epoll.c
+static void broadcast_frame(Room &room, const Client &c, const char *frame,
+                            std::size_t frame_len) {
+  char msg_buf[32 + MAX_CLIENT_MSG_LENGTH + 2]; /* "user %d: " max length is
+                                                   assumed to be <= 32 */
+  int n = snprintf(msg_buf, sizeof(msg_buf), "user %d: ", c.fd);
+
+  /* the line terminator (\n or telnet's \r\n) is not part of the text */
+  if (frame_len != 0 && frame[frame_len - 1] == '\n')
+    --frame_len;
+  if (frame_len != 0 && frame[frame_len - 1] == '\r')
+    --frame_len;
+
+  char *text = msg_buf + n;
+  std::memcpy(text, frame, frame_len);
+  text_sanitize(text, frame_len);
+  n += frame_len;
+  msg_buf[n++] = '\n';
+  msg_buf[n] = '\0';
+  room.broadcast(msg_buf, n + 1, &c);
+}
+
+static void announce(Room &room, const Client &c, const char *what) {
+  char msg_buf[64];
+  int n = snprintf(msg_buf, sizeof(msg_buf), "user %d %s\n", c.fd, what);
+  room.broadcast(msg_buf, n + 1, &c);
+}
+
+// a client connection: reads lines and broadcasts them until it hangs up
+static coro::Task<> session(coro::Executor &ex, Room &room, int fd) {
+  Client c{ex, fd};
+  char rx[RX_BUF_SIZE];
+  char line[MAX_CLIENT_MSG_LENGTH]; // partial line
+  std::size_t line_len = 0;
+
+  room.join(&c);
+  announce(room, c, "joined the chat room");
+  ex.spawn(writer(ex, c));
+
+  for (;;) {
+    ssize_t n = co_await ex.recv(fd, rx, sizeof(rx));
+    if (n <= 0) { /* error or connection closed */
+      if (n == -1 && errno != ECONNRESET)
+        perror("recv");
+      break;
+    }
+
+    const char *p = rx, *end = rx + n;
+    while (p != end) {
+      std::size_t nl = text_find_newline(p, end - p);
+      bool complete = nl != static_cast<std::size_t>(end - p);
+      std::size_t len = complete ? nl + 1 : nl;
+      std::size_t room_left = MAX_CLIENT_MSG_LENGTH - line_len;
+
+      if (line_len == 0 && complete && len <= room_left) { /* no copy */
+        broadcast_frame(room, c, p, len);
+        p += len;
+        continue;
+      }
+      if (len > room_left)
+        len = room_left;
+      std::memcpy(line + line_len, p, len);
+      line_len += len;
+      p += len;
+      if (line[line_len - 1] == '\n' || line_len == MAX_CLIENT_MSG_LENGTH) {
+        broadcast_frame(room, c, line, line_len);
+        line_len = 0;
+      }
+    }
+  }
+
+  c.closing = true;
+  c.wake.set();
+  shutdown(fd, SHUT_RDWR); // fails a send the writer may be parked in
+  co_await c.writer_done; // the writer refers to c
+  room.leave(&c);
+  ex.close(fd);
+  announce(room, c, "disconnected");
+}
+
+static coro::Task<> acceptor(coro::Executor &ex, Room &room, int list_fd) {
+  for (;;) {
+    int fd = static_cast<int>(co_await ex.accept(list_fd));
+    if (fd == -1) {
+      perror("accept");
+      if (errno == EMFILE || errno == ENFILE) // let clients leave first
+        co_await ex.sleep_for(std::chrono::milliseconds{100});
+      continue;
+    }
+    /* frames are coalesced by the writer already - Nagle would only add
+     * delay */
+    int y = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &y, sizeof(y));
+    ex.spawn(session(ex, room, fd));
+  }
+}
+
+static coro::Task<> print_stats(coro::Executor &ex, Room &room,
+                                unsigned interval_s) {
+  std::uint64_t frames = 0, allocs = heap_allocs.load();
+  coro::FramePool &pool = coro::FramePool::local();
+  for (;;) {
+    co_await ex.sleep_for(std::chrono::seconds{interval_s});
+    std::uint64_t now_allocs = heap_allocs.load();
+    printf("clients %zu  frames %.0f/s  dropped %lu  coroutine frames: %lu "
+           "allocated, %lu reused  heap allocations in the last %u s: %lu\n",
+           room.clients.size(), (room.frames - frames) / (double)interval_s,
+           room.dropped, pool.heap_allocs(), pool.reused(), interval_s,
+           now_allocs - allocs);
+    fflush(stdout);
+    frames = room.frames;
+    allocs = heap_allocs.load(); // printf may allocate its buffer once
+  }
+}
+
+int main(int argc, char *argv[]) {
+  unsigned stats_s = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+    case 's':
+      stats_s = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if (argc - optind != 1) {
+  usage:
+    fprintf(stderr, "Usage: %s [-s SECONDS] PORT\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  int list_fd = create_listening_socket(argv[optind], 512);
+  if (list_fd == -1) {
+    perror("create_listening_socket");
+    exit(EXIT_FAILURE);
+  }
+  fcntl(list_fd, F_SETFL, fcntl(list_fd, F_GETFL) | O_NONBLOCK);
+
+  struct sigaction sa {};
+  sa.sa_handler = handle_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  coro::Executor ex{};
+  Room room{};
+  room.clients.reserve(1024);
+  ex.spawn(acceptor(ex, room, list_fd));
+  if (stats_s != 0)
+    ex.spawn(print_stats(ex, room, stats_s));
+
+  puts("started the coroutine event loop");
+  ex.run(&stop);
+  printf("broadcast %lu frames (%lu dropped), %lu operations had to wait "
+         "for their socket\n",
+         room.frames, room.dropped, ex.suspends());
+  exit(EXIT_SUCCESS); // the clients' coroutines are not unwound
+}
@@ -1,213 +1,2138 @@
+/*
+ * multichatserver_epoll.c -- epoll-based version of multichatserver.c. Clients
+ * connect (e.g., using telnet localhost 9034) and every line they send is
+ * broadcast to all other connected clients.
+ *
+ * Usage: ./multichatserver_epoll [-d] [-t TICK_MS] [-p MAX_PRESENCE]
+ *                                [-c COALESCING] [-b BYTES] [-u USEC]
+ *                                [-r RATE[:BURST]] [-R RATE[:BURST]]
+ *                                [-B USEC] [-C CPU] [-w CPU_LIST]
+ *                                [-L DIR [-D] [-S SEGMENT_MB] [-K SEGMENTS]]
+ *                                [-H PATH [-T]]
+ *                                [-N NODE [-F FED_PORT] [-P HOST:PORT]...]
+ *                                [-W WS_PORT] [-X FILE] [-z [-Z DICT]] PORT
+ *
+ *   -d  memory diet mode: idle connections hold no dedicated read or write
+ *       buffers. Reads land in a shared per-thread buffer and only partial
+ *       frames are copied out; output buffers are allocated lazily and given
+ *       back as soon as they are drained.
+ *   -t  presence tick interval in milliseconds (default 100). Join/leave
+ *       events are batched and broadcast as a single "presence:" diff frame
+ *       per tick. 0 broadcasts every event immediately (one O(N) broadcast
+ *       per join/leave - i.e., O(N^2) for a reconnect storm of N clients).
+ *   -p  max size in bytes of a presence frame (default 1024). Ids that do not
+ *       fit are only counted (e.g., "+42 more"). Capped at 65534 with -N.
+ *   -c  write coalescing policy: off, latency, throughput or adaptive (the
+ *       default). Outgoing frames are accumulated per client and flushed with
+ *       a single send. latency flushes at the end of every loop iteration,
+ *       throughput waits for a byte threshold or a deadline (and uses
+ *       MSG_MORE), and adaptive switches between the two based on the number
+ *       of frames broadcast per loop iteration. off sends every frame right
+ *       away.
+ *   -b  flush a client as soon as this many bytes are pending (default 16384)
+ *   -u  max time in microseconds a frame may be held back in throughput mode
+ *       (default 500)
+ *   -r  per-connection rate limit in frames per second (and bucket size,
+ *       which defaults to RATE). 0 (the default) means unlimited.
+ *   -R  same as -r but for the whole room (i.e., shared by all connections)
+ *   -B  busy-poll low-latency mode: sockets get SO_BUSY_POLL (with this
+ *       value in microseconds) and SO_PREFER_BUSY_POLL, and the loop spins on
+ *       a non-blocking epoll_wait for up to USEC microseconds before falling
+ *       back to a blocking one. Values above net.core.busy_read require
+ *       CAP_NET_ADMIN.
+ *   -C  pin the event loop thread to this CPU (ideally an isolated one that
+ *       also handles the NIC's interrupts - spinning burns it entirely)
+ *   -w  run one event loop (worker) thread per CPU of the comma separated
+ *       list (e.g., 0,1,2,3), each pinned to its CPU and with its own
+ *       SO_REUSEPORT listening socket. A classic BPF program attached to the
+ *       reuseport group steers each new connection to the worker pinned on
+ *       the CPU that received its packets (set up RSS/RPS so that each of
+ *       these CPUs handles RX). Workers share a single chat room - messages
+ *       are handed to other workers through per-worker inboxes. Whether a
+ *       connection ended up on the right CPU is checked with SO_INCOMING_CPU
+ *       and reported by the stats command. The room rate limit applies per
+ *       worker.
+ *   -L  append every chat message to a durable log in directory DIR (see
+ *       msglog.c) - one log per worker (DIR/0, DIR/1, ...) with -w. Messages
+ *       are flushed by a background thread once per loop iteration (group
+ *       commit) - the loop itself only copies them into a mapped segment.
+ *   -D  durable mode: a message is only broadcast once it is on disk. This
+ *       adds (at most) one loop iteration plus one flush of latency per
+ *       message, shared by all messages of the iteration.
+ *   -S  size of the log segments in MiB (default 64)
+ *   -K  number of log segments retained (default 16) - older ones are deleted
+ *   -H  hot restart through the unix socket at PATH. On startup, the server
+ *       connects to PATH and, if a previous instance is listening there, takes
+ *       over its listening socket (SCM_RIGHTS) - connections keep queueing up
+ *       in its backlog in the meantime so none are refused. The previous
+ *       instance then flushes its log, drains its clients' pending output,
+ *       closes them and exits. The new instance then listens on PATH for its
+ *       own successor.
+ *   -T  with -H, also take over the previous instance's client connections
+ *       along with their partial input and pending output - i.e., clients do
+ *       not notice the restart (except that their user ids, which are fd
+ *       numbers, may change)
+ *   -N  cluster mode: this server is node NODE (1-65535, unique in the
+ *       cluster) of a chat room spread over several servers (see
+ *       federation.c). User ids become "FD@NODE".
+ *   -F  accept links from other nodes on this port
+ *   -P  keep a link to the node at HOST:PORT (its -F port). Every pair of
+ *       nodes must be linked (on either side), e.g., for three nodes on
+ *       localhost:
+ *
+ *         ./multichatserver_epoll -N 1 -F 9101 9001
+ *         ./multichatserver_epoll -N 2 -F 9102 -P localhost:9101 9002
+ *         ./multichatserver_epoll -N 3 -F 9103 -P localhost:9101 \
+ *                                 -P localhost:9102 9003
+ *
+ *       Neither -N nor -H is supported with -w.
+ *   -W  also accept WebSocket clients (e.g., browsers) on WS_PORT (see
+ *       websocket.c). They share the room with the raw TCP clients: each text
+ *       or binary message is a line, and every broadcast is encoded once as a
+ *       WebSocket text frame (without the trailing newline) that is then sent
+ *       to all WebSocket clients. Not supported with -H.
+ *   -X  capture the inbound traffic of the raw TCP clients to FILE (see
+ *       capture.c): connects, every chunk of bytes as received and hang ups,
+ *       with connection ids and timestamps. Replay it against any of the chat
+ *       servers with chatreplay.c. The capture is written out once per loop
+ *       iteration. Not supported with -H (a successor would truncate the
+ *       capture its predecessor is still writing).
+ *   -z  offer compression to raw TCP clients (see framezip.c): a client that
+ *       starts with "/compress deflate-dict deflate" (the codecs it supports,
+ *       preferred first) gets every later frame compressed with the first of
+ *       them the server supports. Every broadcast is compressed once per codec
+ *       (and worker) and shared by all clients that picked it. Without -z,
+ *       offers are answered with "compress none".
+ *   -Z  shared dictionary of deflate-dict (a file of at most 32 KiB of content
+ *       typical for the room, most common last) - clients must use the same
+ *       one. Implies -z. The default is a built-in one for short chat lines.
+ *
+ * Rate limits are token buckets evaluated inline on the receive path. Every
+ * received frame costs a token of the sender's and of the room's bucket and
+ * only as many frames as there are tokens are consumed from a socket. A
+ * connection that runs out of tokens is simply not read from until its bucket
+ * refills (i.e., TCP flow control pushes back on the sender) - nothing is
+ * buffered on its behalf.
+ *
+ * Received lines are scanned for control characters and invalid UTF-8 with
+ * SIMD (see textscan.c) and offending bytes are replaced with '?' before the
+ * line is broadcast (a trailing \r is dropped).
+ *
+ * The server reads commands from stdin:
+ *
+ *   rate conn RATE [BURST]   change the per-connection rate limit
+ *   rate room RATE [BURST]   change the room rate limit
+ *   stats                    print counters
+ *   log OFFSET               print the logged message at OFFSET (with -L)
+ *
+ * compile with:
+ *
+ *   cc -pthread -o multichatserver_epoll multichatserver_epoll.c \
+ *      sockethelpers.c msglog.c federation.c textscan.c websocket.c capture.c \
+ *      framezip.c -lz
+ */
+
+#define _GNU_SOURCE /* accept4 */
+#include "capture.h"
+#include "federation.h"
+#include "framezip.h"
+#include "msglog.h"
 #include "sockethelpers.h"
+#include "textscan.h"
+#include "websocket.h"
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_NBR_CLIENT 16384
-#define MAX_CLIENT_MSG_LENGTH 256
-
-/* Sends a message to all recipients in fds except to the listening and
- * except_fd sockets. */
-void broadcast_msg(const int *fds, int fds_count, const char *buf,
-                   uint64_t buf_len, int list_fd, int except_fd) {
-  for (int i = 0; i < fds_count; ++i) { /* send the message to all others */
-    int dest_fd = fds[i];
-    if (dest_fd != list_fd &&
-        dest_fd != except_fd /* without this an infinite loop occurs */) {
-      if (send(dest_fd, buf, buf_len, 0) == -1) {
+#define MAX_EVENTS 1024 /* max number of events returned per epoll_wait */
+#define INIT_NBR_CLIENT 1024 /* initial capacity of the clients array */
+#define MAX_CLIENT_MSG_LENGTH 256 /* a frame longer than this is cut */
+#define RX_BUF_SIZE 65536         /* size of the shared per-thread rx buffer */
+#define WBUF_INIT_CAP 4096        /* initial capacity of an output buffer */
+#define WBUF_MAX_CAP (1 << 20)    /* slow consumers lose messages beyond this */
+#define PRESENCE_TICK_MS 100      /* default presence tick interval */
+#define PRESENCE_FRAME_MAX 1024   /* default max size of a presence frame */
+#define FLUSH_BYTES 16384         /* default coalescing byte threshold */
+#define FLUSH_DEADLINE_US 500     /* default coalescing deadline */
+#define LOAD_HIGH 16 /* frames per iteration above which throughput is favored */
+#define LOAD_LOW 4   /* frames per iteration below which latency is favored */
+#define THROTTLE_TICK_MS 10 /* how often throttled clients are re-evaluated */
+#define MAX_WORKERS 256
+#define MAX_PEERS FEDERATION_MAX_LINKS
+#define LOG_SEGMENT_MB 64 /* default size of a log segment */
+#define LOG_KEEP_SEGMENTS 16
+#define WS_REQUEST_MAX 4096 /* max size of a WebSocket upgrade request */
+
+/* only defined by recent (>= 2.34) glibc headers */
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+#define BUSY_POLL_BUDGET 64 /* max packets per busy-poll attempt */
+
+/* epoll user data of non-client fds - client fds use their index instead */
+#define PRESENCE_IDX UINT64_MAX
+#define FLUSH_IDX (UINT64_MAX - 1)
+#define THROTTLE_IDX (UINT64_MAX - 2)
+#define STDIN_IDX (UINT64_MAX - 3)
+#define INBOX_IDX (UINT64_MAX - 4)
+#define LOG_IDX (UINT64_MAX - 5)
+#define HANDOFF_IDX (UINT64_MAX - 6)
+#define WS_LISTEN_IDX (UINT64_MAX - 7)
+
+#define HANDOFF_MAGIC 0x43484154 /* "CHAT" */
+
+/* Pending outbound bytes of a client that could not be sent right away. The
+ * data is stored inline (flexible array member) to save an allocation. */
+struct wbuf {
+  uint32_t off; /* offset of the first unsent byte */
+  uint32_t len; /* offset past the last unsent byte */
+  uint32_t cap; /* capacity of data */
+  char data[];
+};
+
+/* WebSocket state of a client. The upgrade request is gathered in req until
+ * it is complete - messages are assembled in the client's rbuf like lines. */
+struct ws_conn {
+  struct ws_parser parser;
+  char *req;        /* upgrade request received so far, NULL once upgraded */
+  uint16_t req_len;
+  uint8_t ctrl_len; /* bytes of the current control frame's payload */
+  char ctrl[WS_CONTROL_MAX];
+};
+
+/* Per-connection state. Keep this small - there may be millions of these. In
+ * diet mode, rbuf and wbuf are NULL for idle connections. */
+struct client {
+  int fd;
+  uint16_t rlen;     /* number of bytes of a partial frame held in rbuf */
+  uint8_t dirty : 1; /* has coalesced frames that were not flushed yet */
+  uint8_t corked : 1;  /* last send used MSG_MORE */
+  uint8_t pollout : 1; /* EPOLLOUT is requested (socket buffer was full) */
+  uint8_t throttled : 1; /* not read from until its bucket refills */
+  uint8_t fresh : 1;     /* its first line (maybe an offer) is still to come */
+  uint8_t codec : 2;     /* enum fz_codec of its output */
+  int32_t tokens;        /* rate limit bucket in thousandths of a frame */
+  uint32_t stamp;        /* time (in ms) of the last bucket refill */
+  char *rbuf;        /* partial inbound frame (MAX_CLIENT_MSG_LENGTH bytes) */
+  struct wbuf *wbuf; /* pending outbound bytes */
+  struct ws_conn *ws; /* NULL for raw TCP clients */
+};
+
+/* Growable list of client ids (fds). */
+struct id_list {
+  int *ids;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+/* Join/leave events gathered during the current presence tick. */
+struct presence {
+  int timer_fd;          /* one-shot timer - armed by the first event of a tick */
+  int armed;             /* whether timer_fd is currently armed */
+  uint32_t tick_ms;      /* tick interval (-t) - 0 disables batching */
+  uint32_t frame_max;    /* max size of a presence frame (-p) */
+  struct id_list joined; /* clients that joined during this tick */
+  struct id_list left;   /* clients that left during this tick */
+};
+
+enum coalescing_policy {
+  COALESCE_OFF,
+  COALESCE_LATENCY,
+  COALESCE_THROUGHPUT,
+  COALESCE_ADAPTIVE
+};
+
+/* Write coalescing state (see -c). */
+struct coalescing {
+  enum coalescing_policy policy;
+  int throughput;       /* whether frames are currently held back */
+  int timer_fd;         /* deadline timer of throughput mode */
+  int armed;            /* whether timer_fd is currently armed */
+  int dirty;            /* whether at least one client is dirty */
+  uint32_t flush_bytes; /* byte threshold (-b) */
+  uint32_t deadline_us; /* deadline (-u) */
+  uint32_t frames;      /* frames broadcast during the current iteration */
+  uint32_t load;        /* moving average of frames per iteration (x8) */
+};
+
+/* A rate limit - rate 0 means unlimited. */
+struct rate {
+  uint32_t rate;  /* frames per second */
+  uint32_t burst; /* bucket size in frames */
+};
+
+/* Rate limiting state and counters (see -r and -R). */
+struct ratelimit {
+  struct rate conn;          /* per-connection limit */
+  struct rate room;          /* limit shared by the whole room */
+  int32_t room_tokens;       /* room bucket in thousandths of a frame */
+  uint32_t room_stamp;       /* time (in ms) of the last room bucket refill */
+  struct id_list throttled;  /* indices of throttled clients */
+  int timer_fd;              /* periodic while clients are throttled */
+  uint64_t frames;           /* received frames */
+  uint64_t conn_throttles;   /* times a client ran out of its own tokens */
+  uint64_t room_throttles;   /* times a client ran out of room tokens */
+};
+
+enum shared_msg_type {
+  MSG_CHAT,   /* deliver to the clients of the receiving worker */
+  MSG_COMMAND /* run as a stdin command on the receiving worker */
+};
+
+/* A message handed from one worker to all others. It is allocated once and
+ * freed by whichever worker drops the last reference. */
+struct shared_msg {
+  atomic_uint refs;
+  enum shared_msg_type type;
+  int except_fd; /* the sender's fd - -1 once handed to other workers */
+  uint32_t len;
+  char data[];
+};
+
+/* Messages sent to a worker by other workers. The eventfd is only written when
+ * the inbox goes from empty to non-empty. */
+struct inbox {
+  pthread_mutex_t lock;
+  int efd;
+  struct shared_msg **msgs;
+  uint32_t count;
+  uint32_t capacity;
+  struct shared_msg **spare; /* only touched by the owning worker */
+  uint32_t spare_capacity;
+};
+
+/* A message held back until the log says it is durable (-D). */
+struct held_msg {
+  uint64_t offset;
+  struct shared_msg *msg;
+};
+
+/* Durable message log (-L). */
+struct persistence {
+  struct msglog *log; /* NULL if disabled */
+  int durable;        /* hold broadcasts until durable (-D) */
+  struct held_msg *held; /* FIFO - held[head] is the oldest */
+  uint32_t head;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+/* Hot restart protocol (-H). The successor sends a request, the predecessor
+ * answers with a hello that carries its listening socket and then, if asked
+ * to, one handoff_client (carrying the client's socket) per client followed by
+ * the client's partial input and pending output. The successor acknowledges
+ * with a single byte once it serves everything. */
+struct handoff_request {
+  uint32_t magic;
+  uint32_t want_clients;
+};
+
+struct handoff_hello {
+  uint32_t magic;
+  uint32_t nbr_clients;
+};
+
+struct handoff_client {
+  uint32_t rlen;
+  uint32_t wlen;
+  uint16_t fresh;
+  uint16_t codec;
+};
+
+/* Hot restart state (-H). */
+struct hot_restart {
+  const char *path;  /* unix socket path, NULL if disabled */
+  int want_clients;  /* take over the predecessor's clients (-T) */
+  int fd;            /* where successors connect to */
+  int peer;          /* connection to the predecessor, -1 once done */
+  uint32_t nbr_clients; /* number of clients the predecessor is handing off */
+  struct timespec start;
+};
+
+/* Event loop state. The listening socket is always at index 0 of clients. */
+struct server {
+  int epfd;
+  int list_fd;
+  uint32_t id;           /* worker id - 0 without -w */
+  int diet;              /* memory diet mode (-d) */
+  int cpu;               /* CPU the loop is pinned to (-C), -1 if none */
+  uint64_t accepts;      /* accepted connections */
+  uint64_t affine;       /* accepted connections whose RX CPU was cpu */
+  uint64_t sanitized;    /* frames with bytes replaced by text_sanitize */
+  uint64_t dropped;      /* frames lost by too slow clients */
+  uint32_t busy_poll_us; /* busy-poll budget (-B), 0 if disabled */
+  struct client *clients;
+  uint64_t count;    /* number of elements in clients */
+  uint64_t capacity; /* capacity of clients */
+  struct presence presence;
+  struct coalescing coalescing;
+  struct ratelimit ratelimit;
+  struct inbox inbox;
+  struct persistence persistence;
+  struct hot_restart restart;
+  uint16_t node;          /* cluster node id (-N), 0 if not clustered */
+  char node_tag[8];       /* "@NODE" appended to user ids, "" if not */
+  const char *fed_port;   /* -F */
+  const char **peers;     /* -P */
+  uint32_t nbr_peers;
+  struct federation *fed; /* NULL if not clustered */
+  int ws_list_fd;         /* WebSocket listening socket (-W), -1 if none */
+  uint64_t ws_encodes;    /* broadcasts encoded as a WebSocket frame */
+  uint64_t ws_sends;      /* WebSocket frames sent (or queued) */
+  struct capture *capture; /* -X, NULL if disabled - shared by all workers */
+  struct fz_encoder *fz;   /* -z, NULL if disabled */
+  uint64_t fz_sends[FZ_NBR_CODECS]; /* compressed frames sent (or queued) */
+};
+
+/* all workers (-w) - a single one without -w */
+static struct server *workers;
+static uint32_t nbr_workers = 1;
+
+/* all reads land in this buffer first - only partial frames are copied out of
+ * it into a client's own rbuf */
+static _Thread_local char rx_buf[RX_BUF_SIZE];
+
+/* broadcasts are encoded as WebSocket frames in here (unless they are larger) */
+static _Thread_local char ws_tx_buf[WS_HEADER_MAX + RX_BUF_SIZE];
+
+/* and compressed in here - one buffer per codec (but FZ_NONE) */
+static _Thread_local char fz_tx_buf[FZ_NBR_CODECS - 1][FZ_BOUND(RX_BUF_SIZE)];
+
+/* Allocates an empty output buffer that can hold cap bytes. */
+static struct wbuf *wbuf_new(uint32_t cap) {
+  struct wbuf *wb = (struct wbuf *)malloc(sizeof(struct wbuf) + cap);
+  if (wb == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  wb->off = wb->len = 0;
+  wb->cap = cap;
+  return wb;
+}
+
+/* Updates the epoll interest of client idx - EPOLLOUT is only requested while
+ * the client's socket buffer is full (otherwise epoll_wait would return
+ * immediately for every writable socket). */
+static int update_interest(struct server *srv, uint64_t idx) {
+  struct client *c = &srv->clients[idx];
+  struct epoll_event ev;
+
+  ev.events = c->throttled ? 0 : EPOLLIN;
+  if (c->pollout)
+    ev.events |= EPOLLOUT;
+  ev.data.u64 = idx;
+  if (epoll_ctl(srv->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+/* Appends buf to the output buffer of client idx, (re-)allocating it if
+ * necessary. Returns -1 (and counts the frame as dropped) if the client is too
+ * slow and the bytes were dropped - the client is kept and just misses them. */
+static int queue_output(struct server *srv, uint64_t idx, const char *buf,
+                        uint64_t buf_len) {
+  struct client *c = &srv->clients[idx];
+  struct wbuf *wb = c->wbuf;
+
+  if (wb == NULL) {
+    uint32_t cap = WBUF_INIT_CAP;
+    while (cap < buf_len && cap < WBUF_MAX_CAP)
+      cap *= 2;
+    if ((wb = c->wbuf = wbuf_new(cap)) == NULL)
+      return -1;
+  }
+
+  if (wb->off != 0 && wb->len + buf_len > wb->cap) { /* compact first */
+    memmove(wb->data, wb->data + wb->off, wb->len - wb->off);
+    wb->len -= wb->off;
+    wb->off = 0;
+  }
+
+  if (wb->len + buf_len > wb->cap) { /* still no space left - grow */
+    uint32_t cap = wb->cap;
+    while (cap < wb->len + buf_len && cap < WBUF_MAX_CAP)
+      cap *= 2;
+    if (wb->len + buf_len > cap) {
+      fprintf(stderr, "client %d is too slow - dropping message\n", c->fd);
+      ++srv->dropped;
+      return -1;
+    }
+    struct wbuf *nwb = (struct wbuf *)realloc(wb, sizeof(struct wbuf) + cap);
+    if (nwb == NULL) {
+      perror("realloc");
+      return -1;
+    }
+    wb = c->wbuf = nwb;
+    wb->cap = cap;
+  }
+
+  memcpy(wb->data + wb->len, buf, buf_len);
+  wb->len += buf_len;
+  return 0;
+}
+
+/* Sends as much as possible of the pending output of client idx - with
+ * MSG_MORE if more is set (i.e., more frames are expected shortly and the
+ * kernel should not push a partial segment yet). In diet mode, a drained
+ * output buffer is given back. */
+static void flush_client(struct server *srv, uint64_t idx, int more) {
+  struct client *c = &srv->clients[idx];
+  struct wbuf *wb = c->wbuf;
+  int full = 0;
+
+  while (wb != NULL && wb->off != wb->len) {
+    ssize_t n = send(c->fd, wb->data + wb->off, wb->len - wb->off,
+                     MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        full = 1; /* retry when EPOLLOUT fires */
+      else
         perror("send");
+      break;
+    }
+    wb->off += n;
+    c->corked = more;
+  }
+
+  if (wb != NULL && wb->off == wb->len) {
+    wb->off = wb->len = 0;
+    c->dirty = c->corked; /* still needs a final push */
+    if (srv->diet) {
+      free(wb);
+      c->wbuf = NULL;
+    }
+  }
+
+  /* nothing left to send but the kernel may still hold back a partial segment
+   * because of a previous MSG_MORE - (re-)enabling TCP_NODELAY pushes it */
+  if (!more && c->corked && !full) {
+    int y = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &y, sizeof(y));
+    c->corked = 0;
+  }
+
+  if (c->pollout != full) {
+    c->pollout = full;
+    update_interest(srv, idx);
+  }
+}
+
+/* Flushes every dirty client. This is O(N) but only runs after at least one
+ * (equally O(N)) broadcast. */
+static void flush_dirty(struct server *srv) {
+  srv->coalescing.dirty = 0;
+  for (uint64_t i = 0; i < srv->count; ++i) {
+    struct client *c = &srv->clients[i];
+    if (c->dirty && !c->pollout)
+      flush_client(srv, i, 0);
+  }
+}
+
+/* Encodes msg (a "...\n\0" frame) as a WebSocket text frame - without the
+ * line terminator, WebSocket messages are delimited already. Returns the frame
+ * (in ws_tx_buf unless it does not fit) or NULL on error. */
+static char *encode_ws_frame(struct server *srv, const char *msg, uint64_t len,
+                             uint64_t *frame_len) {
+  char *frame = ws_tx_buf;
+
+  if (len != 0 && msg[len - 1] == '\0')
+    --len;
+  if (len != 0 && msg[len - 1] == '\n')
+    --len;
+  if (WS_HEADER_MAX + len > sizeof(ws_tx_buf) &&
+      (frame = (char *)malloc(WS_HEADER_MAX + len)) == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  *frame_len = ws_encode(frame, WS_OP_TEXT, msg, len);
+  ++srv->ws_encodes;
+  return frame;
+}
+
+/* Compresses msg with codec (see framezip.h). Returns the compressed frame (in
+ * fz_tx_buf unless it does not fit) or NULL on error. */
+static char *encode_fz_frame(struct server *srv, enum fz_codec codec,
+                             const char *msg, uint64_t len,
+                             uint64_t *frame_len) {
+  char *buf = fz_tx_buf[codec - 1], *frame = buf;
+
+  if (FZ_BOUND(len) > sizeof(fz_tx_buf[0]) &&
+      (frame = (char *)malloc(FZ_BOUND(len))) == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  int64_t n = fz_encode(srv->fz, codec, msg, len, frame);
+  if (n == -1) {
+    fprintf(stderr, "%s compression failed\n", fz_codec_name(codec));
+    if (frame != buf)
+      free(frame);
+    return NULL;
+  }
+  *frame_len = n;
+  return frame;
+}
+
+/* Sends a message to all clients except to the listening and except_fd
+ * sockets. Sockets are non-blocking - whatever can not be sent right away is
+ * queued in the client's output buffer. With write coalescing, the message is
+ * only queued and is sent later on together with other frames. WebSocket
+ * clients get the message as a WebSocket frame, which is encoded once (on
+ * demand) and shared by all of them - and so are the compressed forms of the
+ * message for clients that negotiated compression (one per codec). */
+void broadcast_msg(struct server *srv, const char *buf, uint64_t buf_len,
+                   int except_fd) {
+  struct coalescing *co = &srv->coalescing;
+  char *ws_frame = NULL;
+  uint64_t ws_len = 0;
+  char *fz_frames[FZ_NBR_CODECS] = {NULL};
+  uint64_t fz_lens[FZ_NBR_CODECS];
+
+  for (uint64_t i = 0; i < srv->count; ++i) { /* send the msg to all others */
+    struct client *c = &srv->clients[i];
+    const char *out = buf;
+    uint64_t out_len = buf_len;
+    if (c->fd == srv->list_fd ||
+        c->fd == except_fd /* without this an infinite loop occurs */)
+      continue;
+
+    if (c->ws != NULL) {
+      if (c->ws->req != NULL) /* not upgraded yet */
+        continue;
+      if (ws_frame == NULL &&
+          (ws_frame = encode_ws_frame(srv, buf, buf_len, &ws_len)) == NULL)
+        continue;
+      out = ws_frame;
+      out_len = ws_len;
+      ++srv->ws_sends;
+    } else if (c->codec != FZ_NONE) {
+      enum fz_codec codec = (enum fz_codec)c->codec;
+      if (fz_frames[codec] == NULL &&
+          (fz_frames[codec] = encode_fz_frame(srv, codec, buf, buf_len,
+                                              &fz_lens[codec])) == NULL)
+        continue;
+      out = fz_frames[codec];
+      out_len = fz_lens[codec];
+      ++srv->fz_sends[codec];
+    }
+
+    if (co->policy != COALESCE_OFF) {
+      if (queue_output(srv, i, out, out_len) == -1)
+        continue;
+      c->dirty = 1;
+      co->dirty = 1;
+      /* byte threshold reached - unless the socket buffer is full anyway */
+      if (!c->pollout && c->wbuf->len - c->wbuf->off >= co->flush_bytes)
+        flush_client(srv, i, co->throughput);
+      continue;
+    }
+
+    uint64_t sent = 0;
+    if (c->wbuf == NULL || c->wbuf->off == c->wbuf->len) { /* nothing queued */
+      ssize_t n = send(c->fd, out, out_len, MSG_NOSIGNAL);
+      if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("send");
+        continue;
       }
+      sent = n == -1 ? 0 : n;
+    }
+    if (sent < out_len && queue_output(srv, i, out + sent, out_len - sent) == 0)
+      flush_client(srv, i, 0); /* (most likely) requests EPOLLOUT */
+  }
+  ++co->frames;
+
+  if (ws_frame != NULL && ws_frame != ws_tx_buf)
+    free(ws_frame);
+  for (int codec = FZ_DEFLATE; codec < FZ_NBR_CODECS; ++codec)
+    if (fz_frames[codec] != NULL && fz_frames[codec] != fz_tx_buf[codec - 1])
+      free(fz_frames[codec]);
+}
+
+/* Appends msg to the inbox of worker w and wakes it up if needed. */
+static void inbox_push(struct server *w, struct shared_msg *msg) {
+  struct inbox *ib = &w->inbox;
+  int was_empty;
+
+  pthread_mutex_lock(&ib->lock);
+  if (ib->count == ib->capacity) {
+    uint32_t capacity = ib->capacity == 0 ? 64 : ib->capacity * 2;
+    struct shared_msg **msgs = (struct shared_msg **)reallocarray(
+        ib->msgs, capacity, sizeof(struct shared_msg *));
+    if (msgs == NULL) {
+      pthread_mutex_unlock(&ib->lock);
+      perror("reallocarray");
+      if (atomic_fetch_sub(&msg->refs, 1) == 1)
+        free(msg);
+      return;
     }
+    ib->msgs = msgs;
+    ib->capacity = capacity;
+  }
+  ib->msgs[ib->count++] = msg;
+  was_empty = ib->count == 1;
+  pthread_mutex_unlock(&ib->lock);
+
+  if (was_empty) {
+    uint64_t one = 1;
+    if (write(ib->efd, &one, sizeof(one)) == -1)
+      perror("write (eventfd)");
   }
+}
+
+/* Hands a copy of buf to every worker other than srv. */
+static void post_to_workers(struct server *srv, enum shared_msg_type type,
+                            const char *buf, uint32_t len) {
+  if (nbr_workers == 1)
+    return;
+
+  struct shared_msg *msg =
+      (struct shared_msg *)malloc(sizeof(struct shared_msg) + len);
+  if (msg == NULL) {
+    perror("malloc");
+    return;
+  }
+  atomic_init(&msg->refs, nbr_workers - 1);
+  msg->type = type;
+  /* the sender (if any) is a client of srv, so no client of another worker
+   * is - and its fd may belong to a new client of another worker by the time
+   * that one drains its inbox */
+  msg->except_fd = -1;
+  msg->len = len;
+  memcpy(msg->data, buf, len);
+
+  for (uint32_t i = 0; i < nbr_workers; ++i) {
+    if (&workers[i] != srv)
+      inbox_push(&workers[i], msg);
+  }
+}
+
+/* Sends a message to every member of the chat room - i.e., to the clients of
+ * this worker and, through their inboxes, to those of all other workers. */
+static void room_broadcast(struct server *srv, const char *buf,
+                           uint64_t buf_len, int except_fd) {
+  broadcast_msg(srv, buf, buf_len, except_fd);
+  post_to_workers(srv, MSG_CHAT, buf, buf_len);
+  if (srv->fed != NULL) /* and the clients of the other nodes */
+    federation_forward(srv->fed, buf, buf_len);
+
   /* and print the sent message to this server's stdout */
   printf("%s", buf);
 }
 
-/* Adds provided fd to the fds list, monitors it via the epoll instance epfd,
- * and increments fds_count. */
-int add_to_fds(int epfd, int *fds, uint64_t *fds_count, int fd) {
+/* Delivers a message that originates from another node to our clients. */
+static void deliver_remote(void *arg, const char *msg, uint32_t len) {
+  struct server *srv = (struct server *)arg;
+
+  if (len == 0 || msg[len - 1] != '\0')
+    return;
+  broadcast_msg(srv, msg, len, -1);
+  printf("%s", msg);
+}
+
+/* Called once all events returned by an epoll_wait call are handled. Updates
+ * the observed load, switches between latency-first and throughput-first mode
+ * if needed, and flushes (or schedules the flush of) dirty clients. */
+static void end_of_iteration(struct server *srv) {
+  struct coalescing *co = &srv->coalescing;
+
+  /* a single flush for all messages logged during this iteration */
+  if (srv->persistence.log != NULL)
+    msglog_commit(srv->persistence.log);
+
+  /* and a single batch per link to the other nodes */
+  if (srv->fed != NULL)
+    federation_flush(srv->fed);
+
+  /* and a single write of what was captured */
+  if (srv->capture != NULL)
+    capture_flush(srv->capture);
+
+  co->load = co->load - co->load / 8 + co->frames;
+  co->frames = 0;
+
+  if (co->policy == COALESCE_ADAPTIVE) { /* with hysteresis */
+    if (!co->throughput && co->load > LOAD_HIGH * 8) {
+      co->throughput = 1;
+      fprintf(stderr, "coalescing: switched to throughput-first mode\n");
+    } else if (co->throughput && co->load < LOAD_LOW * 8) {
+      co->throughput = 0;
+      fprintf(stderr, "coalescing: switched to latency-first mode\n");
+    }
+  }
+
+  if (!co->dirty)
+    return;
+
+  if (!co->throughput) {
+    flush_dirty(srv);
+  } else if (!co->armed) { /* flushed by the deadline timer at the latest */
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = (long)co->deadline_us * 1000;
+    if (co->deadline_us >= 1000000) {
+      its.it_value.tv_sec = co->deadline_us / 1000000;
+      its.it_value.tv_nsec = (long)(co->deadline_us % 1000000) * 1000;
+    }
+    if (timerfd_settime(co->timer_fd, 0, &its, NULL) == -1) {
+      perror("timerfd_settime");
+      flush_dirty(srv);
+      return;
+    }
+    co->armed = 1;
+  }
+}
+
+/* Appends id to the provided list, re-allocating it if necessary. */
+static int id_list_push(struct id_list *l, int id) {
+  if (l->count == l->capacity) {
+    uint32_t capacity = l->capacity == 0 ? 64 : l->capacity * 2;
+    int *ids = (int *)reallocarray(l->ids, capacity, sizeof(int));
+    if (ids == NULL) {
+      perror("reallocarray");
+      return -1;
+    }
+    l->ids = ids;
+    l->capacity = capacity;
+  }
+  l->ids[l->count++] = id;
+  return 0;
+}
+
+/* Writes " ID ID ..." for as many ids as fit into buf (of size cap >= 18,
+ * leaving room for a " +N more" suffix) and returns the number of written
+ * bytes. */
+static int format_ids(char *buf, int cap, const struct id_list *l) {
+  int n = 0;
+  uint32_t i = 0;
+  for (; i < l->count; ++i) {
+    int w = snprintf(buf + n, cap - n, " %d", l->ids[i]);
+    if (n + w > cap - 18 /* strlen(" +4294967295 more") + 1 */)
+      break;
+    n += w;
+  }
+  if (i < l->count)
+    n += snprintf(buf + n, cap - n, " +%u more", l->count - i);
+  return n;
+}
+
+/* Broadcasts the join/leave events of the current tick as a single diff
+ * frame (e.g., "presence: joined 5 6 +3 more; left 4") and resets them. The
+ * frame never exceeds frame_max bytes, so each tick costs one O(N) broadcast
+ * no matter how many clients joined or left during it. */
+static void presence_flush(struct server *srv) {
+  struct presence *pr = &srv->presence;
+  char *frame;
+  int n, half;
+
+  pr->armed = 0;
+  if (pr->joined.count == 0 && pr->left.count == 0)
+    return;
+
+  if ((frame = (char *)malloc(pr->frame_max)) == NULL) {
+    perror("malloc");
+    return;
+  }
+
+  /* the last 2 bytes are reserved for "\n\0" */
+  n = snprintf(frame, pr->frame_max - 2, "presence%s:", srv->node_tag);
+  half = (pr->frame_max - 2 - n) / 2; /* each list gets at least half */
+  if (pr->joined.count != 0) {
+    int cap = pr->left.count != 0 ? half : (int)pr->frame_max - 2 - n;
+    n += snprintf(frame + n, cap, " joined");
+    n += format_ids(frame + n, cap - 7 /* " joined" */, &pr->joined);
+  }
+  if (pr->left.count != 0) {
+    int cap = pr->frame_max - 2 - n;
+    n += snprintf(frame + n, cap, "%sleft", pr->joined.count != 0 ? "; " : " ");
+    n += format_ids(frame + n, pr->frame_max - 2 - n, &pr->left);
+  }
+  frame[n++] = '\n';
+  frame[n] = '\0';
+
+  room_broadcast(srv, frame, n + 1, -1);
+  free(frame);
+
+  pr->joined.count = 0;
+  pr->left.count = 0;
+}
+
+/* Records a presence event. With batching disabled, this broadcasts msg right
+ * away. Otherwise, fd is added to the provided list of the current tick and
+ * the tick timer is armed if it is not already. */
+static void presence_event(struct server *srv, struct id_list *l, int fd,
+                           const char *msg, int except_fd) {
+  struct presence *pr = &srv->presence;
+
+  if (pr->tick_ms == 0) {
+    room_broadcast(srv, msg, strlen(msg) + 1, except_fd);
+    return;
+  }
+
+  if (id_list_push(l, fd) == -1)
+    return;
+
+  if (!pr->armed) { /* only wake up when there is something to send */
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = pr->tick_ms / 1000;
+    its.it_value.tv_nsec = (long)(pr->tick_ms % 1000) * 1000000;
+    if (timerfd_settime(pr->timer_fd, 0, &its, NULL) == -1) {
+      perror("timerfd_settime");
+      return;
+    }
+    pr->armed = 1;
+  }
+}
+
+/* Announces that fd joined the chat room (to everyone except fd itself). */
+static void presence_joined(struct server *srv, int fd) {
+  char msg_buf[256];
+  snprintf(msg_buf, sizeof(msg_buf), "user %d%s joined the chat room\n", fd,
+           srv->node_tag);
+  presence_event(srv, &srv->presence.joined, fd, msg_buf, fd);
+}
+
+/* Returns whether client c was announced as joined - WebSocket clients only
+ * join once their upgrade was answered. */
+static int has_joined(const struct client *c) {
+  return c->ws == NULL || c->ws->req == NULL;
+}
+
+/* Announces that fd left the chat room. */
+static void presence_left(struct server *srv, int fd, int error) {
+  char msg_buf[256];
+  snprintf(msg_buf, sizeof(msg_buf),
+           error ? "client %d%s disconnected due to error\n"
+                 : "user %d%s disconnected\n",
+           fd, srv->node_tag);
+  presence_event(srv, &srv->presence.left, fd, msg_buf, fd);
+}
+
+/* Returns a coarse (but cheap) monotonic timestamp in milliseconds. */
+static uint32_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Refills a token bucket for the time elapsed since its last refill. */
+static void bucket_refill(int32_t *tokens, uint32_t *stamp,
+                          const struct rate *r, uint32_t now) {
+  int64_t t = *tokens + (int64_t)(uint32_t)(now - *stamp) * r->rate;
+  int64_t max = (int64_t)r->burst * 1000;
+  *tokens = t > max ? max : t;
+  *stamp = now;
+}
+
+/* Refills the buckets of client c and of the room and returns the number of
+ * frames client c may send right now (UINT32_MAX if unlimited). */
+static uint32_t frame_budget(struct server *srv, struct client *c,
+                             uint32_t now) {
+  struct ratelimit *rl = &srv->ratelimit;
+  uint32_t budget = UINT32_MAX;
+  if (rl->conn.rate != 0) {
+    bucket_refill(&c->tokens, &c->stamp, &rl->conn, now);
+    budget = c->tokens < 1000 ? 0 : c->tokens / 1000;
+    if (budget == 0) {
+      ++rl->conn_throttles;
+      return 0;
+    }
+  }
+  if (rl->room.rate != 0) {
+    bucket_refill(&rl->room_tokens, &rl->room_stamp, &rl->room, now);
+    uint32_t room = rl->room_tokens < 1000 ? 0 : rl->room_tokens / 1000;
+    if (room == 0) {
+      ++rl->room_throttles;
+      return 0;
+    }
+    budget = room < budget ? room : budget;
+  }
+  return budget;
+}
+
+/* Returns the length of the prefix of buf that holds at most budget frames. */
+static size_t frames_prefix(const char *buf, size_t len, uint32_t budget) {
+  const char *p = buf, *end = buf + len;
+  while (budget-- != 0 && p != end) {
+    size_t nl = text_find_newline(p, end - p);
+    if (nl == (size_t)(end - p))
+      return len;
+    p += nl + 1;
+  }
+  return p - buf;
+}
+
+/* Takes the tokens of nbr_frames received frames out of the buckets of client
+ * c and of the room. A bucket may go slightly into debt because cut frames
+ * (longer than MAX_CLIENT_MSG_LENGTH) are only counted once received. */
+static void charge(struct server *srv, struct client *c, uint32_t nbr_frames) {
+  struct ratelimit *rl = &srv->ratelimit;
+  rl->frames += nbr_frames;
+  if (rl->conn.rate != 0)
+    c->tokens -= (int32_t)nbr_frames * 1000;
+  if (rl->room.rate != 0)
+    rl->room_tokens -= (int32_t)nbr_frames * 1000;
+}
+
+/* Stops reading from client idx until its (and the room's) bucket refills. */
+static void throttle(struct server *srv, uint64_t idx) {
+  struct ratelimit *rl = &srv->ratelimit;
+  struct client *c = &srv->clients[idx];
+
+  if (c->throttled || id_list_push(&rl->throttled, (int)idx) == -1)
+    return;
+  c->throttled = 1;
+  update_interest(srv, idx);
+
+  if (rl->throttled.count == 1) { /* first one - start ticking */
+    struct itimerspec its;
+    its.it_value.tv_sec = its.it_interval.tv_sec = 0;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = THROTTLE_TICK_MS * 1000000;
+    if (timerfd_settime(rl->timer_fd, 0, &its, NULL) == -1)
+      perror("timerfd_settime");
+  }
+}
+
+/* Resumes reading from throttled clients whose buckets have refilled. */
+static void throttle_tick(struct server *srv) {
+  struct ratelimit *rl = &srv->ratelimit;
+  uint32_t now = now_ms();
+
+  for (uint32_t i = 0; i < rl->throttled.count;) {
+    uint64_t idx = rl->throttled.ids[i];
+    struct client *c = &srv->clients[idx];
+    if (frame_budget(srv, c, now) == 0) {
+      ++i;
+      continue;
+    }
+    c->throttled = 0;
+    update_interest(srv, idx);
+    rl->throttled.ids[i] = rl->throttled.ids[--rl->throttled.count];
+  }
+
+  if (rl->throttled.count == 0) { /* nobody left - stop ticking */
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(rl->timer_fd, 0, &its, NULL);
+  }
+}
+
+/* Keeps the list of throttled clients in sync with del_fr_fds - the client at
+ * idx is gone and the client at moved_from (if any) now lives at idx. */
+static void throttle_fixup(struct server *srv, uint64_t idx,
+                           uint64_t moved_from) {
+  struct id_list *l = &srv->ratelimit.throttled;
+  for (uint32_t i = 0; i < l->count; ++i) {
+    if ((uint64_t)l->ids[i] == idx) {
+      l->ids[i--] = l->ids[--l->count];
+    } else if ((uint64_t)l->ids[i] == moved_from) {
+      l->ids[i] = (int)idx;
+    }
+  }
+}
+
+/* Parses "RATE[:BURST]" (or "RATE BURST") - BURST defaults to RATE. */
+static void parse_rate(struct rate *r, const char *str) {
+  char *end;
+  r->rate = strtoul(str, &end, 10);
+  r->burst = (*end == ':' || *end == ' ') ? strtoul(end + 1, NULL, 10) : 0;
+  if (r->burst == 0)
+    r->burst = r->rate;
+}
+
+/* Returns how many of the current clients are (still) served by the CPU that
+ * receives their packets. */
+static uint64_t count_affine(struct server *srv) {
+  uint64_t affine = 0;
+  for (uint64_t i = 1; i < srv->count; ++i) {
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(srv->clients[i].fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+                   &len) == 0 &&
+        cpu == srv->cpu)
+      ++affine;
+  }
+  return affine;
+}
+
+/* Handles a single command line read from stdin. With -w, every worker runs
+ * every command (each one prints its own part). */
+static void handle_command(struct server *srv, char *line) {
+  struct ratelimit *rl = &srv->ratelimit;
+  char prefix[32] = "";
+
+  if (nbr_workers > 1)
+    snprintf(prefix, sizeof(prefix), "[worker %u cpu %d] ", srv->id, srv->cpu);
+
+  if (strncmp(line, "rate conn ", 10) == 0) {
+    parse_rate(&rl->conn, line + 10);
+    printf("%sper-connection rate limit: %u frames/s (burst %u)\n", prefix,
+           rl->conn.rate, rl->conn.burst);
+  } else if (strncmp(line, "rate room ", 10) == 0) {
+    parse_rate(&rl->room, line + 10);
+    rl->room_tokens = rl->room.burst * 1000;
+    rl->room_stamp = now_ms();
+    printf("%sroom rate limit: %u frames/s (burst %u)\n", prefix,
+           rl->room.rate, rl->room.burst);
+  } else if (strcmp(line, "stats") == 0) {
+    printf("%sclients:         %lu\n"
+           "%sframes received: %lu\n"
+           "%sconn throttles:  %lu\n"
+           "%sroom throttles:  %lu\n"
+           "%sthrottled now:   %u\n",
+           prefix, srv->count - 1, prefix, rl->frames, prefix,
+           rl->conn_throttles, prefix, rl->room_throttles, prefix,
+           rl->throttled.count);
+    printf("%ssanitized:       %lu (%s)\n", prefix, srv->sanitized,
+           text_impl());
+    printf("%sdropped:         %lu frames (too slow clients)\n", prefix,
+           srv->dropped);
+    if (srv->ws_list_fd != -1)
+      printf("%swebsocket:       %lu frames encoded, %lu sent (unmask %s)\n",
+             prefix, srv->ws_encodes, srv->ws_sends, ws_unmask_impl());
+    if (srv->cpu != -1) /* RX CPU affinity (SO_INCOMING_CPU) */
+      printf("%saffine accepts:  %lu of %lu\n"
+             "%saffine now:      %lu of %lu\n",
+             prefix, srv->affine, srv->accepts, prefix, count_affine(srv),
+             srv->count - 1);
+    if (srv->fed != NULL)
+      federation_print_stats(srv->fed, prefix);
+    if (srv->persistence.log != NULL) {
+      msglog_print_stats(srv->persistence.log, prefix);
+      printf("%sheld messages:   %u\n", prefix, srv->persistence.count);
+    }
+    if (srv->capture != NULL)
+      capture_print_stats(srv->capture, prefix);
+    if (srv->fz != NULL) {
+      printf("%scompression:     %lu deflate and %lu deflate-dict frames "
+             "sent\n",
+             prefix, srv->fz_sends[FZ_DEFLATE], srv->fz_sends[FZ_DEFLATE_DICT]);
+      fz_print_stats(srv->fz, prefix);
+    }
+  } else if (strncmp(line, "log ", 4) == 0 && srv->persistence.log != NULL) {
+    char msg[MAX_CLIENT_MSG_LENGTH + 64];
+    uint64_t offset = strtoull(line + 4, NULL, 10);
+    int64_t len = msglog_read(srv->persistence.log, offset, msg, sizeof(msg));
+    if (len == -1)
+      printf("%soffset %lu is not in the log\n", prefix, offset);
+    else
+      printf("%s%lu: %.*s", prefix, offset,
+             (int)(len < (int64_t)sizeof(msg) ? len : (int64_t)sizeof(msg)),
+             msg);
+  } else if (line[0] != '\0') {
+    printf("%sunknown command: %s\n", prefix, line);
+  }
+  fflush(stdout);
+}
+
+/* Reads (possibly partial) command lines from stdin. */
+static void handle_stdin(struct server *srv) {
+  static char line[256];
+  static size_t len = 0;
+  char buf[256];
+  ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+
+  if (n <= 0) { /* EOF (e.g., stdin is /dev/null) - stop monitoring it */
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    return;
+  }
+
+  for (ssize_t i = 0; i < n; ++i) {
+    if (buf[i] == '\n' || len == sizeof(line) - 1) {
+      line[len] = '\0';
+      handle_command(srv, line);
+      post_to_workers(srv, MSG_COMMAND, line, len + 1);
+      len = 0;
+    } else if (buf[i] != '\r') {
+      line[len++] = buf[i];
+    }
+  }
+}
+
+/* Pins the calling thread to the provided CPU. */
+static int pin_to_cpu(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0 /* calling thread */, sizeof(set), &set) == -1) {
+    perror("sched_setaffinity");
+    return -1;
+  }
+  return 0;
+}
+
+/* Lets the kernel busy-poll the device queue of fd when it has no data (for
+ * up to usec microseconds) instead of waiting for an interrupt. */
+static void enable_busy_poll(int fd, uint32_t usec) {
+  static int warned = 0;
+  int val = (int)usec, y = 1, budget = BUSY_POLL_BUDGET;
+  if ((setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) == -1 ||
+       setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &y, sizeof(y)) == -1 ||
+       setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget,
+                  sizeof(budget)) == -1) &&
+      !warned) {
+    perror("setsockopt (busy poll)");
+    warned = 1;
+  }
+}
+
+/* Waits for events - in busy-poll mode, spins on a non-blocking epoll_wait
+ * for up to busy_poll_us microseconds before falling back to sleeping. */
+static int wait_for_events(struct server *srv, struct epoll_event *events) {
+  if (srv->busy_poll_us != 0) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+      int n = epoll_wait(srv->epfd, events, MAX_EVENTS, 0);
+      if (n != 0)
+        return n;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if ((now.tv_sec - start.tv_sec) * 1000000 +
+              (now.tv_nsec - start.tv_nsec) / 1000 >=
+          srv->busy_poll_us)
+        break;
+    }
+  }
+  return epoll_wait(srv->epfd, events, MAX_EVENTS, -1 /* infinite timeout */);
+}
+
+/* Handles the messages other workers have sent to srv. */
+static void inbox_drain(struct server *srv) {
+  struct inbox *ib = &srv->inbox;
+  struct shared_msg **msgs;
+  uint64_t val;
+  uint32_t count;
+
+  if (read(ib->efd, &val, sizeof(val)) == -1)
+    return;
+
+  /* swap the arrays so that the lock is not held while delivering */
+  pthread_mutex_lock(&ib->lock);
+  msgs = ib->msgs;
+  count = ib->count;
+  ib->msgs = ib->spare;
+  ib->spare = msgs;
+  ib->count = 0;
+  uint32_t capacity = ib->capacity;
+  ib->capacity = ib->spare_capacity;
+  ib->spare_capacity = capacity;
+  pthread_mutex_unlock(&ib->lock);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    struct shared_msg *msg = msgs[i];
+    if (msg->type == MSG_CHAT)
+      broadcast_msg(srv, msg->data, msg->len, msg->except_fd);
+    else
+      handle_command(srv, msg->data);
+    if (atomic_fetch_sub(&msg->refs, 1) == 1) /* last reference */
+      free(msg);
+  }
+}
+
+/* Adds provided fd to the clients list, monitors it via the epoll instance,
+ * and increments the clients count. Re-allocates the clients list if
+ * necessary. Outside of diet mode, the client's buffers are allocated
+ * upfront. */
+int add_to_fds(struct server *srv, int fd) {
   struct epoll_event ev;
-  int idx = *fds_count;
+  uint64_t idx = srv->count;
+
+  if (srv->count == srv->capacity) { /* no more space left - reallocation */
+    struct client *clients = (struct client *)reallocarray(
+        srv->clients, srv->capacity * 2, sizeof(struct client));
+    if (clients == NULL) {
+      perror("reallocarray");
+      return -1;
+    }
+    srv->clients = clients;
+    srv->capacity *= 2; /* double the capacity */
+  }
 
-  fds[idx] = fd;
+  struct client *c = &srv->clients[idx];
+  memset(c, 0, sizeof(*c));
+  c->fd = fd;
+  c->tokens = srv->ratelimit.conn.burst * 1000; /* start with a full bucket */
+  c->stamp = now_ms();
+  if (!srv->diet && fd != srv->list_fd) {
+    c->rbuf = (char *)malloc(MAX_CLIENT_MSG_LENGTH);
+    c->wbuf = wbuf_new(WBUF_INIT_CAP);
+    if (c->rbuf == NULL || c->wbuf == NULL) {
+      free(c->rbuf);
+      free(c->wbuf);
+      return -1;
+    }
+  }
 
   ev.events = EPOLLIN; /* data is available for reading */
   ev.data.u64 = idx;   /* set custom user field to the index so that we can
-                          retrieve the fd later on */
-  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                          retrieve the client later on */
+  if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
     perror("epoll_ctl");
+    free(c->rbuf);
+    free(c->wbuf);
     return -1;
   }
 
-  ++(*fds_count);
+  ++srv->count;
   return 0;
 }
 
-/* Deletes provided fd from the fds list, closes it, un-monitors it from the
- * the epoll instance epfd, and decrements fds_count. */
-int del_fr_fds(int epfd, int *fds, uint64_t *fds_count, uint64_t idx) {
-  struct epoll_event ev;
-  int fd = fds[idx];
+/* Broadcasts the held messages with an offset below durable. */
+static void release_durable(struct server *srv, uint64_t durable) {
+  struct persistence *ps = &srv->persistence;
+
+  while (ps->count != 0 && ps->held[ps->head].offset < durable) {
+    struct shared_msg *msg = ps->held[ps->head].msg;
+    room_broadcast(srv, msg->data, msg->len, msg->except_fd);
+    free(msg);
+    ps->head = (ps->head + 1) % ps->capacity;
+    --ps->count;
+  }
+}
+
+/* Broadcasts the held messages that have become durable. */
+static void release_held(struct server *srv) {
+  struct persistence *ps = &srv->persistence;
+  uint64_t val;
+
+  if (read(msglog_event_fd(ps->log), &val, sizeof(val)) == -1)
+    return;
+  release_durable(srv, msglog_durable(ps->log));
+}
+
+/* Holds a copy of a message until its offset is durable. Returns -1 if it
+ * could not be held. */
+static int hold(struct server *srv, uint64_t offset, const char *buf,
+                uint32_t len, int except_fd) {
+  struct persistence *ps = &srv->persistence;
+
+  if (ps->count == ps->capacity) { /* grow and unwrap the ring */
+    uint32_t capacity = ps->capacity == 0 ? 256 : ps->capacity * 2;
+    struct held_msg *held =
+        (struct held_msg *)malloc(capacity * sizeof(struct held_msg));
+    if (held == NULL) {
+      perror("malloc");
+      return -1;
+    }
+    for (uint32_t i = 0; i < ps->count; ++i)
+      held[i] = ps->held[(ps->head + i) % ps->capacity];
+    free(ps->held);
+    ps->held = held;
+    ps->head = 0;
+    ps->capacity = capacity;
+  }
+
+  struct shared_msg *msg =
+      (struct shared_msg *)malloc(sizeof(struct shared_msg) + len);
+  if (msg == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  msg->type = MSG_CHAT;
+  msg->except_fd = except_fd;
+  msg->len = len;
+  memcpy(msg->data, buf, len);
+  ps->held[(ps->head + ps->count++) % ps->capacity] =
+      (struct held_msg){offset, msg};
+  return 0;
+}
+
+/* Logs a chat message (with -L) and broadcasts it - right away or, in
+ * durable mode, once it is on disk. */
+static void publish(struct server *srv, const char *buf, uint32_t len,
+                    int sender_fd) {
+  struct persistence *ps = &srv->persistence;
+
+  if (ps->log != NULL) {
+    int64_t offset = msglog_append(ps->log, buf, len - 1); /* minus the NUL */
+    if (offset == -1)
+      perror("msglog_append");
+    else if (ps->durable && hold(srv, offset, buf, len, sender_fd) == 0)
+      return;
+  }
+  room_broadcast(srv, buf, len, sender_fd);
+}
+
+/* Deletes the client at idx from the clients list, closes it, un-monitors it
+ * from the epoll instance, releases its buffers, and decrements the clients
+ * count. */
+int del_fr_fds(struct server *srv, uint64_t idx) {
+  struct client *c = &srv->clients[idx];
+  struct persistence *ps = &srv->persistence;
+
+  /* the fd may be reused by a new client before the held messages of this
+   * one are released - which must not skip the new client */
+  for (uint32_t i = 0; i < ps->count; ++i) {
+    struct shared_msg *msg = ps->held[(ps->head + i) % ps->capacity].msg;
+    if (msg->except_fd == c->fd)
+      msg->except_fd = -1;
+  }
+
+  /* before the fd can be reused by a new connection */
+  if (srv->capture != NULL)
+    capture_disconnect(srv->capture, c->fd);
 
   /* not necessarily needed (read questions in man epoll) - stop monitoring */
-  if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+  if (epoll_ctl(srv->epfd, EPOLL_CTL_DEL, c->fd, NULL) == -1) {
     perror("epoll_ctl");
     return -1;
   }
 
   /* close the socket */
-  if (close(fd) == -1) {
+  if (close(c->fd) == -1) {
     perror("close");
     return -1;
   }
 
-  --(*fds_count);
+  free(c->rbuf);
+  free(c->wbuf);
+  if (c->ws != NULL) {
+    free(c->ws->req);
+    free(c->ws);
+  }
+
+  --srv->count;
+
+  if (c->throttled || srv->clients[srv->count].throttled)
+    throttle_fixup(srv, idx, srv->count);
 
   /* if this is possitioned at the end of the array => do nothing */
-  if (idx == *fds_count) {
+  if (idx == srv->count) {
     return 0;
   }
 
-  fds[idx] = fds[*fds_count]; /* assign prev last element to this elm index */
+  /* assign prev last element to this elm index */
+  srv->clients[idx] = srv->clients[srv->count];
 
   /* call epoll_ctl to update the custom user data - i.e., the new index */
-  ev.events = EPOLLIN;
-  ev.data.u64 = idx;
-  if (epoll_ctl(epfd, EPOLL_CTL_MOD, fds[idx], &ev) == -1) {
-    perror("epoll_ctl");
-    return -1;
-  }
-
-  return 0;
+  return update_interest(srv, idx);
 }
 
-/* Handles a new connection by calling accept, performing error checks, and
- * adding the new connected socket (client) to fds. */
-void handle_new_connection(int epfd, int *fds, uint64_t *fds_count,
-                           int list_sockfd) {
+/* Handles a new connection by calling accept on list_fd (the listening socket
+ * or the WebSocket one), performing error checks, and adding the new
+ * connected socket (client) to the clients list. */
+void handle_new_connection(struct server *srv, int list_fd) {
   struct sockaddr_storage remoteaddr;
   socklen_t addrlen;
   int newfd;
-  char remoteIP[INET6_ADDRSTRLEN];
 
   addrlen = sizeof remoteaddr;
-  newfd = accept(list_sockfd, (struct sockaddr *)&remoteaddr, &addrlen);
+  newfd = accept4(list_fd, (struct sockaddr *)&remoteaddr, &addrlen,
+                  SOCK_NONBLOCK);
   if (newfd == -1) {
-    perror("accept");
-  } else {
-    add_to_fds(epfd, fds, fds_count, newfd);
-    /* broadcast to all clients (except the new client itself) that a new user
-     * has joined the chat room */
-    char msg_buf[256];
-    snprintf(msg_buf, sizeof(msg_buf), "user %d joined the chat room\n", newfd);
-    broadcast_msg(fds, *fds_count, msg_buf, strlen(msg_buf) + 1, list_sockfd,
-                  newfd);
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      perror("accept");
+    return;
+  }
+
+  /* frames are coalesced in userspace already - Nagle would only add delay */
+  if (srv->coalescing.policy != COALESCE_OFF) {
+    int y = 1;
+    setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, &y, sizeof(y));
+  }
+
+  if (srv->busy_poll_us != 0)
+    enable_busy_poll(newfd, srv->busy_poll_us);
+
+  /* verify the steering - was the connection's SYN received by our CPU? */
+  if (srv->cpu != -1) {
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    ++srv->accepts;
+    if (getsockopt(newfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+        cpu == srv->cpu)
+      ++srv->affine;
+  }
+
+  if (add_to_fds(srv, newfd) == -1) {
+    close(newfd);
+    return;
+  }
+
+  /* nothing but the upgrade request is expected until it is answered */
+  if (list_fd == srv->ws_list_fd) {
+    struct ws_conn *ws = (struct ws_conn *)calloc(1, sizeof(struct ws_conn));
+    if (ws == NULL || (ws->req = (char *)malloc(WS_REQUEST_MAX)) == NULL) {
+      perror("malloc");
+      free(ws);
+      del_fr_fds(srv, srv->count - 1);
+      return;
+    }
+    srv->clients[srv->count - 1].ws = ws;
+    return; /* joins once upgraded (see handle_ws_data) */
+  }
+
+  srv->clients[srv->count - 1].fresh = 1; /* may offer compression */
+  if (srv->capture != NULL) /* WebSocket clients are not captured */
+    capture_connect(srv->capture, newfd);
+
+  /* tell all clients (except the new client itself) that a new user has
+   * joined the chat room */
+  presence_joined(srv, newfd);
+}
+
+/* Connects to the predecessor listening on the hot restart socket (if any)
+ * and asks it for its listening socket. Returns the listening socket or -1 if
+ * there is no predecessor (or the handoff failed). */
+static int take_over_listener(struct server *srv) {
+  struct hot_restart *hr = &srv->restart;
+  struct sockaddr_un addr;
+  struct handoff_request req = {HANDOFF_MAGIC, (uint32_t)hr->want_clients};
+  struct handoff_hello hello;
+  int list_fd;
+
+  clock_gettime(CLOCK_MONOTONIC, &hr->start);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", hr->path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(fd); /* nobody to take over from - a cold start */
+    return -1;
+  }
+
+  if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req) ||
+      recv_fd(fd, &hello, sizeof(hello), &list_fd) == -1 ||
+      hello.magic != HANDOFF_MAGIC || list_fd == -1) {
+    fprintf(stderr, "hot restart: handoff failed - starting cold\n");
+    close(fd);
+    return -1;
+  }
+
+  hr->peer = fd;
+  hr->nbr_clients = hello.nbr_clients;
+  return list_fd;
+}
+
+/* Adds the clients handed off by the predecessor (see take_over_listener) and
+ * tells it that we are done. */
+static void adopt_clients(struct server *srv) {
+  struct hot_restart *hr = &srv->restart;
+  uint32_t adopted = 0;
+
+  for (uint32_t i = 0; i < hr->nbr_clients; ++i) {
+    struct handoff_client hc;
+    int fd;
+
+    if (recv_fd(hr->peer, &hc, sizeof(hc), &fd) == -1 || fd == -1 ||
+        hc.rlen > MAX_CLIENT_MSG_LENGTH || hc.wlen > WBUF_MAX_CAP ||
+        hc.codec >= FZ_NBR_CODECS) {
+      fprintf(stderr, "hot restart: lost the predecessor\n");
+      break;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+        add_to_fds(srv, fd) == -1) {
+      close(fd);
+      exit(EXIT_FAILURE); /* the stream of client data is out of sync */
+    }
+
+    uint64_t idx = srv->count - 1;
+    struct client *c = &srv->clients[idx];
+    c->fresh = hc.fresh;
+    c->codec = hc.codec;
+    if (hc.rlen != 0) { /* partial frame */
+      if (c->rbuf == NULL &&
+          (c->rbuf = (char *)malloc(MAX_CLIENT_MSG_LENGTH)) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+      }
+      if (recv(hr->peer, c->rbuf, hc.rlen, MSG_WAITALL) != hc.rlen)
+        break;
+      c->rlen = hc.rlen;
+    }
+    if (hc.wlen != 0) { /* pending output */
+      free(c->wbuf);
+      if ((c->wbuf = wbuf_new(hc.wlen > WBUF_INIT_CAP ? hc.wlen
+                                                      : WBUF_INIT_CAP)) ==
+          NULL)
+        exit(EXIT_FAILURE);
+      if (recv(hr->peer, c->wbuf->data, hc.wlen, MSG_WAITALL) != hc.wlen)
+        break;
+      c->wbuf->len = hc.wlen;
+      flush_client(srv, idx, 0);
+    }
+
+    if (c->codec != FZ_NONE && srv->fz == NULL) { /* we cannot speak it */
+      fprintf(stderr, "hot restart: client %d uses %s compression - dropping "
+                      "it (restart with -z)\n",
+              fd, fz_codec_name((enum fz_codec)c->codec));
+      del_fr_fds(srv, idx);
+      continue;
+    }
+
+    /* push out whatever the predecessor may have corked */
+    int y = 1;
+    if (srv->coalescing.policy != COALESCE_OFF)
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &y, sizeof(y));
+    ++adopted;
   }
+
+  char ack = 1;
+  if (send(hr->peer, &ack, 1, MSG_NOSIGNAL) == -1)
+    perror("send");
+  close(hr->peer);
+  hr->peer = -1;
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("hot restart: took over the listening socket and %u clients in "
+         "%.2f ms\n",
+         adopted,
+         (end.tv_sec - hr->start.tv_sec) * 1e3 +
+             (end.tv_nsec - hr->start.tv_nsec) / 1e6);
 }
 
-/* Handles the client data which amounts to either receiving a message and
- * broadcasting it to other clients or hang up in which case the client's socket
- * fd is closed, removed from the fds list and fd_count is decremented.
+/* Creates the hot restart socket our successor will connect to. 0 on success
+ * and -1 on error. */
+static int listen_for_successor(struct server *srv) {
+  struct hot_restart *hr = &srv->restart;
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", hr->path);
+  unlink(hr->path); /* the predecessor's (or a stale) socket */
+
+  hr->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (hr->fd == -1) {
+    perror("socket");
+    return -1;
+  }
+  if (bind(hr->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(hr->fd, 1) == -1) {
+    perror("bind/listen (hot restart socket)");
+    return -1;
+  }
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = HANDOFF_IDX};
+  if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, hr->fd, &ev) == -1) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+/* Sends whatever output is pending for a client that is about to be closed -
+ * blocking, but for no longer than a second. */
+static void drain_client(struct client *c) {
+  struct wbuf *wb = c->wbuf;
+  struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
+
+  if (wb == NULL || wb->off == wb->len)
+    return;
+  int flags = fcntl(c->fd, F_GETFL);
+  if (flags != -1)
+    fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK);
+  setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  while (wb->off < wb->len) {
+    ssize_t n = send(c->fd, wb->data + wb->off, wb->len - wb->off,
+                     MSG_NOSIGNAL);
+    if (n <= 0)
+      break;
+    wb->off += n;
+  }
+}
+
+/* Hands the listening socket (and, if asked to, every client) over to the
+ * successor that connected to the hot restart socket - then exits. */
+static void hand_off(struct server *srv) {
+  struct persistence *ps = &srv->persistence;
+  struct handoff_request req;
+
+  int fd = accept4(srv->restart.fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd == -1) {
+    perror("accept4");
+    return;
+  }
+  if (recv(fd, &req, sizeof(req), MSG_WAITALL) != sizeof(req) ||
+      req.magic != HANDOFF_MAGIC) {
+    fprintf(stderr, "hot restart: bad request\n");
+    close(fd);
+    return;
+  }
+
+  /* stop accepting - from now on, new connections queue up in the listening
+   * socket's backlog until the successor accepts them */
+  if (epoll_ctl(srv->epfd, EPOLL_CTL_DEL, srv->list_fd, NULL) == -1)
+    perror("epoll_ctl");
+
+  /* the successor appends to the same log - close it before the successor
+   * opens it (which makes everything durable, i.e., releases what is held) */
+  if (ps->log != NULL) {
+    uint64_t end = msglog_next_offset(ps->log);
+    msglog_close(ps->log);
+    ps->log = NULL;
+    release_durable(srv, end);
+  }
+  presence_flush(srv); /* pending joins and leaves */
+
+  struct handoff_hello hello = {HANDOFF_MAGIC,
+                                req.want_clients ? srv->count - 1 : 0};
+  if (send_fd(fd, &hello, sizeof(hello), srv->list_fd) == -1) {
+    perror("hot restart");
+    exit(EXIT_FAILURE);
+  }
+
+  for (uint64_t idx = 1; idx < srv->count; ++idx) {
+    struct client *c = &srv->clients[idx];
+    struct wbuf *wb = c->wbuf;
+
+    if (!req.want_clients) {
+      drain_client(c);
+      continue;
+    }
+
+    struct handoff_client hc = {c->rlen, wb != NULL ? wb->len - wb->off : 0,
+                                c->fresh, c->codec};
+    if (send_fd(fd, &hc, sizeof(hc), c->fd) == -1 ||
+        (hc.rlen != 0 && send(fd, c->rbuf, hc.rlen, MSG_NOSIGNAL) == -1) ||
+        (hc.wlen != 0 &&
+         send(fd, wb->data + wb->off, hc.wlen, MSG_NOSIGNAL) == -1)) {
+      perror("hot restart");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* wait until the successor serves everything - our copies of the client
+   * sockets are closed on exit (which the clients do not notice if they were
+   * handed off) */
+  char ack;
+  if (recv(fd, &ack, 1, 0) != 1)
+    fprintf(stderr, "hot restart: the successor did not acknowledge\n");
+  printf("hot restart: handed off to the successor (%s %lu clients)\n",
+         req.want_clients ? "with" : "after draining", srv->count - 1);
+  fflush(stdout);
+  if (srv->capture != NULL)
+    capture_close(srv->capture);
+  exit(EXIT_SUCCESS);
+}
+
+/* Broadcasts a single frame (not null-terminated) received from sender_fd.
+ * The frame is sanitized on the way (see text_sanitize) so that clients never
+ * get control characters (e.g., terminal escape sequences) or invalid UTF-8
+ * from other users - only frames that actually contain such bytes are
+ * touched, the others are just scanned. */
+static void broadcast_frame(struct server *srv, int sender_fd,
+                            const char *frame, uint64_t frame_len) {
+  char msg_buf[32 + MAX_CLIENT_MSG_LENGTH + 2]; /* "user %d: " max length is
+                                                   assumed to be <= 32 */
+  int n = snprintf(msg_buf, sizeof(msg_buf), "user %d%s: ", sender_fd,
+                   srv->node_tag);
+
+  /* the line terminator (\n or telnet's \r\n) is not part of the text */
+  if (frame_len != 0 && frame[frame_len - 1] == '\n')
+    --frame_len;
+  if (frame_len != 0 && frame[frame_len - 1] == '\r')
+    --frame_len;
+
+  char *text = msg_buf + n;
+  memcpy(text, frame, frame_len);
+  if (text_sanitize(text, frame_len) != 0)
+    ++srv->sanitized;
+  n += frame_len;
+  msg_buf[n++] = '\n';
+  msg_buf[n] = '\0';
+  publish(srv, msg_buf, n + 1, sender_fd);
+}
+
+/* Sends buf (of len bytes) to client idx - or queues it if the socket buffer
+ * is full. */
+static void send_to_client(struct server *srv, uint64_t idx, const char *buf,
+                           uint64_t len) {
+  if (queue_output(srv, idx, buf, len) == 0)
+    flush_client(srv, idx, 0);
+}
+
+/* Handles the bytes [p, end) received from WebSocket client idx: the upgrade
+ * request first and then frames. Every complete text or binary message is
+ * broadcast like a line, pings are answered and a close frame is echoed before
+ * the connection is closed. Returns the number of broadcast messages or -1 if
+ * the client was dropped. */
+static int handle_ws_data(struct server *srv, uint64_t idx, char *p,
+                          char *end) {
+  struct client *c = &srv->clients[idx];
+  struct ws_conn *ws = c->ws;
+  int sender_fd = c->fd, nbr_frames = 0;
+
+  if (ws->req != NULL) { /* the upgrade request may span several reads */
+    size_t n = end - p, resp_len = 0;
+    char resp[256];
+    if (n > (size_t)(WS_REQUEST_MAX - ws->req_len))
+      n = WS_REQUEST_MAX - ws->req_len;
+    memcpy(ws->req + ws->req_len, p, n);
+    size_t req_len = ws_request_length(ws->req, ws->req_len + n);
+    if (req_len == 0 && ws->req_len + n < WS_REQUEST_MAX) {
+      ws->req_len += n;
+      return 0;
+    }
+    if (req_len != 0) {
+      int r = ws_handshake(ws->req, req_len, resp, sizeof(resp));
+      resp_len = r == -1 ? 0 : r;
+    }
+    if (resp_len == 0) {
+      send(sender_fd, WS_BAD_REQUEST, sizeof(WS_BAD_REQUEST) - 1, MSG_NOSIGNAL);
+      del_fr_fds(srv, idx); /* it never joined */
+      return -1;
+    }
+    send_to_client(srv, idx, resp, resp_len);
+    p += req_len - ws->req_len; /* frames may follow right away */
+    free(ws->req);
+    ws->req = NULL;
+    presence_joined(srv, sender_fd);
+  }
+
+  while (p != end) {
+    struct ws_chunk ch;
+    int64_t n = ws_parse(&ws->parser, p, end - p, &ch);
+    if (n == -1) {
+      fprintf(stderr, "client %d violated the WebSocket protocol\n", sender_fd);
+      del_fr_fds(srv, idx);
+      presence_left(srv, sender_fd, 1);
+      return -1;
+    }
+    p += n;
+
+    if (ch.opcode >= WS_OP_CLOSE) { /* control frames are small - gather */
+      memcpy(ws->ctrl + ws->ctrl_len, ch.data, ch.len);
+      ws->ctrl_len += ch.len;
+      if (!ch.last)
+        continue;
+
+      char frame[WS_HEADER_MAX + WS_CONTROL_MAX];
+      uint8_t len = ws->ctrl_len;
+      ws->ctrl_len = 0;
+      if (ch.opcode == WS_OP_PING) {
+        send_to_client(srv, idx, frame,
+                       ws_encode(frame, WS_OP_PONG, ws->ctrl, len));
+      } else if (ch.opcode == WS_OP_CLOSE) { /* echo the status code */
+        send_to_client(srv, idx, frame,
+                       ws_encode(frame, WS_OP_CLOSE, ws->ctrl,
+                                 len < 2 ? len : 2));
+        drain_client(c);
+        del_fr_fds(srv, idx);
+        presence_left(srv, sender_fd, 0);
+        return -1;
+      }
+      continue;
+    }
+
+    /* an unfragmented message received at once - zero-copy fast path */
+    if (ch.first && ch.last && ch.fin && ch.opcode != WS_OP_CONT &&
+        c->rlen == 0) {
+      broadcast_frame(srv, sender_fd, ch.data,
+                      ch.len < MAX_CLIENT_MSG_LENGTH ? ch.len
+                                                     : MAX_CLIENT_MSG_LENGTH);
+      ++nbr_frames;
+      continue;
+    }
+
+    /* part of a message - assemble it in rbuf (cut beyond its capacity) */
+    if (c->rbuf == NULL &&
+        (c->rbuf = (char *)malloc(MAX_CLIENT_MSG_LENGTH)) == NULL) {
+      perror("malloc");
+      return nbr_frames;
+    }
+    size_t room = MAX_CLIENT_MSG_LENGTH - c->rlen;
+    size_t len = ch.len < room ? ch.len : room;
+    memcpy(c->rbuf + c->rlen, ch.data, len);
+    c->rlen += len;
+    if (ch.last && ch.fin) {
+      broadcast_frame(srv, sender_fd, c->rbuf, c->rlen);
+      ++nbr_frames;
+      c->rlen = 0;
+    }
+  }
+  return nbr_frames;
+}
+
+/* Handles the first line of raw TCP client idx, which may be an offer of
+ * compression codecs (see framezip.h). An offer is answered - uncompressed,
+ * but after whatever is queued for the client already - and not broadcast.
+ * Returns 1 if line was an offer. */
+static int negotiate(struct server *srv, uint64_t idx, const char *line,
+                     uint64_t len) {
+  struct client *c = &srv->clients[idx];
+  char answer[64];
+
+  c->fresh = 0;
+  int codec = fz_negotiate(srv->fz, line, len);
+  if (codec == -1)
+    return 0;
+  send_to_client(srv, idx, answer,
+                 fz_format_answer(srv->fz, (enum fz_codec)codec, answer,
+                                  sizeof(answer)));
+  c->codec = codec;
+  return 1;
+}
+
+/* Handles the client data which amounts to either receiving data and
+ * broadcasting every complete line (i.e., frame) in it to other clients or
+ * hang up in which case the client's socket fd is closed and removed from the
+ * clients list.
+ *
+ * Data is received into the shared rx_buf. Complete frames are broadcast
+ * straight from there, and only a trailing partial frame is copied into the
+ * client's rbuf (allocated on demand in diet mode).
  */
-void handle_client_data(int epfd, int *fds, uint64_t *fds_count,
-                        int list_sockfd, uint64_t idx) {
-  char buf[MAX_CLIENT_MSG_LENGTH];
-  int sender_fd = fds[idx];
-  int nbytes = recv(sender_fd, buf, sizeof(buf), 0);
+void handle_client_data(struct server *srv, uint64_t idx) {
+  struct client *c = &srv->clients[idx];
+  int sender_fd = c->fd;
+  uint32_t nbr_frames = 0;
+  size_t want = sizeof(rx_buf);
+
+  /* out of tokens - leave the data in the socket's receive buffer */
+  uint32_t budget = frame_budget(srv, c, now_ms());
+  if (budget == 0) {
+    throttle(srv, idx);
+    return;
+  }
 
-  if (nbytes <= 0) {   /* error or connection closed */
+  /* rate limited - only consume as many frames as there are tokens for (lines
+   * only - WebSocket clients are charged afterwards and may go into debt) */
+  if (budget != UINT32_MAX && c->ws == NULL) {
+    ssize_t n = recv(sender_fd, rx_buf, sizeof(rx_buf), MSG_PEEK);
+    if (n > 0)
+      want = frames_prefix(rx_buf, n, budget);
+  }
+
+  ssize_t nbytes = recv(sender_fd, rx_buf, want, 0);
+
+  if (nbytes <= 0) { /* error or connection closed */
+    if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return; /* spurious wakeup */
     if (nbytes != 0) { /* error */
       perror("recv");
     }
 
-    del_fr_fds(epfd, fds, fds_count, idx);
+    int joined = has_joined(c);
+    del_fr_fds(srv, idx);
 
-    /* broadcast to all clients that this user disconnected */
-    char msg_buf[256];
-    snprintf(msg_buf, sizeof(msg_buf), "user %d disconnected\n", sender_fd);
-    broadcast_msg(fds, *fds_count, msg_buf, strlen(msg_buf) + 1, list_sockfd,
-                  -1);
+    /* tell all clients that this user disconnected */
+    if (joined)
+      presence_left(srv, sender_fd, 0);
     return;
   }
 
-  /* since this is a messaging up - expected data is a set of messages (i.e.,
-   * null terminated char buffers - thus you have to absolutely sure to set
-   * the null termination character! */
-  buf[nbytes] = '\0';
+  if (srv->capture != NULL)
+    capture_data(srv->capture, sender_fd, rx_buf, nbytes);
+
+  const char *p = rx_buf, *end = rx_buf + nbytes;
+  if (c->ws != NULL) { /* WebSocket frames rather than lines */
+    int n = handle_ws_data(srv, idx, rx_buf, rx_buf + nbytes);
+    if (n == -1)
+      return;
+    nbr_frames = n;
+    p = end;
+  }
+  while (p != end) {
+    uint64_t nl = text_find_newline(p, end - p);
+    int complete = nl != (uint64_t)(end - p);
+    uint64_t len = complete ? nl + 1 : nl;
+    uint64_t room = MAX_CLIENT_MSG_LENGTH - c->rlen;
+
+    if (c->rlen == 0 && complete && len <= room) { /* zero-copy fast path */
+      if (!c->fresh || !negotiate(srv, idx, p, len)) {
+        broadcast_frame(srv, sender_fd, p, len);
+        ++nbr_frames;
+      }
+      p += len;
+      continue;
+    }
+
+    /* partial frame - stash it in this client's own rbuf */
+    if (c->rbuf == NULL &&
+        (c->rbuf = (char *)malloc(MAX_CLIENT_MSG_LENGTH)) == NULL) {
+      perror("malloc");
+      return;
+    }
+    if (len > room)
+      len = room;
+    memcpy(c->rbuf + c->rlen, p, len);
+    c->rlen += len;
+    p += len;
+
+    if (c->rbuf[c->rlen - 1] == '\n' || c->rlen == MAX_CLIENT_MSG_LENGTH) {
+      if (!c->fresh || !negotiate(srv, idx, c->rbuf, c->rlen)) {
+        broadcast_frame(srv, sender_fd, c->rbuf, c->rlen);
+        ++nbr_frames;
+      }
+      c->rlen = 0;
+    }
+  }
+
+  charge(srv, c, nbr_frames);
 
-  /* broadcast what this user sent to all other clients */
-  char msg_buf[32 + MAX_CLIENT_MSG_LENGTH]; /* "user %d: " max length is
-                                               assmumed to be <= 32 */
-  snprintf(msg_buf, sizeof(msg_buf), "user %d: %s", sender_fd, buf);
-  broadcast_msg(fds, *fds_count, msg_buf, strlen(msg_buf) + 1, list_sockfd,
-                sender_fd);
+  if (srv->diet && c->rlen == 0) { /* nothing pending - give rbuf back */
+    free(c->rbuf);
+    c->rbuf = NULL;
+  }
 }
 
-int main(int argc, char *argv[]) {
-  /* usual arguments checking (of course you should not do this in production
-   * code and you should use something like getopt) */
-  if (argc != 2) {
-    printf("Usage: %s PORT\n", argv[0]);
-    exit(EXIT_FAILURE);
+/* Creates a timer fd monitored by the epoll instance of srv with the provided
+ * user data. Returns the timer fd or -1 on error. */
+static int add_timer(struct server *srv, uint64_t idx) {
+  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (tfd == -1) {
+    perror("timerfd_create");
+    return -1;
+  }
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = idx};
+  if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, tfd, &ev) == -1) {
+    perror("epoll_ctl");
+    close(tfd);
+    return -1;
   }
+  return tfd;
+}
 
-  int list_sockfd, epfd; /* listening socket, epoll instance fd */
-  char *port = argv[1];
+/* Runs the event loop of srv (whose listening socket has already been
+ * created). This is the body of every worker thread. */
+static void *run_loop(void *arg) {
+  struct server *srv = (struct server *)arg;
   struct epoll_event *events; /* these will be filled by epoll_wait */
-  int *fds;                   /* keep track of socket fds */
-  uint64_t fds_count = 0;     /* count of elements in pfds */
+
+  /* pin before anything is allocated so that the loop's memory is local to
+   * the CPU's NUMA node */
+  if (srv->cpu != -1 && pin_to_cpu(srv->cpu) == -1)
+    exit(EXIT_FAILURE);
 
   /* create the epoll instance */
-  epfd = epoll_create1(0);
-  if (epfd == -1) {
+  srv->epfd = epoll_create1(0);
+  if (srv->epfd == -1) {
     perror("epoll_create1");
     exit(EXIT_FAILURE);
   }
 
-  /* allocate the maximum possible number of clients - this will be dynamically
-   * filled by epoll_wait but NOT allocated by it*/
-  events =
-      (struct epoll_event *)calloc(MAX_NBR_CLIENT, sizeof(struct epoll_event));
+  /* epoll_wait fills at most MAX_EVENTS events per call - remaining ready
+   * sockets are simply returned by the next call */
+  events = (struct epoll_event *)calloc(MAX_EVENTS, sizeof(struct epoll_event));
   if (events == NULL) {
     perror("calloc");
     exit(EXIT_FAILURE);
   }
 
-  /* allocate maximum number of possible clients - this is a client-side list
-   * to keep track of client socket fds */
-  fds = (int *)calloc(MAX_NBR_CLIENT, sizeof(int));
-  if (fds == NULL) {
+  /* client-side list to keep track of connections - this grows on demand */
+  srv->capacity = INIT_NBR_CLIENT;
+  srv->clients = (struct client *)calloc(srv->capacity, sizeof(struct client));
+  if (srv->clients == NULL) {
     perror("calloc");
     exit(EXIT_FAILURE);
   }
 
-  /* create the listening socket */
-  list_sockfd = create_listening_socket(port, 512);
-  if (list_sockfd == -1) {
-    perror("create_listening_socket");
+  /* add the listening socket to the clients list */
+  add_to_fds(srv, srv->list_fd);
+
+  if (srv->busy_poll_us != 0)
+    enable_busy_poll(srv->list_fd, srv->busy_poll_us);
+
+  /* WebSocket clients */
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = WS_LISTEN_IDX};
+  if (srv->ws_list_fd != -1 &&
+      epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->ws_list_fd, &ev) == -1) {
+    perror("epoll_ctl");
     exit(EXIT_FAILURE);
   }
 
-  /* add the listening socket to the fds list */
-  add_to_fds(epfd, fds, &fds_count, list_sockfd);
+  /* presence ticks, the write coalescing deadline and the re-evaluation of
+   * throttled clients are driven by timer fds monitored by the same epoll
+   * instance - no signals and no extra threads */
+  if ((srv->presence.timer_fd = add_timer(srv, PRESENCE_IDX)) == -1 ||
+      (srv->coalescing.timer_fd = add_timer(srv, FLUSH_IDX)) == -1 ||
+      (srv->ratelimit.timer_fd = add_timer(srv, THROTTLE_IDX)) == -1)
+    exit(EXIT_FAILURE);
+
+  /* messages from other workers */
+  ev.data.u64 = INBOX_IDX;
+  if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->inbox.efd, &ev) == -1) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+
+  /* take over the predecessor's clients and wait for a successor */
+  if (srv->restart.peer != -1)
+    adopt_clients(srv);
+  if (srv->restart.path != NULL && listen_for_successor(srv) == -1)
+    exit(EXIT_FAILURE);
+
+  /* link up with the other nodes of the cluster */
+  if (srv->node != 0) {
+    srv->fed = federation_new(srv->node, srv->epfd, srv->fed_port,
+                              deliver_remote, srv);
+    if (srv->fed == NULL)
+      exit(EXIT_FAILURE);
+    for (uint32_t i = 0; i < srv->nbr_peers; ++i) {
+      if (federation_add_peer(srv->fed, srv->peers[i]) == -1)
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  /* durable messages to release */
+  if (srv->persistence.durable) {
+    ev.data.u64 = LOG_IDX;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD,
+                  msglog_event_fd(srv->persistence.log), &ev) == -1) {
+      perror("epoll_ctl");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* runtime commands (read by the first worker only) - this fails with EPERM
+   * if stdin is not pollable (e.g., /dev/null or a regular file) which is
+   * fine, there just won't be any */
+  ev.data.u64 = STDIN_IDX;
+  if (srv->id == 0 &&
+      epoll_ctl(srv->epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1 &&
+      errno != EPERM)
+    perror("epoll_ctl (stdin commands disabled)");
 
-  puts("started the main poll loop");
+  if (nbr_workers > 1)
+    printf("worker %u started on cpu %d\n", srv->id, srv->cpu);
+  else
+    printf("started the main poll loop%s%s\n", srv->diet ? " (diet mode)" : "",
+           srv->busy_poll_us != 0 ? " (busy-poll mode)" : "");
 
   /* poll loop, poll-ing loop, main loop, or whatever you want to call it */
   for (;;) {
 
     /* this blocks until one or more sockets are ready (i.e., instant return
     upon call) for the specified operation */
-    int epoll_count =
-        epoll_wait(epfd, events, MAX_NBR_CLIENT, -1 /* infinite timeout */);
+    int epoll_count = wait_for_events(srv, events);
     if (epoll_count == -1) {
+      if (errno == EINTR)
+        continue;
       perror("epoll_wait");
       exit(EXIT_FAILURE);
     }
@@ -218,43 +2143,400 @@ int main(int argc, char *argv[]) {
       uint64_t idx =
           events[j].data.u64; /* data is a custom user-filled field - in this
                                  case we fill the u64 field with the index of
-                                 the fd in the fds array */
-      int fd = fds[idx];
+                                 the client in the clients array */
+      uint64_t expirations;
+
+      /* the presence tick has expired */
+      if (idx == PRESENCE_IDX) {
+        if (read(srv->presence.timer_fd, &expirations, sizeof(expirations)) >
+            0)
+          presence_flush(srv);
+        continue;
+      }
+
+      /* the coalescing deadline has expired */
+      if (idx == FLUSH_IDX) {
+        if (read(srv->coalescing.timer_fd, &expirations,
+                 sizeof(expirations)) > 0) {
+          srv->coalescing.armed = 0;
+          flush_dirty(srv);
+        }
+        continue;
+      }
+
+      /* throttled clients may have enough tokens again */
+      if (idx == THROTTLE_IDX) {
+        if (read(srv->ratelimit.timer_fd, &expirations,
+                 sizeof(expirations)) > 0)
+          throttle_tick(srv);
+        continue;
+      }
+
+      /* a runtime command */
+      if (idx == STDIN_IDX) {
+        handle_stdin(srv);
+        continue;
+      }
+
+      /* messages from other workers */
+      if (idx == INBOX_IDX) {
+        inbox_drain(srv);
+        continue;
+      }
+
+      /* held messages have become durable */
+      if (idx == LOG_IDX) {
+        release_held(srv);
+        continue;
+      }
+
+      /* a new instance is taking over */
+      if (idx == HANDOFF_IDX) {
+        hand_off(srv);
+        continue;
+      }
+
+      /* a new WebSocket client */
+      if (idx == WS_LISTEN_IDX) {
+        handle_new_connection(srv, srv->ws_list_fd);
+        continue;
+      }
+
+      /* a link to another node */
+      if (idx >= FEDERATION_IDX_FIRST && idx <= FEDERATION_IDX_LAST) {
+        federation_handle(srv->fed, idx, events[j].events);
+        continue;
+      }
+
+      /* a previous event in this batch may have deleted a client (which moves
+       * the last client into its slot) - skip indices that are now out of
+       * range. The moved client is level-triggered and will be reported again
+       * by the next epoll_wait. */
+      if (idx >= srv->count)
+        continue;
+
+      int fd = srv->clients[idx].fd;
+
+      /* pending output can be written */
+      if (events[j].events & EPOLLOUT)
+        flush_client(srv, idx, 0);
+
+      /* a throttled client is not read from - but still has to be dropped if
+       * its connection breaks */
+      if (srv->clients[idx].throttled &&
+          (events[j].events & (EPOLLHUP | EPOLLERR))) {
+        int joined = has_joined(&srv->clients[idx]);
+        del_fr_fds(srv, idx);
+        if (joined)
+          presence_left(srv, fd, 1);
+        continue;
+      }
 
       /* data is available for reading or client hang up */
       if (events[j].events & (EPOLLIN | EPOLLHUP)) {
 
         /* if this the listening socket fd then we have a new connection */
-        if (fd == list_sockfd) {
-          handle_new_connection(epfd, fds, &fds_count, list_sockfd);
+        if (fd == srv->list_fd) {
+          handle_new_connection(srv, srv->list_fd);
         } else { /* either got msg from this client or conn closed */
-          handle_client_data(epfd, fds, &fds_count, list_sockfd, idx);
+          handle_client_data(srv, idx);
         }
 
-      } else { /* (EPOLLERR) - some error happened */
-
-        if (fd != list_sockfd) {
+      } else if (events[j].events & EPOLLERR) { /* some error happened */
+        int joined = has_joined(&srv->clients[idx]);
 
-          char msg_buf[256];
-          snprintf(msg_buf, sizeof(msg_buf),
-                   "client %d disconnected due to error", fd);
-          broadcast_msg(fds, fds_count, msg_buf, strlen(msg_buf) + 1,
-                        list_sockfd, fd);
-        }
+        del_fr_fds(srv, idx);
 
-        del_fr_fds(epfd, fds, &fds_count, idx);
+        if (fd != srv->list_fd && joined)
+          presence_left(srv, fd, 1);
       }
 
     } // END INNER FOR LOOP
 
+    end_of_iteration(srv);
+
   } // END MAIN FOR LOOP
 
   /* don't forget to free the previously allocated epoll events array (of
-   * course, this is not needed here because the process will exit in next
-   * instruction - but better always keep this muscle memory) */
+   * course, this is not needed here because the loop never exits - but better
+   * always keep this muscle memory) */
   free(events);
 
   /* close epfd, and fds here etc ... */
 
+  return NULL;
+}
+
+/* Parses a comma separated list of CPUs (e.g., "0,1,2,3") into cpus and
+ * returns the number of parsed CPUs. */
+static uint32_t parse_cpu_list(const char *str, int *cpus) {
+  uint32_t n = 0;
+  char *end;
+  while (n < MAX_WORKERS) {
+    cpus[n++] = (int)strtol(str, &end, 10);
+    if (*end != ',')
+      break;
+    str = end + 1;
+  }
+  return n;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [-d] [-t TICK_MS] [-p MAX_PRESENCE] [-c COALESCING] "
+         "[-b BYTES] [-u USEC] [-r RATE[:BURST]] [-R RATE[:BURST]] "
+         "[-B USEC] [-C CPU] [-w CPU_LIST] "
+         "[-L DIR [-D] [-S SEGMENT_MB] [-K SEGMENTS]] [-H PATH [-T]] "
+         "[-N NODE [-F FED_PORT] [-P HOST:PORT]...] [-W WS_PORT] [-X FILE] "
+         "[-z [-Z DICT]] PORT\n",
+         prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  struct server srv; /* template every worker is copied from */
+  int cpus[MAX_WORKERS];
+  const char *log_dir = NULL;
+  uint64_t segment_mb = LOG_SEGMENT_MB;
+  uint32_t keep_segments = LOG_KEEP_SEGMENTS;
+  const char *peers[MAX_PEERS];
+  const char *ws_port = NULL;
+  const char *capture_path = NULL;
+  int compression = 0;
+  const char *dict_path = NULL;
+  int opt;
+
+  memset(&srv, 0, sizeof(srv));
+  srv.presence.tick_ms = PRESENCE_TICK_MS;
+  srv.presence.frame_max = PRESENCE_FRAME_MAX;
+  srv.cpu = -1;
+  srv.coalescing.policy = COALESCE_ADAPTIVE;
+  srv.coalescing.flush_bytes = FLUSH_BYTES;
+  srv.coalescing.deadline_us = FLUSH_DEADLINE_US;
+  srv.restart.fd = srv.restart.peer = -1;
+  srv.ws_list_fd = -1;
+  nbr_workers = 0; /* 0 means -w was not provided */
+
+  while ((opt = getopt(argc, argv, "dt:p:c:b:u:r:R:B:C:w:L:DS:K:H:TN:F:P:W:X:zZ:")) != -1) {
+    switch (opt) {
+    case 'd':
+      srv.diet = 1;
+      break;
+    case 't':
+      srv.presence.tick_ms = strtoul(optarg, NULL, 10);
+      break;
+    case 'p':
+      srv.presence.frame_max = strtoul(optarg, NULL, 10);
+      if (srv.presence.frame_max < 128) /* room for both "+N more" */
+        srv.presence.frame_max = 128;
+      break;
+    case 'c':
+      if (strcmp(optarg, "off") == 0)
+        srv.coalescing.policy = COALESCE_OFF;
+      else if (strcmp(optarg, "latency") == 0)
+        srv.coalescing.policy = COALESCE_LATENCY;
+      else if (strcmp(optarg, "throughput") == 0)
+        srv.coalescing.policy = COALESCE_THROUGHPUT;
+      else if (strcmp(optarg, "adaptive") == 0)
+        srv.coalescing.policy = COALESCE_ADAPTIVE;
+      else
+        usage(argv[0]);
+      break;
+    case 'b':
+      srv.coalescing.flush_bytes = strtoul(optarg, NULL, 10);
+      break;
+    case 'u':
+      srv.coalescing.deadline_us = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      parse_rate(&srv.ratelimit.conn, optarg);
+      break;
+    case 'R':
+      parse_rate(&srv.ratelimit.room, optarg);
+      break;
+    case 'B':
+      srv.busy_poll_us = strtoul(optarg, NULL, 10);
+      break;
+    case 'C':
+      srv.cpu = (int)strtol(optarg, NULL, 10);
+      break;
+    case 'w':
+      nbr_workers = parse_cpu_list(optarg, cpus);
+      break;
+    case 'L':
+      log_dir = optarg;
+      break;
+    case 'D':
+      srv.persistence.durable = 1;
+      break;
+    case 'S':
+      segment_mb = strtoull(optarg, NULL, 10);
+      break;
+    case 'K':
+      keep_segments = strtoul(optarg, NULL, 10);
+      break;
+    case 'H':
+      srv.restart.path = optarg;
+      break;
+    case 'T':
+      srv.restart.want_clients = 1;
+      break;
+    case 'N':
+      srv.node = (uint16_t)strtoul(optarg, NULL, 10);
+      snprintf(srv.node_tag, sizeof(srv.node_tag), "@%u", srv.node);
+      break;
+    case 'F':
+      srv.fed_port = optarg;
+      break;
+    case 'P':
+      if (srv.nbr_peers == MAX_PEERS)
+        usage(argv[0]);
+      peers[srv.nbr_peers++] = optarg;
+      break;
+    case 'W':
+      ws_port = optarg;
+      break;
+    case 'X':
+      capture_path = optarg;
+      break;
+    case 'z':
+      compression = 1;
+      break;
+    case 'Z':
+      compression = 1;
+      dict_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1 || (srv.persistence.durable && log_dir == NULL) ||
+      (srv.restart.path != NULL && nbr_workers != 0) ||
+      ((srv.fed_port != NULL || srv.nbr_peers != 0) && srv.node == 0) ||
+      (srv.node != 0 && nbr_workers != 0) ||
+      (ws_port != NULL && srv.restart.path != NULL) ||
+      (capture_path != NULL && srv.restart.path != NULL))
+    usage(argv[0]);
+  srv.peers = peers;
+
+  /* presence frames are forwarded to the other nodes like any message */
+  if (srv.node != 0 && srv.presence.frame_max > FEDERATION_MSG_MAX)
+    srv.presence.frame_max = FEDERATION_MSG_MAX;
+
+  srv.coalescing.throughput = srv.coalescing.policy == COALESCE_THROUGHPUT;
+  srv.ratelimit.room_tokens = srv.ratelimit.room.burst * 1000;
+  srv.ratelimit.room_stamp = now_ms();
+
+  char *port = argv[optind];
+
+  /* each connection is a fd - raise the soft limit as far as we are allowed
+   * to so that we are not capped at the (usually) default 1024 */
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+      perror("setrlimit");
+  }
+
+  int reuseport = nbr_workers != 0;
+  if (!reuseport) {
+    nbr_workers = 1;
+    cpus[0] = srv.cpu;
+  }
+
+  if (capture_path != NULL &&
+      (srv.capture = capture_open(capture_path)) == NULL)
+    exit(EXIT_FAILURE);
+
+  /* the dictionary is shared by the encoders of all workers */
+  char *dict = NULL;
+  size_t dict_len = 0;
+  if (dict_path != NULL) {
+    FILE *f = fopen(dict_path, "rb");
+    if (f == NULL || (dict = (char *)malloc(FZ_DICT_MAX + 1)) == NULL) {
+      perror(dict_path);
+      exit(EXIT_FAILURE);
+    }
+    dict_len = fread(dict, 1, FZ_DICT_MAX + 1, f); /* too long if it fills */
+    fclose(f);
+  }
+
+  workers = (struct server *)calloc(nbr_workers, sizeof(struct server));
+  if (workers == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  /* the listening sockets are created upfront, in order, so that the i-th
+   * socket of the reuseport group belongs to the i-th worker */
+  for (uint32_t i = 0; i < nbr_workers; ++i) {
+    struct server *w = &workers[i];
+    *w = srv;
+    w->id = i;
+    w->cpu = cpus[i];
+    w->list_fd = w->restart.path != NULL ? take_over_listener(w) : -1;
+    if (w->list_fd == -1)
+      w->list_fd = reuseport ? create_reuseport_listening_socket(port, 512)
+                             : create_listening_socket(port, 512);
+    if (w->list_fd == -1) {
+      perror("create_listening_socket");
+      exit(EXIT_FAILURE);
+    }
+    if (ws_port != NULL) {
+      w->ws_list_fd = reuseport
+                          ? create_reuseport_listening_socket(ws_port, 512)
+                          : create_listening_socket(ws_port, 512);
+      if (w->ws_list_fd == -1) {
+        perror("create_listening_socket (WebSocket)");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (compression && (w->fz = fz_encoder_new(dict, dict_len)) == NULL)
+      exit(EXIT_FAILURE);
+    w->inbox.efd = eventfd(0, EFD_NONBLOCK);
+    if (w->inbox.efd == -1) {
+      perror("eventfd");
+      exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&w->inbox.lock, NULL);
+
+    if (log_dir != NULL) {
+      char path[PATH_MAX];
+      if (nbr_workers > 1) {
+        if (i == 0 && mkdir(log_dir, 0755) == -1 && errno != EEXIST) {
+          perror("mkdir");
+          exit(EXIT_FAILURE);
+        }
+        snprintf(path, sizeof(path), "%s/%u", log_dir, i);
+      } else {
+        snprintf(path, sizeof(path), "%s", log_dir);
+      }
+      w->persistence.log =
+          msglog_open(path, segment_mb * 1024 * 1024, keep_segments);
+      if (w->persistence.log == NULL)
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (reuseport &&
+      attach_cpu_steering_program(workers[0].list_fd, cpus, nbr_workers) == -1)
+    fprintf(stderr, "connections will be steered by the default 4-tuple "
+                    "hash instead\n");
+
+  if (nbr_workers == 1) {
+    run_loop(&workers[0]); /* no need for an extra thread */
+    exit(EXIT_SUCCESS);
+  }
+
+  pthread_t *threads = (pthread_t *)calloc(nbr_workers, sizeof(pthread_t));
+  for (uint32_t i = 0; i < nbr_workers; ++i) {
+    if (pthread_create(&threads[i], NULL, run_loop, &workers[i]) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (uint32_t i = 0; i < nbr_workers; ++i)
+    pthread_join(threads[i], NULL);
+
   exit(EXIT_SUCCESS);
 }
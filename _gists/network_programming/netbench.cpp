@@ -0,0 +1,274 @@
+/*
+ * netbench.cpp -- micro-benchmarks (Google Benchmark) of the hot paths of
+ * multichatserver_epoll.c, run on the server's own code (see
+ * netbench_server.c) rather than on a copy of it:
+ *
+ *   BM_CreateListeningSocket  create_listening_socket + close
+ *   BM_AcceptLoopback         connect over loopback + handle_new_connection
+ *                             (accept4, add_to_fds, join broadcast) +
+ *                             del_fr_fds
+ *   BM_ConnectionChurn        add_to_fds + del_fr_fds of a table of N clients
+ *                             (args: N, diet mode)
+ *   BM_FormatFrame            broadcast_frame to an empty room: the
+ *                             "user FD: TEXT\n" formatting and sanitizing
+ *                             (args: line length, whether it needs fixing)
+ *   BM_HandleClientData       a read of 16 lines by handle_client_data -
+ *                             including the sender's send (arg: line length)
+ *   BM_Broadcast              8 broadcast_msg calls to N socketpair
+ *                             recipients in one loop iteration, sent right
+ *                             away or coalesced (args: N, coalescing)
+ *
+ * Usage: ./netbench [--benchmark_filter=REGEX] [--benchmark_repetitions=N]
+ *                   [--benchmark_out=FILE --benchmark_out_format=json]
+ *
+ * Compare two runs (e.g., before and after a change) with
+ * netbench_compare.py, which exits with 1 if a benchmark got slower by more
+ * than its threshold:
+ *
+ *   ./netbench --benchmark_repetitions=5 --benchmark_out=base.json \
+ *              --benchmark_out_format=json
+ *   ... change the server, rebuild ...
+ *   ./netbench --benchmark_repetitions=5 --benchmark_out=new.json \
+ *              --benchmark_out_format=json
+ *   ./netbench_compare.py -t 10 base.json new.json
+ *
+ * compile with:
+ *
+ *   cc -O2 -pthread -c netbench_server.c sockethelpers.c msglog.c \
+ *      federation.c textscan.c websocket.c capture.c framezip.c
+ *   c++ -std=c++20 -O2 -o netbench netbench.cpp netbench_server.o \
+ *       sockethelpers.o msglog.o federation.o textscan.o websocket.o \
+ *       capture.o framezip.o -lbenchmark -lz -pthread
+ */
+
+#include "netbench_server.h"
+#include "sockethelpers.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// frames broadcast per event loop iteration by BM_Broadcast
+constexpr int frames_per_iteration = 8;
+
+// peers of the recipients are drained every this many iterations (with the
+// timer paused) so that no socket buffer ever fills up
+constexpr int drain_every = 4;
+
+static void set_nonblocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// a unix socketpair - sv[0] goes to the server (non-blocking), sv[1] is the
+// peer. Aborts the benchmark on failure
+static bool make_pair(benchmark::State &state, int sv[2]) {
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    state.SkipWithError(strerror(errno));
+    return false;
+  }
+  set_nonblocking(sv[0]);
+  return true;
+}
+
+static void drain(int fd) {
+  static char buf[65536];
+  while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+    ;
+}
+
+// a line of len bytes (including the '\n'), with a control character and an
+// invalid UTF-8 byte in it if dirty
+static std::string make_line(std::size_t len, bool dirty) {
+  std::string line(len - 1, 'x');
+  for (std::size_t i = 0; i < line.size(); i += 8)
+    line[i] = ' ';
+  if (dirty && line.size() >= 4) {
+    line[1] = '\x1b';
+    line[line.size() / 2] = '\xff';
+  }
+  return line + '\n';
+}
+
+static void BM_CreateListeningSocket(benchmark::State &state) {
+  for (auto _ : state) {
+    int fd = create_listening_socket("0", 512);
+    if (fd == -1) {
+      state.SkipWithError("create_listening_socket failed");
+      break;
+    }
+    close(fd);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CreateListeningSocket);
+
+static void BM_AcceptLoopback(benchmark::State &state) {
+  int list_fd = create_listening_socket("0", 512);
+  if (list_fd == -1) {
+    state.SkipWithError("create_listening_socket failed");
+    return;
+  }
+  set_nonblocking(list_fd);
+
+  // the listening socket's port, on the loopback address of its family
+  sockaddr_storage addr{};
+  socklen_t addrlen = sizeof(addr);
+  getsockname(list_fd, reinterpret_cast<sockaddr *>(&addr), &addrlen);
+  if (addr.ss_family == AF_INET6)
+    reinterpret_cast<sockaddr_in6 *>(&addr)->sin6_addr = in6addr_loopback;
+  else
+    reinterpret_cast<sockaddr_in *>(&addr)->sin_addr.s_addr =
+        htonl(INADDR_LOOPBACK);
+
+  struct server *srv = nb_server_new(0, 0);
+  // the client resets its connection so that no TIME_WAIT socket ties up its
+  // ephemeral port - there would be none left after a few seconds
+  linger lg{1, 0};
+  for (auto _ : state) {
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd == -1 ||
+        connect(fd, reinterpret_cast<sockaddr *>(&addr), addrlen) == -1) {
+      state.SkipWithError(strerror(errno));
+      break;
+    }
+    nb_handle_new_connection(srv, list_fd);
+    if (nb_server_count(srv) != 1) {
+      state.SkipWithError("handle_new_connection did not accept");
+      break;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+    nb_del_fr_fds(srv, 0);
+  }
+  state.SetItemsProcessed(state.iterations());
+  nb_server_free(srv);
+  close(list_fd);
+}
+BENCHMARK(BM_AcceptLoopback);
+
+static void BM_ConnectionChurn(benchmark::State &state) {
+  const auto n = static_cast<uint64_t>(state.range(0));
+  struct server *srv = nb_server_new(static_cast<int>(state.range(1)), 0);
+  int sv[2];
+  if (!make_pair(state, sv))
+    return;
+
+  // every client is a dup of the same socket - del_fr_fds closes its fd
+  for (uint64_t i = 0; i < n; ++i)
+    nb_add_to_fds(srv, dup(sv[0]));
+
+  // a client joins at the end and one leaves from anywhere (the last one is
+  // moved into its slot)
+  uint64_t victim = 0;
+  for (auto _ : state) {
+    if (nb_add_to_fds(srv, dup(sv[0])) == -1) {
+      state.SkipWithError("add_to_fds failed");
+      break;
+    }
+    nb_del_fr_fds(srv, victim);
+    victim = (victim + 7) % n;
+  }
+  state.SetItemsProcessed(state.iterations());
+  nb_server_free(srv);
+  close(sv[0]);
+  close(sv[1]);
+}
+BENCHMARK(BM_ConnectionChurn)
+    ->ArgNames({"clients", "diet"})
+    ->ArgsProduct({{16, 1024, 16384}, {0, 1}});
+
+static void BM_FormatFrame(benchmark::State &state) {
+  struct server *srv = nb_server_new(0, 0);
+  const std::string line =
+      make_line(static_cast<std::size_t>(state.range(0)), state.range(1) != 0);
+
+  for (auto _ : state)
+    nb_broadcast_frame(srv, 42, line.data(), line.size());
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * line.size());
+  nb_server_free(srv);
+}
+BENCHMARK(BM_FormatFrame)
+    ->ArgNames({"len", "dirty"})
+    ->ArgsProduct({{16, 64, 256}, {0, 1}});
+
+static void BM_HandleClientData(benchmark::State &state) {
+  constexpr int lines = 16;
+  struct server *srv = nb_server_new(0, 0);
+  int sv[2];
+  if (!make_pair(state, sv))
+    return;
+  nb_add_to_fds(srv, sv[0]);
+
+  std::string batch{};
+  for (int i = 0; i < lines; ++i)
+    batch += make_line(static_cast<std::size_t>(state.range(0)), false);
+
+  for (auto _ : state) {
+    if (send(sv[1], batch.data(), batch.size(), 0) !=
+        static_cast<ssize_t>(batch.size())) {
+      state.SkipWithError("send failed");
+      break;
+    }
+    nb_handle_client_data(srv, 0);
+  }
+  state.SetItemsProcessed(state.iterations() * lines);
+  state.SetBytesProcessed(state.iterations() * batch.size());
+  nb_server_free(srv);
+  close(sv[1]);
+}
+BENCHMARK(BM_HandleClientData)->ArgName("len")->Arg(16)->Arg(64)->Arg(256);
+
+static void BM_Broadcast(benchmark::State &state) {
+  const auto n = static_cast<int>(state.range(0));
+  const bool coalescing = state.range(1) != 0;
+  struct server *srv = nb_server_new(0, coalescing);
+  std::vector<int> peers{};
+  for (int i = 0; i < n; ++i) {
+    int sv[2];
+    if (!make_pair(state, sv)) {
+      nb_server_free(srv);
+      return;
+    }
+    nb_add_to_fds(srv, sv[0]);
+    peers.push_back(sv[1]);
+  }
+
+  // a frame as broadcast_frame makes it (null-terminated)
+  const std::string msg = "user 42: " + make_line(48, false);
+
+  int since_drain = 0;
+  for (auto _ : state) {
+    for (int i = 0; i < frames_per_iteration; ++i)
+      nb_broadcast_msg(srv, msg.c_str(), msg.size() + 1, -1);
+    nb_end_of_iteration(srv);
+    if (++since_drain == drain_every) {
+      state.PauseTiming();
+      for (int fd : peers)
+        drain(fd);
+      since_drain = 0;
+      state.ResumeTiming();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * frames_per_iteration * n);
+  nb_server_free(srv);
+  for (int fd : peers)
+    close(fd);
+}
+BENCHMARK(BM_Broadcast)
+    ->ArgNames({"clients", "coalescing"})
+    ->ArgsProduct({{1, 16, 256}, {0, 1}});
+
+BENCHMARK_MAIN();
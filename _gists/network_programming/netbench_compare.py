@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""netbench_compare.py -- compares two JSON results of netbench.cpp (or of any
+Google Benchmark binary) and flags every benchmark that got slower by more than
+a threshold.
+
+Usage: ./netbench_compare.py [-t PERCENT] [-m real_time|cpu_time] BASE NEW
+
+  -t  regression threshold in percent (default 5)
+  -m  which time to compare (default real_time)
+
+With --benchmark_repetitions, the median of the repetitions is compared (the
+"median" aggregate if the run reported aggregates). Exits with 1 if at least
+one benchmark regressed, 0 otherwise. Benchmarks found in only one of the
+files are listed but never count as regressions.
+"""
+
+import argparse
+import json
+import statistics
+import sys
+
+TO_NS = {"ns": 1.0, "us": 1e3, "ms": 1e6, "s": 1e9}
+
+
+def load(path, metric):
+    """returns {benchmark name: time in ns} of a JSON result file"""
+    with open(path) as f:
+        benchmarks = json.load(f)["benchmarks"]
+
+    runs, medians = {}, {}
+    for b in benchmarks:
+        if "error_occurred" in b and b["error_occurred"]:
+            continue
+        name = b.get("run_name", b["name"])
+        t = b[metric] * TO_NS[b.get("time_unit", "ns")]
+        if b.get("run_type") == "aggregate":
+            if b.get("aggregate_name") == "median":
+                medians[name] = t
+        else:
+            runs.setdefault(name, []).append(t)
+
+    times = {name: statistics.median(ts) for name, ts in runs.items()}
+    times.update(medians)
+    return times
+
+
+def fmt_ns(t):
+    for unit, scale in (("s", 1e9), ("ms", 1e6), ("us", 1e3)):
+        if t >= scale:
+            return "%.2f %s" % (t / scale, unit)
+    return "%.1f ns" % t
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="flags benchmarks of NEW that are slower than in BASE")
+    parser.add_argument("-t", type=float, default=5.0, metavar="PERCENT",
+                        help="regression threshold in percent (default 5)")
+    parser.add_argument("-m", choices=("real_time", "cpu_time"),
+                        default="real_time",
+                        help="time to compare (default real_time)")
+    parser.add_argument("base")
+    parser.add_argument("new")
+    args = parser.parse_args()
+
+    base = load(args.base, args.m)
+    new = load(args.new, args.m)
+    width = max(len(name) for name in list(base) + list(new) + ["benchmark"])
+
+    print("%-*s %12s %12s %9s" % (width, "benchmark", "base", "new", "change"))
+    regressions = 0
+    for name in list(base) + [n for n in new if n not in base]:
+        if name not in new or name not in base:
+            print("%-*s %12s %12s %9s  only in %s" %
+                  (width, name, fmt_ns(base[name]) if name in base else "-",
+                   fmt_ns(new[name]) if name in new else "-", "",
+                   "BASE" if name in base else "NEW"))
+            continue
+        change = (new[name] - base[name]) / base[name] * 100
+        flag = ""
+        if change > args.t:
+            flag = "  REGRESSION"
+            regressions += 1
+        elif change < -args.t:
+            flag = "  improved"
+        print("%-*s %12s %12s %+8.1f%%%s" % (width, name, fmt_ns(base[name]),
+                                             fmt_ns(new[name]), change, flag))
+
+    if regressions != 0:
+        print("%d benchmark(s) regressed by more than %g%%" %
+              (regressions, args.t))
+        return 1
+    print("no regression above %g%%" % args.t)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
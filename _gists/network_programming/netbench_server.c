@@ -0,0 +1,106 @@
+/*
+ * netbench_server.c -- the hot paths of multichatserver_epoll.c, compiled
+ * into netbench.cpp as they are: the server's source file is included with its
+ * main renamed, and the few functions below set up a bare server (one worker,
+ * no log, no federation, no presence batching) and expose its static
+ * functions to the benchmark.
+ *
+ * The server echoes every broadcast message to stdout - that echo goes to
+ * /dev/null here (through a buffered stream, like stdout redirected to a file)
+ * so that the benchmarks measure the server and not the terminal or the pipe
+ * the benchmark's own output goes to.
+ *
+ * compile with (see netbench.cpp):
+ *
+ *   cc -O2 -pthread -c netbench_server.c sockethelpers.c msglog.c \
+ *      federation.c textscan.c websocket.c capture.c framezip.c
+ */
+
+#define _GNU_SOURCE /* accept4 */
+#include <stdio.h>
+
+static FILE *nb_echo; /* stdout of the server */
+
+#define printf(...) fprintf(nb_echo, __VA_ARGS__)
+#define main multichatserver_epoll_main
+#include "multichatserver_epoll.c"
+#undef main
+#undef printf
+
+#include "netbench_server.h"
+
+struct server *nb_server_new(int diet, int coalescing) {
+  if (nb_echo == NULL && (nb_echo = fopen("/dev/null", "w")) == NULL) {
+    perror("fopen");
+    return NULL;
+  }
+
+  struct server *srv = (struct server *)calloc(1, sizeof(struct server));
+  if (srv == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  srv->list_fd = srv->ws_list_fd = -1;
+  srv->cpu = -1;
+  srv->diet = diet;
+  srv->restart.peer = -1;
+  srv->presence.timer_fd = -1; /* tick_ms 0 - joins and leaves go out now */
+  srv->coalescing.policy = coalescing ? COALESCE_LATENCY : COALESCE_OFF;
+  srv->coalescing.timer_fd = -1;
+  srv->coalescing.flush_bytes = FLUSH_BYTES;
+  srv->coalescing.deadline_us = FLUSH_DEADLINE_US;
+  srv->ratelimit.timer_fd = -1;
+  srv->inbox.efd = -1;
+
+  srv->capacity = INIT_NBR_CLIENT;
+  srv->clients =
+      (struct client *)malloc(srv->capacity * sizeof(struct client));
+  if (srv->clients == NULL) {
+    perror("malloc");
+    free(srv);
+    return NULL;
+  }
+  if ((srv->epfd = epoll_create1(0)) == -1) {
+    perror("epoll_create1");
+    free(srv->clients);
+    free(srv);
+    return NULL;
+  }
+  return srv;
+}
+
+void nb_server_free(struct server *srv) {
+  while (srv->count != 0)
+    del_fr_fds(srv, srv->count - 1);
+  close(srv->epfd);
+  free(srv->clients);
+  free(srv);
+}
+
+uint64_t nb_server_count(const struct server *srv) { return srv->count; }
+
+int nb_add_to_fds(struct server *srv, int fd) { return add_to_fds(srv, fd); }
+
+int nb_del_fr_fds(struct server *srv, uint64_t idx) {
+  return del_fr_fds(srv, idx);
+}
+
+void nb_handle_new_connection(struct server *srv, int list_fd) {
+  handle_new_connection(srv, list_fd);
+}
+
+void nb_handle_client_data(struct server *srv, uint64_t idx) {
+  handle_client_data(srv, idx);
+}
+
+void nb_broadcast_frame(struct server *srv, int sender_fd, const char *frame,
+                        uint64_t frame_len) {
+  broadcast_frame(srv, sender_fd, frame, frame_len);
+}
+
+void nb_broadcast_msg(struct server *srv, const char *buf, uint64_t buf_len,
+                      int except_fd) {
+  broadcast_msg(srv, buf, buf_len, except_fd);
+}
+
+void nb_end_of_iteration(struct server *srv) { end_of_iteration(srv); }
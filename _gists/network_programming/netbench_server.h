@@ -0,0 +1,52 @@
+#ifndef NETBENCH_SERVER_H
+#define NETBENCH_SERVER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The hot paths of multichatserver_epoll.c for netbench.cpp (see
+ * netbench_server.c). A server created here has no listening socket - the
+ * benchmarks add whatever fds they need. */
+
+struct server;
+
+/* returns a server with an empty clients list and its own epoll instance,
+ * NULL on failure. coalescing selects the latency policy (frames are queued
+ * and sent by nb_end_of_iteration) instead of sending right away */
+struct server *nb_server_new(int diet, int coalescing);
+
+/* closes every client and frees srv */
+void nb_server_free(struct server *srv);
+
+/* returns the number of clients of srv */
+uint64_t nb_server_count(const struct server *srv);
+
+/* add_to_fds and del_fr_fds (which closes the client's fd) */
+int nb_add_to_fds(struct server *srv, int fd);
+int nb_del_fr_fds(struct server *srv, uint64_t idx);
+
+/* accepts a connection from listening socket list_fd and adds it */
+void nb_handle_new_connection(struct server *srv, int list_fd);
+
+/* reads what client idx sent and broadcasts every line of it */
+void nb_handle_client_data(struct server *srv, uint64_t idx);
+
+/* formats, sanitizes and broadcasts a frame as if sender_fd had sent it */
+void nb_broadcast_frame(struct server *srv, int sender_fd, const char *frame,
+                        uint64_t frame_len);
+
+/* broadcast_msg */
+void nb_broadcast_msg(struct server *srv, const char *buf, uint64_t buf_len,
+                      int except_fd);
+
+/* what the event loop does after each epoll_wait (flushes coalesced frames) */
+void nb_end_of_iteration(struct server *srv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ * presencebench.c -- measures how long a chat server takes to absorb a join
+ * storm (NBR_CONNS clients connecting at once) followed by a leave storm (all
+ * of them disconnecting at once), and how many bytes of presence traffic the
+ * storm generated.
+ *
+ * Usage: ./presencebench PORT NBR_CONNS
+ *
+ * Run it for increasing NBR_CONNS against both presence modes to see the cost
+ * go from quadratic (-t 0, one broadcast per event) to linear (batched):
+ *
+ *   ./multichatserver_epoll -t 0 9034 > /dev/null &
+ *   for n in 1000 2000 4000 8000; do ./presencebench 9034 $n; done
+ *
+ * compile with:
+ *
+ *   cc -O2 -o presencebench presencebench.c
+ */
+
+#define _GNU_SOURCE /* memmem */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 1024
+
+static char buf[65536];
+static uint64_t total_bytes = 0; /* bytes received by all storm clients */
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Connects a (blocking) client socket to localhost:port. */
+static int connect_to(int port) {
+  struct sockaddr_in dst;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  memset(&dst, 0, sizeof(dst));
+  dst.sin_family = AF_INET;
+  dst.sin_port = htons(port);
+  dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&dst, sizeof(dst)) == -1) {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+/* Reads (and discards) whatever the server sent to the storm clients. */
+static void drain(int epfd, struct epoll_event *events) {
+  int n;
+  while ((n = epoll_wait(epfd, events, MAX_EVENTS, 0)) > 0) {
+    for (int i = 0; i < n; ++i) {
+      ssize_t r;
+      while ((r = recv(events[i].data.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        total_bytes += r;
+    }
+  }
+}
+
+/* The server handles events in order - once the observer receives the token
+ * sent by the sender, everything that happened before has been processed. */
+static void sync_on(int sender, int observer, int seq, int epfd,
+                    struct epoll_event *events) {
+  char token[32], tail[64 + sizeof(buf)];
+  size_t tail_len = 0;
+  int len = snprintf(token, sizeof(token), "sync-%d\n", seq);
+
+  if (send(sender, token, len, 0) == -1) {
+    perror("send");
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    drain(epfd, events);
+    ssize_t r = recv(observer, tail + tail_len, sizeof(buf), MSG_DONTWAIT);
+    if (r == 0) {
+      fprintf(stderr, "server closed the connection\n");
+      exit(EXIT_FAILURE);
+    }
+    if (r < 0)
+      continue;
+    tail_len += r;
+    if (memmem(tail, tail_len, token, len) != NULL)
+      return;
+    if (tail_len > 64) { /* only keep what may hold a partial token */
+      memmove(tail, tail + tail_len - 64, 64);
+      tail_len = 64;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s PORT NBR_CONNS\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  int port = (int)strtol(argv[1], NULL, 10);
+  long nbr_conns = strtol(argv[2], NULL, 10);
+
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  int epfd = epoll_create1(0);
+  struct epoll_event *events =
+      (struct epoll_event *)calloc(MAX_EVENTS, sizeof(struct epoll_event));
+  int *fds = (int *)calloc(nbr_conns, sizeof(int));
+  if (epfd == -1 || events == NULL || fds == NULL) {
+    perror("epoll_create1/calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  int sender = connect_to(port), observer = connect_to(port);
+  sync_on(sender, observer, 0, epfd, events);
+
+  /* join storm */
+  double t0 = now_ms();
+  for (long i = 0; i < nbr_conns; ++i) {
+    fds[i] = connect_to(port);
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fds[i]};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+    drain(epfd, events);
+  }
+  sync_on(sender, observer, 1, epfd, events);
+  double join_ms = now_ms() - t0;
+  uint64_t join_bytes = total_bytes;
+
+  /* leave storm */
+  t0 = now_ms();
+  for (long i = 0; i < nbr_conns; ++i)
+    close(fds[i]);
+  sync_on(sender, observer, 2, epfd, events);
+  double leave_ms = now_ms() - t0;
+
+  printf("conns %7ld  join storm %9.1f ms  leave storm %9.1f ms  "
+         "presence bytes per client %9.1f\n",
+         nbr_conns, join_ms, leave_ms, (double)join_bytes / nbr_conns);
+
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,599 @@
+/*
+ * rudp.c -- a reliable message channel over UDP with selective ACKs, RTT
+ * based retransmission timeouts, a congestion window and per-stream ordering
+ * (see rudp.h).
+ */
+
+#include "rudp.h"
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+#define RUDP_MAGIC 0x52554450 /* "RUDP" */
+#define RUDP_UNORDERED 0x80   /* stream flag of unordered messages */
+#define MAX_SACK_BLOCKS 64    /* per ACK */
+#define DUPTHRESH 3 /* a packet is lost once this many later ones arrived */
+#define MAX_DUPTHRESH 64 /* ... raised up to this when there is reordering */
+#define INITIAL_RTO_US 1000000 /* before the first RTT sample (RFC 6298) */
+#define MIN_RTO_US 10000 /* TCP's 200 ms would stall a chat on every timeout */
+#define MAX_RTO_US 10000000
+#define MIN_PTO_US 2000  /* tail loss probe timeout */
+#define MIN_REORDER_US 1000 /* reordering tolerated before a packet is lost */
+#define INITIAL_CWND 10 /* packets */
+
+enum { LOST_ACK = 1, LOST_TIMEOUT }; /* why a packet is deemed lost */
+
+enum rudp_type {
+  RUDP_DATA, /* a message: seq, stream, sseq */
+  RUDP_FIN,  /* the sender's end: seq */
+  RUDP_ACK,  /* everything before seq arrived, and the len SACK blocks that
+                follow the header */
+};
+
+/* header of every packet (in network byte order on the wire) */
+struct rudp_header {
+  uint32_t magic;
+  uint32_t session; /* the sender's (DATA, FIN) or the acknowledged (ACK) */
+  uint64_t seq;
+  uint32_t sseq; /* DATA: the message's number in its stream if ordered */
+  uint16_t len;  /* DATA: payload length, ACK: number of SACK blocks */
+  uint8_t type;
+  uint8_t stream; /* DATA: stream, with RUDP_UNORDERED for unordered ones */
+};
+
+_Static_assert(sizeof(struct rudp_header) + RUDP_MAX_PAYLOAD ==
+                   RUDP_MAX_PACKET,
+               "RUDP_MAX_PACKET does not match struct rudp_header");
+
+/* a range [start, end) of packets that arrived */
+struct sack_block {
+  uint64_t start;
+  uint64_t end;
+};
+
+/* a queued or unacknowledged packet */
+struct tx_slot {
+  uint64_t seq;
+  uint64_t sent_us; /* time of the last transmission, 0 if not sent yet */
+  uint64_t order;   /* number of the last transmission (see rudp.sent) */
+  uint32_t sseq;
+  uint16_t len;
+  uint8_t type;
+  uint8_t stream;
+  uint8_t in_flight; /* sent and neither acknowledged nor deemed lost */
+  uint8_t sacked;
+  uint8_t lost; /* waiting for its retransmission: LOST_ACK or LOST_TIMEOUT */
+  uint8_t retransmitted;
+  char data[RUDP_MAX_PAYLOAD];
+};
+
+/* a packet that arrived (and, if held, a message waiting for its stream's
+ * earlier ones) */
+struct rx_slot {
+  uint64_t seq; /* 0 if the slot is free */
+  uint32_t sseq;
+  uint16_t len;
+  uint8_t stream;
+  uint8_t held;
+  char data[RUDP_MAX_PAYLOAD];
+};
+
+struct rudp {
+  rudp_output_fn output;
+  rudp_deliver_fn deliver;
+  void *arg;
+  uint32_t session;
+
+  /* sending - packets [una, next_tx) were sent, [next_tx, next_seq) are
+   * queued */
+  struct tx_slot *tx; /* RUDP_WINDOW slots, by seq % RUDP_WINDOW */
+  uint64_t una;       /* lowest unacknowledged seq */
+  uint64_t next_tx;
+  uint64_t next_seq;
+  uint32_t in_flight;   /* number of packets in flight */
+  uint32_t lost;        /* number of packets waiting for a retransmission */
+  uint64_t lost_from;   /* no packet before it is waiting */
+  uint64_t max_sacked;  /* highest seq SACKed */
+  uint32_t dupthresh;   /* DUPTHRESH, adapted to the reordering seen */
+  uint64_t sacked_order;   /* latest transmission acknowledged */
+  uint64_t recovery_end;   /* losses before it belong to the last loss event */
+  double cwnd, ssthresh;   /* in packets */
+  uint64_t srtt_us, rttvar_us, rto_us;
+  uint64_t timer_at; /* when the retransmission timer expires, 0 if stopped */
+  uint64_t loss_at;  /* when detect_losses has to run again, 0 if never */
+  int probed;        /* the timer expired once (tail loss probe sent) */
+  uint32_t stream_sseq[RUDP_MAX_STREAMS]; /* next sseq of each stream */
+  int closed;
+
+  /* receiving */
+  struct rx_slot *rx; /* RUDP_WINDOW slots, by seq % RUDP_WINDOW */
+  int synced;         /* got a first packet of peer_session */
+  uint32_t peer_session;
+  uint64_t rcv_next; /* everything before it arrived */
+  uint64_t rcv_max;  /* highest seq that arrived */
+  uint64_t fin_seq;  /* seq of the peer's end, 0 if not arrived */
+  int ack_pending;
+  uint32_t stream_next[RUDP_MAX_STREAMS]; /* sseq to deliver next */
+  uint64_t held[RUDP_MAX_STREAMS][RUDP_WINDOW]; /* seq, by sseq % WINDOW */
+
+  uint64_t sent, retransmits, fast_losses, probes, timeouts, loss_events;
+  uint64_t received, duplicates, delivered, acks_sent, acks_received;
+};
+
+static void reset_receiver(struct rudp *r, uint32_t peer_session) {
+  r->synced = 1;
+  r->peer_session = peer_session;
+  r->rcv_next = 1;
+  r->rcv_max = 0;
+  r->fin_seq = 0;
+  for (uint32_t i = 0; i < RUDP_WINDOW; ++i)
+    r->rx[i].seq = 0;
+  memset(r->stream_next, 0, sizeof(r->stream_next));
+  memset(r->held, 0, sizeof(r->held));
+}
+
+struct rudp *rudp_new(rudp_output_fn output, rudp_deliver_fn deliver,
+                      void *arg) {
+  struct rudp *r = (struct rudp *)calloc(1, sizeof(struct rudp));
+  if (r == NULL)
+    return NULL;
+  r->tx = (struct tx_slot *)calloc(RUDP_WINDOW, sizeof(struct tx_slot));
+  r->rx = (struct rx_slot *)calloc(RUDP_WINDOW, sizeof(struct rx_slot));
+  if (r->tx == NULL || r->rx == NULL) {
+    rudp_free(r);
+    return NULL;
+  }
+  r->output = output;
+  r->deliver = deliver;
+  r->arg = arg;
+  if (getrandom(&r->session, sizeof(r->session), 0) != sizeof(r->session))
+    r->session = (uint32_t)time(NULL);
+  r->una = r->next_tx = r->next_seq = r->lost_from = 1;
+  r->dupthresh = DUPTHRESH;
+  r->cwnd = INITIAL_CWND;
+  r->ssthresh = RUDP_WINDOW;
+  r->rto_us = INITIAL_RTO_US;
+  r->rcv_next = 1;
+  return r;
+}
+
+void rudp_free(struct rudp *r) {
+  if (r == NULL)
+    return;
+  free(r->tx);
+  free(r->rx);
+  free(r);
+}
+
+/* Queues a packet. 0 on success and -1 if the window is full. */
+static int enqueue(struct rudp *r, uint8_t type, uint8_t stream, uint32_t sseq,
+                   const void *data, size_t len) {
+  if (r->next_seq - r->una >= RUDP_WINDOW)
+    return -1;
+  struct tx_slot *s = &r->tx[r->next_seq % RUDP_WINDOW];
+  s->seq = r->next_seq++;
+  s->sent_us = 0;
+  s->sseq = sseq;
+  s->len = len;
+  s->type = type;
+  s->stream = stream;
+  s->in_flight = s->sacked = s->lost = s->retransmitted = 0;
+  if (len != 0)
+    memcpy(s->data, data, len);
+  return 0;
+}
+
+int rudp_send(struct rudp *r, unsigned stream, int unordered, const void *msg,
+              size_t len) {
+  if (stream >= RUDP_MAX_STREAMS || len > RUDP_MAX_PAYLOAD || r->closed)
+    return -1;
+  uint32_t sseq = unordered ? 0 : r->stream_sseq[stream];
+  if (enqueue(r, RUDP_DATA, stream | (unordered ? RUDP_UNORDERED : 0), sseq,
+              msg, len) == -1)
+    return -1;
+  if (!unordered)
+    ++r->stream_sseq[stream];
+  return 0;
+}
+
+int rudp_close(struct rudp *r) {
+  if (!r->closed && enqueue(r, RUDP_FIN, 0, 0, NULL, 0) == -1)
+    return -1;
+  r->closed = 1;
+  return 0;
+}
+
+uint32_t rudp_pending(const struct rudp *r) {
+  return (uint32_t)(r->next_seq - r->una);
+}
+
+int rudp_peer_closed(const struct rudp *r) {
+  return r->fin_seq != 0 && r->rcv_next > r->fin_seq;
+}
+
+/* Starts the retransmission timer - for a tail loss probe first. */
+static void arm_timer(struct rudp *r, uint64_t now_us) {
+  uint64_t pto = r->srtt_us != 0 ? 2 * r->srtt_us : r->rto_us;
+  r->probed = 0;
+  r->timer_at = now_us + (pto > MIN_PTO_US ? pto : MIN_PTO_US);
+}
+
+/* Sends (or re-sends) packet s. */
+static void transmit(struct rudp *r, struct tx_slot *s, uint64_t now_us) {
+  char buf[RUDP_MAX_PACKET];
+  struct rudp_header h = {.magic = htobe32(RUDP_MAGIC),
+                          .session = htobe32(r->session),
+                          .seq = htobe64(s->seq),
+                          .sseq = htobe32(s->sseq),
+                          .len = htobe16(s->len),
+                          .type = s->type,
+                          .stream = s->stream};
+
+  memcpy(buf, &h, sizeof(h));
+  memcpy(buf + sizeof(h), s->data, s->len);
+  r->output(r->arg, buf, sizeof(h) + s->len);
+
+  if (s->sent_us != 0) {
+    s->retransmitted = 1;
+    ++r->retransmits;
+  }
+  s->sent_us = now_us;
+  s->order = ++r->sent;
+  s->in_flight = 1;
+  ++r->in_flight;
+  if (r->timer_at == 0)
+    arm_timer(r, now_us);
+}
+
+/* Sends the ACK of what arrived so far. */
+static void send_ack(struct rudp *r) {
+  char buf[sizeof(struct rudp_header) +
+           MAX_SACK_BLOCKS * sizeof(struct sack_block)];
+  struct sack_block *blocks =
+      (struct sack_block *)(buf + sizeof(struct rudp_header));
+  uint16_t n = 0;
+
+  /* the ranges that arrived beyond rcv_next */
+  for (uint64_t seq = r->rcv_next + 1; seq <= r->rcv_max && n < MAX_SACK_BLOCKS;
+       ++seq) {
+    if (r->rx[seq % RUDP_WINDOW].seq != seq)
+      continue;
+    uint64_t start = seq;
+    while (seq <= r->rcv_max && r->rx[seq % RUDP_WINDOW].seq == seq)
+      ++seq;
+    blocks[n].start = htobe64(start);
+    blocks[n].end = htobe64(seq);
+    ++n;
+  }
+
+  struct rudp_header h = {.magic = htobe32(RUDP_MAGIC),
+                          .session = htobe32(r->peer_session),
+                          .seq = htobe64(r->rcv_next),
+                          .len = htobe16(n),
+                          .type = RUDP_ACK};
+  memcpy(buf, &h, sizeof(h));
+  r->output(r->arg, buf, sizeof(h) + n * sizeof(struct sack_block));
+  r->ack_pending = 0;
+  ++r->acks_sent;
+}
+
+/* Delivers the held messages of stream that are next in line. */
+static void deliver_held(struct rudp *r, unsigned stream) {
+  for (;;) {
+    uint32_t sseq = r->stream_next[stream];
+    uint64_t seq = r->held[stream][sseq % RUDP_WINDOW];
+    struct rx_slot *s = &r->rx[seq % RUDP_WINDOW];
+    if (seq == 0 || s->seq != seq || !s->held || s->sseq != sseq)
+      return;
+    r->held[stream][sseq % RUDP_WINDOW] = 0;
+    s->held = 0;
+    ++r->stream_next[stream];
+    ++r->delivered;
+    r->deliver(r->arg, stream, s->data, s->len);
+  }
+}
+
+/* Handles a DATA or FIN packet. */
+static void handle_data(struct rudp *r, const struct rudp_header *h,
+                        const char *payload) {
+  unsigned stream = h->stream & ~RUDP_UNORDERED;
+
+  ++r->received;
+  r->ack_pending = 1; /* duplicates too - our last ACK may have been lost */
+  if (h->seq < r->rcv_next || r->rx[h->seq % RUDP_WINDOW].seq == h->seq) {
+    ++r->duplicates;
+    return;
+  }
+  /* the sender never gets that far ahead - unless it is broken */
+  if (h->seq >= r->rcv_next + RUDP_WINDOW || stream >= RUDP_MAX_STREAMS)
+    return;
+
+  struct rx_slot *s = &r->rx[h->seq % RUDP_WINDOW];
+  s->seq = h->seq;
+  s->held = 0;
+  if (h->seq > r->rcv_max)
+    r->rcv_max = h->seq;
+
+  if (h->type == RUDP_FIN) {
+    r->fin_seq = h->seq;
+  } else if ((h->stream & RUDP_UNORDERED) ||
+             h->sseq == r->stream_next[stream]) {
+    if (!(h->stream & RUDP_UNORDERED))
+      ++r->stream_next[stream];
+    ++r->delivered;
+    r->deliver(r->arg, stream, payload, h->len);
+    deliver_held(r, stream);
+  } else if (h->sseq - r->stream_next[stream] < RUDP_WINDOW) {
+    /* an earlier message of its stream is missing - hold it back (its
+     * predecessor has a lower seq, so the slot is not reused before) */
+    s->sseq = h->sseq;
+    s->len = h->len;
+    s->stream = stream;
+    s->held = 1;
+    memcpy(s->data, payload, h->len);
+    r->held[stream][h->sseq % RUDP_WINDOW] = h->seq;
+  }
+
+  while (r->rx[r->rcv_next % RUDP_WINDOW].seq == r->rcv_next)
+    ++r->rcv_next;
+}
+
+/* Takes an RTT sample (RFC 6298). */
+static void update_rtt(struct rudp *r, uint64_t rtt_us) {
+  if (r->srtt_us == 0) {
+    r->srtt_us = rtt_us;
+    r->rttvar_us = rtt_us / 2;
+  } else {
+    uint64_t err =
+        rtt_us > r->srtt_us ? rtt_us - r->srtt_us : r->srtt_us - rtt_us;
+    r->rttvar_us = (3 * r->rttvar_us + err) / 4;
+    r->srtt_us = (7 * r->srtt_us + rtt_us) / 8;
+  }
+  /* with a clock granularity of 1 ms */
+  r->rto_us = r->srtt_us + (4 * r->rttvar_us > 1000 ? 4 * r->rttvar_us : 1000);
+  if (r->rto_us < MIN_RTO_US)
+    r->rto_us = MIN_RTO_US;
+  if (r->rto_us > MAX_RTO_US)
+    r->rto_us = MAX_RTO_US;
+}
+
+/* Takes packet s out of flight once acknowledged (cumulatively or by a SACK
+ * block). Returns 1 if that is news. */
+static int acknowledge(struct rudp *r, struct tx_slot *s,
+                       struct tx_slot **sample) {
+  if (s->sacked)
+    return 0;
+  s->sacked = 1;
+  if (s->in_flight) {
+    s->in_flight = 0;
+    --r->in_flight;
+  }
+  if (s->lost) { /* the original arrived after all */
+    if (s->lost == LOST_ACK && r->max_sacked >= s->seq &&
+        r->max_sacked - s->seq + 1 > r->dupthresh)
+      r->dupthresh = r->max_sacked - s->seq + 1 < MAX_DUPTHRESH
+                         ? r->max_sacked - s->seq + 1
+                         : MAX_DUPTHRESH; /* it was reordered */
+    s->lost = 0;
+    --r->lost;
+  }
+  if (s->order > r->sacked_order)
+    r->sacked_order = s->order;
+  /* Karn's algorithm - a retransmitted packet's RTT is ambiguous */
+  if (!s->retransmitted && (*sample == NULL || s->seq > (*sample)->seq))
+    *sample = s;
+  return 1;
+}
+
+/* Deems the packets in flight that were sent before a packet that has since
+ * been acknowledged lost if they are dupthresh or more packets behind the
+ * highest SACKed one, or if they have been waiting for more than an RTT plus
+ * a reordering window (like RACK, RFC 8985 - so that a single later packet
+ * is enough to detect a loss). */
+static void detect_losses(struct rudp *r, uint64_t now_us) {
+  uint64_t wait_us = r->srtt_us + (r->srtt_us / 4 > MIN_REORDER_US
+                                       ? r->srtt_us / 4
+                                       : MIN_REORDER_US);
+
+  r->loss_at = 0;
+  for (uint64_t seq = r->una; seq < r->next_tx; ++seq) {
+    struct tx_slot *s = &r->tx[seq % RUDP_WINDOW];
+    if (!s->in_flight || s->order > r->sacked_order)
+      continue;
+    if (seq + r->dupthresh > r->max_sacked && now_us < s->sent_us + wait_us) {
+      if (r->loss_at == 0 || s->sent_us + wait_us < r->loss_at)
+        r->loss_at = s->sent_us + wait_us; /* check again then */
+      continue;
+    }
+    s->in_flight = 0;
+    --r->in_flight;
+    s->lost = LOST_ACK;
+    ++r->lost;
+    ++r->fast_losses;
+    if (seq < r->lost_from)
+      r->lost_from = seq;
+    if (seq >= r->recovery_end) { /* a new loss event - back off once */
+      ++r->loss_events;
+      r->ssthresh = r->cwnd / 2 > 2 ? r->cwnd / 2 : 2;
+      r->cwnd = r->ssthresh;
+      r->recovery_end = r->next_tx;
+    }
+  }
+}
+
+/* Handles an ACK. */
+static void handle_ack(struct rudp *r, const struct rudp_header *h,
+                       const char *payload, size_t len, uint64_t now_us) {
+  struct tx_slot *sample = NULL;
+  uint32_t acked = 0;
+
+  if (h->seq > r->next_tx || h->len * sizeof(struct sack_block) > len)
+    return;
+  ++r->acks_received;
+
+  for (; r->una < h->seq; ++r->una)
+    acked += acknowledge(r, &r->tx[r->una % RUDP_WINDOW], &sample);
+
+  for (uint16_t i = 0; i < h->len; ++i) {
+    struct sack_block b;
+    memcpy(&b, payload + i * sizeof(b), sizeof(b));
+    uint64_t start = be64toh(b.start), end = be64toh(b.end);
+    if (start < r->una)
+      start = r->una;
+    if (end > r->next_tx)
+      end = r->next_tx;
+    for (uint64_t seq = start; seq < end; ++seq)
+      acked += acknowledge(r, &r->tx[seq % RUDP_WINDOW], &sample);
+    if (end > start && end - 1 > r->max_sacked)
+      r->max_sacked = end - 1;
+  }
+
+  if (sample != NULL)
+    update_rtt(r, now_us - sample->sent_us);
+  detect_losses(r, now_us);
+
+  /* slow start, then one packet per window - but not while recovering */
+  if (r->una >= r->recovery_end) {
+    r->cwnd += r->cwnd < r->ssthresh ? acked : acked / r->cwnd;
+    if (r->cwnd > RUDP_WINDOW)
+      r->cwnd = RUDP_WINDOW;
+  }
+
+  /* restart the retransmission timer on progress (RFC 6298 5.3) */
+  if (r->in_flight == 0)
+    r->timer_at = 0;
+  else if (acked != 0)
+    arm_timer(r, now_us);
+}
+
+void rudp_input(struct rudp *r, const void *pkt, size_t len, uint64_t now_us) {
+  struct rudp_header h;
+
+  if (len < sizeof(h))
+    return;
+  memcpy(&h, pkt, sizeof(h));
+  h.magic = be32toh(h.magic);
+  h.session = be32toh(h.session);
+  h.seq = be64toh(h.seq);
+  h.sseq = be32toh(h.sseq);
+  h.len = be16toh(h.len);
+  if (h.magic != RUDP_MAGIC)
+    return;
+  const char *payload = (const char *)pkt + sizeof(h);
+  len -= sizeof(h);
+
+  if (h.type == RUDP_ACK) {
+    if (h.session == r->session)
+      handle_ack(r, &h, payload, len, now_us);
+    return;
+  }
+  if ((h.type != RUDP_DATA && h.type != RUDP_FIN) || h.len > len)
+    return;
+  if (!r->synced || h.session != r->peer_session) /* a new (or restarted)
+                                                     peer */
+    reset_receiver(r, h.session);
+  handle_data(r, &h, payload);
+}
+
+/* The retransmission timer expired: everything in flight is deemed lost and
+ * the congestion window starts over. */
+static void handle_timeout(struct rudp *r) {
+  ++r->timeouts;
+  ++r->loss_events;
+  r->ssthresh = r->in_flight / 2.0 > 2 ? r->in_flight / 2.0 : 2;
+  r->cwnd = 1;
+  r->rto_us = r->rto_us * 2 < MAX_RTO_US ? r->rto_us * 2 : MAX_RTO_US;
+  for (uint64_t seq = r->una; seq < r->next_tx; ++seq) {
+    struct tx_slot *s = &r->tx[seq % RUDP_WINDOW];
+    if (!s->in_flight)
+      continue;
+    s->in_flight = 0;
+    s->lost = LOST_TIMEOUT;
+    ++r->lost;
+  }
+  r->in_flight = 0;
+  r->lost_from = r->una;
+  r->recovery_end = r->next_tx;
+  r->timer_at = 0;
+}
+
+/* The retransmission timer expired for the first time: the last packet in
+ * flight is sent again so that its ACK reveals what else is missing (tail
+ * loss probe, RFC 8985) - without the back off of a timeout. */
+static void send_probe(struct rudp *r, uint64_t now_us) {
+  for (uint64_t seq = r->next_tx; seq-- > r->una;) {
+    struct tx_slot *s = &r->tx[seq % RUDP_WINDOW];
+    if (s->in_flight) {
+      s->in_flight = 0;
+      --r->in_flight;
+      transmit(r, s, now_us);
+      break;
+    }
+  }
+  ++r->probes;
+  r->probed = 1;
+  r->timer_at = now_us + r->rto_us;
+}
+
+/* Returns the lowest packet waiting for its retransmission, NULL if none. */
+static struct tx_slot *next_lost(struct rudp *r) {
+  if (r->lost_from < r->una)
+    r->lost_from = r->una;
+  for (; r->lost != 0 && r->lost_from < r->next_tx; ++r->lost_from) {
+    struct tx_slot *s = &r->tx[r->lost_from % RUDP_WINDOW];
+    if (s->lost)
+      return s;
+  }
+  return NULL;
+}
+
+uint64_t rudp_tick(struct rudp *r, uint64_t now_us) {
+  if (r->loss_at != 0 && now_us >= r->loss_at)
+    detect_losses(r, now_us);
+  if (r->timer_at != 0 && now_us >= r->timer_at) {
+    if (!r->probed)
+      send_probe(r, now_us);
+    else
+      handle_timeout(r);
+  }
+
+  /* retransmissions first, then new packets */
+  while (r->in_flight < (uint32_t)r->cwnd) {
+    struct tx_slot *s = next_lost(r);
+    if (s != NULL) {
+      s->lost = 0;
+      --r->lost;
+    } else if (r->next_tx < r->next_seq) {
+      s = &r->tx[r->next_tx++ % RUDP_WINDOW];
+    } else {
+      break;
+    }
+    transmit(r, s, now_us);
+  }
+
+  if (r->ack_pending)
+    send_ack(r);
+  uint64_t next = r->timer_at != 0 ? r->timer_at : UINT64_MAX;
+  return r->loss_at != 0 && r->loss_at < next ? r->loss_at : next;
+}
+
+uint64_t rudp_retransmits(const struct rudp *r) { return r->retransmits; }
+
+void rudp_print_stats(const struct rudp *r, FILE *out, const char *prefix) {
+  fprintf(out,
+          "%ssent %lu packets (%lu retransmissions: %lu deemed lost from "
+          "ACKs, %lu probes, %lu timeouts - in %lu loss events), %lu ACKs\n",
+          prefix, r->sent, r->retransmits, r->fast_losses, r->probes,
+          r->timeouts, r->loss_events, r->acks_sent);
+  fprintf(out,
+          "%sreceived %lu packets (%lu duplicates) and %lu ACKs, delivered "
+          "%lu messages\n",
+          prefix, r->received, r->duplicates, r->acks_received, r->delivered);
+  fprintf(out,
+          "%srtt %.3f ms (var %.3f ms), rto %.1f ms, cwnd %.1f, reordering "
+          "tolerated %u packets\n",
+          prefix, r->srtt_us / 1000.0, r->rttvar_us / 1000.0,
+          r->rto_us / 1000.0, r->cwnd, r->dupthresh);
+}
@@ -0,0 +1,82 @@
+#ifndef RUDP_H
+#define RUDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A reliable message channel over UDP (udptalker -R / udplistener -R and
+ * rudpbench.c). Every message is sent as one datagram with a packet sequence
+ * number and acknowledged with a cumulative ACK plus selective ACK (SACK)
+ * blocks for what arrived beyond it, so that only the packets that are
+ * actually missing are retransmitted - after three later packets were SACKed
+ * (fast retransmit) or after a retransmission timeout derived from the
+ * measured RTT (RFC 6298). How many packets are in flight is limited by a
+ * congestion window (slow start and additive increase, halved once per loss
+ * event - like TCP NewReno).
+ *
+ * Messages are ordered per stream (RUDP_MAX_STREAMS of them): a lost message
+ * only holds back the later messages of its own stream, not those of the
+ * other streams, and unordered messages are delivered as soon as they
+ * arrive. There is no fragmentation - a message is at most RUDP_MAX_PAYLOAD
+ * bytes.
+ *
+ * A channel does no I/O itself (so that tests can drop, reorder or delay its
+ * packets in-process): packets it wants to send are passed to an output
+ * callback and the packets received from the peer are fed to rudp_input. */
+struct rudp;
+
+#define RUDP_MAX_PAYLOAD 1200 /* 1280 bytes IPv6 minimum MTU, minus headers */
+#define RUDP_MAX_PACKET (24 + RUDP_MAX_PAYLOAD) /* see struct rudp_header */
+#define RUDP_MAX_STREAMS 8
+#define RUDP_WINDOW 1024 /* max number of unacknowledged packets */
+
+/* called for every packet to send to the peer */
+typedef void (*rudp_output_fn)(void *arg, const void *pkt, size_t len);
+
+/* called for every message delivered from the peer */
+typedef void (*rudp_deliver_fn)(void *arg, unsigned stream, const void *msg,
+                                size_t len);
+
+/* creates a channel. Returns NULL on failure */
+struct rudp *rudp_new(rudp_output_fn output, rudp_deliver_fn deliver,
+                      void *arg);
+
+/* queues message msg for stream (in order with the stream's other ordered
+ * messages unless unordered is set). 0 on success and -1 if the message is
+ * too long or RUDP_WINDOW packets are already queued or unacknowledged - in
+ * which case try again after the next rudp_input */
+int rudp_send(struct rudp *r, unsigned stream, int unordered, const void *msg,
+              size_t len);
+
+/* queues the end of the channel (after everything queued before it). 0 on
+ * success and -1 if the window is full (see rudp_send) */
+int rudp_close(struct rudp *r);
+
+/* handles a packet received from the peer */
+void rudp_input(struct rudp *r, const void *pkt, size_t len, uint64_t now_us);
+
+/* sends what the congestion window allows, pending ACKs and
+ * retransmissions. Call it after rudp_send/rudp_input (once per batch is
+ * enough) and whenever the time it returns (CLOCK_MONOTONIC in us, UINT64_MAX
+ * for never) has come */
+uint64_t rudp_tick(struct rudp *r, uint64_t now_us);
+
+/* returns the number of queued or unacknowledged packets */
+uint32_t rudp_pending(const struct rudp *r);
+
+/* returns 1 once the peer's end (rudp_close) and everything before it has
+ * arrived, 0 otherwise */
+int rudp_peer_closed(const struct rudp *r);
+
+/* returns the number of packets sent again so far */
+uint64_t rudp_retransmits(const struct rudp *r);
+
+/* prints statistics (packets, retransmissions, RTT, congestion window) to out
+ * with every line prefixed by prefix */
+void rudp_print_stats(const struct rudp *r, FILE *out, const char *prefix);
+
+/* releases the channel */
+void rudp_free(struct rudp *r);
+
+#endif
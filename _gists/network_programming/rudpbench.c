@@ -0,0 +1,515 @@
+/*
+ * rudpbench.c -- test harness of the reliable UDP channel (rudp.c): sends
+ * messages over the loopback interface between two threads, with packet loss
+ * and reordering injected in-process (by the channel's output callback - no
+ * netem needed), checks that every message arrives exactly once and in
+ * order, and compares goodput and delivery latency against TCP.
+ *
+ * Usage: ./rudpbench [-n MESSAGES] [-l SIZE] [-r RATE]
+ *
+ *   -n  number of messages of the bulk runs (default 100000). The paced runs
+ *       send a tenth of them
+ *   -l  message size in bytes (default 1000, max RUDP_MAX_PAYLOAD)
+ *   -r  messages per second of the paced runs (default 10000)
+ *
+ * Every scenario runs twice: in bulk (as fast as the window allows - the
+ * goodput) and paced (the latency from rudp_send/write to delivery, without
+ * the time spent waiting for room in the window). Loss and reordering hit
+ * both directions (i.e., ACKs too); a reordered packet is sent after the
+ * next REORDER_DEPTH ones. TCP runs without injected loss (the kernel's
+ * retransmissions cannot be faked from user space) - it is the baseline of
+ * the lossless rudp run.
+ *
+ * compile with:
+ *
+ *   cc -O2 -pthread -o rudpbench rudpbench.c rudp.c
+ */
+
+#define _GNU_SOURCE /* ppoll */
+#include "rudp.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_HELD 64      /* packets held back for reordering */
+#define REORDER_DEPTH 3  /* a reordered packet is sent after this many more */
+#define HOLD_US 1000     /* ... or after this long */
+#define SOCKET_BUF (1 << 20)
+#define RUN_TIMEOUT_US 120000000
+
+struct scenario {
+  const char *name;
+  int tcp;
+  double loss;    /* fraction of packets dropped */
+  double reorder; /* fraction of packets reordered */
+  unsigned streams;
+  int unordered;
+};
+
+static const struct scenario scenarios[] = {
+    {"tcp", 1, 0, 0, 1, 0},
+    {"rudp", 0, 0, 0, 1, 0},
+    {"rudp, 5% reordered", 0, 0, 0.05, 1, 0},
+    {"rudp, 1% loss", 0, 0.01, 0, 1, 0},
+    {"rudp, 1% loss, 8 streams", 0, 0.01, 0, 8, 0},
+    {"rudp, 1% loss, unordered", 0, 0.01, 0, 1, 1},
+    {"rudp, 5% loss", 0, 0.05, 0, 1, 0},
+    {"rudp, 5% loss, 5% reordered", 0, 0.05, 0.05, 1, 0},
+};
+
+/* a packet held back to be sent later */
+struct held_pkt {
+  uint64_t since_us;
+  uint32_t after; /* number of packets still to be sent before it */
+  uint32_t len;
+  char data[RUDP_MAX_PACKET];
+};
+
+struct run;
+
+/* one side of a run */
+struct endpoint {
+  struct run *run;
+  int fd;
+  struct rudp *r;
+  const struct scenario *sc;
+  unsigned seed;
+  struct held_pkt held[MAX_HELD];
+  int nheld;
+  uint64_t dropped, reordered;
+};
+
+/* a run: what the sender sends and what the receiver checks and measures */
+struct run {
+  const struct scenario *sc;
+  uint64_t n;
+  size_t size;
+  uint32_t rate; /* 0 for bulk */
+  struct endpoint ends[2];
+  atomic_int done;
+  int failed;
+  uint64_t start_us, end_us;
+  uint64_t delivered;
+  uint64_t retransmits;
+  uint64_t next[RUDP_MAX_STREAMS]; /* expected message number per stream */
+  uint32_t *samples;               /* delivery latencies in us */
+};
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Waits for fd to become readable until deadline_us at the latest. */
+static void wait_readable(int fd, uint64_t deadline_us) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  uint64_t now = now_us();
+  uint64_t us = deadline_us > now ? deadline_us - now : 0;
+  struct timespec ts = {us / 1000000, (us % 1000000) * 1000};
+  if (ppoll(&pfd, 1, &ts, NULL) == -1 && errno != EINTR)
+    perror("ppoll");
+}
+
+static void send_packet(struct endpoint *e, const void *pkt, size_t len) {
+  if (send(e->fd, pkt, len, 0) == -1 && errno != EAGAIN && errno != ENOBUFS &&
+      errno != ECONNREFUSED)
+    perror("send");
+}
+
+/* Sends the held packets that are due. */
+static void release_held(struct endpoint *e, int sent_one) {
+  uint64_t now = 0;
+  for (int i = 0; i < e->nheld;) {
+    struct held_pkt *h = &e->held[i];
+    if (sent_one && h->after > 0)
+      --h->after;
+    if (h->after > 0 && !sent_one && now == 0)
+      now = now_us();
+    if (h->after == 0 || (!sent_one && now >= h->since_us + HOLD_US)) {
+      send_packet(e, h->data, h->len);
+      *h = e->held[--e->nheld];
+    } else {
+      ++i;
+    }
+  }
+}
+
+/* rudp output callback - the lossy, reordering link */
+static void link_output(void *arg, const void *pkt, size_t len) {
+  struct endpoint *e = (struct endpoint *)arg;
+
+  if (rand_r(&e->seed) < e->sc->loss * RAND_MAX) {
+    ++e->dropped;
+    return;
+  }
+  if (e->nheld < MAX_HELD && rand_r(&e->seed) < e->sc->reorder * RAND_MAX) {
+    struct held_pkt *h = &e->held[e->nheld++];
+    h->since_us = now_us();
+    h->after = REORDER_DEPTH;
+    h->len = len;
+    memcpy(h->data, pkt, len);
+    ++e->reordered;
+    return;
+  }
+  send_packet(e, pkt, len);
+  release_held(e, 1);
+}
+
+/* Checks and measures a message that arrived. */
+static void check_message(struct run *run, unsigned stream, const char *msg,
+                          size_t len) {
+  uint64_t sent_us, nbr;
+
+  if (len != run->size) {
+    fprintf(stderr, "message of %zu bytes instead of %zu\n", len, run->size);
+    run->failed = 1;
+    return;
+  }
+  memcpy(&sent_us, msg, sizeof(sent_us));
+  memcpy(&nbr, msg + sizeof(sent_us), sizeof(nbr));
+  if (!run->sc->unordered && nbr != run->next[stream]) {
+    fprintf(stderr, "stream %u: message %lu instead of %lu\n", stream, nbr,
+            run->next[stream]);
+    run->failed = 1;
+  }
+  run->next[stream] = nbr + 1;
+  run->samples[run->delivered++] = now_us() - sent_us;
+}
+
+/* rudp deliver callback */
+static void deliver(void *arg, unsigned stream, const void *msg, size_t len) {
+  check_message(((struct endpoint *)arg)->run, stream, (const char *)msg, len);
+}
+
+/* Feeds the packets that arrived to the channel. */
+static void drain(struct endpoint *e) {
+  char buf[RUDP_MAX_PACKET];
+  ssize_t n;
+  while ((n = recv(e->fd, buf, sizeof(buf), MSG_DONTWAIT)) >= 0)
+    rudp_input(e->r, buf, n, now_us());
+}
+
+/* Fills message nbr of the run (send time, number, padding). */
+static void fill_message(char *msg, size_t size, uint64_t nbr) {
+  uint64_t t = now_us();
+  memcpy(msg, &t, sizeof(t));
+  memcpy(msg + sizeof(t), &nbr, sizeof(nbr));
+  memset(msg + 2 * sizeof(t), 'x', size - 2 * sizeof(t));
+}
+
+static void *rudp_sender(void *arg) {
+  struct run *run = (struct run *)arg;
+  struct endpoint *e = &run->ends[0];
+  char msg[RUDP_MAX_PAYLOAD];
+  uint64_t sent = 0, next_us = now_us();
+  int closed = 0;
+
+  while (!closed || rudp_pending(e->r) != 0) {
+    uint64_t now = now_us();
+    if (now > run->start_us + RUN_TIMEOUT_US) {
+      fprintf(stderr, "%s: timed out\n", run->sc->name);
+      run->failed = 1;
+      break;
+    }
+    while (sent < run->n && (run->rate == 0 || now >= next_us)) {
+      unsigned stream = sent % run->sc->streams;
+      fill_message(msg, run->size, sent / run->sc->streams);
+      if (rudp_send(e->r, stream, run->sc->unordered, msg, run->size) == -1)
+        break; /* the window is full */
+      ++sent;
+      if (run->rate != 0)
+        next_us += 1000000 / run->rate;
+    }
+    if (sent == run->n && !closed)
+      closed = rudp_close(e->r) == 0;
+
+    uint64_t deadline = rudp_tick(e->r, now);
+    release_held(e, 0);
+    if (run->rate != 0 && sent < run->n && next_us < deadline)
+      deadline = next_us;
+    if (e->nheld != 0 && now + HOLD_US < deadline)
+      deadline = now + HOLD_US;
+    wait_readable(e->fd, deadline);
+    drain(e);
+  }
+  atomic_store(&run->done, 1);
+  return NULL;
+}
+
+static void *rudp_receiver(void *arg) {
+  struct run *run = (struct run *)arg;
+  struct endpoint *e = &run->ends[1];
+
+  while (!atomic_load(&run->done)) {
+    uint64_t deadline = rudp_tick(e->r, now_us());
+    release_held(e, 0);
+    if (e->nheld != 0 && now_us() + HOLD_US < deadline)
+      deadline = now_us() + HOLD_US;
+    if (deadline > now_us() + 10000) /* check done now and then */
+      deadline = now_us() + 10000;
+    wait_readable(e->fd, deadline);
+    drain(e);
+    if (run->end_us == 0 && rudp_peer_closed(e->r))
+      run->end_us = now_us();
+  }
+  return NULL;
+}
+
+/* Creates a pair of UDP sockets on the loopback interface connected to each
+ * other. 0 on success and -1 on failure. */
+static int udp_pair(int fds[2]) {
+  struct sockaddr_in addr[2];
+  socklen_t len = sizeof(addr[0]);
+  int buf = SOCKET_BUF;
+
+  for (int i = 0; i < 2; ++i) {
+    memset(&addr[i], 0, sizeof(addr[i]));
+    addr[i].sin_family = AF_INET;
+    addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fds[i] == -1 ||
+        bind(fds[i], (struct sockaddr *)&addr[i], sizeof(addr[i])) == -1 ||
+        getsockname(fds[i], (struct sockaddr *)&addr[i], &len) == -1) {
+      perror("udp socket");
+      return -1;
+    }
+    setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+    setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+  }
+  if (connect(fds[0], (struct sockaddr *)&addr[1], sizeof(addr[1])) == -1 ||
+      connect(fds[1], (struct sockaddr *)&addr[0], sizeof(addr[0])) == -1) {
+    perror("connect");
+    return -1;
+  }
+  return 0;
+}
+
+static int run_rudp(struct run *run) {
+  int fds[2];
+  pthread_t sender, receiver;
+
+  if (udp_pair(fds) == -1)
+    return -1;
+  for (int i = 0; i < 2; ++i) {
+    struct endpoint *e = &run->ends[i];
+    e->run = run;
+    e->fd = fds[i];
+    e->sc = run->sc;
+    e->seed = 42 + i;
+    e->r = rudp_new(link_output, deliver, e);
+    if (e->r == NULL) {
+      perror("rudp_new");
+      return -1;
+    }
+  }
+
+  run->start_us = now_us();
+  pthread_create(&receiver, NULL, rudp_receiver, run);
+  pthread_create(&sender, NULL, rudp_sender, run);
+  pthread_join(sender, NULL);
+  pthread_join(receiver, NULL);
+  run->retransmits = rudp_retransmits(run->ends[0].r);
+  for (int i = 0; i < 2; ++i) {
+    close(run->ends[i].fd);
+    rudp_free(run->ends[i].r);
+  }
+  return 0;
+}
+
+/* Writes len bytes of buf to blocking socket fd. 0 on success and -1 on
+ * failure. */
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void *tcp_sender(void *arg) {
+  struct run *run = (struct run *)arg;
+  int fd = run->ends[0].fd;
+  char msg[sizeof(uint32_t) + RUDP_MAX_PAYLOAD];
+  uint32_t len = run->size;
+  uint64_t next_us = now_us();
+
+  memcpy(msg, &len, sizeof(len));
+  for (uint64_t sent = 0; sent < run->n; ++sent) {
+    if (run->rate != 0) {
+      uint64_t now = now_us();
+      if (now < next_us)
+        usleep(next_us - now);
+      next_us += 1000000 / run->rate;
+    }
+    /* every message is a write of its own, like every rudp message is a
+     * datagram of its own */
+    fill_message(msg + sizeof(len), run->size, sent);
+    if (write_all(fd, msg, sizeof(len) + run->size) == -1) {
+      perror("write");
+      run->failed = 1;
+      break;
+    }
+  }
+  shutdown(fd, SHUT_WR);
+  return NULL;
+}
+
+static void *tcp_receiver(void *arg) {
+  struct run *run = (struct run *)arg;
+  int fd = run->ends[1].fd;
+  static char buf[1 << 18];
+  size_t have = 0;
+  ssize_t n;
+
+  while ((n = read(fd, buf + have, sizeof(buf) - have)) > 0) {
+    have += n;
+    size_t off = 0;
+    for (;;) {
+      uint32_t len;
+      if (have - off < sizeof(len))
+        break;
+      memcpy(&len, buf + off, sizeof(len));
+      if (have - off < sizeof(len) + len)
+        break;
+      check_message(run, 0, buf + off + sizeof(len), len);
+      off += sizeof(len) + len;
+    }
+    memmove(buf, buf + off, have - off);
+    have -= off;
+  }
+  run->end_us = now_us();
+  return NULL;
+}
+
+static int run_tcp(struct run *run) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  pthread_t sender, receiver;
+  int y = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(lfd, 1) == -1 ||
+      getsockname(lfd, (struct sockaddr *)&addr, &len) == -1) {
+    perror("tcp listener");
+    return -1;
+  }
+  run->ends[0].fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (run->ends[0].fd == -1 ||
+      connect(run->ends[0].fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      (run->ends[1].fd = accept(lfd, NULL, NULL)) == -1) {
+    perror("tcp connect");
+    return -1;
+  }
+  close(lfd);
+  setsockopt(run->ends[0].fd, IPPROTO_TCP, TCP_NODELAY, &y, sizeof(y));
+
+  run->start_us = now_us();
+  pthread_create(&receiver, NULL, tcp_receiver, run);
+  pthread_create(&sender, NULL, tcp_sender, run);
+  pthread_join(sender, NULL);
+  pthread_join(receiver, NULL);
+  close(run->ends[0].fd);
+  close(run->ends[1].fd);
+  return 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Runs scenario sc and prints a line of results. */
+static void run_scenario(const struct scenario *sc, uint64_t n, size_t size,
+                         uint32_t rate) {
+  struct run *run = (struct run *)calloc(1, sizeof(struct run));
+  if (run == NULL || (run->samples = (uint32_t *)malloc(
+                          n * sizeof(uint32_t))) == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  run->sc = sc;
+  run->n = n;
+  run->size = size;
+  run->rate = rate;
+
+  if ((sc->tcp ? run_tcp(run) : run_rudp(run)) == -1)
+    exit(EXIT_FAILURE);
+
+  double secs = (run->end_us - run->start_us) / 1e6;
+  printf("%-30s %9.1f MB/s", sc->name, n * size / secs / 1e6);
+  if (run->delivered != n || run->failed) {
+    printf("  FAILED: %lu of %lu messages delivered\n", run->delivered, n);
+  } else {
+    qsort(run->samples, n, sizeof(uint32_t), cmp_u32);
+    printf(" %9.0f %9.0f %9u", run->samples[n / 2] / 1.0,
+           run->samples[n * 99 / 100] / 1.0, run->samples[n - 1]);
+    if (sc->tcp) /* the kernel's retransmissions are not counted */
+      printf(" %8s\n", "-");
+    else
+      printf(" %7.1f%%\n", 100.0 * run->retransmits / (n + 1));
+  }
+  free(run->samples);
+  free(run);
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t n = 100000;
+  size_t size = 1000;
+  uint32_t rate = 10000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:l:r:")) != -1) {
+    switch (opt) {
+    case 'n':
+      n = strtoull(optarg, NULL, 10);
+      break;
+    case 'l':
+      size = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      rate = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n MESSAGES] [-l SIZE] [-r RATE]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (n < 10 || size < 16 || size > RUDP_MAX_PAYLOAD || rate == 0) {
+    fprintf(stderr, "need -n >= 10, 16 <= -l <= %d and -r > 0\n",
+            RUDP_MAX_PAYLOAD);
+    exit(EXIT_FAILURE);
+  }
+
+  const char *phases[] = {"bulk", "paced"};
+  for (int p = 0; p < 2; ++p) {
+    if (p == 0)
+      printf("bulk: %lu messages of %zu bytes\n", n, size);
+    else
+      printf("\npaced: %lu messages of %zu bytes at %u per second\n", n / 10,
+             size, rate);
+    printf("%-30s %14s %9s %9s %9s %8s\n", phases[p], "goodput", "p50 us",
+           "p99 us", "max us", "retx");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i)
+      run_scenario(&scenarios[i], p == 0 ? n : n / 10, size,
+                   p == 0 ? 0 : rate);
+  }
+  return EXIT_SUCCESS;
+}
@@ -1,17 +1,304 @@
+/*
+ * showipaddrs.c -- shows the IP addresses of a hostname, or, with -f,
+ * resolves every hostname of a file (one per line, - for stdin) with a pool
+ * of worker threads (i.e., at most JOBS lookups in flight at once).
+ *
+ * Usage: ./showipaddrs hostname
+ *        ./showipaddrs [-j JOBS] -f FILE
+ *
+ *   -f  batch mode: prints one JSON object per hostname (JSON Lines) as soon
+ *       as its lookup completes, e.g.,
+ *
+ *         {"line":3,"name":"localhost","latency_ms":0.412,"addrs":["::1",
+ *          "127.0.0.1"]}
+ *         {"line":4,"name":"nope.invalid","latency_ms":12.020,
+ *          "error":"Name or service not known"}
+ *
+ *       ("line" is the hostname's line number - sort by it to get the input
+ *       order back) and a summary (wall time, latency percentiles and the
+ *       speedup over resolving the names one after the other) to stderr.
+ *       Empty lines and lines starting with # are skipped.
+ *   -j  number of worker threads, i.e., concurrent lookups (default 32)
+ *
+ * Lookups use getaddrinfo, so they go through /etc/hosts, nsswitch.conf and
+ * the resolver's timeouts and retries (see resolv.conf) like any other
+ * program's. getaddrinfo_a would do the same on threads of its own, with no
+ * bound on how many run at once.
+ *
+ * compile with:
+ *
+ *   cc -pthread -o showipaddrs showipaddrs.c
+ */
+
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_JOBS 32
+#define MAX_JOBS 1024
+#define RESULT_MAX_LEN 4096 /* longest JSON line printed */
+
+/* a hostname of the batch */
+struct lookup {
+  char *name;
+  uint32_t line;
+  uint32_t latency_us;
+  int failed;
+};
+
+/* the batch shared by the workers */
+struct batch {
+  struct lookup *lookups;
+  size_t nbr_lookups;
+  atomic_size_t next; /* index of the next lookup to start */
+};
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the p->ai_addr is a different struct depending on the type of the IP (IPv4
+// vs. IPv6) - returns a pointer to the address in it
+static void *ip_addr(const struct addrinfo *p) {
+  if (p->ai_family == AF_INET) // IPv4
+    return &((struct sockaddr_in *)p->ai_addr)->sin_addr;
+  return &((struct sockaddr_in6 *)p->ai_addr)->sin6_addr; // IPv6
+}
+
+/* Appends to buf (of cap bytes, *len used so far) like snprintf. *len ends
+ * up as cap if it does not fit. */
+static void appendf(char *buf, size_t *len, size_t cap, const char *fmt, ...) {
+  va_list ap;
+  if (*len >= cap)
+    return;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf + *len, cap - *len, fmt, ap);
+  va_end(ap);
+  *len = n >= 0 && (size_t)n < cap - *len ? *len + n : cap;
+}
+
+/* Appends s to buf as a JSON string (see appendf). */
+static void append_json_string(char *buf, size_t *len, size_t cap,
+                               const char *s) {
+  appendf(buf, len, cap, "\"");
+  for (; *s != '\0'; ++s) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+      appendf(buf, len, cap, "\\%c", c);
+    else if (c < 0x20)
+      appendf(buf, len, cap, "\\u%04x", c);
+    else
+      appendf(buf, len, cap, "%c", c);
+  }
+  appendf(buf, len, cap, "\"");
+}
+
+/* Resolves l and prints its result line. */
+static void resolve(struct lookup *l) {
+  struct addrinfo hints, *res, *p;
+  char line[RESULT_MAX_LEN], ipstr[INET6_ADDRSTRLEN];
+  size_t len = 0;
+
+  // SOCK_STREAM so that every address is listed once (and not once per
+  // socket type)
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  uint64_t start = now_us();
+  int status = getaddrinfo(l->name, NULL, &hints, &res);
+  l->latency_us = now_us() - start;
+  l->failed = status != 0;
+
+  appendf(line, &len, sizeof(line), "{\"line\":%u,\"name\":", l->line);
+  append_json_string(line, &len, sizeof(line), l->name);
+  appendf(line, &len, sizeof(line), ",\"latency_ms\":%.3f,",
+          l->latency_us / 1000.0);
+  if (status != 0) {
+    appendf(line, &len, sizeof(line), "\"error\":");
+    append_json_string(line, &len, sizeof(line), gai_strerror(status));
+  } else {
+    appendf(line, &len, sizeof(line), "\"addrs\":[");
+    for (p = res; p != NULL; p = p->ai_next) {
+      inet_ntop(p->ai_family, ip_addr(p), ipstr, sizeof ipstr);
+      appendf(line, &len, sizeof(line), "%s\"%s\"", p == res ? "" : ",",
+              ipstr);
+    }
+    appendf(line, &len, sizeof(line), "]");
+    freeaddrinfo(res);
+  }
+  appendf(line, &len, sizeof(line), "}\n");
+  if (len == sizeof(line)) { /* hundreds of addresses - keep it valid JSON */
+    fprintf(stderr, "%s: result too long - skipped\n", l->name);
+    return;
+  }
+  fwrite(line, 1, len, stdout); /* stdio locks the stream - lines stay whole */
+}
+
+static void *worker(void *arg) {
+  struct batch *b = (struct batch *)arg;
+  size_t i;
+  while ((i = atomic_fetch_add(&b->next, 1)) < b->nbr_lookups)
+    resolve(&b->lookups[i]);
+  return NULL;
+}
+
+/* Reads the hostnames of file f into b. 0 on success and -1 on failure. */
+static int read_names(FILE *f, struct batch *b) {
+  char *line = NULL;
+  size_t cap = 0, allocated = 0;
+  uint32_t line_nbr = 0;
+  ssize_t n;
+
+  while ((n = getline(&line, &cap, f)) != -1) {
+    ++line_nbr;
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r' ||
+                     line[n - 1] == ' ' || line[n - 1] == '\t'))
+      line[--n] = '\0';
+    char *name = line + strspn(line, " \t");
+    if (*name == '\0' || *name == '#')
+      continue;
+    if (b->nbr_lookups == allocated) {
+      allocated = allocated != 0 ? 2 * allocated : 1024;
+      struct lookup *l = (struct lookup *)realloc(
+          b->lookups, allocated * sizeof(struct lookup));
+      if (l == NULL) {
+        perror("realloc");
+        free(line);
+        return -1;
+      }
+      b->lookups = l;
+    }
+    struct lookup *l = &b->lookups[b->nbr_lookups++];
+    memset(l, 0, sizeof(*l));
+    l->line = line_nbr;
+    if ((l->name = strdup(name)) == NULL) {
+      perror("strdup");
+      free(line);
+      return -1;
+    }
+  }
+  free(line);
+  if (ferror(f)) {
+    perror("getline");
+    return -1;
+  }
+  return 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Resolves every hostname of path (see the top of this file). */
+static int run_batch(const char *path, int jobs) {
+  struct batch b = {0};
+  pthread_t threads[MAX_JOBS];
+  FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+  if (f == NULL) {
+    perror(path);
+    return 2;
+  }
+  if (read_names(f, &b) == -1)
+    return 2;
+  if (f != stdin)
+    fclose(f);
+  if ((size_t)jobs > b.nbr_lookups)
+    jobs = b.nbr_lookups != 0 ? (int)b.nbr_lookups : 1;
+
+  uint64_t start = now_us();
+  for (int i = 0; i < jobs; ++i) {
+    if (pthread_create(&threads[i], NULL, worker, &b) != 0) {
+      fprintf(stderr, "pthread_create failed - using %d workers\n", i);
+      jobs = i;
+      break;
+    }
+  }
+  if (jobs == 0)
+    worker(&b);
+  for (int i = 0; i < jobs; ++i)
+    pthread_join(threads[i], NULL);
+  double wall_s = (now_us() - start) / 1e6;
+  fflush(stdout);
+
+  /* summary */
+  size_t failed = 0;
+  double total_s = 0;
+  uint32_t *latencies =
+      (uint32_t *)malloc((b.nbr_lookups + 1) * sizeof(uint32_t));
+  if (latencies == NULL) {
+    perror("malloc");
+    return 2;
+  }
+  for (size_t i = 0; i < b.nbr_lookups; ++i) {
+    failed += b.lookups[i].failed;
+    total_s += b.lookups[i].latency_us / 1e6;
+    latencies[i] = b.lookups[i].latency_us;
+    free(b.lookups[i].name);
+  }
+  fprintf(stderr, "resolved %zu names (%zu failed) in %.3f s with %d workers",
+          b.nbr_lookups, failed, wall_s, jobs);
+  if (b.nbr_lookups != 0) {
+    size_t n = b.nbr_lookups;
+    qsort(latencies, n, sizeof(uint32_t), cmp_u32);
+    fprintf(stderr,
+            "\nlookup latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n"
+            "sum of the lookup latencies %.3f s - %.1fx speedup over one at "
+            "a time",
+            latencies[n / 2] / 1000.0, latencies[n * 9 / 10] / 1000.0,
+            latencies[n * 99 / 100] / 1000.0, latencies[n - 1] / 1000.0,
+            total_s, wall_s > 0 ? total_s / wall_s : 0);
+  }
+  fprintf(stderr, "\n");
+  free(latencies);
+  free(b.lookups);
+  return failed != 0 ? 1 : 0;
+}
 
 int main(int argc, char *argv[]) {
   struct addrinfo hints, *res, *p;
-  int status;
+  int status, opt, jobs = DEFAULT_JOBS;
+  const char *batch_path = NULL;
   char ipstr[INET6_ADDRSTRLEN];
 
-  if (argc != 2) {
+  while ((opt = getopt(argc, argv, "f:j:")) != -1) {
+    switch (opt) {
+    case 'f':
+      batch_path = optarg;
+      break;
+    case 'j':
+      jobs = (int)strtol(optarg, NULL, 10);
+      if (jobs < 1 || jobs > MAX_JOBS) {
+        fprintf(stderr, "-j must be between 1 and %d\n", MAX_JOBS);
+        return 2;
+      }
+      break;
+    default:
+      fprintf(stderr, "usage: showipaddrs hostname\n"
+                      "       showipaddrs [-j JOBS] -f FILE\n");
+      return 2;
+    }
+  }
+
+  if (batch_path != NULL)
+    return run_batch(batch_path, jobs);
+
+  if (argc - optind != 1) {
     fprintf(stderr, "usage: showipaddrs hostname\n");
     return 1;
   }
@@ -22,37 +309,22 @@ int main(int argc, char *argv[]) {
   hints.ai_socktype = SOCK_STREAM; // TCP
 
   // why is the port NULL?
-  if ((status = getaddrinfo(argv[1], NULL, &hints, &res)) != 0) {
+  if ((status = getaddrinfo(argv[optind], NULL, &hints, &res)) != 0) {
     fprintf(stderr, "getaddrinfor: %s\n", gai_strerror(status));
     return 2;
   }
 
-  printf("IP addresses for %s:\n\n", argv[1]);
+  printf("IP addresses for %s:\n\n", argv[optind]);
 
   // getaddrinfo returns a linked list of addrinfo structs. Why?
   // well, the domain name resolution might resolve to different IP addresses
   // (e.g., one for IPv4 and one for IPv6)
   for (p = res; p != NULL; p = p->ai_next) {
-    void *addr; /* pointer to the ipv4/ipv6 address struct */
-    char *ipver;
-    struct sockaddr_in *ipv4;
-    struct sockaddr_in6 *ipv6;
-
-    // the p->ai_addr is a different struct depending on the type of the IP
-    // (IPv4 vs. IPv6)
-    if (p->ai_family == AF_INET) { // IPv4
-      ipv4 = (struct sockaddr_in *)p->ai_addr;
-      addr = &(ipv4->sin_addr);
-      ipver = "IPv4";
-    } else { // IPv6
-      ipv6 = (struct sockaddr_in6 *)p->ai_addr;
-      addr = &(ipv6->sin6_addr);
-      ipver = "IPv6";
-    }
+    char *ipver = p->ai_family == AF_INET ? "IPv4" : "IPv6";
 
     // (n)etwork (to) (p)resentation - convert the IP struct pointer to a string
     // reprensentation
-    inet_ntop(p->ai_family, addr, ipstr, sizeof ipstr);
+    inet_ntop(p->ai_family, ip_addr(p), ipstr, sizeof ipstr);
     printf("  %s: %s\n", ipver, ipstr);
   }
 
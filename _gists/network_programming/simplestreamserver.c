@@ -1,28 +1,455 @@
+/*
+ * simplestreamserver.c -- TCP server that echoes every line it receives and,
+ * with -d, serves the files of a directory:
+ *
+ *   GET NAME [RANGE]
+ *
+ * answers "OK FIRST LENGTH SIZE\n" followed by LENGTH bytes of file NAME
+ * starting at byte FIRST (SIZE is the size of the whole file), or
+ * "ERR REASON\n". RANGE is FIRST-LAST (inclusive), FIRST- (to the end) or
+ * -N (the last N bytes), like an HTTP byte range.
+ *
+ * Usage: ./simplestreamserver [-p PORT] [-d DIR] [-m MODE]
+ *
+ *   -p  port to listen on (default 3490)
+ *   -d  directory whose files GET serves (no subdirectories, no hidden files
+ *       and no symbolic links). Without it, GET is refused
+ *   -m  how file data is sent: sendfile (default - straight from the page
+ *       cache to the socket), splice (page cache -> pipe -> socket, both
+ *       without a copy) or readwrite (pread into a user space buffer and
+ *       send it - the baseline the two others are measured against, see
+ *       filebench.c)
+ *
+ * Any number of clients are served at once by an epoll event loop over
+ * non-blocking sockets. A transfer sends at most CHUNK bytes per loop
+ * iteration so that a large file does not hold up the other clients, and
+ * the client's next line is not read before its transfer is done. On
+ * SIGINT/SIGTERM, the server prints how much it sent and the CPU time it
+ * used doing so.
+ *
+ * compile with:
+ *
+ *   cc -o simplestreamserver simplestreamserver.c sockethelpers.c
+ */
+
+#define _GNU_SOURCE /* splice, accept4 */
 #include "sockethelpers.h"
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #define PORT "3490" /* this server's port */
 #define BACKLOG 10  /* max number of connections to be help in the backlog */
+#define MAX_EVENTS 64
+#define LINE_MAX_LEN 4096  /* longest line (GET command) read from a client */
+#define CHUNK (1 << 20)    /* bytes sent per transfer per loop iteration */
+#define RW_BUF_SIZE 65536  /* buffer of the readwrite mode */
+#define PIPE_SIZE (1 << 20) /* pipe capacity asked for in splice mode */
+
+enum send_mode { MODE_SENDFILE, MODE_SPLICE, MODE_READWRITE };
+
+/* a client connection */
+struct client {
+  int fd;
+  char addr_str[INET6_ADDRSTRLEN];
+  uint32_t events;        /* what epoll watches for it */
+  char in[LINE_MAX_LEN];  /* received, not yet handled */
+  size_t in_len;
+  char out[LINE_MAX_LEN + 64]; /* to send before anything else: a response
+                                  header or an echoed line */
+  size_t out_len, out_off;
+  /* the transfer in progress (file_fd != -1) */
+  int file_fd;
+  off_t offset;       /* next byte of the file to read */
+  uint64_t remaining; /* bytes still to read from the file */
+  int pipe[2];        /* splice mode: created on the first transfer */
+  size_t in_pipe;     /* splice mode: bytes in the pipe */
+  char *buf;          /* readwrite mode: created on the first transfer */
+  size_t buf_len, buf_off;
+};
+
+static enum send_mode mode = MODE_SENDFILE;
+static int dir_fd = -1; /* the directory of -d */
+static uint64_t bytes_sent, transfers;
+static volatile sig_atomic_t stop;
+
+static void handle_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+static void free_client(struct client *c) {
+  printf("[server] client %s hung up\n", c->addr_str);
+  close(c->fd);
+  if (c->file_fd != -1)
+    close(c->file_fd);
+  if (c->pipe[0] != -1) {
+    close(c->pipe[0]);
+    close(c->pipe[1]);
+  }
+  free(c->buf);
+  free(c);
+}
+
+/* Queues line (of len bytes) to be sent to c. */
+static void reply(struct client *c, const char *line, size_t len) {
+  memcpy(c->out + c->out_len, line, len);
+  c->out_len += len;
+}
+
+/* Parses range spec (see the top of this file) of a file of size bytes into
+ * first and length. 0 on success, -1 if it is malformed and -2 if it is not
+ * satisfiable. */
+static int parse_range(const char *spec, uint64_t size, uint64_t *first,
+                       uint64_t *length) {
+  char *end;
+  const char *dash = strchr(spec, '-');
+
+  if (dash == NULL || strchr(dash + 1, '-') != NULL)
+    return -1;
+  if (dash == spec) { /* -N: the last N bytes */
+    uint64_t n = strtoull(dash + 1, &end, 10);
+    if (end == dash + 1 || *end != '\0')
+      return -1;
+    if (n == 0 || size == 0)
+      return -2;
+    *first = n < size ? size - n : 0;
+    *length = size - *first;
+    return 0;
+  }
+  *first = strtoull(spec, &end, 10);
+  if (end != dash)
+    return -1;
+  uint64_t last = size - 1; /* FIRST-: to the end */
+  if (dash[1] != '\0') {
+    last = strtoull(dash + 1, &end, 10);
+    if (*end != '\0' || last < *first)
+      return -1;
+    if (last >= size)
+      last = size - 1;
+  }
+  if (*first >= size)
+    return -2;
+  *length = last - *first + 1;
+  return 0;
+}
+
+/* Handles a GET command (args is what follows "GET "). */
+static void handle_get(struct client *c, char *args) {
+  char header[128];
+  struct stat st;
+  uint64_t first = 0, length;
+
+  char *name = strtok(args, " "), *range = strtok(NULL, " ");
+  if (name == NULL || strtok(NULL, " ") != NULL) {
+    reply(c, "ERR usage: GET NAME [RANGE]\n", 28);
+    return;
+  }
+  if (dir_fd == -1) {
+    reply(c, "ERR file serving is disabled\n", 29);
+    return;
+  }
+  /* only the files right in the directory */
+  if (strchr(name, '/') != NULL || name[0] == '.') {
+    reply(c, "ERR no such file\n", 17);
+    return;
+  }
+  int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    if (fd != -1)
+      close(fd);
+    reply(c, "ERR no such file\n", 17);
+    return;
+  }
+  length = st.st_size;
+  if (range != NULL) {
+    int rv = parse_range(range, st.st_size, &first, &length);
+    if (rv != 0) {
+      close(fd);
+      if (rv == -1)
+        reply(c, "ERR bad range\n", 14);
+      else
+        reply(c, "ERR range not satisfiable\n", 26);
+      return;
+    }
+  }
+
+  int len = snprintf(header, sizeof(header), "OK %lu %lu %lu\n", first, length,
+                     (uint64_t)st.st_size);
+  reply(c, header, len);
+  printf("[server] client %s: GET %s (%lu bytes from %lu)\n", c->addr_str,
+         name, length, first);
+  if (length == 0) {
+    close(fd);
+    return;
+  }
+  if (mode == MODE_SPLICE && c->pipe[0] == -1) {
+    if (pipe2(c->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+      perror("pipe2");
+      close(fd);
+      c->pipe[0] = -1;
+      c->out_len -= len;
+      reply(c, "ERR out of resources\n", 21);
+      return;
+    }
+    fcntl(c->pipe[1], F_SETPIPE_SZ, PIPE_SIZE); /* fewer splice calls */
+  }
+  if (mode == MODE_READWRITE && c->buf == NULL &&
+      (c->buf = (char *)malloc(RW_BUF_SIZE)) == NULL) {
+    perror("malloc");
+    close(fd);
+    c->out_len -= len;
+    reply(c, "ERR out of resources\n", 21);
+    return;
+  }
+  /* the file's pages are read once, front to back */
+  posix_fadvise(fd, first, length, POSIX_FADV_SEQUENTIAL);
+  c->file_fd = fd;
+  c->offset = first;
+  c->remaining = length;
+  ++transfers;
+}
+
+/* Handles the complete line at the start of c->in (of len bytes including
+ * its newline) - a GET command or a line to echo. */
+static void handle_line(struct client *c, size_t len) {
+  if (len > 4 && strncmp(c->in, "GET ", 4) == 0) {
+    char cmd[LINE_MAX_LEN];
+    size_t n = len - 1;
+    if (n > 0 && c->in[n - 1] == '\r') /* telnet */
+      --n;
+    memcpy(cmd, c->in + 4, n - 4);
+    cmd[n - 4] = '\0';
+    handle_get(c, cmd);
+  } else {
+    // echo the received message
+    printf("[server] received message from client %s\n", c->addr_str);
+    reply(c, c->in, len);
+  }
+  memmove(c->in, c->in + len, c->in_len - len);
+  c->in_len -= len;
+}
+
+/* Sends up to CHUNK bytes of c's transfer. Returns 1 if the transfer is done,
+ * 0 if it has to continue later and -1 if the connection failed. */
+static int send_file_data(struct client *c) {
+  size_t budget = CHUNK;
+  ssize_t n;
+
+  while (budget > 0 && (c->remaining > 0 || c->in_pipe > 0 ||
+                        c->buf_off < c->buf_len)) {
+    size_t want = c->remaining < budget ? c->remaining : budget;
+    switch (mode) {
+    case MODE_SENDFILE: /* the kernel copies page cache -> socket */
+      n = sendfile(c->fd, c->file_fd, &c->offset, want);
+      if (n > 0)
+        c->remaining -= n;
+      break;
+    case MODE_SPLICE: /* page cache pages are moved into the pipe and from
+                         there into the socket - no copy at all */
+      if (c->in_pipe == 0) {
+        n = splice(c->file_fd, &c->offset, c->pipe[1], NULL, want,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n <= 0)
+          return -1; /* the file was truncated - we promised more */
+        c->remaining -= n;
+        c->in_pipe = n;
+      }
+      n = splice(c->pipe[0], NULL, c->fd, NULL, c->in_pipe,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+                     (c->remaining > 0 ? SPLICE_F_MORE : 0));
+      if (n > 0)
+        c->in_pipe -= n;
+      break;
+    default: /* MODE_READWRITE - two copies through user space */
+      if (c->buf_off == c->buf_len) {
+        n = pread(c->file_fd, c->buf, want < RW_BUF_SIZE ? want : RW_BUF_SIZE,
+                  c->offset);
+        if (n <= 0)
+          return -1;
+        c->offset += n;
+        c->remaining -= n;
+        c->buf_len = n;
+        c->buf_off = 0;
+      }
+      n = send(c->fd, c->buf + c->buf_off, c->buf_len - c->buf_off,
+               MSG_NOSIGNAL | (c->remaining > 0 ? MSG_MORE : 0));
+      if (n > 0)
+        c->buf_off += n;
+      break;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0; /* the socket buffer is full */
+    if (n <= 0)
+      return -1; /* sendfile returns 0 if the file was truncated */
+    bytes_sent += n;
+    budget -= n < (ssize_t)budget ? (size_t)n : budget;
+  }
+  if (c->remaining > 0 || c->in_pipe > 0 || c->buf_off < c->buf_len)
+    return 0; /* our CHUNK is used up - the other clients' turn */
+
+  close(c->file_fd);
+  c->file_fd = -1;
+  c->buf_off = c->buf_len = 0;
+  return 1;
+}
+
+/* Makes progress on client c: sends what is queued, continues its transfer
+ * and handles the lines received - in that order, so that responses are not
+ * mixed up. Returns the epoll events to wait for or 0 if the connection is
+ * to be closed. */
+static uint32_t serve(struct client *c) {
+  for (;;) {
+    if (c->out_off < c->out_len) {
+      /* a response header goes out in one segment with the start of its
+       * body */
+      ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                       MSG_NOSIGNAL | (c->file_fd != -1 ? MSG_MORE : 0));
+      if (n == -1)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? EPOLLOUT : 0;
+      c->out_off += n;
+      continue;
+    }
+    c->out_off = c->out_len = 0;
+
+    if (c->file_fd != -1) {
+      int rv = send_file_data(c);
+      if (rv == -1)
+        return 0;
+      if (rv == 0)
+        return EPOLLOUT; /* level triggered - back in the next round */
+      continue;
+    }
+
+    char *nl = (char *)memchr(c->in, '\n', c->in_len);
+    if (nl != NULL) {
+      handle_line(c, nl - c->in + 1);
+      continue;
+    }
+    if (c->in_len == sizeof(c->in)) { /* a line too long for us - echo it */
+      reply(c, c->in, LINE_MAX_LEN / 2);
+      memmove(c->in, c->in + LINE_MAX_LEN / 2, LINE_MAX_LEN / 2);
+      c->in_len -= LINE_MAX_LEN / 2;
+      continue;
+    }
+    return EPOLLIN;
+  }
+}
+
+/* Reads what c sent. Returns 0 if the connection is to be closed, 1
+ * otherwise. */
+static int receive(struct client *c) {
+  ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 1;
+  if (n <= 0) {
+    if (n == -1)
+      perror("recv");
+    return 0;
+  }
+  c->in_len += n;
+  return 1;
+}
+
+static void accept_clients(int epfd, int list_sockfd) {
+  struct sockaddr_storage client_addr;
+  socklen_t client_addr_len;
 
-int main(void) {
-  int list_sockfd, conn_sockfd; /* listening and connection socket fds */
-  int rv;                       /* return value - always check for success */
+  for (;;) {
+    client_addr_len = sizeof(client_addr);
+    int fd = accept4(list_sockfd, (struct sockaddr *)&client_addr,
+                     &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept");
+      return;
+    }
+    struct client *c = (struct client *)calloc(1, sizeof(struct client));
+    if (c == NULL) {
+      perror("calloc");
+      close(fd);
+      continue;
+    }
+    /* responses are sent whole (with MSG_MORE/SPLICE_F_MORE while more of
+     * them follows) - Nagle would only hold back their last segment until
+     * the client's delayed ACK */
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    c->fd = fd;
+    c->file_fd = c->pipe[0] = c->pipe[1] = -1;
+    c->events = EPOLLIN;
+    inet_ntop(client_addr.ss_family,
+              get_addr_struct((struct sockaddr *)&client_addr), c->addr_str,
+              INET6_ADDRSTRLEN);
+    struct epoll_event ev = {.events = c->events, .data.ptr = c};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      perror("epoll_ctl");
+      close(fd);
+      free(c);
+      continue;
+    }
+    // print so that we know when client connected
+    printf("[server] got connection from %s:%d\n", c->addr_str,
+           ntohs(get_port((struct sockaddr *)&client_addr)));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int list_sockfd; /* listening socket fd */
+  int rv;          /* return value - always check for success */
   struct addrinfo hints, *servinfo, *p; /* hints for getaddrinfo() and servinfo
                                          * is its output */
-  int yes = 1;
+  int yes = 1, opt;
   char addr_str[INET6_ADDRSTRLEN]; /* holds address representation string */
-  struct sockaddr_storage client_addr;
-  socklen_t client_addr_len = sizeof(struct sockaddr_storage);
-  char data_buf[4096]; /* data buffer to hold received client message */
+  const char *port = PORT;
+  struct epoll_event events[MAX_EVENTS];
+
+  while ((opt = getopt(argc, argv, "p:d:m:")) != -1) {
+    switch (opt) {
+    case 'p':
+      port = optarg;
+      break;
+    case 'd':
+      dir_fd = open(optarg, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dir_fd == -1) {
+        perror(optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'm':
+      if (strcmp(optarg, "sendfile") == 0)
+        mode = MODE_SENDFILE;
+      else if (strcmp(optarg, "splice") == 0)
+        mode = MODE_SPLICE;
+      else if (strcmp(optarg, "readwrite") == 0)
+        mode = MODE_READWRITE;
+      else
+        goto usage;
+      break;
+    default:
+    usage:
+      fprintf(stderr, "Usage: %s [-p PORT] [-d DIR] "
+                      "[-m sendfile|splice|readwrite]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
 
   /* Fill up the addrinfo hints by choosing IPv4 vs. IPv6, UDP vs. TCP and the
    * target IP address. The AI_PASSIVE flag means "hey, look for this host IPs
@@ -36,9 +463,9 @@ int main(void) {
    * NULL and AI_PASSIVE flag is set, the returned sockets are suitable for
    * bind() calls (i.e., suitable for server applications to accept connections
    * or recvieve data using recvfrom) */
-  rv = getaddrinfo(NULL, PORT, &hints, &servinfo);
+  rv = getaddrinfo(NULL, port, &hints, &servinfo);
   if (rv != 0) { /* error handling here - use gai_strerror() */
-    perror("getaddrinfo");
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
     exit(EXIT_FAILURE);
   }
 
@@ -52,10 +479,12 @@ int main(void) {
 
     // print current attempted addr
     printf("[server] trying to open a listening socket at %s:%s ...\n",
-           addr_str, PORT);
+           addr_str, port);
 
-    // try to create a socket for the current addrinfo candidate
-    list_sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    // try to create a socket for the current addrinfo candidate - it is
+    // non-blocking: the event loop accepts until there is nobody left
+    list_sockfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
+                         p->ai_protocol);
 
     // check if socket creation failed
     if (list_sockfd == -1) {
@@ -99,7 +528,7 @@ int main(void) {
   }
 
   printf("[server] successfully opened a listening socket to %s:%s\n", addr_str,
-         PORT);
+         port);
 
   // remember to call this to avoid a memory leak!
   // freeaddrinfo frees the linked list but does NOT NULL assign the struct's
@@ -114,64 +543,61 @@ int main(void) {
     exit(EXIT_FAILURE);
   }
 
-  // wait for the client to connect ...
-  // or if you don't care about client's addr: accept(list_sockfd, NULL, NULL)
-  conn_sockfd =
-      accept(list_sockfd, (struct sockaddr *)&client_addr, &client_addr_len);
-  if (conn_sockfd == -1) { /* handle error */
-    perror("accept");
+  /* the listening socket is the one without a client (data.ptr is NULL) */
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, list_sockfd, &ev) == -1) {
+    perror("epoll");
     exit(EXIT_FAILURE);
   }
 
-  inet_ntop(client_addr.ss_family,
-            get_addr_struct((struct sockaddr *)&client_addr), addr_str,
-            INET6_ADDRSTRLEN);
-
-  // print so that we know when client connected
-  printf("[server] got conncetion from %s:%d\n", addr_str,
-         get_port((struct sockaddr *)&client_addr));
+  struct sigaction sa = {.sa_handler = handle_signal};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
 
-  /* in this example we expect only one client to connect - so we no longer need
-   * the listening socket */
-  close(list_sockfd);
-
-  while (1) {
-    printf("[server] waiting for message from client %s\n", addr_str);
-
-    /* wait (i.e., block) until we receive a message from the client or the
-     * until the client closes the connection */
-    int nbytes = recv(conn_sockfd, data_buf, 4096, 0);
-
-    if (nbytes <= 0) {   /* error or connection closed */
-      if (nbytes == 0) { /* connection closed */
-        printf("[server] client %s hung up\n", addr_str);
-        break;
-      } else {
-        perror("recv");
-      }
+  while (!stop) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
     }
 
-    // just to be sure that data_buf string is null terminated
-    // telnet adds null termination after hitting \r - but it is always
-    // important to be safe :-)
-    data_buf[nbytes] = '\0';
+    for (int i = 0; i < n; ++i) {
+      struct client *c = (struct client *)events[i].data.ptr;
+      if (c == NULL) {
+        accept_clients(epfd, list_sockfd);
+        continue;
+      }
 
-    // echo the received message
-    printf("[server] received message from client %s:%d\n", addr_str,
-           get_port((struct sockaddr *)&client_addr));
-
-    /* now send the data back again to the client
-     * send may in fact not send the entirety of your data and it is your
-     * reponsibility to keep re-sending until all chunks of your message are
-     * sent.*/
-    rv = send(conn_sockfd, data_buf, nbytes, 0);
-    if (rv == -1) { /* handle error */
-      perror("send");
-      continue;
+      uint32_t want = 0;
+      if (!(events[i].events & EPOLLIN) || receive(c))
+        want = serve(c);
+      if (want == 0) { /* error or connection closed */
+        free_client(c); /* closing it removes it from epoll */
+        continue;
+      }
+      if (want != c->events) {
+        struct epoll_event mod = {.events = want, .data.ptr = c};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &mod);
+        c->events = want;
+      }
     }
   }
 
-  // do NOT forget to close the connection sockfd!
-  close(conn_sockfd);
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  double cpu_s = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+                 ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  printf("[server] sent %.1f MiB of files in %lu transfers (%s) using %.2f s "
+         "of CPU (%.2f s user, %.2f s system) - %.0f MiB per CPU second\n",
+         bytes_sent / 1048576.0, transfers,
+         mode == MODE_SENDFILE ? "sendfile"
+         : mode == MODE_SPLICE ? "splice"
+                               : "readwrite",
+         cpu_s, ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+         ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6,
+         cpu_s > 0 ? bytes_sent / 1048576.0 / cpu_s : 0);
   exit(EXIT_SUCCESS);
 }
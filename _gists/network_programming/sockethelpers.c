@@ -1,19 +1,21 @@
 #include "sockethelpers.h"
 #include <arpa/inet.h>
+#include <linux/filter.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-/* Creates a listening socket that can be used to accept connection requests.
- * Returns the created listening socket fd. -1 on error. */
-int create_listening_socket(const char *port, int backlog) {
+/* Creates a listening socket that can be used to accept connection requests
+ * (with SO_REUSEPORT set if reuseport is non-zero). Returns the created
+ * listening socket fd. -1 on error. */
+static int create_listener(const char *port, int backlog, int reuseport) {
   int sfd;
-  int rv;
   struct addrinfo hints, *servinfo, *p;
 
   memset(&hints, 0, sizeof(hints));
@@ -48,6 +50,16 @@ int create_listening_socket(const char *port, int backlog) {
       continue;
     }
 
+    /* SO_REUSEPORT lets multiple sockets (e.g., one per thread) bind to the
+     * exact same address and port. The kernel then load balances incoming
+     * connections across them (by hashing the 4-tuple by default) */
+    if (reuseport &&
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &y, sizeof(int)) == -1) {
+      close(sfd);
+      perror("setsockopt");
+      continue;
+    }
+
     if (bind(sfd, p->ai_addr, p->ai_addrlen) == 0)
       break; /* success */
 
@@ -69,3 +81,123 @@ int create_listening_socket(const char *port, int backlog) {
 
   return sfd;
 }
+
+/* Creates a listening socket that can be used to accept connection requests.
+ * Returns the created listening socket fd. -1 on error. */
+int create_listening_socket(const char *port, int backlog) {
+  return create_listener(port, backlog, 0);
+}
+
+/* Same as above but other sockets can be bound to the same port. */
+int create_reuseport_listening_socket(const char *port, int backlog) {
+  return create_listener(port, backlog, 1);
+}
+
+/* Attaches a classic BPF program to the reuseport group of fd. The program
+ * returns the index of the socket that should get a new connection. It looks
+ * like this (for cpus = {2, 3}):
+ *
+ *   A = cpu                  (CPU that is processing the SYN packet)
+ *   if (A == 2) return 0
+ *   if (A == 3) return 1
+ *   return A % 2             (CPU without a socket - pick any)
+ */
+int attach_cpu_steering_program(int fd, const int *cpus, int nbr_cpus) {
+  struct sock_filter *code;
+  struct sock_fprog prog;
+  int n = 0;
+
+  code = (struct sock_filter *)calloc(2 * nbr_cpus + 3, sizeof(*code));
+  if (code == NULL) {
+    perror("calloc");
+    return -1;
+  }
+
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                           SKF_AD_OFF + SKF_AD_CPU);
+  for (int i = 0; i < nbr_cpus; ++i) {
+    /* if equal, fall through to the return - otherwise skip it */
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                             cpus[i], 0, 1);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+  }
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nbr_cpus);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+  prog.len = n;
+  prog.filter = code;
+  int rv = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                      sizeof(prog));
+  if (rv == -1)
+    perror("setsockopt (SO_ATTACH_REUSEPORT_CBPF)");
+
+  free(code);
+  return rv;
+}
+
+/* Sends len bytes of buf with file descriptor fd attached as ancillary data
+ * (SCM_RIGHTS) - the receiver gets its own descriptor referring to the same
+ * open file (e.g., socket). Returns 0 on success and -1 on error. */
+int send_fd(int sock, const void *buf, size_t len, int fd) {
+  union { /* properly aligned buffer for a single control message */
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } ctrl;
+  struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&ctrl, 0, sizeof(ctrl));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  if (n == -1)
+    return -1;
+  /* the descriptor went with the first byte - the rest is plain data */
+  if ((size_t)n < len && send(sock, (const char *)buf + n, len - n,
+                              MSG_NOSIGNAL) != (ssize_t)(len - n))
+    return -1;
+  return 0;
+}
+
+/* Receives exactly len bytes into buf along with the file descriptor that was
+ * sent with them (stored in fd, -1 if there was none). Returns 0 on success
+ * and -1 on error or if the peer closed the connection. */
+int recv_fd(int sock, void *buf, size_t len, int *fd) {
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } ctrl;
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+
+  *fd = -1;
+  ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  if (n <= 0)
+    return -1;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+  if ((size_t)n < len &&
+      recv(sock, (char *)buf + n, len - n, MSG_WAITALL) != (ssize_t)(len - n))
+    return -1;
+  return 0;
+}
@@ -4,6 +4,10 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // returns sockaddr struct from provided sockaddr in IPv4 or IPv6.
 static inline void *get_addr_struct(const struct sockaddr *sa) {
   return sa->sa_family == AF_INET
@@ -20,4 +24,28 @@ static inline in_port_t get_port(const struct sockaddr *sa) {
 /* returns listening socket file descriptor on success and -1 on failure */
 int create_listening_socket(const char *port, int backlog);
 
+/* same as create_listening_socket but with SO_REUSEPORT set so that multiple
+ * listening sockets can be bound to the same port */
+int create_reuseport_listening_socket(const char *port, int backlog);
+
+/* attaches a classic BPF program to the SO_REUSEPORT group of listening
+ * socket fd that steers each new connection to the socket of the group that
+ * belongs to the CPU which received the connection's packets - the i-th
+ * socket added to the group belongs to cpus[i]. 0 on success and -1 on
+ * failure */
+int attach_cpu_steering_program(int fd, const int *cpus, int nbr_cpus);
+
+/* sends len bytes of buf over unix socket sock along with file descriptor fd
+ * (SCM_RIGHTS). 0 on success and -1 on failure */
+int send_fd(int sock, const void *buf, size_t len, int fd);
+
+/* receives exactly len bytes into buf from unix socket sock along with the
+ * file descriptor sent with them (stored in fd, -1 if none). 0 on success and
+ * -1 on failure (or if the peer closed the connection) */
+int recv_fd(int sock, void *buf, size_t len, int *fd);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,132 @@
+/*
+ * textbench.c -- measures the throughput of the text scanning functions of
+ * textscan.c for every implementation the CPU supports, against memchr for
+ * the newline search.
+ *
+ * Usage: ./textbench [SECONDS_PER_RUN]
+ *
+ * Every function runs over a 64 KiB buffer of ASCII text, of mixed UTF-8
+ * text (about a third of the characters are 2-4 bytes long) and over the same
+ * ASCII text cut into 64 byte chat lines (i.e., call overhead included). The
+ * buffers contain no newline and no control character so that every scan
+ * goes all the way through.
+ *
+ * compile with:
+ *
+ *   cc -O2 -o textbench textbench.c textscan.c
+ */
+
+#include "textscan.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BUF_SIZE 65536
+#define LINE_SIZE 64
+
+static char ascii[BUF_SIZE];
+static char utf8[BUF_SIZE];
+static volatile size_t sink; /* keeps the scans from being optimized out */
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t run_memchr(const char *p, size_t len) {
+  const char *nl = memchr(p, '\n', len);
+  return nl != NULL ? (size_t)(nl - p) : len;
+}
+
+static size_t run_newline(const char *p, size_t len) {
+  return text_find_newline(p, len);
+}
+
+static size_t run_control(const char *p, size_t len) {
+  return text_find_control(p, len);
+}
+
+static size_t run_utf8(const char *p, size_t len) {
+  return text_valid_utf8(p, len);
+}
+
+/* Runs fn over buf in chunks of chunk bytes for about seconds and returns the
+ * throughput in GB/s. */
+static double measure(size_t (*fn)(const char *, size_t), const char *buf,
+                      size_t chunk, double seconds) {
+  uint64_t bytes = 0;
+  double start = now_s(), elapsed;
+
+  do {
+    for (int rep = 0; rep < 16; ++rep) {
+      for (size_t off = 0; off + chunk <= BUF_SIZE; off += chunk)
+        sink += fn(buf + off, chunk);
+      bytes += BUF_SIZE / chunk * chunk;
+    }
+  } while ((elapsed = now_s() - start) < seconds);
+  return bytes / elapsed / 1e9;
+}
+
+static void fill(void) {
+  static const char *wide[] = {"\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+                               "\xd0\x96", "\xe3\x81\x82"};
+  size_t len = 0;
+
+  srand(42);
+  for (size_t i = 0; i < BUF_SIZE; ++i)
+    ascii[i] = ' ' + rand() % 95;
+  while (len + 4 <= BUF_SIZE) {
+    if (rand() % 3 == 0) {
+      const char *s = wide[rand() % 5];
+      memcpy(utf8 + len, s, strlen(s));
+      len += strlen(s);
+    } else {
+      utf8[len++] = ' ' + rand() % 95;
+    }
+  }
+  memset(utf8 + len, ' ', BUF_SIZE - len);
+}
+
+int main(int argc, char *argv[]) {
+  static const char *impls[] = {"scalar", "sse4.2", "avx2"};
+  double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+  const char *best = text_impl();
+
+  fill();
+  if (!text_valid_utf8(utf8, BUF_SIZE)) {
+    fprintf(stderr, "test data is not valid UTF-8\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("selected implementation: %s\n\n", best);
+  printf("%-8s %-16s %12s %12s %12s\n", "impl", "function", "64K ascii",
+         "64K utf-8", "64B lines");
+  printf("%-8s %-16s %9.2f GB/s %9.2f GB/s %9.2f GB/s\n", "libc", "memchr",
+         measure(run_memchr, ascii, BUF_SIZE, seconds),
+         measure(run_memchr, utf8, BUF_SIZE, seconds),
+         measure(run_memchr, ascii, LINE_SIZE, seconds));
+
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+    static const struct {
+      const char *name;
+      size_t (*fn)(const char *, size_t);
+    } fns[] = {{"find_newline", run_newline},
+               {"find_control", run_control},
+               {"valid_utf8", run_utf8}};
+
+    if (text_select(impls[i]) == -1) {
+      printf("%-8s (not supported by this CPU)\n", impls[i]);
+      continue;
+    }
+    for (size_t f = 0; f < sizeof(fns) / sizeof(fns[0]); ++f)
+      printf("%-8s %-16s %9.2f GB/s %9.2f GB/s %9.2f GB/s\n", impls[i],
+             fns[f].name, measure(fns[f].fn, ascii, BUF_SIZE, seconds),
+             measure(fns[f].fn, utf8, BUF_SIZE, seconds),
+             measure(fns[f].fn, ascii, LINE_SIZE, seconds));
+  }
+  text_select(best);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,448 @@
+/*
+ * textscan.c -- vectorized scanning of client text (see textscan.h).
+ *
+ * Every scan processes 16 (SSE4.2) or 32 (AVX2) bytes per step with a
+ * compare + movemask - the x86 string instructions of SSE4.2 (PCMPESTRI and
+ * friends) are not used as they are slower than that for simple byte classes.
+ *
+ * UTF-8 validation uses the lookup algorithm of Keiser and Lemire
+ * ("Validating UTF-8 In Less Than One Instruction Per Byte", 2021): three
+ * 16-entry table lookups (PSHUFB) on the high and low nibbles of each byte and
+ * of its predecessor classify every 2-byte window into error classes, and
+ * subtracting from the 2nd/3rd predecessors tells which bytes must be
+ * continuation bytes. Blocks of pure ASCII (the common case for chat) skip all
+ * of that.
+ *
+ * compile with (no -m flags needed - the vectorized functions are compiled
+ * for their instruction set with target attributes and only called if the
+ * CPU supports it):
+ *
+ *   cc -O2 -c textscan.c
+ */
+
+#include "textscan.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXTSCAN_X86
+#endif
+
+/* Returns 1 for C0 control characters (except tab) and DEL. */
+static inline int is_control(unsigned char ch) {
+  return (ch < 0x20 && ch != '\t') || ch == 0x7f;
+}
+
+/* Returns the length of the valid UTF-8 sequence at the start of p (of len
+ * bytes) or 0 if it is not valid (see table 3-7 of the Unicode standard). */
+static size_t utf8_sequence(const unsigned char *p, size_t len) {
+  unsigned char lo = 0x80, hi = 0xbf;
+  size_t n;
+
+  if (p[0] < 0x80)
+    return 1;
+  if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+    n = 2;
+  } else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+    n = 3;
+    if (p[0] == 0xe0) /* overlong */
+      lo = 0xa0;
+    else if (p[0] == 0xed) /* surrogate */
+      hi = 0x9f;
+  } else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+    n = 4;
+    if (p[0] == 0xf0) /* overlong */
+      lo = 0x90;
+    else if (p[0] == 0xf4) /* above U+10FFFF */
+      hi = 0x8f;
+  } else {
+    return 0;
+  }
+
+  if (n > len || p[1] < lo || p[1] > hi)
+    return 0;
+  for (size_t i = 2; i < n; ++i) {
+    if ((p[i] & 0xc0) != 0x80)
+      return 0;
+  }
+  return n;
+}
+
+/* scalar implementation */
+
+static size_t find_newline_scalar(const char *p, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (p[i] == '\n')
+      return i;
+  }
+  return len;
+}
+
+static size_t find_control_scalar(const char *p, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (is_control((unsigned char)p[i]))
+      return i;
+  }
+  return len;
+}
+
+static int valid_utf8_scalar(const char *p, size_t len) {
+  const unsigned char *s = (const unsigned char *)p;
+  size_t i = 0;
+
+  while (i < len) {
+    if (s[i] < 0x80) {
+      ++i;
+      continue;
+    }
+    size_t n = utf8_sequence(s + i, len - i);
+    if (n == 0)
+      return 0;
+    i += n;
+  }
+  return 1;
+}
+
+#ifdef TEXTSCAN_X86
+
+/* error classes of the lookup algorithm - a 2-byte window is invalid if the
+ * classes of its first byte's high nibble, first byte's low nibble and second
+ * byte's high nibble have one in common */
+#define TOO_SHORT (1 << 0)  /* 11______ 0_______ or 11______ 11______ */
+#define TOO_LONG (1 << 1)   /* 0_______ 10______ */
+#define OVERLONG_3 (1 << 2) /* 11100000 100_____ */
+#define TOO_LARGE (1 << 3)  /* 11110100 1001____ etc. (above U+10FFFF) */
+#define SURROGATE (1 << 4)  /* 11101101 101_____ */
+#define OVERLONG_2 (1 << 5) /* 1100000_ 10______ */
+#define TOO_LARGE_1000 (1 << 6) /* 11110101 1000____ etc. */
+#define OVERLONG_4 (1 << 6)     /* 11110000 1000____ */
+#define TWO_CONTS (1 << 7)      /* 10______ 10______ */
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define BYTE_1_HIGH                                                            \
+  TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,       \
+      TOO_LONG, TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,                    \
+      TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE,   \
+      TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW                                                             \
+  CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY,     \
+      CARRY, CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000,            \
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,  \
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,  \
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,  \
+      CARRY | TOO_LARGE | TOO_LARGE_1000,                                      \
+      CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,                          \
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define BYTE_2_HIGH                                                            \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+      TOO_SHORT,                                                               \
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |        \
+          OVERLONG_4,                                                          \
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,              \
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,               \
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, TOO_SHORT,    \
+      TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+#define SSE __attribute__((target("sse4.2")))
+#define AVX2 __attribute__((target("avx2")))
+
+/* SSE4.2 implementation */
+
+SSE static size_t find_newline_sse(const char *p, size_t len) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, nl));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + find_newline_scalar(p + i, len - i);
+}
+
+/* Returns a mask of the control characters in x. */
+SSE static inline __m128i controls_sse(__m128i x) {
+  __m128i c0 = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(0x1f)), x);
+  __m128i tab = _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'));
+  __m128i del = _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7f));
+  return _mm_or_si128(_mm_andnot_si128(tab, c0), del);
+}
+
+SSE static size_t find_control_sse(const char *p, size_t len) {
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+    int mask = _mm_movemask_epi8(controls_sse(x));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + find_control_scalar(p + i, len - i);
+}
+
+/* UTF-8 validation state carried from one block to the next */
+struct utf8_sse {
+  __m128i prev;       /* previous block */
+  __m128i incomplete; /* non-zero if prev ends with a truncated sequence */
+  __m128i error;
+};
+
+SSE static inline void utf8_block_sse(struct utf8_sse *st, __m128i x) {
+  if (_mm_movemask_epi8(x) == 0) { /* ASCII */
+    st->error = _mm_or_si128(st->error, st->incomplete);
+    st->incomplete = _mm_setzero_si128();
+    st->prev = x;
+    return;
+  }
+
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i prev1 = _mm_alignr_epi8(x, st->prev, 15);
+  __m128i b1h = _mm_shuffle_epi8(
+      _mm_setr_epi8(BYTE_1_HIGH),
+      _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+  __m128i b1l = _mm_shuffle_epi8(_mm_setr_epi8(BYTE_1_LOW),
+                                 _mm_and_si128(prev1, nibble));
+  __m128i b2h = _mm_shuffle_epi8(_mm_setr_epi8(BYTE_2_HIGH),
+                                 _mm_and_si128(_mm_srli_epi16(x, 4), nibble));
+  __m128i special = _mm_and_si128(_mm_and_si128(b1h, b1l), b2h);
+
+  /* bytes 2 and 3 after a 3/4-byte lead must be continuation bytes */
+  __m128i prev2 = _mm_alignr_epi8(x, st->prev, 14);
+  __m128i prev3 = _mm_alignr_epi8(x, st->prev, 13);
+  __m128i must23 =
+      _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80))),
+                   _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80))));
+  __m128i must23_80 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+  st->error = _mm_or_si128(st->error, _mm_xor_si128(must23_80, special));
+
+  /* a lead byte among the last 3 that needs more bytes than are left */
+  st->incomplete = _mm_subs_epu8(
+      x, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                       (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1)));
+  st->prev = x;
+}
+
+SSE static int valid_utf8_sse(const char *p, size_t len) {
+  struct utf8_sse st = {_mm_setzero_si128(), _mm_setzero_si128(),
+                        _mm_setzero_si128()};
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16)
+    utf8_block_sse(&st, _mm_loadu_si128((const __m128i *)(p + i)));
+  if (i < len) { /* pad the tail with ASCII */
+    char tail[16] = {0};
+    memcpy(tail, p + i, len - i);
+    utf8_block_sse(&st, _mm_loadu_si128((const __m128i *)tail));
+  }
+  __m128i error = _mm_or_si128(st.error, st.incomplete);
+  return _mm_testz_si128(error, error);
+}
+
+/* AVX2 implementation */
+
+AVX2 static size_t find_newline_avx2(const char *p, size_t len) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64) { /* 2 vectors per step */
+    __m256i a = _mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i *)(p + i)), nl);
+    __m256i b = _mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i *)(p + i + 32)), nl);
+    if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) {
+      uint64_t mask = (uint32_t)_mm256_movemask_epi8(a) |
+                      (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+      return i + __builtin_ctzll(mask);
+    }
+  }
+  for (; i + 32 <= len; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, nl));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + find_newline_scalar(p + i, len - i);
+}
+
+AVX2 static inline __m256i controls_avx2(__m256i x) {
+  __m256i c0 =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(0x1f)), x);
+  __m256i tab = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t'));
+  __m256i del = _mm256_cmpeq_epi8(x, _mm256_set1_epi8(0x7f));
+  return _mm256_or_si256(_mm256_andnot_si256(tab, c0), del);
+}
+
+AVX2 static size_t find_control_avx2(const char *p, size_t len) {
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(controls_avx2(x));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + find_control_scalar(p + i, len - i);
+}
+
+struct utf8_avx2 {
+  __m256i prev;
+  __m256i incomplete;
+  __m256i error;
+};
+
+/* Returns x shifted right by n bytes with the last bytes of prev shifted in
+ * (PALIGNR only works within 128-bit lanes). */
+#define PREV_AVX2(x, prev, n)                                                  \
+  _mm256_alignr_epi8((x), _mm256_permute2x128_si256((prev), (x), 0x21), 16 - (n))
+
+AVX2 static inline void utf8_block_avx2(struct utf8_avx2 *st, __m256i x) {
+  if (_mm256_movemask_epi8(x) == 0) { /* ASCII */
+    st->error = _mm256_or_si256(st->error, st->incomplete);
+    st->incomplete = _mm256_setzero_si256();
+    st->prev = x;
+    return;
+  }
+
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i prev1 = PREV_AVX2(x, st->prev, 1);
+  __m256i b1h = _mm256_shuffle_epi8(
+      _mm256_broadcastsi128_si256(_mm_setr_epi8(BYTE_1_HIGH)),
+      _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+  __m256i b1l = _mm256_shuffle_epi8(
+      _mm256_broadcastsi128_si256(_mm_setr_epi8(BYTE_1_LOW)),
+      _mm256_and_si256(prev1, nibble));
+  __m256i b2h = _mm256_shuffle_epi8(
+      _mm256_broadcastsi128_si256(_mm_setr_epi8(BYTE_2_HIGH)),
+      _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+  __m256i special = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+  __m256i prev2 = PREV_AVX2(x, st->prev, 2);
+  __m256i prev3 = PREV_AVX2(x, st->prev, 3);
+  __m256i must23 = _mm256_or_si256(
+      _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80))),
+      _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80))));
+  __m256i must23_80 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+  st->error = _mm256_or_si256(st->error, _mm256_xor_si256(must23_80, special));
+
+  st->incomplete = _mm256_subs_epu8(
+      x, _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                          -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                          -1, -1, -1, (char)(0xf0 - 1), (char)(0xe0 - 1),
+                          (char)(0xc0 - 1)));
+  st->prev = x;
+}
+
+AVX2 static int valid_utf8_avx2(const char *p, size_t len) {
+  struct utf8_avx2 st = {_mm256_setzero_si256(), _mm256_setzero_si256(),
+                         _mm256_setzero_si256()};
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32)
+    utf8_block_avx2(&st, _mm256_loadu_si256((const __m256i *)(p + i)));
+  if (i < len) {
+    char tail[32] = {0};
+    memcpy(tail, p + i, len - i);
+    utf8_block_avx2(&st, _mm256_loadu_si256((const __m256i *)tail));
+  }
+  __m256i error = _mm256_or_si256(st.error, st.incomplete);
+  return _mm256_testz_si256(error, error);
+}
+
+static int has_sse(void) { return __builtin_cpu_supports("sse4.2"); }
+static int has_avx2(void) { return __builtin_cpu_supports("avx2"); }
+
+#endif /* TEXTSCAN_X86 */
+
+static int always(void) { return 1; }
+
+struct textscan_impl {
+  const char *name;
+  int (*supported)(void);
+  size_t (*find_newline)(const char *, size_t);
+  size_t (*find_control)(const char *, size_t);
+  int (*valid_utf8)(const char *, size_t);
+};
+
+/* fastest first */
+static const struct textscan_impl impls[] = {
+#ifdef TEXTSCAN_X86
+    {"avx2", has_avx2, find_newline_avx2, find_control_avx2, valid_utf8_avx2},
+    {"sse4.2", has_sse, find_newline_sse, find_control_sse, valid_utf8_sse},
+#endif
+    {"scalar", always, find_newline_scalar, find_control_scalar,
+     valid_utf8_scalar},
+};
+
+#define NBR_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static const struct textscan_impl *impl = &impls[NBR_IMPLS - 1];
+
+__attribute__((constructor)) static void textscan_init(void) {
+#ifdef TEXTSCAN_X86
+  __builtin_cpu_init(); /* required before __builtin_cpu_supports in here */
+#endif
+  for (size_t i = 0; i < NBR_IMPLS; ++i) {
+    if (impls[i].supported()) {
+      impl = &impls[i];
+      break;
+    }
+  }
+}
+
+size_t text_find_newline(const char *p, size_t len) {
+  return impl->find_newline(p, len);
+}
+
+size_t text_find_control(const char *p, size_t len) {
+  return impl->find_control(p, len);
+}
+
+int text_valid_utf8(const char *p, size_t len) {
+  return impl->valid_utf8(p, len);
+}
+
+size_t text_sanitize(char *p, size_t len) {
+  unsigned char *s = (unsigned char *)p;
+  size_t replaced = 0, i = 0;
+
+  /* clean text (by far the common case) is only scanned */
+  if (impl->find_control(p, len) == len && impl->valid_utf8(p, len))
+    return 0;
+
+  while (i < len) {
+    if (s[i] < 0x80) {
+      if (is_control(s[i])) {
+        s[i] = '?';
+        ++replaced;
+      }
+      ++i;
+      continue;
+    }
+    size_t n = utf8_sequence(s + i, len - i);
+    if (n == 0) { /* the following bytes get their own turn */
+      s[i] = '?';
+      ++replaced;
+      n = 1;
+    }
+    i += n;
+  }
+  return replaced;
+}
+
+const char *text_impl(void) { return impl->name; }
+
+int text_select(const char *name) {
+  for (size_t i = 0; i < NBR_IMPLS; ++i) {
+    if (strcmp(impls[i].name, name) == 0) {
+      if (!impls[i].supported())
+        return -1;
+      impl = &impls[i];
+      return 0;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,40 @@
+#ifndef TEXTSCAN_H
+#define TEXTSCAN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Vectorized scanning of text received from clients. Every function has a
+ * scalar, an SSE4.2 and an AVX2 implementation - the fastest one supported by
+ * the CPU is selected at startup. */
+
+/* returns the index of the first '\n' in p or len if there is none */
+size_t text_find_newline(const char *p, size_t len);
+
+/* returns the index of the first control character in p (C0 except tab, and
+ * DEL) or len if there is none */
+size_t text_find_control(const char *p, size_t len);
+
+/* returns 1 if p is valid UTF-8 and 0 otherwise */
+int text_valid_utf8(const char *p, size_t len);
+
+/* replaces control characters and every byte of invalid UTF-8 sequences in p
+ * with '?'. Returns the number of replaced bytes */
+size_t text_sanitize(char *p, size_t len);
+
+/* returns the name of the selected implementation ("avx2", "sse4.2" or
+ * "scalar") */
+const char *text_impl(void);
+
+/* selects an implementation by name (e.g., to benchmark them against each
+ * other). 0 on success and -1 if the CPU does not support it */
+int text_select(const char *impl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,14 +1,396 @@
+/*
+ * udplistener.c -- receives a single UDP datagram on PORT (see udptalker.c),
+ * or, with -m, subscribes to a multicast group and prints the messages of
+ * its publisher in order (see mcast.h), or, with -R, prints the messages of a
+ * reliable talker (udptalker -R, see rudp.h).
+ *
+ * Usage: ./udplistener PORT MAXBUFLEN
+ *        ./udplistener -m [-i IFACE] [-q] GROUP PORT
+ *        ./udplistener -R [-q] PORT
+ *
+ *   -m  multicast subscriber mode. Missing messages are requested from the
+ *       publisher (NACK) and later ones are held back until they arrive - or
+ *       until the publisher reports them as gone, in which case they are
+ *       skipped. Exits once the publisher is done.
+ *   -i  join the group on this network interface (e.g., lo)
+ *   -R  reliable mode - messages are acknowledged and printed in order (per
+ *       stream). Exits once the talker is done
+ *   -q  quiet - only print the counters at the end
+ *
+ * compile with:
+ *
+ *   cc -o udplistener udplistener.c sockethelpers.c mcast.c rudp.c
+ */
+
+#include "mcast.h"
+#include "rudp.h"
 #include "sockethelpers.h"
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#define WINDOW 8192       /* max number of messages held back */
+#define NACK_INTERVAL_MS 20 /* a gap is NACKed again after this long */
+#define MAX_NACKS 256     /* max number of NACKs (gaps) sent at once */
+#define GIVE_UP_MS 1000   /* after the publisher's END, missing messages are
+                             given up once it is silent for this long */
+#define LINGER_MS 1000    /* -R: ACKs are repeated this long after the end */
+
+/* a message that arrived before some of its predecessors */
+struct held_msg {
+  uint64_t seq; /* 0 if the slot is free */
+  uint16_t len;
+  char data[MCAST_MAX_PAYLOAD];
+};
+
+/* multicast subscriber state (-m) */
+struct subscriber {
+  const char *iface;
+  int quiet;
+  int fd;
+  int repair_fd; /* unicast side channel: NACKs out, repairs in */
+  int synced;             /* got a first datagram of session */
+  uint32_t session;
+  uint64_t next;          /* seq of the next message to print */
+  uint64_t last;          /* highest seq known to exist */
+  uint64_t end;           /* seq of the publisher's last message, 0 if unknown */
+  struct held_msg *window; /* WINDOW slots, by seq % WINDOW */
+  struct sockaddr_storage publisher; /* where NACKs go */
+  socklen_t publisher_len;
+  uint64_t nacked;  /* highest seq NACKs were sent up to */
+  uint64_t nack_ms; /* time of the last retry, 0 if there is no gap */
+  uint64_t heard_ms; /* time of the last datagram of the publisher */
+  uint64_t received, repaired, duplicates, delivered, lost, nacks; /* counters */
+};
+
+/* reliable mode state (-R) */
+struct reliable {
+  int quiet;
+  int fd;
+  struct rudp *r;
+  struct sockaddr_storage talker; /* where ACKs go */
+  socklen_t talker_len;
+};
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_ms(void) { return now_us() / 1000; }
+
+/* Prints the message with the next seq and the ones held back after it. */
+static void deliver(struct subscriber *sub) {
+  struct held_msg *m;
+  while ((m = &sub->window[sub->next % WINDOW])->seq == sub->next) {
+    if (!sub->quiet)
+      printf("%.*s\n", m->len, m->data);
+    m->seq = 0;
+    ++sub->next;
+    ++sub->delivered;
+  }
+}
+
+/* Asks the publisher for the missing messages between seq and last - one
+ * NACK per gap (and for at most MAX_NACKS gaps). */
+static void send_nacks(struct subscriber *sub, uint64_t seq) {
+  uint64_t last = sub->last;
+  int sent = 0;
+
+  if (last >= sub->next + WINDOW) /* only what fits in the window */
+    last = sub->next + WINDOW - 1;
+  while (seq <= last && sent < MAX_NACKS) {
+    if (sub->window[seq % WINDOW].seq == seq) {
+      ++seq;
+      continue;
+    }
+    struct mcast_header h = {.magic = MCAST_MAGIC,
+                             .session = sub->session,
+                             .type = MCAST_NACK,
+                             .seq = seq};
+    while (seq <= last && sub->window[seq % WINDOW].seq != seq &&
+           h.count < MCAST_MAX_NACK) {
+      ++h.count;
+      ++seq;
+    }
+    mcast_header_swap(&h);
+    if (sendto(sub->repair_fd, &h, sizeof(h), 0,
+               (struct sockaddr *)&sub->publisher, sub->publisher_len) == -1)
+      perror("sendto");
+    ++sub->nacks;
+    ++sent;
+  }
+  sub->nacked = seq - 1;
+}
+
+/* Handles a datagram of the publisher. */
+static void handle_datagram(struct subscriber *sub, const char *buf, size_t n,
+                            const struct sockaddr_storage *from,
+                            socklen_t from_len) {
+  struct mcast_header h;
+
+  if (n < sizeof(h))
+    return;
+  memcpy(&h, buf, sizeof(h));
+  mcast_header_swap(&h);
+  if (h.magic != MCAST_MAGIC || h.len > n - sizeof(h))
+    return;
+  sub->heard_ms = now_ms();
+
+  /* the first datagram of a publisher (or of a restarted one) - start with
+   * whatever comes next */
+  if (!sub->synced || h.session != sub->session) {
+    if (h.type == MCAST_NACK || h.type == MCAST_GONE)
+      return;
+    sub->synced = 1;
+    sub->session = h.session;
+    sub->next = h.type == MCAST_DATA ? h.seq : h.seq + 1;
+    sub->last = sub->next - 1;
+    sub->end = 0;
+    sub->nacked = sub->last;
+    sub->nack_ms = 0;
+    for (uint32_t i = 0; i < WINDOW; ++i)
+      sub->window[i].seq = 0;
+    memcpy(&sub->publisher, from, from_len);
+    sub->publisher_len = from_len;
+  }
+
+  switch (h.type) {
+  case MCAST_DATA: {
+    struct held_msg *m = &sub->window[h.seq % WINDOW];
+    ++sub->received;
+    if (h.count == 1) /* a retransmission */
+      ++sub->repaired;
+    if (h.seq < sub->next || m->seq == h.seq) {
+      ++sub->duplicates;
+      return;
+    }
+    if (h.seq > sub->last)
+      sub->last = h.seq;
+    if (h.seq >= sub->next + WINDOW)
+      return; /* too far ahead - NACKed again later */
+    m->seq = h.seq;
+    m->len = h.len;
+    memcpy(m->data, buf + sizeof(h), h.len);
+    deliver(sub);
+    break;
+  }
+  case MCAST_END:
+    sub->end = h.seq;
+    /* fall through */
+  case MCAST_HEARTBEAT:
+    if (h.seq > sub->last)
+      sub->last = h.seq;
+    break;
+  case MCAST_GONE: /* skip them */
+    while (sub->next >= h.seq && sub->next < h.seq + h.count) {
+      if (sub->window[sub->next % WINDOW].seq != sub->next) {
+        ++sub->lost;
+        ++sub->next;
+      }
+      deliver(sub);
+    }
+    break;
+  }
+
+  /* a new gap is NACKed right away, the old ones every NACK_INTERVAL_MS */
+  if (sub->last < sub->next) {
+    sub->nack_ms = 0;
+  } else if (sub->last > sub->nacked) {
+    send_nacks(sub, sub->nacked >= sub->next ? sub->nacked + 1 : sub->next);
+    if (sub->nack_ms == 0)
+      sub->nack_ms = now_ms();
+  }
+}
+
+/* Prints the messages of the group's publisher (see the top of this file). */
+static int run_subscriber(struct subscriber *sub, const char *group,
+                          const char *port) {
+  struct sockaddr_storage group_addr, from;
+  socklen_t group_len, from_len;
+  char buf[sizeof(struct mcast_header) + MCAST_MAX_PAYLOAD];
+
+  sub->fd = mcast_socket(group, port, sub->iface, 1, 0, 0, &group_addr,
+                         &group_len);
+  if (sub->fd == -1)
+    return EXIT_FAILURE;
+
+  /* repairs are unicast - they must not go to the group's port, which other
+   * subscribers on this host may share (only one of them would get them) */
+  sub->repair_fd = socket(group_addr.ss_family, SOCK_DGRAM, 0);
+  if (sub->repair_fd == -1) {
+    perror("socket");
+    return EXIT_FAILURE;
+  }
+  sub->window = (struct held_msg *)calloc(WINDOW, sizeof(struct held_msg));
+  if (sub->window == NULL) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "[listener] joined %s port %s\n", group, port);
+
+  while (sub->end == 0 || sub->next <= sub->end) {
+    struct pollfd fds[2] = {{sub->fd, POLLIN, 0}, {sub->repair_fd, POLLIN, 0}};
+    if (poll(fds, 2, NACK_INTERVAL_MS) == -1) {
+      perror("poll");
+      return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+      ssize_t n;
+      for (;;) {
+        from_len = sizeof(from);
+        n = recvfrom(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT,
+                     (struct sockaddr *)&from, &from_len);
+        if (n == -1)
+          break;
+        handle_datagram(sub, buf, n, &from, from_len);
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("recvfrom");
+        return EXIT_FAILURE;
+      }
+    }
+
+    if (sub->nack_ms != 0 && now_ms() >= sub->nack_ms + NACK_INTERVAL_MS) {
+      send_nacks(sub, sub->next);
+      sub->nack_ms = now_ms();
+    }
+
+    /* the publisher is gone - and so are the messages we still miss */
+    if (sub->end != 0 && now_ms() >= sub->heard_ms + GIVE_UP_MS) {
+      for (; sub->next <= sub->end; deliver(sub)) {
+        if (sub->window[sub->next % WINDOW].seq != sub->next) {
+          ++sub->lost;
+          ++sub->next;
+        }
+      }
+    }
+  }
+
+  fflush(stdout);
+  fprintf(stderr,
+          "[listener] delivered %lu messages (%lu lost), received %lu "
+          "datagrams (%lu repairs, %lu duplicates), sent %lu NACKs\n",
+          sub->delivered, sub->lost, sub->received, sub->repaired,
+          sub->duplicates, sub->nacks);
+  close(sub->fd);
+  close(sub->repair_fd);
+  free(sub->window);
+  return EXIT_SUCCESS;
+}
+
+/* rudp output callback */
+static void reliable_output(void *arg, const void *pkt, size_t len) {
+  struct reliable *rel = (struct reliable *)arg;
+  if (sendto(rel->fd, pkt, len, 0, (struct sockaddr *)&rel->talker,
+             rel->talker_len) == -1 &&
+      errno != EAGAIN && errno != ENOBUFS)
+    perror("sendto");
+}
+
+/* rudp deliver callback */
+static void reliable_deliver(void *arg, unsigned stream, const void *msg,
+                             size_t len) {
+  (void)stream;
+  if (!((struct reliable *)arg)->quiet)
+    printf("%.*s\n", (int)len, (const char *)msg);
+}
+
+/* Prints the messages of a reliable talker (see the top of this file). */
+static int run_reliable(struct reliable *rel, const char *port) {
+  struct addrinfo hints, *res;
+  char buf[RUDP_MAX_PACKET];
+  uint64_t end_ms = 0;
+  int rv;
+
+  /* an IPv6 socket gets IPv4 talkers too (as mapped addresses) */
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET6;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+  rv = getaddrinfo(NULL, port, &hints, &res);
+  if (rv != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return EXIT_FAILURE;
+  }
+  rel->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (rel->fd == -1 || bind(rel->fd, res->ai_addr, res->ai_addrlen) == -1) {
+    perror("bind");
+    freeaddrinfo(res);
+    return EXIT_FAILURE;
+  }
+  freeaddrinfo(res);
+  rel->r = rudp_new(reliable_output, reliable_deliver, rel);
+  if (rel->r == NULL) {
+    perror("rudp_new");
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "[listener] waiting for a talker on port %s\n", port);
+
+  /* once the talker is done, keep acknowledging for a while - it may not
+   * have got our last ACK */
+  while (end_ms == 0 || now_ms() < end_ms) {
+    uint64_t now = now_us(), deadline = rudp_tick(rel->r, now);
+    int timeout = end_ms != 0 ? (int)(end_ms - now / 1000) : -1;
+    if (deadline != UINT64_MAX) {
+      int t = deadline > now ? (deadline - now + 999) / 1000 : 0;
+      if (timeout == -1 || t < timeout)
+        timeout = t;
+    }
+    struct pollfd pfd = {rel->fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout) == -1) {
+      perror("poll");
+      return EXIT_FAILURE;
+    }
+
+    for (;;) {
+      struct sockaddr_storage from;
+      socklen_t from_len = sizeof(from);
+      ssize_t n = recvfrom(rel->fd, buf, sizeof(buf), MSG_DONTWAIT,
+                           (struct sockaddr *)&from, &from_len);
+      if (n == -1)
+        break;
+      /* ACKs go to whoever sent last (a restarted talker has a new port) */
+      memcpy(&rel->talker, &from, from_len);
+      rel->talker_len = from_len;
+      rudp_input(rel->r, buf, n, now_us());
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("recvfrom");
+      return EXIT_FAILURE;
+    }
+    if (end_ms == 0 && rudp_peer_closed(rel->r))
+      end_ms = now_ms() + LINGER_MS;
+  }
+  rudp_tick(rel->r, now_us());
+
+  fflush(stdout);
+  rudp_print_stats(rel->r, stderr, "[listener] ");
+  rudp_free(rel->r);
+  close(rel->fd);
+  return EXIT_SUCCESS;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s PORT MAXBUFLEN\n"
+          "       %s -m [-i IFACE] [-q] GROUP PORT\n"
+          "       %s -R [-q] PORT\n",
+          prog, prog, prog);
+  exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]) {
   int sockfd, rv;
   char *port;               /* filled from command line */
@@ -18,15 +400,46 @@ int main(int argc, char *argv[]) {
   char addr_str[INET6_ADDRSTRLEN];
   struct sockaddr_storage their_addr;     /* holds address of a client */
   socklen_t addr_len = sizeof their_addr; /* inout parameter for recvfrom */
-  char buf[maxbuflen];
+  struct subscriber sub = {0};
+  struct reliable rel = {0};
+  int multicast = 0, reliable = 0, opt;
 
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s PORT MAXBUFLEN\n", argv[0]);
-    exit(EXIT_FAILURE);
+  while ((opt = getopt(argc, argv, "mi:qR")) != -1) {
+    switch (opt) {
+    case 'm':
+      multicast = 1;
+      break;
+    case 'i':
+      sub.iface = optarg;
+      break;
+    case 'q':
+      sub.quiet = rel.quiet = 1;
+      break;
+    case 'R':
+      reliable = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
   }
 
-  port = argv[1];
-  maxbuflen = strtol(argv[2], NULL, 10);
+  if (multicast) {
+    if (argc - optind != 2)
+      usage(argv[0]);
+    exit(run_subscriber(&sub, argv[optind], argv[optind + 1]));
+  }
+  if (reliable) {
+    if (argc - optind != 1)
+      usage(argv[0]);
+    exit(run_reliable(&rel, argv[optind]));
+  }
+
+  if (argc - optind != 2)
+    usage(argv[0]);
+
+  port = argv[optind];
+  maxbuflen = strtol(argv[optind + 1], NULL, 10);
+  char buf[maxbuflen];
 
   /* The AI_PASSIVE flag means "hey, look for this host's IPs that can
    * be used to accept connection (i.e., bind() calls). This is the usual
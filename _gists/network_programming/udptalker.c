@@ -1,28 +1,488 @@
+/*
+ * udptalker.c -- sends a single UDP datagram to HOSTNAME:PORT (see
+ * udplistener.c), or, with -m, publishes every line read from stdin to a
+ * multicast group (see mcast.h) - one send reaches every subscriber, or,
+ * with -R, sends every line read from stdin reliably to HOSTNAME:PORT (see
+ * rudp.h).
+ *
+ * Usage: ./udptalker HOSTNAME PORT MESSAGE
+ *        ./udptalker -m [-i IFACE] [-t TTL] [-n] [-H HISTORY] [-r RATE]
+ *                    [-x LOSS] GROUP PORT
+ *        ./udptalker -R [-s STREAMS] [-u] [-x LOSS] HOSTNAME PORT
+ *
+ *   -m  multicast publisher mode
+ *   -i  send on this network interface (e.g., lo) instead of the default one
+ *   -t  multicast TTL / hop limit (default 1, i.e., the local network only)
+ *   -n  no multicast loopback - subscribers on this host receive nothing
+ *   -H  number of sent messages kept to answer NACKs (default 4096)
+ *   -r  max messages per second (default 0, i.e., as fast as stdin delivers)
+ *   -x  drop this fraction (0-1) of the multicast sends on purpose to
+ *       exercise the NACK repair (e.g., over the loopback interface) - or,
+ *       with -R, of all packets to exercise the retransmissions
+ *   -R  reliable mode: every line is a message, retransmitted until the
+ *       listener (udplistener -R) acknowledges it, and delivered in order
+ *   -s  spread the lines round-robin over this many streams (default 1,
+ *       max RUDP_MAX_STREAMS) - a lost line only holds back its own stream
+ *   -u  unordered - lines are delivered as soon as they arrive
+ *
+ * e.g., over the loopback interface (see mcast.c to enable multicast on it):
+ *
+ *   ./udplistener -m -i lo 239.1.2.3 9050
+ *   seq 100000 | ./udptalker -m -i lo -x 0.01 239.1.2.3 9050
+ *
+ * Once stdin is closed, the publisher keeps answering NACKs for a while
+ * (LINGER_MS) and then exits. In reliable mode, the talker exits once the
+ * listener has acknowledged everything:
+ *
+ *   ./udplistener -R 9050 > out.txt
+ *   seq 100000 | ./udptalker -R -x 0.05 localhost 9050
+ *
+ * compile with:
+ *
+ *   cc -o udptalker udptalker.c sockethelpers.c mcast.c rudp.c
+ */
+
+#include "mcast.h"
+#include "rudp.h"
 #include "sockethelpers.h"
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#define HISTORY 4096      /* default number of messages kept for repairs */
+#define HEARTBEAT_MS 100  /* heartbeat interval while there is nothing new */
+#define LINGER_MS 2000    /* repairs are served this long after stdin's EOF */
+#define LINE_BUF_SIZE 65536
+#define BURST 64 /* max messages sent in a row before NACKs are checked */
+
+/* a sent message kept for repairs */
+struct sent_msg {
+  uint64_t seq;
+  uint16_t len;
+  char data[MCAST_MAX_PAYLOAD];
+};
+
+/* multicast publisher state (-m) */
+struct publisher {
+  const char *iface;
+  int ttl;
+  int loop;
+  uint32_t history; /* capacity of ring */
+  uint32_t rate;    /* max messages per second, 0 for unlimited */
+  double loss;      /* fraction of multicast sends dropped on purpose */
+  int fd;
+  struct sockaddr_storage group;
+  socklen_t group_len;
+  uint32_t session;
+  uint64_t next_seq;     /* seq of the next message - the first one is 1 */
+  struct sent_msg *ring; /* the last history messages, by seq % history */
+  uint64_t last_send_ms; /* time of the last multicast send */
+  uint64_t sent, dropped, nacks, repaired, gone; /* counters */
+};
+
+/* reliable mode state (-R) */
+struct reliable {
+  unsigned streams;
+  int unordered;
+  double loss; /* fraction of packets dropped on purpose */
+  int fd;
+  struct rudp *r;
+  uint64_t dropped;
+};
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Sends a datagram made of header h and payload to addr. */
+static void send_datagram(struct publisher *pub, struct mcast_header h,
+                          const char *payload, uint16_t len,
+                          const struct sockaddr *addr, socklen_t addr_len) {
+  char buf[sizeof(struct mcast_header) + MCAST_MAX_PAYLOAD];
+
+  h.magic = MCAST_MAGIC;
+  h.session = pub->session;
+  mcast_header_swap(&h);
+  memcpy(buf, &h, sizeof(h));
+  memcpy(buf + sizeof(h), payload, len);
+  if (sendto(pub->fd, buf, sizeof(h) + len, 0, addr, addr_len) == -1 &&
+      errno != EAGAIN && errno != ENOBUFS)
+    perror("sendto");
+}
+
+/* Multicasts message msg (cut to MCAST_MAX_PAYLOAD bytes) and keeps it for
+ * repairs. */
+static void publish(struct publisher *pub, const char *msg, size_t len) {
+  struct sent_msg *m = &pub->ring[pub->next_seq % pub->history];
+
+  m->seq = pub->next_seq++;
+  m->len = len < MCAST_MAX_PAYLOAD ? len : MCAST_MAX_PAYLOAD;
+  memcpy(m->data, msg, m->len);
+
+  ++pub->sent;
+  pub->last_send_ms = now_us() / 1000;
+  if (pub->loss > 0 && (double)rand() / RAND_MAX < pub->loss) {
+    ++pub->dropped;
+    return;
+  }
+  struct mcast_header h = {.type = MCAST_DATA, .len = m->len, .seq = m->seq};
+  send_datagram(pub, h, m->data, m->len, (struct sockaddr *)&pub->group,
+                pub->group_len);
+}
+
+/* Answers the NACKs received on the publisher's socket - the requested
+ * messages are re-sent unicast to the subscriber that asked for them. */
+static void handle_nacks(struct publisher *pub) {
+  char buf[sizeof(struct mcast_header) + MCAST_MAX_PAYLOAD];
+  struct sockaddr_storage from;
+  socklen_t from_len;
+  ssize_t n;
+
+  for (;;) {
+    struct mcast_header h;
+    from_len = sizeof(from);
+    n = recvfrom(pub->fd, buf, sizeof(buf), MSG_DONTWAIT,
+                 (struct sockaddr *)&from, &from_len);
+    if (n == -1)
+      break;
+    if ((size_t)n < sizeof(h))
+      continue;
+    memcpy(&h, buf, sizeof(h));
+    mcast_header_swap(&h);
+    if (h.magic != MCAST_MAGIC || h.type != MCAST_NACK ||
+        h.session != pub->session || h.count > MCAST_MAX_NACK)
+      continue;
+
+    ++pub->nacks;
+    uint64_t oldest = pub->next_seq > pub->history
+                          ? pub->next_seq - pub->history
+                          : 1;
+    uint64_t seq = h.seq, end = h.seq + h.count;
+    if (end > pub->next_seq)
+      end = pub->next_seq; /* not sent yet */
+    if (seq < oldest) { /* overwritten - the subscriber has to skip them */
+      uint64_t gone_end = end < oldest ? end : oldest;
+      struct mcast_header g = {
+          .type = MCAST_GONE, .count = (uint32_t)(gone_end - seq), .seq = seq};
+      send_datagram(pub, g, NULL, 0, (struct sockaddr *)&from, from_len);
+      pub->gone += gone_end - seq;
+      seq = gone_end;
+    }
+    for (; seq < end; ++seq) {
+      struct sent_msg *m = &pub->ring[seq % pub->history];
+      struct mcast_header d = {
+          .type = MCAST_DATA, .len = m->len, .count = 1, .seq = seq};
+      send_datagram(pub, d, m->data, m->len, (struct sockaddr *)&from,
+                    from_len);
+      ++pub->repaired;
+    }
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK)
+    perror("recvfrom");
+}
+
+/* Publishes the lines of stdin until EOF (see the top of this file). */
+static int run_publisher(struct publisher *pub, const char *group,
+                         const char *port) {
+  static char lines[LINE_BUF_SIZE];
+  size_t start = 0, pending = 0; /* unsent lines are in [start, pending) */
+  int eof = 0;
+  uint64_t next_send_us = 0, end_ms = 0;
+
+  pub->fd = mcast_socket(group, port, pub->iface, 0, pub->ttl, pub->loop,
+                         &pub->group, &pub->group_len);
+  if (pub->fd == -1)
+    return EXIT_FAILURE;
+  pub->ring = (struct sent_msg *)calloc(pub->history, sizeof(struct sent_msg));
+  if (pub->ring == NULL) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+  srand(now_us());
+  pub->session = (uint32_t)rand();
+  pub->next_seq = 1;
+
+  /* announce ourselves so that subscribers sync before the first message */
+  struct mcast_header hb = {.type = MCAST_HEARTBEAT, .seq = 0};
+  send_datagram(pub, hb, NULL, 0, (struct sockaddr *)&pub->group,
+                pub->group_len);
+  pub->last_send_ms = now_us() / 1000;
+
+  for (;;) {
+    uint64_t now = now_us();
+    char *nl = (char *)memchr(lines + start, '\n', pending - start);
+    int burst = 0;
+
+    /* send the complete lines we have (as fast as the rate allows) */
+    while ((nl != NULL || (eof && pending != start)) && now >= next_send_us &&
+           burst++ < BURST) {
+      size_t len = nl != NULL ? (size_t)(nl - lines - start) : pending - start;
+      publish(pub, lines + start, len);
+      start += nl != NULL ? len + 1 : len;
+      if (pub->rate != 0) { /* keep the pace (poll sleeps whole ms) - but do
+                               not catch up on idle time */
+        if (next_send_us + 10000 < now)
+          next_send_us = now;
+        next_send_us += 1000000 / pub->rate;
+      }
+      nl = (char *)memchr(lines + start, '\n', pending - start);
+    }
+    if (eof && pending == start && end_ms == 0) /* all sent - linger */
+      end_ms = now / 1000 + LINGER_MS;
+    if (end_ms != 0 && now / 1000 >= end_ms)
+      break;
+
+    /* nothing new for a while - tell subscribers what the last message is
+     * (so that they notice if they missed the last ones) */
+    if (now / 1000 >= pub->last_send_ms + HEARTBEAT_MS) {
+      hb.type = end_ms != 0 ? MCAST_END : MCAST_HEARTBEAT;
+      hb.seq = pub->next_seq - 1;
+      send_datagram(pub, hb, NULL, 0, (struct sockaddr *)&pub->group,
+                    pub->group_len);
+      pub->last_send_ms = now / 1000;
+    }
+
+    /* read more lines only once the ones we have are sent */
+    if (nl == NULL && start != 0) {
+      memmove(lines, lines + start, pending - start);
+      pending -= start;
+      start = 0;
+    }
+    int want_stdin = !eof && nl == NULL && pending < sizeof(lines);
+    struct pollfd fds[2] = {{pub->fd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+    int timeout = HEARTBEAT_MS;
+    if (nl != NULL) /* more to send - right away or once the rate allows */
+      timeout = next_send_us > now ? (next_send_us - now + 999) / 1000 : 0;
+    if (poll(fds, want_stdin ? 2 : 1, timeout) == -1) {
+      perror("poll");
+      return EXIT_FAILURE;
+    }
+
+    if (fds[0].revents & POLLIN)
+      handle_nacks(pub);
+    if (want_stdin && (fds[1].revents & (POLLIN | POLLHUP))) {
+      ssize_t n = read(STDIN_FILENO, lines + pending, sizeof(lines) - pending);
+      if (n <= 0)
+        eof = 1;
+      else
+        pending += n;
+      if (pending == sizeof(lines) && memchr(lines, '\n', pending) == NULL)
+        eof = 1; /* a line longer than the buffer - send what we have */
+    }
+  }
+
+  fprintf(stderr,
+          "[publisher] sent %lu messages (%lu dropped on purpose), answered "
+          "%lu NACKs with %lu repairs (%lu messages were gone)\n",
+          pub->sent, pub->dropped, pub->nacks, pub->repaired, pub->gone);
+  close(pub->fd);
+  free(pub->ring);
+  return EXIT_SUCCESS;
+}
+
+/* rudp output callback */
+static void reliable_output(void *arg, const void *pkt, size_t len) {
+  struct reliable *rel = (struct reliable *)arg;
+  if (rel->loss > 0 && (double)rand() / RAND_MAX < rel->loss) {
+    ++rel->dropped;
+    return;
+  }
+  if (send(rel->fd, pkt, len, 0) == -1 && errno != EAGAIN &&
+      errno != ENOBUFS && errno != ECONNREFUSED)
+    perror("send");
+}
+
+/* rudp deliver callback - the listener sends nothing but ACKs */
+static void reliable_deliver(void *arg, unsigned stream, const void *msg,
+                             size_t len) {
+  (void)arg, (void)stream, (void)msg, (void)len;
+}
+
+/* Sends the lines of stdin reliably until EOF (see the top of this file). */
+static int run_reliable(struct reliable *rel, const char *host,
+                        const char *port) {
+  static char lines[LINE_BUF_SIZE];
+  size_t start = 0, pending = 0; /* unsent lines are in [start, pending) */
+  struct addrinfo hints, *res;
+  int eof = 0, closed = 0, rv;
+  uint64_t nbr = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  rv = getaddrinfo(host, port, &hints, &res);
+  if (rv != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return EXIT_FAILURE;
+  }
+  /* connected, so that ICMP errors (nobody listening) are reported */
+  rel->fd = socket(res->ai_family, SOCK_DGRAM, 0);
+  if (rel->fd == -1 || connect(rel->fd, res->ai_addr, res->ai_addrlen) == -1) {
+    perror("socket");
+    freeaddrinfo(res);
+    return EXIT_FAILURE;
+  }
+  freeaddrinfo(res);
+  srand(now_us());
+  rel->r = rudp_new(reliable_output, reliable_deliver, rel);
+  if (rel->r == NULL) {
+    perror("rudp_new");
+    return EXIT_FAILURE;
+  }
+
+  while (!closed || rudp_pending(rel->r) != 0) {
+    char *nl;
+
+    /* queue the complete lines we have while the window has room */
+    while ((nl = (char *)memchr(lines + start, '\n', pending - start)) !=
+               NULL ||
+           (eof && pending != start)) {
+      size_t len = nl != NULL ? (size_t)(nl - lines - start) : pending - start;
+      if (rudp_send(rel->r, nbr % rel->streams, rel->unordered, lines + start,
+                    len < RUDP_MAX_PAYLOAD ? len : RUDP_MAX_PAYLOAD) == -1)
+        break;
+      ++nbr;
+      start += nl != NULL ? len + 1 : len;
+    }
+    if (eof && pending == start && !closed)
+      closed = rudp_close(rel->r) == 0;
+
+    uint64_t now = now_us(), deadline = rudp_tick(rel->r, now);
+
+    /* read more lines only once the ones we have are queued */
+    if (nl == NULL && start != 0) {
+      memmove(lines, lines + start, pending - start);
+      pending -= start;
+      start = 0;
+    }
+    int want_stdin = !eof && nl == NULL && pending < sizeof(lines);
+    struct pollfd fds[2] = {{rel->fd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+    int timeout = -1;
+    if (deadline != UINT64_MAX)
+      timeout = deadline > now ? (deadline - now + 999) / 1000 : 0;
+    if (poll(fds, want_stdin ? 2 : 1, timeout) == -1) {
+      perror("poll");
+      return EXIT_FAILURE;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLERR)) {
+      char buf[RUDP_MAX_PACKET];
+      ssize_t n;
+      while ((n = recv(rel->fd, buf, sizeof(buf), MSG_DONTWAIT)) >= 0)
+        rudp_input(rel->r, buf, n, now_us());
+      if (errno == ECONNREFUSED) {
+        fprintf(stderr, "[talker] nobody listens on %s port %s\n", host,
+                port);
+        return EXIT_FAILURE;
+      }
+    }
+    if (want_stdin && (fds[1].revents & (POLLIN | POLLHUP))) {
+      ssize_t n = read(STDIN_FILENO, lines + pending, sizeof(lines) - pending);
+      if (n <= 0)
+        eof = 1;
+      else
+        pending += n;
+      if (pending == sizeof(lines) && memchr(lines, '\n', pending) == NULL)
+        eof = 1; /* a line longer than the buffer - send what we have */
+    }
+  }
+
+  fprintf(stderr, "[talker] sent %lu lines (%lu packets dropped on purpose)\n",
+          nbr, rel->dropped);
+  rudp_print_stats(rel->r, stderr, "[talker] ");
+  rudp_free(rel->r);
+  close(rel->fd);
+  return EXIT_SUCCESS;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s HOSTNAME PORT MESSAGE\n"
+          "       %s -m [-i IFACE] [-t TTL] [-n] [-H HISTORY] [-r RATE] "
+          "[-x LOSS] GROUP PORT\n"
+          "       %s -R [-s STREAMS] [-u] [-x LOSS] HOSTNAME PORT\n",
+          prog, prog, prog);
+  exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]) {
   int sockfd, rv, nbr_bytes;
   struct addrinfo hints, *servinfo, *p;
   char *port, *hostname, *msg;     /* filled from command line */
   char addr_str[INET6_ADDRSTRLEN]; /* holds address representation string */
+  struct publisher pub = {.ttl = 1, .loop = 1, .history = HISTORY};
+  struct reliable rel = {.streams = 1};
+  int multicast = 0, reliable = 0, opt;
 
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s HOSTNAME PORT MESSAGE\n", argv[0]);
-    exit(EXIT_FAILURE);
+  while ((opt = getopt(argc, argv, "mi:t:nH:r:x:Rs:u")) != -1) {
+    switch (opt) {
+    case 'm':
+      multicast = 1;
+      break;
+    case 'i':
+      pub.iface = optarg;
+      break;
+    case 't':
+      pub.ttl = (int)strtol(optarg, NULL, 10);
+      break;
+    case 'n':
+      pub.loop = 0;
+      break;
+    case 'H':
+      pub.history = strtoul(optarg, NULL, 10);
+      if (pub.history == 0)
+        usage(argv[0]);
+      break;
+    case 'r':
+      pub.rate = strtoul(optarg, NULL, 10);
+      break;
+    case 'x':
+      pub.loss = rel.loss = strtod(optarg, NULL);
+      break;
+    case 'R':
+      reliable = 1;
+      break;
+    case 's':
+      rel.streams = strtoul(optarg, NULL, 10);
+      if (rel.streams == 0 || rel.streams > RUDP_MAX_STREAMS)
+        usage(argv[0]);
+      break;
+    case 'u':
+      rel.unordered = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
   }
 
-  hostname = argv[1];
-  port = argv[2];
-  msg = argv[3];
+  if (multicast) {
+    if (argc - optind != 2)
+      usage(argv[0]);
+    exit(run_publisher(&pub, argv[optind], argv[optind + 1]));
+  }
+  if (reliable) {
+    if (argc - optind != 2)
+      usage(argv[0]);
+    exit(run_reliable(&rel, argv[optind], argv[optind + 1]));
+  }
+
+  if (argc - optind != 3)
+    usage(argv[0]);
+
+  hostname = argv[optind];
+  port = argv[optind + 1];
+  msg = argv[optind + 2];
 
   /* Fill up the addrinfo hints by choosing IPv4 vs. IPv6, UDP vs. TCP and the
    * target IP address. In this case, we are using UDP (datagram) and IPv6. */
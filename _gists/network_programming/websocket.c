@@ -0,0 +1,378 @@
+/*
+ * websocket.c -- server side of the WebSocket protocol (see websocket.h).
+ *
+ * The upgrade handshake needs the SHA-1 of the client's key (which is
+ * implemented here so that there is no dependency on a crypto library - it is
+ * not used for anything security relevant). Client payloads are XOR-masked
+ * with a 4-byte key - unmasking is done 16 (SSE2) or 32 (AVX2, if the CPU
+ * supports it) bytes at a time with the key broadcast to a full vector.
+ *
+ * compile with:
+ *
+ *   cc -O2 -c websocket.c
+ */
+
+#define _GNU_SOURCE /* memmem, strncasecmp */
+#include "websocket.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define WEBSOCKET_X86
+#endif
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_KEY_MAX 64 /* the key is 24 bytes (16 bytes base64-encoded) */
+
+static inline uint32_t rol(uint32_t x, int n) {
+  return (x << n) | (x >> (32 - n));
+}
+
+/* Processes one 64-byte block of SHA-1 (FIPS 180-4). */
+static void sha1_block(uint32_t h[5], const uint8_t *b) {
+  uint32_t w[80], a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+
+  for (int i = 0; i < 16; ++i)
+    w[i] = (uint32_t)b[4 * i] << 24 | (uint32_t)b[4 * i + 1] << 16 |
+           (uint32_t)b[4 * i + 2] << 8 | b[4 * i + 3];
+  for (int i = 16; i < 80; ++i)
+    w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  for (int i = 0; i < 80; ++i) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (bb & c) | (~bb & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = bb ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (bb & c) | (bb & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = bb ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t t = rol(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rol(bb, 30);
+    bb = a;
+    a = t;
+  }
+  h[0] += a;
+  h[1] += bb;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+/* Computes the SHA-1 digest of data (of len bytes). */
+static void sha1(const uint8_t *data, size_t len, uint8_t digest[20]) {
+  uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                   0xc3d2e1f0};
+  uint8_t tail[128];
+  size_t full = len & ~(size_t)63, rest = len - full;
+
+  for (size_t off = 0; off < full; off += 64)
+    sha1_block(h, data + off);
+
+  /* pad with 0x80, zeros and the length in bits (big-endian) */
+  size_t tail_len = rest < 56 ? 64 : 128;
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, data + full, rest);
+  tail[rest] = 0x80;
+  for (int i = 0; i < 8; ++i)
+    tail[tail_len - 1 - i] = (uint8_t)((uint64_t)len * 8 >> (8 * i));
+  for (size_t off = 0; off < tail_len; off += 64)
+    sha1_block(h, tail + off);
+
+  for (int i = 0; i < 5; ++i) {
+    digest[4 * i] = h[i] >> 24;
+    digest[4 * i + 1] = h[i] >> 16;
+    digest[4 * i + 2] = h[i] >> 8;
+    digest[4 * i + 3] = h[i];
+  }
+}
+
+/* Base64-encodes src (of len bytes) into dst and returns the encoded length
+ * (dst needs room for 4 * ceil(len / 3) + 1 bytes). */
+static size_t base64(const uint8_t *src, size_t len, char *dst) {
+  static const char chars[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t n = 0;
+
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t v = (uint32_t)src[i] << 16;
+    if (i + 1 < len)
+      v |= (uint32_t)src[i + 1] << 8;
+    if (i + 2 < len)
+      v |= src[i + 2];
+    dst[n++] = chars[v >> 18 & 0x3f];
+    dst[n++] = chars[v >> 12 & 0x3f];
+    dst[n++] = i + 1 < len ? chars[v >> 6 & 0x3f] : '=';
+    dst[n++] = i + 2 < len ? chars[v & 0x3f] : '=';
+  }
+  dst[n] = '\0';
+  return n;
+}
+
+size_t ws_request_length(const char *buf, size_t len) {
+  const char *end = (const char *)memmem(buf, len, "\r\n\r\n", 4);
+  return end != NULL ? (size_t)(end + 4 - buf) : 0;
+}
+
+/* Returns 1 if the value (of len bytes) of a header contains token (case
+ * insensitive - e.g., "keep-alive, Upgrade" contains "upgrade"). */
+static int has_token(const char *value, size_t len, const char *token) {
+  size_t tlen = strlen(token);
+  for (size_t i = 0; i + tlen <= len; ++i) {
+    if (strncasecmp(value + i, token, tlen) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+int ws_handshake(const char *req, size_t len, char *resp, size_t cap) {
+  const char *p = req, *end = req + len;
+  const char *key = NULL;
+  size_t key_len = 0;
+  int upgrade = 0, connection = 0, version = 0;
+
+  if (len < 4 || memcmp(req, "GET ", 4) != 0)
+    return -1;
+
+  /* skip the request line - then one header per line */
+  while ((p = (const char *)memmem(p, end - p, "\r\n", 2)) != NULL) {
+    p += 2;
+    const char *eol = (const char *)memmem(p, end - p, "\r\n", 2);
+    const char *colon = eol != NULL ? (const char *)memchr(p, ':', eol - p)
+                                    : NULL;
+    if (colon == NULL)
+      continue;
+
+    /* the value without surrounding whitespace */
+    const char *v = colon + 1, *v_end = eol;
+    while (v < v_end && (*v == ' ' || *v == '\t'))
+      ++v;
+    while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t'))
+      --v_end;
+    size_t name_len = colon - p, v_len = v_end - v;
+
+#define HEADER_IS(name)                                                        \
+  (name_len == sizeof(name) - 1 && strncasecmp(p, name, name_len) == 0)
+    if (HEADER_IS("Upgrade"))
+      upgrade = has_token(v, v_len, "websocket");
+    else if (HEADER_IS("Connection"))
+      connection = has_token(v, v_len, "upgrade");
+    else if (HEADER_IS("Sec-WebSocket-Version"))
+      version = v_len == 2 && memcmp(v, "13", 2) == 0;
+    else if (HEADER_IS("Sec-WebSocket-Key")) {
+      key = v;
+      key_len = v_len;
+    }
+#undef HEADER_IS
+  }
+
+  if (!upgrade || !connection || !version || key == NULL || key_len == 0 ||
+      key_len > WS_KEY_MAX)
+    return -1;
+
+  /* the accept value proves that the server understood the handshake */
+  uint8_t concat[WS_KEY_MAX + sizeof(WS_GUID)], digest[20];
+  char accept[32];
+  memcpy(concat, key, key_len);
+  memcpy(concat + key_len, WS_GUID, sizeof(WS_GUID) - 1);
+  sha1(concat, key_len + sizeof(WS_GUID) - 1, digest);
+  base64(digest, sizeof(digest), accept);
+
+  int n = snprintf(resp, cap,
+                   "HTTP/1.1 101 Switching Protocols\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Accept: %s\r\n\r\n",
+                   accept);
+  return n < 0 || (size_t)n >= cap ? -1 : n;
+}
+
+/* unmasking - key is rotated so that key[0] applies to p[0] */
+
+static void unmask_scalar(char *p, size_t len, const uint8_t key[4]) {
+  for (size_t i = 0; i < len; ++i)
+    p[i] ^= key[i & 3];
+}
+
+#ifdef WEBSOCKET_X86
+
+static void unmask_sse2(char *p, size_t len, const uint8_t key[4]) {
+  uint32_t k;
+  memcpy(&k, key, 4);
+  const __m128i m = _mm_set1_epi32((int)k);
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64) {
+    __m128i *v = (__m128i *)(p + i);
+    __m128i a = _mm_loadu_si128(v), b = _mm_loadu_si128(v + 1),
+            c = _mm_loadu_si128(v + 2), d = _mm_loadu_si128(v + 3);
+    _mm_storeu_si128(v, _mm_xor_si128(a, m));
+    _mm_storeu_si128(v + 1, _mm_xor_si128(b, m));
+    _mm_storeu_si128(v + 2, _mm_xor_si128(c, m));
+    _mm_storeu_si128(v + 3, _mm_xor_si128(d, m));
+  }
+  for (; i + 16 <= len; i += 16) {
+    __m128i *v = (__m128i *)(p + i);
+    _mm_storeu_si128(v, _mm_xor_si128(_mm_loadu_si128(v), m));
+  }
+  unmask_scalar(p + i, len - i, key); /* i is a multiple of 4 */
+}
+
+__attribute__((target("avx2"))) static void
+unmask_avx2(char *p, size_t len, const uint8_t key[4]) {
+  uint32_t k;
+  memcpy(&k, key, 4);
+  const __m256i m = _mm256_set1_epi32((int)k);
+  size_t i = 0;
+
+  for (; i + 128 <= len; i += 128) {
+    __m256i *v = (__m256i *)(p + i);
+    __m256i a = _mm256_loadu_si256(v), b = _mm256_loadu_si256(v + 1),
+            c = _mm256_loadu_si256(v + 2), d = _mm256_loadu_si256(v + 3);
+    _mm256_storeu_si256(v, _mm256_xor_si256(a, m));
+    _mm256_storeu_si256(v + 1, _mm256_xor_si256(b, m));
+    _mm256_storeu_si256(v + 2, _mm256_xor_si256(c, m));
+    _mm256_storeu_si256(v + 3, _mm256_xor_si256(d, m));
+  }
+  for (; i + 32 <= len; i += 32) {
+    __m256i *v = (__m256i *)(p + i);
+    _mm256_storeu_si256(v, _mm256_xor_si256(_mm256_loadu_si256(v), m));
+  }
+  unmask_scalar(p + i, len - i, key);
+}
+
+#endif /* WEBSOCKET_X86 */
+
+static void (*unmask)(char *, size_t, const uint8_t *) = unmask_scalar;
+static const char *unmask_name = "scalar";
+
+__attribute__((constructor)) static void websocket_init(void) {
+#ifdef WEBSOCKET_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    unmask = unmask_avx2;
+    unmask_name = "avx2";
+  } else {
+    unmask = unmask_sse2; /* baseline of x86-64 */
+    unmask_name = "sse2";
+  }
+#endif
+}
+
+const char *ws_unmask_impl(void) { return unmask_name; }
+
+void ws_unmask(char *p, size_t len, const uint8_t key[4], unsigned key_off) {
+  uint8_t rotated[4];
+  for (unsigned i = 0; i < 4; ++i)
+    rotated[i] = key[(key_off + i) & 3];
+  unmask(p, len, rotated);
+}
+
+/* Returns the length of the frame header whose first 2 bytes are in hdr. */
+static uint8_t header_length(const uint8_t *hdr) {
+  uint8_t len = 2, plen = hdr[1] & 0x7f;
+  if (plen == 126)
+    len += 2;
+  else if (plen == 127)
+    len += 8;
+  return hdr[1] & 0x80 ? len + 4 : len;
+}
+
+int64_t ws_parse(struct ws_parser *ps, char *buf, size_t len,
+                 struct ws_chunk *chunk) {
+  size_t used = 0;
+
+  memset(chunk, 0, sizeof(*chunk));
+
+  if (!ps->in_payload) {
+    /* the header may be split over several reads - gather it byte by byte
+     * (it is at most 14 bytes) */
+    while (ps->hdr_len < 2 || ps->hdr_len < header_length(ps->hdr)) {
+      if (used == len)
+        return used;
+      ps->hdr[ps->hdr_len++] = (uint8_t)buf[used++];
+    }
+
+    const uint8_t *hdr = ps->hdr;
+    uint8_t plen = hdr[1] & 0x7f, *key = ps->hdr + 2;
+    uint64_t payload_len = plen;
+    if (plen == 126) {
+      payload_len = (uint64_t)hdr[2] << 8 | hdr[3];
+      key += 2;
+    } else if (plen == 127) {
+      payload_len = 0;
+      for (int i = 0; i < 8; ++i)
+        payload_len = payload_len << 8 | hdr[2 + i];
+      key += 8;
+    }
+
+    ps->fin = hdr[0] >> 7;
+    ps->opcode = hdr[0] & 0x0f;
+    if ((hdr[0] & 0x70) != 0 || !(hdr[1] & 0x80) || payload_len >> 63)
+      return -1; /* reserved bits, unmasked or invalid length */
+    if (ps->opcode >= WS_OP_CLOSE) {
+      if (ps->opcode > WS_OP_PONG || !ps->fin ||
+          payload_len > WS_CONTROL_MAX)
+        return -1;
+    } else if (ps->opcode > WS_OP_BINARY) {
+      return -1;
+    } else {
+      /* a continuation needs an open message and anything else must not
+       * start while one is open (control frames may be interleaved) */
+      if ((ps->opcode == WS_OP_CONT) != ps->in_message)
+        return -1;
+      ps->in_message = !ps->fin;
+    }
+
+    memcpy(ps->key, key, 4);
+    ps->key_off = 0;
+    ps->remaining = payload_len;
+    ps->in_payload = 1;
+    ps->hdr_len = 0;
+    chunk->first = 1;
+  }
+
+  size_t n = len - used < ps->remaining ? len - used : (size_t)ps->remaining;
+  ws_unmask(buf + used, n, ps->key, ps->key_off);
+  ps->key_off = (ps->key_off + n) & 3;
+  ps->remaining -= n;
+
+  chunk->data = buf + used;
+  chunk->len = n;
+  chunk->opcode = ps->opcode;
+  chunk->fin = ps->fin;
+  if (ps->remaining == 0) {
+    chunk->last = 1;
+    ps->in_payload = 0;
+  }
+  return used + n;
+}
+
+size_t ws_encode(char *out, uint8_t opcode, const char *payload, size_t len) {
+  size_t n = 0;
+
+  out[n++] = (char)(0x80 | opcode); /* FIN */
+  if (len < 126) {
+    out[n++] = (char)len;
+  } else if (len <= UINT16_MAX) {
+    out[n++] = 126;
+    out[n++] = (char)(len >> 8);
+    out[n++] = (char)len;
+  } else {
+    out[n++] = 127;
+    for (int i = 7; i >= 0; --i)
+      out[n++] = (char)((uint64_t)len >> (8 * i));
+  }
+  memcpy(out + n, payload, len);
+  return n + len;
+}
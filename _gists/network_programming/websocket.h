@@ -0,0 +1,80 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Server side of the WebSocket protocol (RFC 6455): the HTTP upgrade
+ * handshake, a streaming parser for the (masked) frames sent by clients and
+ * the encoding of (unmasked) frames sent to them. Extensions (e.g.,
+ * permessage-deflate) and subprotocols are not supported. */
+
+#define WS_OP_CONT 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xa
+
+#define WS_CONTROL_MAX 125 /* max payload length of a control frame */
+#define WS_HEADER_MAX 10   /* max length of a header written by ws_encode */
+
+/* the response to a request that is not a valid upgrade */
+#define WS_BAD_REQUEST                                                         \
+  "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"
+
+/* Returns the length of the HTTP request at the start of buf (up to and
+ * including the empty line that ends its header) or 0 if it is incomplete. */
+size_t ws_request_length(const char *buf, size_t len);
+
+/* Checks that req (a complete request of len bytes) asks for a WebSocket
+ * upgrade and writes the 101 response to resp (of cap bytes, 256 is plenty).
+ * Returns the length of the response or -1 if the request is not a valid
+ * upgrade (answer it with WS_BAD_REQUEST). */
+int ws_handshake(const char *req, size_t len, char *resp, size_t cap);
+
+/* Incremental parser state of one connection - zero-initialize it. */
+struct ws_parser {
+  uint64_t remaining; /* payload bytes of the current frame still to come */
+  uint8_t key[4];     /* masking key of the current frame */
+  uint8_t key_off;    /* index in key of the next payload byte's key byte */
+  uint8_t hdr[14];    /* the header of the next frame as long as incomplete */
+  uint8_t hdr_len;
+  uint8_t opcode; /* of the current frame */
+  uint8_t fin;
+  uint8_t in_payload;
+  uint8_t in_message; /* a fragmented message awaits its final frame */
+};
+
+/* A piece of the payload of a frame - frames can span several reads. */
+struct ws_chunk {
+  char *data; /* unmasked payload bytes (points into the parsed buffer) */
+  size_t len;
+  uint8_t opcode;
+  uint8_t fin;   /* the frame is the last one of its message */
+  uint8_t first; /* data starts at the beginning of the frame's payload */
+  uint8_t last;  /* data ends at the end of the frame's payload */
+};
+
+/* Parses buf (of len bytes) received from a client: consumes the rest of the
+ * current frame's header (if any) and then as much of its payload as there
+ * is, which is unmasked in place and returned in chunk. A chunk with neither
+ * data nor first/last set means that more bytes are needed. Returns the
+ * number of bytes consumed or -1 on a protocol violation (unmasked frame,
+ * reserved bits or opcode, fragmented or oversized control frame, or a
+ * continuation frame out of sequence - see RFC 6455 5.4). */
+int64_t ws_parse(struct ws_parser *ps, char *buf, size_t len,
+                 struct ws_chunk *chunk);
+
+/* XORs the len bytes at p with key (starting at key byte key_off). */
+void ws_unmask(char *p, size_t len, const uint8_t key[4], unsigned key_off);
+
+/* Writes an unfragmented, unmasked frame carrying payload to out (which must
+ * have room for WS_HEADER_MAX + len bytes) and returns its length. */
+size_t ws_encode(char *out, uint8_t opcode, const char *payload, size_t len);
+
+/* returns the name of the unmasking implementation ("avx2", "sse2" or
+ * "scalar") */
+const char *ws_unmask_impl(void);
+
+#endif